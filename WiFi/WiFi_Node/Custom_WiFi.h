@@ -2,51 +2,59 @@
 #define Custom_WiFi
 
 #include <painlessMesh.h>
-#include <ArduinoJson.h>
-#include <vector>
-#include <algorithm>
-
-// Initialize Ultrasonice Sensor Pins
-#include <HCSR04.h>
-HCSR04 hc(0, 26);
+#include <BinMessage.h>
+#include <LcdFields.h>
+#include "MessageQueue.h"
+#include "ServerSelector.h"
+#include "LevelFilter.h"
+
+// Ultrasonic sensor pins, the echo is timed by an interrupt so the scheduler never waits on it
+#define TRIGGER_PIN 0
+#define ECHO_PIN 26
+#define ECHO_INTERVAL (TASK_MILLISECOND * 100) // the HC-SR04 needs 60 ms between pings
+#define ECHO_TIMEOUT 23530UL                   // us, about 4 m, longer echoes found nothing
 
 #define MESH_PREFIX "dustbin"
 #define MESH_PASSWORD "password"
 #define MESH_PORT 5555
+
+#define SAMPLE_INTERVAL (TASK_SECOND * 2)
+#define SEND_INTERVAL (TASK_SECOND * 10)
+#define ANY_SERVER 0 // queued readings go to the server selected when they are sent
+
 /*===================================================================*/
 /*                     Custom Struct Declaration                     */
 /*===================================================================*/
-struct CustomMessage {
-    uint32_t targetId;
-    String payload;
-    int priority;
-
-    // Method to calculate priority based on bin capacity
-    static int calculatePriority(float binCapacity) {
-        if (binCapacity <= 25) return 1;
-        else if (binCapacity <= 50) return 2;
-        else if (binCapacity <= 75) return 3;
-        else return 4;
-    }
-
-    // Constructor for easy creation of CustomMessage objects
-    CustomMessage(uint32_t id, const String& pl, float binCap) : targetId(id), payload(pl), priority(calculatePriority(binCap)) {}
+// The reading waiting for its ACK, it goes back to the queue when the send fails
+struct PendingSend {
+  BinReading reading;
+  bool waiting;    // false when nothing is waiting for an ACK
+  uint32_t server;
+  uint32_t sentAt; // mesh time
 };
 
 /*===================================================================*/
 /*                         Function Prototypes                       */
 /*===================================================================*/
-void enqueueMessage(const CustomMessage& message);
+void enqueueMessage(uint32_t targetId, int priority, const BinReading &reading);
 void getActualBinCapacity();
 void getBinCapacity();
+void beginEchoSensor();
+void sampleEcho();
 void sendCustomMessage();
+void failPendingSend();
+void checkServers();
 void displayLCD();
+void renderLCD();
 void getBinCapacityCallback();
 
 // Task related comes after regular function prototypes
 Task taskDisplayLCD(TASK_SECOND * 5, TASK_FOREVER, &displayLCD);
-Task tSendCustomMessage(TASK_SECOND * 10, TASK_FOREVER, &sendCustomMessage);
-Task taskGetBinCapacity(TASK_SECOND * 2, TASK_FOREVER, &getBinCapacityCallback);
+Task taskRenderLCD(TASK_MILLISECOND * LCD_FRAME_INTERVAL, TASK_FOREVER, &renderLCD);
+Task tSendCustomMessage(SEND_INTERVAL, TASK_FOREVER, &sendCustomMessage);
+Task taskGetBinCapacity(SAMPLE_INTERVAL, TASK_FOREVER, &getBinCapacityCallback);
+Task taskSampleEcho(ECHO_INTERVAL, TASK_FOREVER, &sampleEcho);
+Task taskCheckServers(TASK_MILLISECOND * 500, TASK_FOREVER, &checkServers);
 
 /*===================================================================*/
 /*                         Global variables                          */
@@ -55,24 +63,30 @@ Scheduler ts;
 String latestReceivedMessage;
 String latestSentMessage;
 painlessMesh mesh;
-// Declare the knownServers here first
-std::vector<uint32_t> knownServers = {634095965};
- // will initially be the first server in the list
-uint32_t preferredServer = knownServers[0];
-std::vector<CustomMessage> messageQueue;
+// Bridges the readings can go to, setup() adds this first one
+ServerSelector knownServers;
+uint32_t preferredServer = 634095965; // the server of the last send
+MessageQueue messageQueue;
+PendingSend pendingSend;
 float binCapacity = 0.0;
+volatile uint32_t echoRiseAt = 0;
+volatile uint32_t echoWidth = 0; // us of the last complete echo, 0 while there is none
+LevelFilter levelFilter;
+LevelReporter levelReporter;
+// Callbacks only set lines, taskRenderLCD draws the ones that changed
+LcdFields<M5Display> lcd(M5.Lcd, 2);
 
 
 /*===================================================================*/
 /*                         Function Logics                           */
 /*===================================================================*/
-void enqueueMessage(const CustomMessage& message) {
-    messageQueue.push_back(message);
-    
-    // Sort the vector based on priority, higher priority comes first
-    std::sort(messageQueue.begin(), messageQueue.end(), [](const CustomMessage& a, const CustomMessage& b) {
-        return a.priority > b.priority;
-    });
+void enqueueMessage(uint32_t targetId, int priority, const BinReading &reading) {
+    // A newer reading of the same sender replaces the waiting one, a full queue drops the least urgent
+    uint32_t dropped = messageQueue.droppedCount();
+    messageQueue.push(targetId, priority, reading);
+    if (messageQueue.droppedCount() != dropped) {
+        Serial.println("Message queue full, dropped messages: " + String(messageQueue.droppedCount()));
+    }
 }
 
 // Mock Bin Capacity
@@ -95,48 +109,145 @@ void getActualBinCapacity(float distance){
   }
 }
 
-void sendCustomMessage() {
-  if (messageQueue.empty()) return;
+// Times the echo pulse between its rising and falling edge
+void IRAM_ATTR onEcho() {
+  if (digitalRead(ECHO_PIN)) {
+    echoRiseAt = micros();
+  } else {
+    echoWidth = micros() - echoRiseAt;
+  }
+}
 
-  CustomMessage message = messageQueue.front();
-  messageQueue.erase(messageQueue.begin());
+void beginEchoSensor() {
+  pinMode(TRIGGER_PIN, OUTPUT);
+  digitalWrite(TRIGGER_PIN, LOW);
+  pinMode(ECHO_PIN, INPUT);
+  attachInterrupt(digitalPinToInterrupt(ECHO_PIN), onEcho, CHANGE);
+}
 
-  if (!mesh.sendSingle(message.targetId, message.payload)) {
+// Filters the echo of the previous ping and sends the next one. An echo is back within 24 ms,
+// long before the task runs again.
+void sampleEcho() {
+  uint32_t width = echoWidth;
+  echoWidth = 0;
+  if (width > 0 && width < ECHO_TIMEOUT) {
+    levelFilter.add(width / 58.0f); // cm, sound takes 58 us per cm there and back
+  }
+
+  digitalWrite(TRIGGER_PIN, HIGH);
+  delayMicroseconds(10);
+  digitalWrite(TRIGGER_PIN, LOW);
+}
+
+void sendCustomMessage() {
+  // One reading at a time, the next one goes out once this one is ACKed or has failed
+  if (messageQueue.empty() || pendingSend.waiting) return;
+
+  uint32_t targetId = knownServers.select();
+  if (targetId == 0) {
+    Serial.println("No server reachable, readings wait in the queue.");
+    return;
+  }
+  preferredServer = targetId;
+
+  // The node only queues its own readings, and a newer one replaces the waiting one, so there is
+  // one reading to send
+  int priority = messageQueue.front()->priority;
+  pendingSend.reading = messageQueue.front()->reading;
+  messageQueue.pop();
+  pendingSend.waiting = true;
+  pendingSend.server = targetId;
+  pendingSend.sentAt = mesh.getNodeTime();
+
+  uint8_t frame[BIN_MESSAGE_MAX_SIZE];
+  char text[BIN_MESSAGE_TEXT_SIZE];
+  // the send time lets the bridge split a reading's latency into its wait here and its way through the mesh
+  size_t length = encodeReading(pendingSend.reading, frame, sizeof(frame), pendingSend.sentAt);
+  binMessageToText(frame, length, text, sizeof(text));
+  // painlessMesh takes a String, it only lives until the send returns
+  String payload(text);
+
+  latestSentMessage = "targetId: " + String(targetId) + ", binCapacity: " + String(pendingSend.reading.binCapacity, 2) + ", priority: " + String(priority);
+  lcd.printf(3, "Sent: %d%% to %u", int(pendingSend.reading.binCapacity), targetId);
+  if (!mesh.sendSingle(targetId, payload)) {
       Serial.println("Failed to send message.");
-      // reset the consecutive failed messages to 0 here
+      // no route to the server
+      failPendingSend();
   } else {
-      // Implement the algorithm to select a new known server and reset the consecutive failed msgs if(knownServers.size() > 2)
       Serial.println("Message sent successfully.");
   }
+}
+
+// Counts the pending reading against its server and puts it back in the queue, unless a newer
+// reading is waiting. The next server is tried right away.
+void failPendingSend() {
+  knownServers.failed(pendingSend.server, mesh.getNodeTime());
+  const BinReading &reading = pendingSend.reading;
+  if (!messageQueue.contains(ANY_SERVER, reading.rootSender)) {
+    messageQueue.push(ANY_SERVER, CustomMessage::calculatePriority(reading.binCapacity), reading);
+  }
+  pendingSend.waiting = false;
 
-  latestSentMessage = "targetId: " + String(message.targetId) + ", payload: " + message.payload + ", priority: " + String(message.priority);
+  if (knownServers.select() != 0) {
+    tSendCustomMessage.forceNextIteration();
+  }
+}
+
+// Times out the pending reading and probes failed servers whose time has come
+void checkServers() {
+  uint32_t now = mesh.getNodeTime();
+  if (pendingSend.waiting && now - pendingSend.sentAt >= knownServers.ackTimeout(pendingSend.server)) {
+    Serial.println("No ACK from server " + String(pendingSend.server));
+    failPendingSend();
+  }
+
+  // the answer comes back in delayReceivedCallback()
+  uint32_t probe = knownServers.nextProbe(now);
+  if (probe != 0) {
+    mesh.startDelayMeas(probe);
+  }
+}
+
+void handleReadingAck(uint32_t from, const BinReadingAck &ack) {
+  // a late ACK, its reading already failed
+  if (!pendingSend.waiting || from != pendingSend.server || ack.rootSender != pendingSend.reading.rootSender ||
+      ack.rootTimestampSent != pendingSend.reading.rootTimestampSent) {
+    return;
+  }
+  knownServers.succeeded(from, mesh.getNodeTime() - pendingSend.sentAt);
+  pendingSend.waiting = false;
+}
+
+// painlessMesh answers startDelayMeas() with the one-way delay in microseconds
+void delayReceivedCallback(uint32_t nodeId, int32_t delay) {
+  if (delay >= 0) {
+    knownServers.probed(nodeId, delay * 2);
+    Serial.printf("Server %u answered its probe\n", nodeId);
+  }
 }
 
 void displayLCD(){
-  M5.Lcd.setRotation(3);
-  M5.Lcd.fillScreen(BLACK);
-  M5.Lcd.setCursor(0, 0, 2);
-  M5.Lcd.printf("NodeID: %u\n", mesh.getNodeId());
+  lcd.printf(0, "NodeID: %u", mesh.getNodeId());
+  lcd.printf(1, "Server: %u", preferredServer);
+  lcd.printf(2, "Capacity: %d%%", int(binCapacity));
+}
+
+void renderLCD(){
+  lcd.render(millis());
 }
 
 void getBinCapacityCallback() {
-  getActualBinCapacity(hc.dist());
-  // Comment bottom line and uncomment top line for ultrasonic data
+  if (!levelFilter.ready()) return; // not enough echoes yet
+  getActualBinCapacity(levelFilter.distance());
+  // For mock data, comment the two lines above and uncomment the bottom line
   // getBinCapacity();
 
-  Serial.println("Bin Capacity: " + String(binCapacity));
-  uint32_t targetId = preferredServer;
-
-  StaticJsonDocument<200> doc;
-  doc["rootSender"] = mesh.getNodeId();
-  doc["binCapacity"] = binCapacity;
-  doc["rootTimestampSent"] = mesh.getNodeTime();
-
-  String payload;
-  serializeJson(doc, payload);
+  // Only a level that moved past the hysteresis, or one not reported for a while, goes to the mesh
+  if (!levelReporter.shouldReport(binCapacity, millis())) return;
 
-  CustomMessage message(targetId, payload, binCapacity);
-  enqueueMessage(message);
+  Serial.println("Bin Capacity: " + String(binCapacity));
+  BinReading reading = {mesh.getNodeId(), binCapacity, mesh.getNodeTime()};
+  enqueueMessage(ANY_SERVER, CustomMessage::calculatePriority(binCapacity), reading);
 }
 
 
@@ -149,33 +260,38 @@ void onDroppedConnectionCallback(uint32_t nodeId) {
 }
 
 void receivedCallback(uint32_t from, String &msg) {
-    StaticJsonDocument<600> inDoc;
-    DeserializationError error = deserializeJson(inDoc, msg);
+    uint8_t frame[BIN_MESSAGE_MAX_SIZE];
+    size_t length = binMessageFromText(msg.c_str(), msg.length(), frame, sizeof(frame));
 
-    if (error) {
-        return; // Early return if deserialization fails
+    BinReadingAck ack;
+    if (decodeReadingAck(frame, length, ack)) {
+        handleReadingAck(from, ack);
+        return;
     }
 
     // handles the broadcast to add new knownServers to the knownServers list
-    if (inDoc["update"] == "update") {
+    BinNewServer update;
+    if (decodeNewServer(frame, length, update)) {
 
         // handle the broadcast from the server to append to the list 
         // (deprecated because of ESP32 hardware issues: https://www.esp32.com/viewtopic.php?f=21&t=27265)
         // Keeping it here for proof of concept ideation
         
-        knownServers.push_back(inDoc["newServer"].as<uint32_t>());
-        for (int i = 0; i < knownServers.size(); i++) {
-            Serial.println(knownServers.at(i));
+        // a new server starts with a clean record, so it is tried with the next send
+        knownServers.add(update.serverId);
+        for (size_t i = 0; i < knownServers.size(); i++) {
+            Serial.println(knownServers.at(i).id);
         }
-        // assign the updatedServer to be this newServer key
-        preferredServer = inDoc["newServer"].as<uint32_t>();
         return;
     }
 
-    // Extract information directly from inDoc
-    uint32_t originalID = inDoc["rootSender"];
-    float binCapacity = inDoc["binCapacity"];
-    unsigned long rootTimestampSent = inDoc["rootTimestampSent"];
+    BinReading reading;
+    if (!decodeReading(frame, length, reading)) {
+        return; // Early return if it is not a reading
+    }
+    uint32_t originalID = reading.rootSender;
+    float binCapacity = reading.binCapacity;
+    unsigned long rootTimestampSent = reading.rootTimestampSent;
     // Calculate priority based on the bin capacity
     int priority = CustomMessage::calculatePriority(binCapacity);
 
@@ -183,11 +299,8 @@ void receivedCallback(uint32_t from, String &msg) {
 
     Serial.println("Latest Received Message: " + latestReceivedMessage);
 
-    // Update display accordingly
-    M5.Lcd.fillScreen(BLACK);
-    M5.Lcd.setCursor(0, 0);
-    M5.Lcd.printf("NodeID: %u\n", mesh.getNodeId());
-    M5.Lcd.printf("Capacity: %d%%\nSent: %s\nRecv: %s", int(binCapacity), latestSentMessage.c_str(), latestReceivedMessage.c_str());
+    // Update display accordingly, it is drawn with the next frame
+    lcd.printf(4, "Recv: %u at %d%%", originalID, int(binCapacity));
 }
 
 #endif
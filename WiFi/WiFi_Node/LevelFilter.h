@@ -0,0 +1,77 @@
+#ifndef Level_Filter
+#define Level_Filter
+
+#include <stdint.h>
+#include <BinMessage.h>
+
+#define LEVEL_MEDIAN_WINDOW 5             // echoes the median is taken over, an odd number
+#define LEVEL_EMA_WEIGHT 0.2f             // weight of a new median in the smoothed distance
+#ifndef LEVEL_HYSTERESIS
+#define LEVEL_HYSTERESIS 5.0f             // percent the bin level moves before it is reported again
+#endif
+#define LEVEL_REPORT_MAX_INTERVAL BIN_REPORT_MAX_INTERVAL // an unchanged level is still reported this often
+
+// Smooths the distances of the ultrasonic echoes. The median of the last LEVEL_MEDIAN_WINDOW
+// echoes drops single bad echoes, and a moving average of the medians evens out the jitter.
+class LevelFilter {
+public:
+    LevelFilter() : count(0), next(0), smoothed(0) {}
+
+    void add(float distance) {
+        window[next] = distance;
+        next = (next + 1) % LEVEL_MEDIAN_WINDOW;
+        if (count < LEVEL_MEDIAN_WINDOW) {
+            count++;
+        }
+        float median = medianOfWindow();
+        smoothed = count == 1 ? median : smoothed + (median - smoothed) * LEVEL_EMA_WEIGHT;
+    }
+
+    // True once a full window of echoes came in
+    bool ready() const { return count == LEVEL_MEDIAN_WINDOW; }
+    float distance() const { return smoothed; }
+
+private:
+    float window[LEVEL_MEDIAN_WINDOW];
+    uint8_t count;
+    uint8_t next;
+    float smoothed;
+
+    float medianOfWindow() const {
+        float sorted[LEVEL_MEDIAN_WINDOW];
+        for (uint8_t i = 0; i < count; i++) {
+            float value = window[i];
+            uint8_t j = i;
+            for (; j > 0 && sorted[j - 1] > value; j--) {
+                sorted[j] = sorted[j - 1];
+            }
+            sorted[j] = value;
+        }
+        return sorted[count / 2];
+    }
+};
+
+// Lets a level through only when it moved by LEVEL_HYSTERESIS since the last one reported, or
+// when LEVEL_REPORT_MAX_INTERVAL passed without a report
+class LevelReporter {
+public:
+    LevelReporter() : reported(false), lastLevel(0), lastAt(0) {}
+
+    bool shouldReport(float level, unsigned long now) {
+        float change = level > lastLevel ? level - lastLevel : lastLevel - level;
+        if (reported && change < LEVEL_HYSTERESIS && now - lastAt < LEVEL_REPORT_MAX_INTERVAL) {
+            return false;
+        }
+        reported = true;
+        lastLevel = level;
+        lastAt = now;
+        return true;
+    }
+
+private:
+    bool reported;
+    float lastLevel;
+    unsigned long lastAt;
+};
+
+#endif
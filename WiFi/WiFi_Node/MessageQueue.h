@@ -0,0 +1,164 @@
+#ifndef Message_Queue
+#define Message_Queue
+
+#include <stddef.h>
+#include <stdint.h>
+#include <BinMessage.h>
+
+#ifndef MESSAGE_QUEUE_SLOTS
+#define MESSAGE_QUEUE_SLOTS 16   // messages that can wait at once, every one has its slot in the pool
+#endif
+#define MESSAGE_PRIORITIES 4     // levels calculatePriority() gives out, 1 is the lowest
+
+static_assert(MESSAGE_QUEUE_SLOTS > 0 && MESSAGE_QUEUE_SLOTS <= 255, "slots are indexed by a uint8_t");
+
+/*===================================================================*/
+/*                     Custom Struct Declaration                     */
+/*===================================================================*/
+struct CustomMessage {
+    uint32_t targetId;
+    int priority;
+    BinReading reading;
+
+    // Method to calculate priority based on bin capacity
+    static int calculatePriority(float binCapacity) {
+        if (binCapacity <= 25) return 1;
+        else if (binCapacity <= 50) return 2;
+        else if (binCapacity <= 75) return 3;
+        else return 4;
+    }
+};
+
+// Readings waiting to be sent, highest priority first and oldest first within a priority. Every
+// priority has a ring of slot numbers into a pool allocated with the queue, so queueing a message
+// never touches the heap and push and pop only look at MESSAGE_PRIORITIES rings. A target holds
+// at most one reading per rootSender: a newer one replaces it.
+class MessageQueue {
+public:
+    MessageQueue() : freeCount(MESSAGE_QUEUE_SLOTS), count(0), dropped(0), coalesced(0) {
+        for (int i = 0; i < MESSAGE_QUEUE_SLOTS; i++) {
+            freeSlots[i] = i;
+        }
+        for (int p = 0; p < MESSAGE_PRIORITIES; p++) {
+            heads[p] = 0;
+            lengths[p] = 0;
+        }
+    }
+
+    // Copies the reading into the pool. A reading of the same rootSender waiting for the same target
+    // is replaced, and keeps its place when the priority is unchanged. When the queue is full the
+    // oldest message of the lowest priority waiting makes room, unless that priority is above the
+    // new message's. Returns false when the new message is the one dropped.
+    bool push(uint32_t targetId, int priority, const BinReading &reading) {
+        uint8_t level = priority < 1 ? 0 : priority > MESSAGE_PRIORITIES ? MESSAGE_PRIORITIES - 1 : priority - 1;
+        int waiting = find(targetId, reading.rootSender);
+        if (waiting >= 0) {
+            coalesced++;
+            int oldLevel = pool[waiting].priority - 1;
+            if (oldLevel == level) {
+                pool[waiting].reading = reading;
+                return true;
+            }
+            freeSlots[freeCount++] = remove(oldLevel, waiting);
+        }
+        if (freeCount == 0) {
+            int lowest = 0;
+            while (lengths[lowest] == 0) {
+                lowest++;
+            }
+            dropped++;
+            if (lowest > level) {
+                return false;
+            }
+            freeSlots[freeCount++] = take(lowest);
+        }
+
+        uint8_t slot = freeSlots[--freeCount];
+        CustomMessage &message = pool[slot];
+        message.targetId = targetId;
+        message.priority = level + 1;
+        message.reading = reading;
+
+        rings[level][(heads[level] + lengths[level]) % MESSAGE_QUEUE_SLOTS] = slot;
+        lengths[level]++;
+        count++;
+        return true;
+    }
+
+    // Next message to send, null when the queue is empty. Valid until the next push or pop.
+    const CustomMessage *front() const {
+        int level = highest();
+        return level < 0 ? 0 : &pool[rings[level][heads[level]]];
+    }
+
+    void pop() {
+        int level = highest();
+        if (level >= 0) {
+            freeSlots[freeCount++] = take(level);
+        }
+    }
+
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    uint32_t droppedCount() const { return dropped; }
+    uint32_t coalescedCount() const { return coalesced; }
+    bool contains(uint32_t targetId, uint32_t rootSender) const { return find(targetId, rootSender) >= 0; }
+
+private:
+    CustomMessage pool[MESSAGE_QUEUE_SLOTS];
+    uint8_t rings[MESSAGE_PRIORITIES][MESSAGE_QUEUE_SLOTS]; // slot numbers, oldest at heads[level]
+    uint8_t heads[MESSAGE_PRIORITIES];
+    uint8_t lengths[MESSAGE_PRIORITIES];
+    uint8_t freeSlots[MESSAGE_QUEUE_SLOTS];
+    uint8_t freeCount;
+    uint8_t count;
+    uint32_t dropped;   // messages lost to a full queue
+    uint32_t coalesced; // readings replaced by a newer one from the same rootSender
+
+    int highest() const {
+        for (int level = MESSAGE_PRIORITIES - 1; level >= 0; level--) {
+            if (lengths[level] > 0) {
+                return level;
+            }
+        }
+        return -1;
+    }
+
+    // Removes the oldest message of a level and hands back its slot
+    uint8_t take(int level) {
+        uint8_t slot = rings[level][heads[level]];
+        heads[level] = (heads[level] + 1) % MESSAGE_QUEUE_SLOTS;
+        lengths[level]--;
+        count--;
+        return slot;
+    }
+
+    // Slot of the reading waiting for targetId from rootSender, -1 when there is none
+    int find(uint32_t targetId, uint32_t rootSender) const {
+        for (int level = 0; level < MESSAGE_PRIORITIES; level++) {
+            for (int i = 0; i < lengths[level]; i++) {
+                uint8_t slot = rings[level][(heads[level] + i) % MESSAGE_QUEUE_SLOTS];
+                if (pool[slot].targetId == targetId && pool[slot].reading.rootSender == rootSender) {
+                    return slot;
+                }
+            }
+        }
+        return -1;
+    }
+
+    // Removes a slot from the middle of its level's ring, the messages behind it move up
+    uint8_t remove(int level, uint8_t slot) {
+        int i = 0;
+        while (rings[level][(heads[level] + i) % MESSAGE_QUEUE_SLOTS] != slot) {
+            i++;
+        }
+        for (; i + 1 < lengths[level]; i++) {
+            rings[level][(heads[level] + i) % MESSAGE_QUEUE_SLOTS] = rings[level][(heads[level] + i + 1) % MESSAGE_QUEUE_SLOTS];
+        }
+        lengths[level]--;
+        count--;
+        return slot;
+    }
+};
+
+#endif
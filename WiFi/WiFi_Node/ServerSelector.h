@@ -0,0 +1,150 @@
+#ifndef Server_Selector
+#define Server_Selector
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Times are painlessMesh node time, microseconds that wrap around every 71 minutes
+#define MAX_KNOWN_SERVERS 4
+#define FAILOVER_THRESHOLD 2             // failures in a row that take a server out of selection
+#define ACK_TIMEOUT_MIN 2000000UL        // a payload not ACKed after this counts as a failure
+#define PROBE_INTERVAL_MIN 5000000UL     // first re-probe of a failed server, doubles with every failure
+#define PROBE_INTERVAL_MAX 60000000UL
+#define RTT_FLOOR 20000UL                // keeps near-equal round trips from dominating the weight
+
+/*===================================================================*/
+/*                     Custom Struct Declaration                     */
+/*===================================================================*/
+struct KnownServer {
+    uint32_t id;
+    float successRate;           // moving average of ACKed sends, 1 for a server not tried yet
+    uint8_t consecutiveFailures;
+    uint32_t rtt;                // smoothed round trip, 0 until one is measured
+    uint32_t retryAt;            // when a failed server is probed next
+};
+
+// Health of the bridges a node can send its readings to. Every server is weighted by its success
+// rate over its round trip, the node sends to the heaviest one that has not failed
+// FAILOVER_THRESHOLD times in a row. Failed servers are probed again with a growing interval and
+// come back into selection once a probe or a send gets through.
+class ServerSelector {
+public:
+    ServerSelector() : count(0) {}
+
+    // False when the server is known already or there is no room for it
+    bool add(uint32_t id) {
+        if (id == 0 || find(id) || count == MAX_KNOWN_SERVERS) {
+            return false;
+        }
+        KnownServer &server = servers[count++];
+        server.id = id;
+        server.successRate = 1;
+        server.consecutiveFailures = 0;
+        server.rtt = 0;
+        server.retryAt = 0;
+        return true;
+    }
+
+    KnownServer *find(uint32_t id) {
+        for (size_t i = 0; i < count; i++) {
+            if (servers[i].id == id) {
+                return &servers[i];
+            }
+        }
+        return 0;
+    }
+
+    // Server to send to, 0 when every known server has failed
+    uint32_t select() const {
+        uint32_t best = 0;
+        float bestWeight = 0;
+        for (size_t i = 0; i < count; i++) {
+            const KnownServer &server = servers[i];
+            if (server.consecutiveFailures >= FAILOVER_THRESHOLD) {
+                continue;
+            }
+            // a server without a measured round trip is assumed to be as fast as the floor
+            float weight = (server.successRate + 0.01f) / (server.rtt + RTT_FLOOR);
+            if (best == 0 || weight > bestWeight) {
+                best = server.id;
+                bestWeight = weight;
+            }
+        }
+        return best;
+    }
+
+    void succeeded(uint32_t id, uint32_t rtt) {
+        KnownServer *server = find(id);
+        if (!server) {
+            return;
+        }
+        server->successRate += (1 - server->successRate) / 8;
+        server->consecutiveFailures = 0;
+        server->rtt = server->rtt == 0 ? rtt : server->rtt - server->rtt / 8 + rtt / 8;
+    }
+
+    void failed(uint32_t id, uint32_t now) {
+        KnownServer *server = find(id);
+        if (!server) {
+            return;
+        }
+        server->successRate -= server->successRate / 8;
+        if (server->consecutiveFailures < 255) {
+            server->consecutiveFailures++;
+        }
+        if (server->consecutiveFailures >= FAILOVER_THRESHOLD) {
+            server->retryAt = now + probeInterval(*server);
+        }
+    }
+
+    // A probe got an answer: the server takes part in selection again, at no better than even odds
+    void probed(uint32_t id, uint32_t rtt) {
+        KnownServer *server = find(id);
+        if (!server) {
+            return;
+        }
+        server->consecutiveFailures = 0;
+        server->successRate = server->successRate < 0.5f ? 0.5f : server->successRate;
+        server->rtt = rtt;
+    }
+
+    // Failed server whose probe is due, 0 when there is none. Its next probe is scheduled.
+    uint32_t nextProbe(uint32_t now) {
+        for (size_t i = 0; i < count; i++) {
+            KnownServer &server = servers[i];
+            if (server.consecutiveFailures >= FAILOVER_THRESHOLD && (int32_t)(now - server.retryAt) >= 0) {
+                if (server.consecutiveFailures < 255) {
+                    server.consecutiveFailures++;
+                }
+                server.retryAt = now + probeInterval(server);
+                return server.id;
+            }
+        }
+        return 0;
+    }
+
+    // How long to wait for the ACK of a payload sent to a server
+    uint32_t ackTimeout(uint32_t id) {
+        KnownServer *server = find(id);
+        uint32_t timeout = server ? server->rtt * 4 : 0;
+        return timeout > ACK_TIMEOUT_MIN ? timeout : ACK_TIMEOUT_MIN;
+    }
+
+    size_t size() const { return count; }
+    const KnownServer &at(size_t i) const { return servers[i]; }
+
+private:
+    KnownServer servers[MAX_KNOWN_SERVERS];
+    size_t count;
+
+    static uint32_t probeInterval(const KnownServer &server) {
+        int doublings = server.consecutiveFailures - FAILOVER_THRESHOLD;
+        uint32_t interval = PROBE_INTERVAL_MIN;
+        for (int i = 0; i < doublings && interval < PROBE_INTERVAL_MAX; i++) {
+            interval *= 2;
+        }
+        return interval < PROBE_INTERVAL_MAX ? interval : PROBE_INTERVAL_MAX;
+    }
+};
+
+#endif
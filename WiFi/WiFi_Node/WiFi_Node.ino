@@ -13,19 +13,28 @@ void setup() {
   mesh.onReceive(&receivedCallback);
   mesh.onNewConnection(&onNewConnectionCallback);
   mesh.onDroppedConnection(&onDroppedConnectionCallback);
+  mesh.onNodeDelayReceived(&delayReceivedCallback);
+  knownServers.add(preferredServer);
+  beginEchoSensor();
 
   // Display NodeID on LCD
-  // displayLCD();
-  M5.Lcd.println(preferredServer);
+  lcd.begin(3, WHITE, BLACK);
+  displayLCD();
 
   // // Setup tasks
   // ts.init();
   ts.addTask(taskGetBinCapacity);
   ts.addTask(tSendCustomMessage);
   ts.addTask(taskDisplayLCD);
+  ts.addTask(taskCheckServers);
+  ts.addTask(taskSampleEcho);
+  ts.addTask(taskRenderLCD);
   taskGetBinCapacity.enable();
   tSendCustomMessage.enable();
   taskDisplayLCD.enable();
+  taskCheckServers.enable();
+  taskSampleEcho.enable();
+  taskRenderLCD.enable();
 }
 
 void loop() {
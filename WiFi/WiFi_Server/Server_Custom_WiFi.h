@@ -3,13 +3,19 @@
 
 #include <WiFi.h>
 #include <vector>
-#include <ArduinoJson.h>
 #include <WiFiUdp.h>
+#include <BinMessage.h>
+#include <LcdFields.h>
 
-void sendAck(const String& originalSender);
+void sendAck(IPAddress originalSender);
+bool handlePacket(const uint8_t* packet, int len, BinReading& reading);
 // Global UDP object
 WiFiUDP udp;
 const unsigned int udpPort = 4210; // UDP port for communication
+#define UDP_PACKET_SIZE 255     // longest datagram read, the rest of a longer one is dropped
+#define UDP_DRAIN_PER_LOOP 64   // datagrams handled at most per pass of loop(), so the screen still renders
+#define PING_INTERVAL 1000UL    // ms between presence broadcasts
+#define NODE_HISTORY_MAX 16     // readings kept for the screen, which shows the last 5
 
 // Replace with actual network credentials
 const char* ssid = "ssid";
@@ -18,6 +24,9 @@ const char* password = "password";
 unsigned long lastDisplayUpdate = 0;
 const long displayInterval = 5000; // Update the display every 5000 milliseconds (5 seconds)
 unsigned long lastRoutingTableCheck = 0; // Variable to track the last time routing table was checked
+unsigned long lastPing = 0;
+// Every datagram is read into this one buffer, loop() drains all that are waiting
+uint8_t packetBuffer[UDP_PACKET_SIZE];
 float binCapacity = 0.0;
 
 // Time threshold for removing nodes from routing table (in milliseconds)
@@ -56,6 +65,9 @@ std::vector<RoutingTableEntry> routingTable;
 // This vector is used to track the path of data packets through the network, facilitating debugging and analysis.
 std::vector<dustbin_info> nodeHistory;
 
+// displayInfo() only sets lines, loop() draws the ones that changed
+LcdFields<M5Display> lcd(M5.Lcd, 2);
+
 float getBinCapacity(){
   if(binCapacity >= 100)
   {
@@ -65,23 +77,22 @@ float getBinCapacity(){
   return binCapacity;
 }
 
-// Function to display info
+// Function to display info, the lines are drawn with the next lcd.render()
 void displayInfo() {
-  M5.Lcd.fillScreen(BLACK);
-  M5.Lcd.setCursor(0, 0, 2);
-  M5.Lcd.print("IP: ");
-  M5.Lcd.println(WiFi.localIP());
+  uint8_t line = 0;
+  lcd.printf(line++, "IP: %s", WiFi.localIP().toString().c_str());
 
-  M5.Lcd.println("RT:");
+  lcd.set(line++, "RT:");
   for (auto& entry : routingTable) {
-    M5.Lcd.printf("IP: %s isOn: %s\n", entry.ip.c_str(), entry.isOn? "True":"False");
+    lcd.printf(line++, "IP: %s isOn: %s", entry.ip.c_str(), entry.isOn? "True":"False");
   }
 
-  M5.Lcd.println("Node History:");
+  lcd.set(line++, "Node History:");
   int startIndex = (nodeHistory.size() > 5) ? nodeHistory.size() - 5 : 0;
   for (int i = nodeHistory.size() - 1; i >= startIndex; i--) {
-    M5.Lcd.printf("%s: %s\%\n", nodeHistory[i].rootIP.c_str(), nodeHistory[i].binInfo.c_str());
+    lcd.printf(line++, "%s: %s%%", nodeHistory[i].rootIP.c_str(), nodeHistory[i].binInfo.c_str());
   }
+  lcd.clearFrom(line);
 }
 
 // Function to display routing table on the Serial Monitor
@@ -96,7 +107,7 @@ void displayRoutingTableSerial() {
 void displayNodeHistorySerial() {
   Serial.println("Node History:");
   for (auto &info : nodeHistory) {
-    Serial.printf("%s: %s\%\n", info.rootIP.c_str(), info.binInfo.c_str());
+    Serial.printf("%s: %s%%\n", info.rootIP.c_str(), info.binInfo.c_str());
   }
 }
 
@@ -118,26 +129,29 @@ void updateRoutingTable(String nodeID, String ip, String mac, unsigned long time
   }
 }
 
+// Only the newest readings are kept, a burst does not grow the heap
 void updateHistory(String ipAddress, String binInfo) {
+    if (nodeHistory.size() >= NODE_HISTORY_MAX) {
+        nodeHistory.erase(nodeHistory.begin());
+    }
     dustbin_info newInfo = {ipAddress, binInfo};
     nodeHistory.push_back(newInfo);
 }
 
 
 void sendPing() {
-  JsonDocument doc;
-  doc["action"] = "ping";
+  BinPing ping;
   // Assuming a unique identifier for each node
-  doc["senderNode"] = WiFi.macAddress(); 
-  doc["server"] = true;
-  String output;
-  serializeJson(doc, output);
+  WiFi.macAddress(ping.mac);
+  ping.server = true;
+  uint8_t frame[BIN_MESSAGE_MAX_SIZE];
+  size_t length = encodePing(ping, frame, sizeof(frame));
 
   IPAddress broadcastIp = WiFi.gatewayIP(); // Get the gateway IP
   broadcastIp[3] = 255; // Convert to the broadcast IP
 
   udp.beginPacket(broadcastIp, udpPort);
-  udp.write((const uint8_t *)output.c_str(), output.length());
+  udp.write(frame, length);
   udp.endPacket();
 }
 
@@ -151,69 +165,65 @@ void markInactiveNodesAsOff() {
     }
 }
 
-void receivePing() {
-  int packetSize = udp.parsePacket();
-  if (packetSize) {
-    char packetBuffer[255];
-    int len = udp.read(packetBuffer, 255);
-    if (len > 0) {
-      packetBuffer[len] = '\0';
+// Drains the datagrams waiting in lwIP, at most UDP_DRAIN_PER_LOOP of them, and returns the
+// readings among them. lwIP only holds a few datagrams, a burst is lost when they wait for the
+// next pass.
+unsigned int receivePackets() {
+  unsigned int readings = 0;
+  BinReading reading;
+  BinReading last;
+  for (int drained = 0; drained < UDP_DRAIN_PER_LOOP && udp.parsePacket() > 0; drained++) {
+    int len = udp.read(packetBuffer, sizeof(packetBuffer));
+    if (len > 0 && handlePacket(packetBuffer, len, reading)) {
+      last = reading;
+      readings++;
     }
-    String data(packetBuffer);
-    JsonDocument doc;
-    DeserializationError error = deserializeJson(doc, data);
+  }
+  if (readings > 0) {
+    // one line per pass, a line per reading would block on the serial port during a burst
+    Serial.printf("Dustbin data: %u readings, the last on %s is about %.2f percent full now\n", readings,
+                  IPAddress(last.rootSender).toString().c_str(), last.binCapacity);
+    displayInfo();
+  }
+  return readings;
+}
 
-    // handle incorrectly parsed json data
-    if (error) {
-      return;
-    }
-    
-    String action = doc["action"];
-    if (action == "ping") {
-      // handle updating of the routing table
-      IPAddress responderIP = udp.remoteIP();
-      updateRoutingTable(doc["senderNode"].as<String>(), udp.remoteIP().toString(), WiFi.macAddress(), millis());
-    }
-    else if (doc.containsKey("action") && doc["action"].as<String>() == "data") {
-      // Handling ACK message
-      String originalSender = doc["rootSender"].as<String>();
-      displayInfo();
-      float binData = doc["binCapacity"].as<float>();
-      Serial.printf("Dustbin data on: %s is about %.2f percent full now\n", doc["rootSender"].as<String>(), binData);
-      sendAck(originalSender);
-
-      // convert the bindata into a 2 decimal string
-      String binInfo = doc["rootTimestampSent"].as<String>() + "@ " + String(binData, 2);
-                        /* If possible change to AM/PM using NTP */
-      updateHistory(doc["rootSender"].as<String>(), binInfo);
-      return;
-    }
-    else if (doc.containsKey("action") && doc["action"].as<String>() == "ack"){
-      // do nothing if ack
-      Serial.println("ACK received, dropping packet");
-      return;
-    }
+// Handles one datagram, true when it was a reading, which is then in reading
+bool handlePacket(const uint8_t* packet, int len, BinReading& reading) {
+  // frames that are too short or of an unknown type are dropped by their decoder
+  BinPing ping;
+  uint8_t type = binMessageType(packet, len);
+  if (type == BIN_MSG_PING && decodePing(packet, len, ping)) {
+    // handle updating of the routing table
+    char senderNode[18];
+    snprintf(senderNode, sizeof(senderNode), "%02X:%02X:%02X:%02X:%02X:%02X",
+             ping.mac[0], ping.mac[1], ping.mac[2], ping.mac[3], ping.mac[4], ping.mac[5]);
+    updateRoutingTable(senderNode, udp.remoteIP().toString(), WiFi.macAddress(), millis());
   }
+  else if (type == BIN_MSG_READING && decodeReading(packet, len, reading)) {
+    // the ACK goes out first, the sender waits for it
+    IPAddress originalSender(reading.rootSender);
+    sendAck(originalSender);
+
+    // convert the bindata into a 2 decimal string
+    String binInfo = String(reading.rootTimestampSent) + "@ " + String(reading.binCapacity, 2);
+                      /* If possible change to AM/PM using NTP */
+    updateHistory(originalSender.toString(), binInfo);
+    return true;
+  }
+  // an ACK is not for the server, it is dropped
+  return false;
 }
 
-void sendAck(const String& originalSender) {
-  JsonDocument ackDoc;
-  ackDoc["action"] = "ack";
-  ackDoc["to"] = originalSender;
-  ackDoc["from"] = WiFi.localIP();
-  ackDoc["message"] = "Packet received at server";
-  ackDoc["server"] = true;
-  String ackMsg;
-  serializeJson(ackDoc, ackMsg);
-
-  IPAddress senderIp;
-  // Assuming originalSender can be directly converted to IP, in real scenarios, a lookup would be required
-  senderIp.fromString(originalSender);
-  udp.beginPacket(senderIp, udpPort);
-  udp.write((const uint8_t *)ackMsg.c_str(), ackMsg.length());
-  udp.endPacket();
+void sendAck(IPAddress originalSender) {
+  BinAck ack = {uint32_t(originalSender), uint32_t(WiFi.localIP())};
+  uint8_t frame[BIN_MESSAGE_MAX_SIZE];
+  size_t length = encodeAck(ack, frame, sizeof(frame));
 
-  Serial.println("ACK Sent: " + ackMsg);
+  // Assuming originalSender can be reached directly, in real scenarios, a lookup would be required
+  udp.beginPacket(originalSender, udpPort);
+  udp.write(frame, length);
+  udp.endPacket();
 }
 
 
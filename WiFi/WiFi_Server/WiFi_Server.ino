@@ -14,9 +14,9 @@ void setupWiFi() {
     delay(500);
     Serial.print("Connecting ..");
   }
-  M5.Lcd.setCursor(0, 20, 2);
-  M5.Lcd.print("IP: ");
-  M5.Lcd.println(WiFi.localIP());
+  lcd.begin(1, WHITE, BLACK);
+  lcd.printf(0, "IP: %s", WiFi.localIP().toString().c_str());
+  lcd.render(millis());
 
   // Initialize UDP
   udp.begin(udpPort);
@@ -29,17 +29,21 @@ void setup() {
 }
 
 
+// Never blocks: every pass drains the waiting datagrams, and the ping, the screen and the
+// routing table check run when their time has come
 void loop() {
   unsigned long currentMillis = millis();
-  sendPing();
-  receivePing();
-  // receivePacket();
-  // timedSendPacket();
+  if (currentMillis - lastPing >= PING_INTERVAL) {
+    lastPing = currentMillis;
+    sendPing();
+  }
+  receivePackets();
 
   if (currentMillis - lastDisplayUpdate >= displayInterval) {
     lastDisplayUpdate = currentMillis; 
     displayInfo();
     }
+  lcd.render(millis());
   
 
   // Check and mark inactive nodes from routing table every 10 seconds
@@ -47,6 +51,4 @@ void loop() {
     lastRoutingTableCheck = currentMillis;
     markInactiveNodesAsOff();
   }
-
-  delay(1000);
 }
@@ -0,0 +1,268 @@
+// Host benchmark of the BinMessage codec against the JSON the sketches exchanged before.
+//
+// Bytes on the wire are counted for every message type, as painlessMesh payload (base64 text,
+// JSON with every quote escaped inside the envelope's "msg" string) and as a UDP datagram. CPU
+// and heap allocations are timed for a reading going from a node through the bridge:
+//   JSON    node: StaticJsonDocument + serializeJson, bridge: deserializeJson twice (the update
+//           check, then deserializeMessage) and rootSender copied out as a String
+//   binary  node: encodeReading + binMessageToText, bridge: binMessageFromText + decodeReading
+// The MQTT edge stays JSON on both paths and is not timed.
+//
+// The JSON path uses ArduinoJson when its src directory is on the include path. Without it a
+// snprintf / strtod stand-in runs instead, which builds no document and so does less work than
+// ArduinoJson: its times are a lower bound on the JSON cost. The bench prints which one ran.
+//
+//   g++ -std=c++11 -O2 -I../libraries/BinMessage codec_bench.cpp -o codec_bench
+//   g++ -std=c++11 -O2 -I../libraries/BinMessage -I<ArduinoJson>/src codec_bench.cpp -o codec_bench
+//   ./codec_bench --messages 1000000
+#include <BinMessage.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+#if __has_include(<ArduinoJson.h>)
+#include <ArduinoJson.h>
+#define BENCH_ARDUINOJSON 1
+#else
+#define BENCH_ARDUINOJSON 0
+#endif
+
+static unsigned long allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static const uint32_t NODE_ID = 634095965;
+static const uint32_t BRIDGE_ID = 2223841013u;
+
+/*===================================================================*/
+/*                      JSON the sketches sent                       */
+/*===================================================================*/
+#if BENCH_ARDUINOJSON
+static size_t json_encode_reading(uint32_t rootSender, float binCapacity, uint32_t timestamp, char *out, size_t size) {
+    StaticJsonDocument<200> doc;
+    doc["rootSender"] = rootSender;
+    doc["binCapacity"] = binCapacity;
+    doc["rootTimestampSent"] = timestamp;
+    return serializeJson(doc, out, size);
+}
+
+static bool json_decode_reading(const char *text, std::string &rootSender, float &binCapacity) {
+    StaticJsonDocument<200> check;
+    if (deserializeJson(check, text) || check["update"] == "update") {
+        return false;
+    }
+    StaticJsonDocument<200> doc;
+    deserializeJson(doc, text);
+    rootSender = doc["rootSender"].as<std::string>();
+    binCapacity = doc["binCapacity"].as<float>();
+    return true;
+}
+#else
+static size_t json_encode_reading(uint32_t rootSender, float binCapacity, uint32_t timestamp, char *out, size_t size) {
+    int length = snprintf(out, size, "{\"rootSender\":%lu,\"binCapacity\":%g,\"rootTimestampSent\":%lu}",
+                          (unsigned long)rootSender, binCapacity, (unsigned long)timestamp);
+    return length < 0 || (size_t)length >= size ? 0 : length;
+}
+
+// Start of a key's value, null when the key is missing
+static const char *json_value(const char *text, const char *key) {
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char *at = strstr(text, pattern);
+    return at ? at + strlen(pattern) : 0;
+}
+
+static bool json_decode_reading(const char *text, std::string &rootSender, float &binCapacity) {
+    // the update check parses the message once, deserializeMessage a second time
+    if (json_value(text, "update")) {
+        return false;
+    }
+    const char *sender = json_value(text, "rootSender");
+    const char *capacity = json_value(text, "binCapacity");
+    if (!sender || !capacity) {
+        return false;
+    }
+    rootSender.assign(sender, strcspn(sender, ",}"));
+    binCapacity = strtod(capacity, 0);
+    return true;
+}
+#endif
+
+/*===================================================================*/
+/*                           Wire sizes                              */
+/*===================================================================*/
+// Bytes of a painlessMesh single message carrying msg, quotes and backslashes escaped
+static size_t mesh_envelope_size(const std::string &msg) {
+    char head[96];
+    int length = snprintf(head, sizeof(head), "{\"dest\":%lu,\"from\":%lu,\"type\":9,\"msg\":\"\"}",
+                          (unsigned long)BRIDGE_ID, (unsigned long)NODE_ID);
+    size_t escaped = 0;
+    for (size_t i = 0; i < msg.size(); i++) {
+        escaped += msg[i] == '"' || msg[i] == '\\';
+    }
+    return length + msg.size() + escaped;
+}
+
+static std::string as_text(const uint8_t *frame, size_t length) {
+    char text[BIN_MESSAGE_TEXT_SIZE];
+    binMessageToText(frame, length, text, sizeof(text));
+    return text;
+}
+
+static void print_sizes() {
+    uint8_t frame[BIN_MESSAGE_MAX_SIZE];
+    char json[128];
+
+    BinReading reading = {NODE_ID, 57.25f, 123456789};
+    size_t readingJson = json_encode_reading(reading.rootSender, reading.binCapacity, reading.rootTimestampSent, json, sizeof(json));
+    size_t readingFrame = encodeReading(reading, frame, sizeof(frame));
+    std::string readingText = as_text(frame, readingFrame);
+
+    std::string newServerJson = "{\"update\":\"update\",\"newServer\":634095965}";
+    BinNewServer update = {NODE_ID};
+    size_t newServerFrame = encodeNewServer(update, frame, sizeof(frame));
+    std::string newServerText = as_text(frame, newServerFrame);
+
+    std::string dataJson = "{\"action\":\"data\",\"rootSender\":\"192.168.68.110\",\"binCapacity\":57.25,"
+                           "\"rootTimestampSent\":123456789}";
+    std::string pingJson = "{\"action\":\"ping\",\"senderNode\":\"24:0A:C4:5F:12:7E\",\"server\":true}";
+    std::string ackJson = "{\"action\":\"ack\",\"to\":\"192.168.68.110\",\"from\":\"192.168.68.105\","
+                          "\"message\":\"Packet received at server\",\"server\":true}";
+    BinPing ping = {{0x24, 0x0A, 0xC4, 0x5F, 0x12, 0x7E}, true};
+    BinAck ack = {0x6E44A8C0, 0x6944A8C0};
+
+    printf("bytes on the wire          JSON  binary\n");
+    printf("mesh reading payload     %6zu  %6zu (%zu byte frame as base64)\n", readingJson, readingText.size(), readingFrame);
+    printf("mesh reading + envelope  %6zu  %6zu\n", mesh_envelope_size(std::string(json, readingJson)),
+           mesh_envelope_size(readingText));
+    printf("mesh new server payload  %6zu  %6zu\n", newServerJson.size(), newServerText.size());
+    printf("mesh new server envelope %6zu  %6zu\n", mesh_envelope_size(newServerJson), mesh_envelope_size(newServerText));
+    printf("UDP reading              %6zu  %6zu\n", dataJson.size(), readingFrame);
+    printf("UDP ping                 %6zu  %6zu\n", pingJson.size(), encodePing(ping, frame, sizeof(frame)));
+    printf("UDP ack                  %6zu  %6zu\n", ackJson.size(), encodeAck(ack, frame, sizeof(frame)));
+}
+
+/*===================================================================*/
+/*                            CPU per message                        */
+/*===================================================================*/
+struct Result {
+    double encodeNs;
+    double decodeNs;
+    double allocations;
+    double checksum; // keeps the work from being optimised away
+};
+
+static const int BATCH = 1024; // messages encoded, then decoded, per round
+
+static double elapsed_ns(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - since).count();
+}
+
+static Result time_json(const std::vector<float> &capacities, long messages) {
+    static char json[BATCH][128];
+    Result result = {0, 0, 0, 0};
+    std::string rootSender;
+    unsigned long startAllocations = allocations;
+    for (long done = 0; done < messages; done += BATCH) {
+        int count = messages - done < BATCH ? messages - done : BATCH;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; i++) {
+            json_encode_reading(NODE_ID, capacities[i % capacities.size()], done + i, json[i], sizeof(json[i]));
+        }
+        result.encodeNs += elapsed_ns(start);
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; i++) {
+            float binCapacity = 0;
+            json_decode_reading(json[i], rootSender, binCapacity);
+            result.checksum += binCapacity + rootSender.size();
+        }
+        result.decodeNs += elapsed_ns(start);
+    }
+    result.encodeNs /= messages;
+    result.decodeNs /= messages;
+    result.allocations = (double)(allocations - startAllocations) / messages;
+    return result;
+}
+
+static Result time_binary(const std::vector<float> &capacities, long messages) {
+    static char text[BATCH][BIN_MESSAGE_TEXT_SIZE];
+    static size_t lengths[BATCH];
+    Result result = {0, 0, 0, 0};
+    unsigned long startAllocations = allocations;
+    for (long done = 0; done < messages; done += BATCH) {
+        int count = messages - done < BATCH ? messages - done : BATCH;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; i++) {
+            BinReading reading = {NODE_ID, capacities[i % capacities.size()], (uint32_t)(done + i)};
+            uint8_t frame[BIN_MESSAGE_MAX_SIZE];
+            lengths[i] = binMessageToText(frame, encodeReading(reading, frame, sizeof(frame)), text[i], sizeof(text[i]));
+        }
+        result.encodeNs += elapsed_ns(start);
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; i++) {
+            uint8_t frame[BIN_MESSAGE_MAX_SIZE];
+            BinReading reading = {0, 0, 0};
+            decodeReading(frame, binMessageFromText(text[i], lengths[i], frame, sizeof(frame)), reading);
+            // the JSON path counts the digits of rootSender
+            result.checksum += reading.binCapacity + (reading.rootSender == NODE_ID ? 9 : 0);
+        }
+        result.decodeNs += elapsed_ns(start);
+    }
+    result.encodeNs /= messages;
+    result.decodeNs /= messages;
+    result.allocations = (double)(allocations - startAllocations) / messages;
+    return result;
+}
+
+int main(int argc, char **argv) {
+    long messages = 1000000;
+    unsigned seed = 1;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--messages" && i + 1 < argc) {
+            messages = atol(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--messages n] [--seed n]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (messages <= 0) {
+        fprintf(stderr, "--messages must be positive\n");
+        return 1;
+    }
+    srand(seed);
+
+    // readings as the node sends them, in hundredths of a percent
+    std::vector<float> capacities;
+    for (int i = 0; i < 1024; i++) {
+        capacities.push_back(rand() % 10001 / 100.0f);
+    }
+
+    print_sizes();
+    Result json = time_json(capacities, messages);
+    Result binary = time_binary(capacities, messages);
+    printf("\nreading node to bridge     encode ns  decode ns  heap allocations  (%ld messages)\n", messages);
+    printf("%-24s %11.1f %10.1f %17.2f\n", BENCH_ARDUINOJSON ? "JSON (ArduinoJson)" : "JSON (stand-in)",
+           json.encodeNs, json.decodeNs, json.allocations);
+    printf("%-24s %11.1f %10.1f %17.2f\n", "binary + base64", binary.encodeNs, binary.decodeNs, binary.allocations);
+    printf("checksum                   %.0f %.0f\n", json.checksum, binary.checksum);
+    return 0;
+}
@@ -0,0 +1,300 @@
+// Host simulation of a WiFi node sending to two bridges while the preferred one goes down.
+//
+// The node samples every 2 s into MessageQueue and sends every 10 s, as WiFi_Node's tasks do.
+// Server choice, ACK timeouts and probes use ServerSelector from WiFi_Node/ServerSelector.h, with
+// the glue of sendCustomMessage(), failPendingSend() and checkServers() mirrored here. The
+// fixed policy is the node before failover: every payload goes to preferredServer, whatever
+// happens to it.
+//
+// A dead bridge still has a route for --route-timeout s, sendSingle() succeeds but nothing is
+// ACKed. After that sendSingle() fails. A probe (startDelayMeas) is answered only by a live bridge.
+// The bench reports how old the newest reading at the bridges is, before, during and after the
+// outage.
+//
+//   g++ -std=c++11 -O2 -I../libraries/BinMessage failover_bench.cpp -o failover_bench
+//   ./failover_bench --fail-at 600 --recover-at 1200 --duration 1800
+#include "../WiFi_Node/MessageQueue.h"
+#include "../WiFi_Node/ServerSelector.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+
+struct BenchConfig {
+    int duration = 1800;     // s
+    int failAt = 600;        // s, the preferred bridge goes down
+    int recoverAt = 1200;    // s, and comes back
+    int routeTimeout = 10;   // s the mesh keeps a route to a dead bridge
+    uint32_t rttA = 40000;   // us, round trip to the preferred bridge
+    uint32_t rttB = 120000;  // us, round trip to the second bridge
+    float loss = 0.02f;      // payloads or ACKs lost on a live link
+    unsigned seed = 1;
+};
+
+static const uint32_t NODE_ID = 2223841013u;
+static const uint32_t SERVER_A = 634095965;
+static const uint32_t SERVER_B = 634095966;
+static const uint32_t STEP = 100000; // us
+
+/*===================================================================*/
+/*                             Bridges                               */
+/*===================================================================*/
+struct Bridge {
+    uint32_t id;
+    uint32_t rtt;
+    bool alive;
+    uint32_t diedAt;
+    unsigned long payloads; // payloads it took
+};
+
+struct World {
+    const BenchConfig *config;
+    Bridge bridges[2];
+    uint32_t newestDelivered; // sample time of the newest reading at any bridge
+    bool delivered;
+
+    Bridge *bridge(uint32_t id) { return id == SERVER_A ? &bridges[0] : id == SERVER_B ? &bridges[1] : 0; }
+
+    bool hasRoute(uint32_t id, uint32_t now) {
+        Bridge *b = bridge(id);
+        return b && (b->alive || now - b->diedAt < config->routeTimeout * 1000000UL);
+    }
+
+    bool lost() { return rand() % 10000 < config->loss * 10000; }
+};
+
+/*===================================================================*/
+/*                               Node                                */
+/*===================================================================*/
+struct PendingSend {
+    BinReading reading;
+    bool waiting;
+    uint32_t server;
+    uint32_t sentAt;
+    uint32_t ackAt; // when the ACK arrives, 0 when it never does
+};
+
+struct Node {
+    bool failover;
+    MessageQueue queue;
+    ServerSelector servers;
+    PendingSend pending;
+    uint32_t probeServer;
+    uint32_t probeAnswerAt; // 0 when no probe is answered
+    bool sendNow;
+
+    explicit Node(bool withFailover) : failover(withFailover), probeServer(0), probeAnswerAt(0), sendNow(false) {
+        pending.waiting = false;
+        servers.add(SERVER_A);
+        servers.add(SERVER_B);
+    }
+
+    void sample(uint32_t now) {
+        BinReading reading = {NODE_ID, (float)(rand() % 10001) / 100, now};
+        queue.push(0, CustomMessage::calculatePriority(reading.binCapacity), reading);
+    }
+
+    // The bridge takes the payload now when it is alive and nothing is lost, the ACK is back one
+    // round trip later
+    void transmit(World &world, uint32_t now) {
+        Bridge *b = world.bridge(pending.server);
+        pending.ackAt = 0;
+        if (!b->alive || world.lost()) {
+            return;
+        }
+        b->payloads++;
+        if (!world.delivered || (int32_t)(pending.reading.rootTimestampSent - world.newestDelivered) > 0) {
+            world.newestDelivered = pending.reading.rootTimestampSent;
+            world.delivered = true;
+        }
+        if (!world.lost()) {
+            pending.ackAt = now + b->rtt;
+        }
+    }
+
+    void send(World &world, uint32_t now) {
+        if (queue.empty() || pending.waiting) {
+            return;
+        }
+        uint32_t target = failover ? servers.select() : SERVER_A;
+        if (target == 0) {
+            return;
+        }
+        pending.reading = queue.front()->reading;
+        queue.pop();
+        pending.waiting = true;
+        pending.server = target;
+        pending.sentAt = now;
+        if (!world.hasRoute(target, now)) {
+            fail(now);
+            return;
+        }
+        transmit(world, now);
+        if (!failover) {
+            pending.waiting = false; // the old node popped the reading and moved on
+        }
+    }
+
+    void fail(uint32_t now) {
+        if (!failover) {
+            pending.waiting = false;
+            return;
+        }
+        servers.failed(pending.server, now);
+        if (!queue.contains(0, pending.reading.rootSender)) {
+            queue.push(0, CustomMessage::calculatePriority(pending.reading.binCapacity), pending.reading);
+        }
+        pending.waiting = false;
+        sendNow = servers.select() != 0;
+    }
+
+    // checkServers() every 500 ms, ACKs and probe answers every step
+    void tick(World &world, uint32_t now) {
+        if (!failover) {
+            return;
+        }
+        if (pending.waiting && pending.ackAt != 0 && (int32_t)(now - pending.ackAt) >= 0) {
+            servers.succeeded(pending.server, pending.ackAt - pending.sentAt);
+            pending.waiting = false;
+        }
+        if (probeAnswerAt != 0 && (int32_t)(now - probeAnswerAt) >= 0) {
+            servers.probed(probeServer, world.bridge(probeServer)->rtt);
+            probeAnswerAt = 0;
+        }
+        if (now % 500000 != 0) {
+            return;
+        }
+        if (pending.waiting && now - pending.sentAt >= servers.ackTimeout(pending.server)) {
+            fail(now);
+        }
+        uint32_t probe = servers.nextProbe(now);
+        Bridge *b = world.bridge(probe);
+        if (b && b->alive && world.hasRoute(probe, now)) {
+            probeServer = probe;
+            probeAnswerAt = now + b->rtt;
+        }
+    }
+};
+
+/*===================================================================*/
+/*                            Simulation                             */
+/*===================================================================*/
+// Age of the newest reading at the bridges, sampled every second of a phase
+struct Staleness {
+    double sum = 0;
+    unsigned long samples = 0;
+    uint32_t max = 0;
+
+    void add(uint32_t age) {
+        sum += age;
+        samples++;
+        max = age > max ? age : max;
+    }
+};
+
+struct RunResult {
+    Staleness phases[3]; // before, during and after the outage
+    long recoveredAfter; // ms from the failure to the first reading delivered after it, -1 for never
+    unsigned long payloadsA;
+    unsigned long payloadsB;
+    unsigned long payloadsAAfter; // payloads the preferred bridge took after it came back
+};
+
+static RunResult run(const BenchConfig &config, bool failover) {
+    srand(config.seed);
+    static World world;
+    world.config = &config;
+    world.bridges[0] = {SERVER_A, config.rttA, true, 0, 0};
+    world.bridges[1] = {SERVER_B, config.rttB, true, 0, 0};
+    world.delivered = false;
+    world.newestDelivered = 0;
+    Node node(failover);
+
+    RunResult result;
+    result.recoveredAfter = -1;
+    unsigned long payloadsAAtRecovery = 0;
+    // start 1 s into mesh time so that a sample time of 0 never looks undelivered
+    for (uint32_t now = 1000000; now <= (config.duration + 1) * 1000000UL; now += STEP) {
+        uint32_t second = now / 1000000 - 1;
+        if (now % 1000000 == 0 && second == (uint32_t)config.failAt) {
+            world.bridges[0].alive = false;
+            world.bridges[0].diedAt = now;
+        }
+        if (now % 1000000 == 0 && second == (uint32_t)config.recoverAt) {
+            world.bridges[0].alive = true;
+            payloadsAAtRecovery = world.bridges[0].payloads;
+        }
+        if (now % 2000000 == 0) {
+            node.sample(now);
+        }
+        node.tick(world, now);
+        if (now % 10000000 == 1000000 || node.sendNow) {
+            node.sendNow = false;
+            node.send(world, now);
+        }
+        if (result.recoveredAfter < 0 && second >= (uint32_t)config.failAt && world.delivered &&
+            (int32_t)(world.newestDelivered - (config.failAt + 1) * 1000000UL) > 0) {
+            result.recoveredAfter = (now - (config.failAt + 1) * 1000000UL) / 1000;
+        }
+        if (now % 1000000 == 0 && world.delivered) {
+            int phase = second < (uint32_t)config.failAt ? 0 : second < (uint32_t)config.recoverAt ? 1 : 2;
+            result.phases[phase].add(now - world.newestDelivered);
+        }
+    }
+    result.payloadsA = world.bridges[0].payloads;
+    result.payloadsB = world.bridges[1].payloads;
+    result.payloadsAAfter = world.bridges[0].payloads - payloadsAAtRecovery;
+    return result;
+}
+
+static void print_result(const char *name, const RunResult &result) {
+    printf("%-10s", name);
+    for (int phase = 0; phase < 3; phase++) {
+        const Staleness &s = result.phases[phase];
+        printf(" %9.1f %8.1f", s.samples ? s.sum / s.samples / 1e6 : 0.0, s.max / 1e6);
+    }
+    if (result.recoveredAfter < 0) {
+        printf("       never");
+    } else {
+        printf(" %9.1f s", result.recoveredAfter / 1e3);
+    }
+    printf("   %lu / %lu (%lu after it is back)\n", result.payloadsA, result.payloadsB, result.payloadsAAfter);
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--duration" && i + 1 < argc) {
+            config.duration = atoi(argv[++i]);
+        } else if (arg == "--fail-at" && i + 1 < argc) {
+            config.failAt = atoi(argv[++i]);
+        } else if (arg == "--recover-at" && i + 1 < argc) {
+            config.recoverAt = atoi(argv[++i]);
+        } else if (arg == "--route-timeout" && i + 1 < argc) {
+            config.routeTimeout = atoi(argv[++i]);
+        } else if (arg == "--loss" && i + 1 < argc) {
+            config.loss = atof(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            config.seed = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--duration s] [--fail-at s] [--recover-at s] [--route-timeout s] [--loss p] "
+                            "[--seed n]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (config.failAt < 0 || config.recoverAt < config.failAt || config.duration < config.recoverAt) {
+        fprintf(stderr, "need 0 <= --fail-at <= --recover-at <= --duration\n");
+        return 1;
+    }
+
+    printf("bridge A (rtt %u ms) down from %d s to %d s, bridge B (rtt %u ms) up, %.0f%% loss, %d s route timeout\n",
+           config.rttA / 1000, config.failAt, config.recoverAt, config.rttB / 1000, config.loss * 100,
+           config.routeTimeout);
+    printf("age of the newest reading at the bridges, s\n");
+    printf("          before: mean    max  during: mean    max   after: mean    max  recovered  payloads A / B\n");
+    print_result("fixed", run(config, false));
+    print_result("failover", run(config, true));
+    return 0;
+}
@@ -0,0 +1,224 @@
+// Host check of the bridge's latency metrics (WiFi/mqttBridge/LatencyStats.h) as the mesh grows.
+//
+// Meshes of 4 to 64 nodes, each taking a reading every --interval s. A reading waits in its node's queue, then
+// crosses the mesh over as many hops as its node is deep, --hop-ms each with jitter, then waits in
+// the bridge's spool for its publish. The mesh grows as a tree of --fanout nodes per node, so the
+// deepest nodes sit log(nodes) hops away. Node clocks are off the bridge's by up to --skew-ms, as
+// painlessMesh's time sync leaves them. The bench feeds LatencyStats as the bridge does, rotates
+// it every half window, and compares every published percentile with the exact one of the same
+// readings. It fails when one is off by more than an eighth, the width of half a bucket, and 1 ms.
+//
+//   g++ -std=c++11 -O2 latency_bench.cpp -o latency_bench
+//   ./latency_bench --minutes 10 --interval 10 --hop-ms 15 --skew-ms 2
+#include "../mqttBridge/LatencyStats.h"
+#include "../mqttBridge/MqttBatch.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+struct BenchConfig {
+    int minutes = 10;
+    double interval = 10;  // s between two readings of a node
+    double hopMs = 15;     // mean mesh delay of one hop
+    double skewMs = 2;     // largest clock offset of a node against the bridge
+    int fanout = 3;        // nodes that join under each node
+    unsigned seed = 1;
+};
+
+static const double QUEUE_MS = 40;    // mean wait for the node's next send
+static const double BRIDGE_MS = 60;   // mean wait in the bridge's spool, up to MQTT_BATCH_LINGER and a publish
+static const double OUTLIER = 0.02;   // share of readings that wait for a retry
+static const double RETRY_MS = 3000;  // what such a reading waits more
+static const size_t METRICS_TOPIC_LENGTH = 14; // "dustbinMetrics"
+
+/*===================================================================*/
+/*                            Simulation                             */
+/*===================================================================*/
+// One published reading, latencies in ms as LatencyStats sees them
+struct Sample {
+    double at; // ms of the sample, record() takes it right then
+    uint32_t hops[LATENCY_HOPS];
+};
+
+struct Result {
+    size_t windows = 0;
+    size_t checked = 0;   // percentiles compared
+    size_t wrong = 0;     // off by more than the bucket allows
+    double worstError = 0;
+    double recordNs = 0;  // per record()
+    double jsonUs = 0;    // per toJson()
+    size_t jsonBytes = 0; // largest metrics payload
+    uint32_t total[3] = {0, 0, 0};
+    uint32_t mesh[3] = {0, 0, 0};
+};
+
+static uint32_t elapsed(uint32_t from, uint32_t to) {
+    int32_t us = (int32_t)(to - from);
+    return us > 0 ? us / 1000 : 0;
+}
+
+static uint32_t exact(std::vector<uint32_t> values, int percent) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = (values.size() * percent + 99) / 100;
+    return values[(rank > 0 ? rank : 1) - 1];
+}
+
+static void compare(Result &result, const LatencyHistogram &histogram, const std::vector<uint32_t> &values) {
+    static const int percents[] = {50, 95, 99};
+    for (int percent : percents) {
+        double want = exact(values, percent);
+        double got = histogram.percentile(percent);
+        double error = fabs(got - want);
+        result.checked++;
+        result.wrong += error > want / 8 + 1;
+        result.worstError = std::max(result.worstError, want > 0 ? error / want : 0);
+    }
+}
+
+static Result run(const BenchConfig &config, int nodes) {
+    std::mt19937 random(config.seed);
+    std::exponential_distribution<double> queueWait(1 / QUEUE_MS), bridgeWait(1 / BRIDGE_MS);
+    std::exponential_distribution<double> hopJitter(1 / (config.hopMs / 3));
+    std::uniform_real_distribution<double> unit(0, 1);
+
+    // a node's depth in the tree, and its clock offset
+    std::vector<int> depth(nodes);
+    std::vector<double> skew(nodes);
+    for (int i = 0; i < nodes; i++) {
+        depth[i] = i < config.fanout ? 1 : depth[(i - config.fanout) / config.fanout] + 1;
+        skew[i] = (unit(random) * 2 - 1) * config.skewMs;
+    }
+
+    LatencyStats stats;
+    Result result;
+    std::deque<Sample> window; // the samples the histograms cover
+    std::vector<double> next(nodes);
+    for (int i = 0; i < nodes; i++) {
+        next[i] = unit(random) * config.interval * 1000;
+    }
+    double halfWindow = LATENCY_WINDOW / 2.0;
+    double nextRotate = halfWindow;
+    double recordSeconds = 0;
+    size_t records = 0;
+    const double end = config.minutes * 60000.0;
+    for (double now = 0; now < end; now += 1) {
+        for (int i = 0; i < nodes; i++) {
+            if (next[i] > now) {
+                continue;
+            }
+            next[i] += config.interval * 1000;
+            double queue = queueWait(random) + (unit(random) < OUTLIER ? RETRY_MS : 0);
+            double mesh = 0;
+            for (int hop = 0; hop < depth[i]; hop++) {
+                mesh += config.hopMs * 2 / 3 + hopJitter(random);
+            }
+            double bridge = bridgeWait(random);
+            // the node stamps with its clock, the bridge with its own, both mesh time in us
+            uint32_t sampledAt = (uint32_t)((now + skew[i]) * 1000);
+            uint32_t sentAt = (uint32_t)((now + queue + skew[i]) * 1000);
+            uint32_t receivedAt = (uint32_t)((now + queue + mesh) * 1000);
+            uint32_t publishedAt = (uint32_t)((now + queue + mesh + bridge) * 1000);
+            uint32_t node = 2223841013u + i;
+
+            auto start = std::chrono::steady_clock::now();
+            stats.record(node, sampledAt, sentAt, receivedAt, publishedAt);
+            recordSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            records++;
+
+            Sample sample = {now, {elapsed(sampledAt, sentAt), elapsed(sentAt, receivedAt),
+                                         elapsed(receivedAt, publishedAt), elapsed(sampledAt, publishedAt)}};
+            window.push_back(sample);
+        }
+
+        if (now + 1 >= nextRotate) {
+            // what the bridge publishes: the two halves since the last but one rotate
+            char json[MQTT_BUFFER_SIZE - MQTT_PACKET_OVERHEAD - METRICS_TOPIC_LENGTH + 1];
+            auto start = std::chrono::steady_clock::now();
+            size_t length = stats.toJson(json, sizeof(json));
+            result.jsonUs += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+            result.jsonBytes = std::max(result.jsonBytes, length);
+            result.windows++;
+            while (!window.empty() && window.front().at < nextRotate - 2 * halfWindow) {
+                window.pop_front();
+            }
+
+            std::vector<uint32_t> hopValues[LATENCY_HOPS];
+            for (const Sample &sample : window) {
+                for (int hop = 0; hop < LATENCY_HOPS; hop++) {
+                    hopValues[hop].push_back(sample.hops[hop]);
+                }
+            }
+            for (int hop = 0; hop < LATENCY_HOPS; hop++) {
+                compare(result, stats.hop(hop), hopValues[hop]);
+            }
+            uint32_t *keep[] = {result.total, result.mesh};
+            const LatencyHistogram *from[] = {&stats.hop(LATENCY_HOP_TOTAL), &stats.hop(LATENCY_HOP_MESH)};
+            for (int k = 0; k < 2; k++) {
+                keep[k][0] = from[k]->percentile(50);
+                keep[k][1] = from[k]->percentile(95);
+                keep[k][2] = from[k]->percentile(99);
+            }
+
+            stats.rotate();
+            nextRotate += halfWindow;
+        }
+    }
+    result.recordNs = records ? recordSeconds * 1e9 / records : 0;
+    result.jsonUs = result.windows ? result.jsonUs / result.windows : 0;
+    return result;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--minutes" && i + 1 < argc) {
+            config.minutes = atoi(argv[++i]);
+        } else if (arg == "--interval" && i + 1 < argc) {
+            config.interval = atof(argv[++i]);
+        } else if (arg == "--hop-ms" && i + 1 < argc) {
+            config.hopMs = atof(argv[++i]);
+        } else if (arg == "--skew-ms" && i + 1 < argc) {
+            config.skewMs = atof(argv[++i]);
+        } else if (arg == "--fanout" && i + 1 < argc) {
+            config.fanout = atoi(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            config.seed = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--minutes n] [--interval s] [--hop-ms ms] [--skew-ms ms] [--fanout n] "
+                            "[--seed n]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (config.minutes <= 0 || config.interval <= 0 || config.hopMs <= 0 || config.skewMs < 0 || config.fanout <= 0) {
+        fprintf(stderr, "--minutes, --interval, --hop-ms and --fanout must be positive, --skew-ms not negative\n");
+        return 1;
+    }
+
+    printf("%d min, a reading every %.0f s per node, %.0f ms per hop, clocks up to %.0f ms apart, %d nodes per node\n",
+           config.minutes, config.interval, config.hopMs, config.skewMs, config.fanout);
+    printf("nodes  mesh p50/p95/p99 ms  total p50/p95/p99 ms  checked  wrong  worst error  record ns  json us  "
+           "json bytes\n");
+    bool failed = false;
+    static const int sizes[] = {4, 8, 16, 32, 64};
+    for (int nodes : sizes) {
+        Result r = run(config, nodes);
+        printf("%5d  %6u %5u %5u  %8u %5u %5u  %7zu  %5zu  %10.1f%%  %9.0f  %7.1f  %10zu\n", nodes, r.mesh[0], r.mesh[1],
+               r.mesh[2], r.total[0], r.total[1], r.total[2], r.checked, r.wrong, r.worstError * 100, r.recordNs,
+               r.jsonUs, r.jsonBytes);
+        failed = failed || r.wrong > 0 || r.jsonBytes == 0;
+    }
+    printf("%s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,243 @@
+// Host simulation of the WiFi node's screen while it relays mesh traffic, before and after LcdFields.
+//
+// The node handles one thing at a time, as painlessMesh's scheduler does. Readings from other
+// nodes arrive at --rate per second, the node sends every 10 s and refreshes its NodeID line every
+// 5 s.
+//   full    every received reading clears the screen and prints all of it again inside
+//           receivedCallback(), as the node did before.
+//   fields  receivedCallback() only sets its line, taskRenderLCD draws the changed characters
+//           at most every LCD_FRAME_INTERVAL.
+// A fake display counts the pixels pushed over SPI. The cost model is the M5StickC Plus ST7789 at
+// 27 MHz, 16 bits a pixel, plus a fixed setup per glyph or rectangle. Font 2 is taken as 7 x 16
+// pixels a glyph. The bench reports the time the screen takes and how long a reading waits
+// between its arrival and the end of its callback.
+//
+//   g++ -std=c++11 -O2 -I../libraries/LcdFields lcd_bench.cpp -o lcd_bench
+//   ./lcd_bench --seconds 600 --rate 5 --senders 8
+#include <LcdFields.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+struct BenchConfig {
+    int seconds = 600;
+    double rate = 5;       // readings received per second
+    int senders = 8;       // nodes whose readings pass through this one
+    unsigned seed = 1;
+};
+
+static const int SCREEN_WIDTH = 240;
+static const int SCREEN_HEIGHT = 135;
+static const int GLYPH_WIDTH = 7;
+static const int GLYPH_HEIGHT = 16;
+static const double US_PER_PIXEL = 16 / 27.0; // 16 bits at 27 MHz
+static const double SETUP_US = 4;             // address window and command bytes per glyph or rectangle
+static const double DECODE_US = 150;          // base64 and the frame, the same in both paths
+
+/*===================================================================*/
+/*                           Fake display                            */
+/*===================================================================*/
+struct FakeDisplay {
+    double busyUs = 0;
+    unsigned long long pixels = 0;
+
+    void push(long area, int setups) {
+        pixels += area;
+        busyUs += area * US_PER_PIXEL + setups * SETUP_US;
+    }
+
+    void setRotation(uint8_t) {}
+    void setTextColor(uint16_t, uint16_t) {}
+    void fillScreen(uint16_t) { push((long)SCREEN_WIDTH * SCREEN_HEIGHT, 1); }
+    void fillRect(int32_t, int32_t y, int32_t w, int32_t h, uint16_t) {
+        if (y < SCREEN_HEIGHT) {
+            push((long)w * h, 1);
+        }
+    }
+    int16_t textWidth(const char *text, uint8_t) { return (int16_t)(strlen(text) * GLYPH_WIDTH); }
+    int16_t fontHeight(uint8_t) { return GLYPH_HEIGHT; }
+    // the glyphs past the bottom are clipped, text past the right edge wraps as print() does
+    int16_t drawString(const char *text, int32_t, int32_t y, uint8_t) {
+        int16_t width = textWidth(text, 2);
+        if (y < SCREEN_HEIGHT) {
+            push((long)width * GLYPH_HEIGHT, (int)strlen(text));
+        }
+        return width;
+    }
+};
+
+/*===================================================================*/
+/*                            Simulation                             */
+/*===================================================================*/
+struct Result {
+    double screenUs = 0;
+    unsigned long long pixels = 0;
+    std::vector<double> waits; // us from a reading's arrival to the end of its callback
+};
+
+enum EventKind { RECEIVE, SEND, REFRESH, RENDER };
+
+struct Event {
+    double at;
+    EventKind kind;
+    bool operator>(const Event &other) const { return at > other.at; }
+};
+
+static Result run(const BenchConfig &config, bool fields) {
+    std::mt19937 random(config.seed);
+    std::exponential_distribution<double> gap(config.rate / 1e6);
+    std::uniform_int_distribution<int> pick(0, config.senders - 1);
+    std::uniform_int_distribution<int> step(0, 1);
+
+    FakeDisplay display;
+    LcdFields<FakeDisplay> lcd(display, 2);
+    const uint32_t nodeId = 2223841013u;
+    const uint32_t server = 634095965;
+    std::vector<int> levels(config.senders, 10);
+    char lastSent[80] = "";
+    char lastReceived[120] = "";
+    Result result;
+
+    // the old receivedCallback() and displayLCD(), line by line as print() put them on the screen
+    auto fullRedraw = [&](bool withReadings) {
+        display.fillScreen(0);
+        char line[128];
+        snprintf(line, sizeof(line), "NodeID: %u", nodeId);
+        display.drawString(line, 0, 0, 2);
+        if (!withReadings) {
+            return;
+        }
+        snprintf(line, sizeof(line), "Capacity: %d%%", levels[0]);
+        display.drawString(line, 0, GLYPH_HEIGHT, 2);
+        snprintf(line, sizeof(line), "Sent: %s", lastSent);
+        display.drawString(line, 0, 2 * GLYPH_HEIGHT, 2);
+        snprintf(line, sizeof(line), "Recv: %s", lastReceived);
+        display.drawString(line, 0, 5 * GLYPH_HEIGHT, 2);
+    };
+
+    if (fields) {
+        lcd.begin(3, 0xFFFF, 0);
+        lcd.printf(0, "NodeID: %u", nodeId);
+        lcd.printf(1, "Server: %u", server);
+    }
+
+    std::vector<Event> events;
+    auto schedule = [&](double at, EventKind kind) {
+        events.push_back({at, kind});
+        std::push_heap(events.begin(), events.end(), std::greater<Event>());
+    };
+    const double end = config.seconds * 1e6;
+    schedule(gap(random), RECEIVE);
+    schedule(10e6, SEND);
+    schedule(5e6, REFRESH);
+    if (fields) {
+        schedule(LCD_FRAME_INTERVAL * 1000.0, RENDER);
+    }
+
+    double freeAt = 0; // the node is busy with a callback until then
+    while (!events.empty()) {
+        std::pop_heap(events.begin(), events.end(), std::greater<Event>());
+        Event event = events.back();
+        events.pop_back();
+        if (event.at >= end) {
+            continue;
+        }
+        double start = std::max(event.at, freeAt);
+        double before = display.busyUs;
+        double work = 0;
+        switch (event.kind) {
+        case RECEIVE: {
+            int sender = pick(random);
+            levels[sender] = std::min(100, levels[sender] + step(random));
+            snprintf(lastReceived, sizeof(lastReceived),
+                     "originalID: %u, binCapacity: %d.00, timestamp: %u, priority: %d", nodeId + sender,
+                     levels[sender], (uint32_t)event.at, levels[sender] / 34 + 1);
+            work = DECODE_US;
+            if (fields) {
+                lcd.printf(4, "Recv: %u at %d%%", nodeId + sender, levels[sender]);
+            } else {
+                fullRedraw(true);
+            }
+            schedule(event.at + gap(random), RECEIVE);
+            break;
+        }
+        case SEND:
+            // the node sends its own level
+            snprintf(lastSent, sizeof(lastSent), "targetId: %u, binCapacity: %d.00, priority: 1", server, levels[0]);
+            if (fields) {
+                lcd.printf(3, "Sent: %d%% to %u", levels[0], server);
+            }
+            schedule(event.at + 10e6, SEND);
+            break;
+        case REFRESH:
+            if (fields) {
+                lcd.printf(0, "NodeID: %u", nodeId);
+                lcd.printf(1, "Server: %u", server);
+                lcd.printf(2, "Capacity: %d%%", levels[0]);
+            } else {
+                fullRedraw(false);
+            }
+            schedule(event.at + 5e6, REFRESH);
+            break;
+        case RENDER:
+            lcd.render((unsigned long)(start / 1000));
+            schedule(event.at + LCD_FRAME_INTERVAL * 1000.0, RENDER);
+            break;
+        }
+        freeAt = start + work + (display.busyUs - before);
+        if (event.kind == RECEIVE) {
+            result.waits.push_back(freeAt - event.at);
+        }
+    }
+    result.screenUs = display.busyUs;
+    result.pixels = display.pixels;
+    return result;
+}
+
+static void print_result(const char *name, Result r, int seconds) {
+    std::sort(r.waits.begin(), r.waits.end());
+    double sum = 0;
+    for (double wait : r.waits) {
+        sum += wait;
+    }
+    size_t n = r.waits.size();
+    printf("%-8s %14.0f %15.1f %12.2f %12.2f %12.2f\n", name, (double)r.pixels / seconds,
+           r.screenUs / 1000 / seconds, n ? sum / n / 1000 : 0.0, n ? r.waits[n * 99 / 100] / 1000 : 0.0,
+           n ? r.waits[n - 1] / 1000 : 0.0);
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--seconds" && i + 1 < argc) {
+            config.seconds = atoi(argv[++i]);
+        } else if (arg == "--rate" && i + 1 < argc) {
+            config.rate = atof(argv[++i]);
+        } else if (arg == "--senders" && i + 1 < argc) {
+            config.senders = atoi(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            config.seed = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--seconds n] [--rate per s] [--senders n] [--seed n]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (config.seconds <= 0 || config.rate <= 0 || config.senders <= 0) {
+        fprintf(stderr, "--seconds, --rate and --senders must be positive\n");
+        return 1;
+    }
+
+    printf("%d s, %.1f readings a second from %d senders, frames at most every %lu ms\n", config.seconds,
+           config.rate, config.senders, LCD_FRAME_INTERVAL);
+    printf("         pixels per s  screen ms per s  wait mean ms  wait p99 ms  wait max ms\n");
+    print_result("full", run(config, false), config.seconds);
+    print_result("fields", run(config, true), config.seconds);
+    return 0;
+}
@@ -0,0 +1,173 @@
+// Host simulation of the WiFi node's bin level sampling, before and after the echo filter.
+//
+// A bin fills at a steady rate while an HC-SR04 measures it with jitter, stray echoes and missed
+// echoes. Both paths map the distance with getActualBinCapacity() and queue readings as the node
+// does. A send every 10 s takes the newest queued reading.
+//   blocking  hc.dist() every 2 s. pulseIn waits for the whole echo, or its timeout when none
+//             comes back, and a missed echo reads as 0 cm, a full bin. Every reading is queued.
+//   filtered  a ping every 100 ms whose echo an interrupt times. LevelFilter takes the median of
+//             the last echoes and smooths it, and LevelReporter lets a level through every 2 s
+//             only past LEVEL_HYSTERESIS or LEVEL_REPORT_MAX_INTERVAL.
+//
+//   g++ -std=c++11 -O2 -I../libraries/BinMessage level_filter_bench.cpp -o level_filter_bench
+//   ./level_filter_bench --hours 4 --noise 0.5 --stray 0.03 --missed 0.02
+#include "../WiFi_Node/LevelFilter.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <random>
+#include <string>
+
+struct BenchConfig {
+    int hours = 4;
+    double fillHours = 3;   // from 25 cm, an empty bin, to 0 cm, a full one
+    double noise = 0.5;     // cm, standard deviation of an echo
+    double stray = 0.03;    // share of echoes off something else in the bin
+    double missed = 0.02;   // share of pings without an echo
+    unsigned seed = 1;
+};
+
+static const unsigned long PULSE_IN_TIMEOUT = 23530; // us, the HCSR04 library's limit
+static const unsigned long TRIGGER_US = 12;          // the trigger pulse, both paths send it
+
+// The node's step function from distance to percent
+static float capacity_of(float distance) {
+    if (distance < 20) {
+        return 100 - distance * 5;
+    } else if (distance > 20) {
+        return 0;
+    }
+    return 100;
+}
+
+struct Sensor {
+    const BenchConfig &config;
+    std::mt19937 random;
+    std::normal_distribution<double> jitter;
+    std::uniform_real_distribution<double> unit;
+
+    Sensor(const BenchConfig &c) : config(c), random(c.seed), jitter(0, c.noise), unit(0, 1) {}
+
+    // Distance in cm at t ms, the bin is emptied when it is full
+    double trueDistance(unsigned long t) const {
+        double fill = fmod(t / 3600000.0, config.fillHours) / config.fillHours;
+        return 25 * (1 - fill);
+    }
+
+    // Echo width in us, 0 when no echo came back
+    unsigned long echo(unsigned long t) {
+        double u = unit(random);
+        if (u < config.missed) {
+            return 0;
+        }
+        double distance = u < config.missed + config.stray ? unit(random) * 200 : trueDistance(t) + jitter(random);
+        return distance < 2 ? 2 * 58 : (unsigned long)(distance * 58);
+    }
+};
+
+struct Result {
+    unsigned long queued = 0;   // readings handed to the message queue
+    unsigned long payloads = 0; // sends that found a reading waiting
+    unsigned long spurious = 0; // readings queued more than LEVEL_HYSTERESIS off the true level
+    double errorSum = 0;        // |level at the bridge - true level|, sampled every second
+    unsigned long errorSamples = 0;
+    unsigned long off = 0;      // of those, samples more than LEVEL_HYSTERESIS off
+    double blockedUs = 0;       // time the scheduler could not run anything else
+};
+
+static void print_result(const char *name, const Result &r, int hours) {
+    printf("%-10s %12.0f %15.0f %15.1f %11.2f %11.1f%% %17.1f\n", name, (double)r.queued / hours,
+           (double)r.payloads / hours, (double)r.spurious / hours, r.errorSum / r.errorSamples,
+           100.0 * r.off / r.errorSamples, r.blockedUs / 1000 / hours);
+}
+
+static Result run(const BenchConfig &config, bool filtered) {
+    Sensor sensor(config);
+    LevelFilter filter;
+    LevelReporter reporter;
+    Result result;
+    bool waiting = false;    // a reading is queued
+    float queuedLevel = 0;
+    bool delivered = false;
+    float bridgeLevel = 0;
+
+    for (unsigned long t = 0; t < config.hours * 3600000UL; t += 100) {
+        float trueLevel = capacity_of(sensor.trueDistance(t));
+        float level = -1;
+        if (filtered) {
+            unsigned long width = sensor.echo(t);
+            result.blockedUs += TRIGGER_US;
+            if (width > 0 && width < PULSE_IN_TIMEOUT) {
+                filter.add(width / 58.0f);
+            }
+            if (t % 2000 == 0 && filter.ready()) {
+                float candidate = capacity_of(filter.distance());
+                if (reporter.shouldReport(candidate, t)) {
+                    level = candidate;
+                }
+            }
+        } else if (t % 2000 == 0) {
+            unsigned long width = sensor.echo(t);
+            bool timedOut = width == 0 || width >= PULSE_IN_TIMEOUT;
+            result.blockedUs += TRIGGER_US + (timedOut ? PULSE_IN_TIMEOUT : width);
+            level = capacity_of(timedOut ? 0 : width / 58.0f);
+        }
+
+        if (level >= 0) {
+            result.queued++;
+            result.spurious += fabsf(level - trueLevel) > LEVEL_HYSTERESIS;
+            waiting = true;
+            queuedLevel = level;
+        }
+        if (t % 10000 == 5000 && waiting) {
+            result.payloads++;
+            waiting = false;
+            delivered = true;
+            bridgeLevel = queuedLevel;
+        }
+        if (t % 1000 == 0 && delivered) {
+            float error = fabsf(bridgeLevel - trueLevel);
+            result.errorSum += error;
+            result.errorSamples++;
+            result.off += error > LEVEL_HYSTERESIS;
+        }
+    }
+    return result;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--hours" && i + 1 < argc) {
+            config.hours = atoi(argv[++i]);
+        } else if (arg == "--fill-hours" && i + 1 < argc) {
+            config.fillHours = atof(argv[++i]);
+        } else if (arg == "--noise" && i + 1 < argc) {
+            config.noise = atof(argv[++i]);
+        } else if (arg == "--stray" && i + 1 < argc) {
+            config.stray = atof(argv[++i]);
+        } else if (arg == "--missed" && i + 1 < argc) {
+            config.missed = atof(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            config.seed = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--hours n] [--fill-hours h] [--noise cm] [--stray p] [--missed p] [--seed n]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (config.hours <= 0 || config.fillHours <= 0) {
+        fprintf(stderr, "--hours and --fill-hours must be positive\n");
+        return 1;
+    }
+
+    printf("%d h, bin full every %.1f h, %.1f cm jitter, %.0f%% stray and %.0f%% missed echoes, %.0f%% hysteresis\n",
+           config.hours, config.fillHours, config.noise, config.stray * 100, config.missed * 100, LEVEL_HYSTERESIS);
+    printf("           queued per h  payloads per h  spurious per h  mean error  time off  blocked ms per h\n");
+    print_result("blocking", run(config, false), config.hours);
+    print_result("filtered", run(config, true), config.hours);
+    return 0;
+}
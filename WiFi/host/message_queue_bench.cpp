@@ -0,0 +1,273 @@
+// Host microbenchmark of the WiFi_Node message queue.
+//
+// Compares MessageQueue from WiFi_Node/MessageQueue.h with the queue it replaced: a
+// std::vector of messages with a heap-allocated payload (std::string standing in for the
+// Arduino String), fully sorted on every insert and popped with erase(begin()).
+// Heap allocations are counted by replacing the global operator new.
+//
+//   g++ -std=c++11 -O2 -I../libraries/BinMessage message_queue_bench.cpp -o message_queue_bench
+//   ./message_queue_bench --depth 15 --ops 1000000
+//   ./message_queue_bench --hours 1    # the node's schedule: a reading every 2 s, a send every 10 s
+#include "../WiFi_Node/MessageQueue.h"
+#include <BinMessage.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include <string>
+#include <vector>
+
+static unsigned long allocations = 0;
+static unsigned long allocatedBytes = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    allocatedBytes += size;
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+struct BenchConfig {
+    int depth = MESSAGE_QUEUE_SLOTS - 1; // messages waiting while push and pop are timed
+    long ops = 1000000;              // push and pop pairs
+    int hours = 0;                   // run the node's schedule for this long instead
+    unsigned seed = 1;
+};
+
+/*===================================================================*/
+/*                    Queue the node used before                     */
+/*===================================================================*/
+struct LegacyMessage {
+    uint32_t targetId;
+    std::string payload;
+    int priority;
+    unsigned long createdAt; // bench only, for the age of the message when it is sent
+
+    LegacyMessage(uint32_t id, const std::string &pl, float binCap)
+        : targetId(id), payload(pl), priority(CustomMessage::calculatePriority(binCap)), createdAt(0) {}
+};
+
+struct LegacyQueue {
+    std::vector<LegacyMessage> messages;
+
+    void push(const LegacyMessage &message) {
+        messages.push_back(message);
+        std::sort(messages.begin(), messages.end(), [](const LegacyMessage &a, const LegacyMessage &b) {
+            return a.priority > b.priority;
+        });
+    }
+
+    int pop() {
+        LegacyMessage message = messages.front();
+        messages.erase(messages.begin());
+        return message.priority;
+    }
+};
+
+/*===================================================================*/
+/*                             Workloads                             */
+/*===================================================================*/
+// A payload as getBinCapacityCallback() encodes it, long enough to live on the heap as a String
+static std::string make_payload(float binCapacity, unsigned long timestamp) {
+    BinReading reading = {634095965, binCapacity, (uint32_t)timestamp};
+    uint8_t frame[BIN_MESSAGE_MAX_SIZE];
+    char buffer[BIN_MESSAGE_TEXT_SIZE];
+    binMessageToText(frame, encodeReading(reading, frame, sizeof(frame)), buffer, sizeof(buffer));
+    return buffer;
+}
+
+struct Result {
+    double nsPerOp;
+    unsigned long allocations;
+    unsigned long bytes;
+    unsigned long checksum; // keeps the work from being optimised away
+};
+
+template <typename Push, typename Pop>
+static Result time_steady_state(const BenchConfig &config, Push push, Pop pop) {
+    for (int i = 0; i < config.depth; i++) {
+        push(i);
+    }
+    Result result;
+    result.checksum = 0;
+    unsigned long startAllocations = allocations;
+    unsigned long startBytes = allocatedBytes;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < config.ops; i++) {
+        push(config.depth + i);
+        result.checksum += pop();
+    }
+    auto end = std::chrono::steady_clock::now();
+    result.nsPerOp = std::chrono::duration<double, std::nano>(end - start).count() / config.ops;
+    result.allocations = allocations - startAllocations;
+    result.bytes = allocatedBytes - startBytes;
+    return result;
+}
+
+// Every message comes from its own rootSender here, so nothing is coalesced
+static void run_steady_state(const BenchConfig &config) {
+    std::vector<std::string> payloads;
+    std::vector<float> capacities;
+    for (int i = 0; i < 1024; i++) {
+        float capacity = rand() % 10001 / 100.0f;
+        capacities.push_back(capacity);
+        payloads.push_back(make_payload(capacity, 1000UL * i));
+    }
+
+    static LegacyQueue legacy;
+    Result before = time_steady_state(
+        config,
+        [&](long i) { legacy.push(LegacyMessage(634095965, payloads[i % 1024], capacities[i % 1024])); },
+        [&]() { return legacy.pop(); });
+
+    static MessageQueue queue;
+    Result after = time_steady_state(
+        config,
+        [&](long i) {
+            BinReading reading = {(uint32_t)i, capacities[i % 1024], (uint32_t)(1000 * i)};
+            queue.push(634095965, CustomMessage::calculatePriority(reading.binCapacity), reading);
+        },
+        [&]() {
+            int priority = queue.front()->priority;
+            queue.pop();
+            return priority;
+        });
+
+    printf("queue depth            %d messages (pool of %d, %zu bytes)\n", config.depth, MESSAGE_QUEUE_SLOTS,
+           sizeof(MessageQueue));
+    printf("push + pop pairs       %ld\n", config.ops);
+    printf("                       ns per pair  heap allocations per pair  heap bytes per pair\n");
+    printf("vector + sort          %11.1f  %25.2f  %19.1f\n", before.nsPerOp, (double)before.allocations / config.ops,
+           (double)before.bytes / config.ops);
+    printf("priority rings         %11.1f  %25.2f  %19.1f\n", after.nsPerOp, (double)after.allocations / config.ops,
+           (double)after.bytes / config.ops);
+    printf("checksum               %lu %lu\n", before.checksum, after.checksum);
+}
+
+// Latency of the readings that went out in one hour of the schedule
+struct HourStats {
+    unsigned long sent = 0;
+    double ageSum = 0;       // ms from the reading to its send
+    unsigned long ageMax = 0;
+    size_t depthMax = 0;
+
+    void add(unsigned long age) {
+        sent++;
+        ageSum += age;
+        ageMax = age > ageMax ? age : ageMax;
+    }
+};
+
+// Readings every 2 s and one send every 10 s, 1 s after a reading, as the node's tasks run them.
+// Both queues send one message per send. The node only queues its own readings, so the rings
+// coalesce them into one waiting reading.
+static void run_schedule(const BenchConfig &config) {
+    static LegacyQueue legacy;
+    static MessageQueue queue;
+    unsigned long legacyAllocations = 0;
+    unsigned long queueAllocations = 0;
+    unsigned long legacyNs = 0;
+    unsigned long queueNs = 0;
+
+    printf("schedule  %d h, a reading every 2 s, send every 10 s\n", config.hours);
+    printf("          vector + sort                      priority rings, coalesced\n");
+    printf("hour      depth  mean age ms   max age ms    depth  mean age ms   max age ms\n");
+    for (int hour = 0; hour < config.hours; hour++) {
+        HourStats before, after;
+        for (unsigned long second = hour * 3600UL; second < (hour + 1) * 3600UL; second += 2) {
+            unsigned long now = second * 1000;
+            float capacity = rand() % 10001 / 100.0f;
+
+            unsigned long start = allocations;
+            auto t0 = std::chrono::steady_clock::now();
+            legacy.push(LegacyMessage(634095965, make_payload(capacity, now), capacity));
+            legacy.messages.back().createdAt = now;
+            auto t1 = std::chrono::steady_clock::now();
+            legacyAllocations += allocations - start;
+            legacyNs += std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+
+            start = allocations;
+            t0 = std::chrono::steady_clock::now();
+            BinReading reading = {634095965u, capacity, (uint32_t)now};
+            queue.push(634095965, CustomMessage::calculatePriority(capacity), reading);
+            t1 = std::chrono::steady_clock::now();
+            queueAllocations += allocations - start;
+            queueNs += std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+
+            before.depthMax = std::max(before.depthMax, legacy.messages.size());
+            after.depthMax = std::max(after.depthMax, queue.size());
+            if (second % 10 != 8) {
+                continue;
+            }
+            now += 1000;
+
+            start = allocations;
+            t0 = std::chrono::steady_clock::now();
+            unsigned long createdAt = legacy.messages.front().createdAt;
+            legacy.pop();
+            t1 = std::chrono::steady_clock::now();
+            legacyAllocations += allocations - start;
+            legacyNs += std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+            before.add(now - createdAt);
+
+            t0 = std::chrono::steady_clock::now();
+            after.add(now - queue.front()->reading.rootTimestampSent);
+            queue.pop();
+            t1 = std::chrono::steady_clock::now();
+            queueNs += std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+        }
+        printf("%4d  %9zu %12.0f %12lu %8zu %12.0f %12lu\n", hour + 1, before.depthMax, before.ageSum / before.sent,
+               before.ageMax, after.depthMax, after.ageSum / after.sent, after.ageMax);
+    }
+
+    size_t legacyBytes = legacy.messages.capacity() * sizeof(LegacyMessage);
+    for (size_t i = 0; i < legacy.messages.size(); i++) {
+        legacyBytes += legacy.messages[i].payload.capacity() + 1;
+    }
+    printf("vector + sort          %zu messages waiting at the end, %zu heap bytes held, %lu allocations, %.1f ms CPU\n",
+           legacy.messages.size(), legacyBytes, legacyAllocations, legacyNs / 1e6);
+    printf("priority rings         %zu messages waiting at the end, %zu bytes fixed, %lu allocations, %.1f ms CPU, "
+           "%lu coalesced, %lu dropped\n", queue.size(), sizeof(MessageQueue), queueAllocations, queueNs / 1e6,
+           (unsigned long)queue.coalescedCount(), (unsigned long)queue.droppedCount());
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--depth" && i + 1 < argc) {
+            config.depth = atoi(argv[++i]);
+        } else if (arg == "--ops" && i + 1 < argc) {
+            config.ops = atol(argv[++i]);
+        } else if (arg == "--hours" && i + 1 < argc) {
+            config.hours = atoi(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            config.seed = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--depth n] [--ops n] [--hours n] [--seed n]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (config.hours <= 0 && (config.depth < 0 || config.depth >= MESSAGE_QUEUE_SLOTS)) {
+        // One slot stays free for the message pushed before each pop
+        fprintf(stderr, "--depth must be between 0 and %d\n", MESSAGE_QUEUE_SLOTS - 1);
+        return 1;
+    }
+    srand(config.seed);
+
+    if (config.hours > 0) {
+        run_schedule(config);
+    } else {
+        run_steady_state(config);
+    }
+    return 0;
+}
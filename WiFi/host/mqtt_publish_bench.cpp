@@ -0,0 +1,239 @@
+// Host simulation of the MQTT bridge's loop() publishing readings while the mesh delivers them.
+//
+// Readings arrive at --rate per second, plus a burst of --burst readings every --burst-every s,
+// as when a node drains a long queue. The broker goes away at --outage-at for --outage s.
+//   task     the bridge before: every 10 s processMessagesFromQueue() calls connect() and drains
+//            the whole queue, one publish per reading.
+//   session  maintainMqtt() keeps one session and retries it with ReconnectBackoff, and
+//            processMessagesFromQueue() publishes at most MQTT_DRAIN_PER_LOOP readings per pass,
+//            packed into PublishBatch arrays, after the oldest waited MQTT_BATCH_LINGER.
+// Both run in loop(), between two mesh.update() calls. The bench reports how long the mesh waits
+// for the MQTT work, and how long a reading waits in the queue.
+//
+// Costs are rough ESP32 numbers: a serialized reading SERIALIZE_US, a publish PUBLISH_US plus the
+// bytes, a connect CONNECT_US, and a connect to a broker that is gone CONNECT_FAIL_US, the TCP
+// timeout of WiFiClient.
+//
+//   g++ -std=c++11 -O2 mqtt_publish_bench.cpp -o mqtt_publish_bench
+//   ./mqtt_publish_bench --seconds 3600 --rate 5 --burst 200 --burst-every 300 --outage-at 1200 --outage 600
+#include "../mqttBridge/MqttBatch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+struct BenchConfig {
+    int seconds = 3600;
+    double rate = 5;        // readings a second
+    int burst = 200;        // readings in a burst
+    int burstEvery = 300;   // s
+    int outageAt = 1200;    // s
+    int outage = 600;       // s
+};
+
+static const double LOOP_US = 2000;           // mesh.update() and the rest of a pass
+static const double SERIALIZE_US = 40;        // ArduinoJson, one reading
+static const double PUBLISH_US = 1200;        // WiFiClient write of one packet
+static const double PUBLISH_BYTE_US = 0.1;
+static const double CONNECT_US = 30000;
+static const double CONNECT_FAIL_US = 3000000;
+static const int TASK_INTERVAL_US = 10000000;
+static const char READING_JSON[] = "{\"rootSender\":\"2223841013\",\"binCapacity\":45.5,\"timestamp\":1234567890,"
+                                   "\"sentAt\":1234607890,\"receivedAt\":1234631250,\"publishedAt\":1234712500}";
+
+/*===================================================================*/
+/*                              Broker                               */
+/*===================================================================*/
+struct Broker {
+    const BenchConfig &config;
+    bool session = false;
+    unsigned long publishes = 0;
+    unsigned long connects = 0;
+
+    explicit Broker(const BenchConfig &c) : config(c) {}
+
+    bool up(double now) const { return now < config.outageAt * 1e6 || now >= (config.outageAt + config.outage) * 1e6; }
+
+    // the session is gone as soon as the broker is
+    bool connected(double now) {
+        session = session && up(now);
+        return session;
+    }
+
+    bool connect(double now, double &cost) {
+        if (connected(now)) {
+            return true; // PubSubClient::connect() does nothing on a live session
+        }
+        connects++;
+        cost += up(now) ? CONNECT_US : CONNECT_FAIL_US;
+        session = up(now);
+        return session;
+    }
+
+    bool publish(double now, size_t bytes, double &cost) {
+        if (!connected(now)) {
+            return false;
+        }
+        publishes++;
+        cost += PUBLISH_US + (MQTT_PACKET_OVERHEAD + sizeof(MQTT_TOPIC) - 1 + bytes) * PUBLISH_BYTE_US;
+        return true;
+    }
+};
+
+/*===================================================================*/
+/*                            Simulation                             */
+/*===================================================================*/
+struct Result {
+    unsigned long published = 0;
+    unsigned long publishes = 0;
+    unsigned long connects = 0;
+    double mqttUs = 0;       // loop() time spent on MQTT
+    double maxStallUs = 0;   // longest single pass of MQTT work
+    unsigned long longStalls = 0; // passes that kept the mesh waiting more than 100 ms
+    std::vector<double> waits; // us from arrival to publish
+    size_t maxQueue = 0;
+};
+
+static Result run(const BenchConfig &config, bool session) {
+    Broker broker(config);
+    ReconnectBackoff backoff;
+    std::deque<double> queue; // arrival times
+    double queuedSince = 0;
+    Result result;
+    char buffer[MQTT_BUFFER_SIZE];
+    const size_t readingLength = sizeof(READING_JSON) - 1;
+
+    double nextArrival = 0;
+    double nextBurst = config.burstEvery * 1e6;
+    double nextTask = TASK_INTERVAL_US;
+    const double end = config.seconds * 1e6;
+    for (double now = 0; now < end;) {
+        // mesh.update() hands over what arrived while loop() was busy
+        while (nextArrival <= now) {
+            if (queue.empty()) {
+                queuedSince = now;
+            }
+            queue.push_back(nextArrival);
+            nextArrival += 1e6 / config.rate;
+        }
+        if (config.burst > 0 && nextBurst <= now) {
+            if (queue.empty()) {
+                queuedSince = now;
+            }
+            queue.insert(queue.end(), config.burst, nextBurst);
+            nextBurst += config.burstEvery * 1e6;
+        }
+        result.maxQueue = std::max(result.maxQueue, queue.size());
+
+        double cost = 0;
+        if (!session) {
+            if (now >= nextTask) {
+                nextTask += TASK_INTERVAL_US;
+                if (broker.connect(now, cost)) {
+                    while (!queue.empty()) {
+                        cost += SERIALIZE_US;
+                        if (!broker.publish(now + cost, readingLength, cost)) {
+                            break;
+                        }
+                        result.waits.push_back(now + cost - queue.front());
+                        queue.pop_front();
+                        result.published++;
+                    }
+                }
+            }
+        } else {
+            unsigned long ms = (unsigned long)(now / 1000);
+            if (!broker.connected(now) && backoff.due(ms)) {
+                if (broker.connect(now, cost)) {
+                    backoff.reset();
+                } else {
+                    backoff.failed(ms + (unsigned long)(cost / 1000));
+                }
+            }
+            size_t drained = 0;
+            bool linger = queue.size() < MQTT_DRAIN_PER_LOOP && now - queuedSince < MQTT_BATCH_LINGER * 1000.0;
+            while (!linger && broker.connected(now + cost) && drained < MQTT_DRAIN_PER_LOOP && drained < queue.size()) {
+                PublishBatch payload(buffer, MQTT_PAYLOAD_MAX + 1);
+                size_t first = drained;
+                while (drained < MQTT_DRAIN_PER_LOOP && drained < queue.size()) {
+                    cost += SERIALIZE_US;
+                    if (!payload.add(READING_JSON, readingLength)) {
+                        break;
+                    }
+                    drained++;
+                }
+                payload.finish();
+                if (!broker.publish(now + cost, payload.bytes(), cost)) {
+                    drained = first;
+                    break;
+                }
+            }
+            for (size_t i = 0; i < drained; i++) {
+                result.waits.push_back(now + cost - queue.front());
+                queue.pop_front();
+                result.published++;
+            }
+            if (drained > 0) {
+                queuedSince = now + cost;
+            }
+        }
+        result.mqttUs += cost;
+        result.maxStallUs = std::max(result.maxStallUs, cost);
+        result.longStalls += cost > 100000;
+        now += LOOP_US + cost;
+    }
+    result.publishes = broker.publishes;
+    result.connects = broker.connects;
+    return result;
+}
+
+static void print_result(const char *name, Result r, int seconds) {
+    std::sort(r.waits.begin(), r.waits.end());
+    double sum = 0;
+    for (double wait : r.waits) {
+        sum += wait;
+    }
+    size_t n = r.waits.size();
+    printf("%-8s %9lu %9lu %8lu %12.1f %12.1f %11lu %9.2f %9.2f %9zu\n", name, r.published, r.publishes,
+           r.connects, r.mqttUs / 1000 / seconds, r.maxStallUs / 1000, r.longStalls, n ? sum / n / 1e6 : 0.0,
+           n ? r.waits[n * 99 / 100] / 1e6 : 0.0, r.maxQueue);
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--seconds" && i + 1 < argc) {
+            config.seconds = atoi(argv[++i]);
+        } else if (arg == "--rate" && i + 1 < argc) {
+            config.rate = atof(argv[++i]);
+        } else if (arg == "--burst" && i + 1 < argc) {
+            config.burst = atoi(argv[++i]);
+        } else if (arg == "--burst-every" && i + 1 < argc) {
+            config.burstEvery = atoi(argv[++i]);
+        } else if (arg == "--outage-at" && i + 1 < argc) {
+            config.outageAt = atoi(argv[++i]);
+        } else if (arg == "--outage" && i + 1 < argc) {
+            config.outage = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--seconds n] [--rate per s] [--burst n] [--burst-every s] [--outage-at s] "
+                            "[--outage s]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (config.seconds <= 0 || config.rate <= 0 || config.burst < 0 || config.burstEvery <= 0 || config.outage < 0) {
+        fprintf(stderr, "--seconds, --rate and --burst-every must be positive, --burst and --outage not negative\n");
+        return 1;
+    }
+
+    printf("%d s, %.1f readings a second, %d more every %d s, broker down from %d s for %d s\n", config.seconds,
+           config.rate, config.burst, config.burstEvery, config.outageAt, config.outage);
+    printf("         published publishes connects  mqtt ms per s  max stall ms  stalls >100ms  wait mean  wait p99  max queue\n");
+    print_result("task", run(config, false), config.seconds);
+    print_result("session", run(config, true), config.seconds);
+    return 0;
+}
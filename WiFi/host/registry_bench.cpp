@@ -0,0 +1,258 @@
+// Host simulation of the MQTT bridge's device registry (WiFi/mqttBridge/DeviceRegistry.h).
+//
+// --nodes bins report as WiFi_Node's LevelReporter lets them: when the level moved 5 points, or
+// after 60 s. A share --dup of the payloads arrives twice, as when the bridge's ACK was lost and
+// the node sent again, and each node goes quiet for 5 min --silences times a day. --churn nodes an
+// hour leave the mesh and a new one joins, so the table fills up with nodes that are gone.
+//   string    the bridge before: every reading is published, with a String of its node id made
+//             for the JSON. A stand-in that always takes its buffer from the heap, as Arduino's does.
+//   registry  DeviceRegistry::ingest() keeps each bin's state and drops resends and unchanged
+//             levels, the JSON takes the node id the registry keeps as text.
+// The bench fails when the registry loses a node still in the mesh, its latest level is not the
+// node's, its counts do not add up, a silence goes uncounted, or it allocates from the heap.
+//
+//   g++ -std=c++11 -O2 -I../libraries/BinMessage registry_bench.cpp -o registry_bench
+//   ./registry_bench --hours 24 --nodes 40 --dup 0.05 --silences 4 --churn 0.5
+#include "../mqttBridge/DeviceRegistry.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+struct BenchConfig {
+    int hours = 24;
+    int nodes = 40;
+    double dup = 0.05;      // share of payloads that arrive twice
+    double silences = 4;    // 5 min silences a node has a day
+    double churn = 0.5;     // nodes replaced an hour
+    unsigned seed = 1;
+};
+
+static const unsigned long STEP_MS = 2000;       // the node samples its level this often
+static const float HYSTERESIS = 5.0f;            // LEVEL_HYSTERESIS
+static const unsigned long SILENCE_MS = 300000;
+
+// operator new is counted only while a path ingests
+static bool counting = false;
+static unsigned long allocations = 0;
+
+void *operator new(size_t size) {
+    if (counting) {
+        allocations++;
+    }
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// What String(rootSender) costs: a heap buffer for every reading
+struct HeapString {
+    char *text;
+    explicit HeapString(uint32_t id) : text(new char[REGISTRY_NAME_SIZE]) { snprintf(text, REGISTRY_NAME_SIZE, "%lu", (unsigned long)id); }
+    ~HeapString() { delete[] text; }
+};
+
+/*===================================================================*/
+/*                            Simulation                             */
+/*===================================================================*/
+struct Node {
+    uint32_t id;
+    float level;
+    float reported;           // level of the last report
+    unsigned long reportedAt;
+    unsigned long quietUntil;
+    BinReading last;          // the last reading it sent
+    uint32_t silences;        // between two of its reports
+    bool silent;              // went quiet since its last report
+    uint32_t sent;            // readings, resends included
+};
+
+struct Arrival {
+    BinReading reading;
+    bool resend;
+};
+
+struct Result {
+    unsigned long readings = 0;
+    unsigned long published = 0;
+    unsigned long allocations = 0;
+    double ns = 0;            // per reading
+    unsigned long checksum = 0; // keeps the JSON names from being optimized away
+};
+
+static std::vector<Arrival> makeStream(const BenchConfig &config, std::vector<Node> &nodes,
+                                       std::vector<unsigned long> &times, uint32_t &nextId) {
+    std::mt19937 random(config.seed);
+    std::uniform_real_distribution<double> unit(0, 1);
+    std::normal_distribution<double> drift(0.05, 0.6);
+    std::vector<Arrival> stream;
+    nodes.resize(config.nodes);
+    for (Node &node : nodes) {
+        node = Node{nextId++, (float)(unit(random) * 80), -100, 0, 0, {0, 0, 0}, 0, false, 0};
+    }
+    double silenceChance = config.silences / (86400000.0 / STEP_MS);
+    double churnChance = config.churn / (3600000.0 / STEP_MS) / config.nodes;
+    for (unsigned long now = STEP_MS; now <= (unsigned long)config.hours * 3600000UL; now += STEP_MS) {
+        for (Node &node : nodes) {
+            if (unit(random) < churnChance) {
+                node = Node{nextId++, (float)(unit(random) * 80), -100, 0, 0, {0, 0, 0}, 0, false, 0};
+            }
+            if (now < node.quietUntil) {
+                continue;
+            }
+            if (unit(random) < silenceChance) {
+                node.quietUntil = now + SILENCE_MS;
+                node.silent = true;
+                continue;
+            }
+            node.level += drift(random);
+            node.level = node.level < 0 ? 0 : node.level > 100 ? 0 : node.level; // emptied when full
+            float moved = node.level - node.reported;
+            if (moved < HYSTERESIS && moved > -HYSTERESIS && now - node.reportedAt < BIN_REPORT_MAX_INTERVAL) {
+                continue;
+            }
+            node.reported = node.level;
+            node.reportedAt = now;
+            node.silences += node.silent && node.last.rootSender != 0;
+            node.silent = false;
+            // mesh time in us wraps every 71 min, as on the nodes
+            node.last = BinReading{node.id, (float)(int)(node.level * 100) / 100, (uint32_t)(now * 1000UL)};
+            stream.push_back(Arrival{node.last, false});
+            times.push_back(now);
+            node.sent++;
+            if (unit(random) < config.dup) {
+                stream.push_back(Arrival{node.last, true});
+                times.push_back(now);
+                node.sent++;
+            }
+        }
+    }
+    return stream;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--hours" && i + 1 < argc) {
+            config.hours = atoi(argv[++i]);
+        } else if (arg == "--nodes" && i + 1 < argc) {
+            config.nodes = atoi(argv[++i]);
+        } else if (arg == "--dup" && i + 1 < argc) {
+            config.dup = atof(argv[++i]);
+        } else if (arg == "--silences" && i + 1 < argc) {
+            config.silences = atof(argv[++i]);
+        } else if (arg == "--churn" && i + 1 < argc) {
+            config.churn = atof(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            config.seed = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--hours n] [--nodes n] [--dup share] [--silences per day] [--churn per hour] "
+                            "[--seed n]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (config.hours <= 0 || config.nodes <= 0 || config.nodes > REGISTRY_MAX_DEVICES || config.dup < 0 ||
+        config.silences < 0 || config.churn < 0) {
+        fprintf(stderr, "--hours must be positive, --nodes 1 to %d, the rest not negative\n", REGISTRY_MAX_DEVICES);
+        return 1;
+    }
+
+    std::vector<Node> nodes;
+    std::vector<unsigned long> times;
+    uint32_t nextId = 2223841013u;
+    std::vector<Arrival> stream = makeStream(config, nodes, times, nextId);
+
+    Result string;
+    counting = true;
+    auto start = std::chrono::steady_clock::now();
+    for (const Arrival &arrival : stream) {
+        HeapString name(arrival.reading.rootSender);
+        string.checksum += name.text[9];
+        string.published++;
+    }
+    string.ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / stream.size();
+    counting = false;
+    string.allocations = allocations;
+    string.readings = stream.size();
+
+    static DeviceRegistry registryTable;
+    DeviceRegistry *registry = &registryTable;
+    Result table;
+    allocations = 0;
+    counting = true;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < stream.size(); i++) {
+        if (registry->ingest(stream[i].reading, times[i])) {
+            table.checksum += registry->find(stream[i].reading.rootSender)->name[9];
+            registry->countPublished(stream[i].reading.rootSender); // every publish goes out here
+            table.published++;
+        }
+    }
+    table.ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / stream.size();
+    counting = false;
+    table.allocations = allocations;
+    table.readings = stream.size();
+
+    // the checks
+    unsigned long lost = 0, wrongLevel = 0, badCounts = 0, missedGaps = 0, unreachable = 0, relearned = 0;
+    unsigned long duplicates = 0, unchanged = 0, late = 0, gaps = 0, resends = 0;
+    for (const Node &node : nodes) {
+        const DeviceState *device = registry->find(node.id);
+        if (!device) {
+            lost += node.last.rootSender != 0;
+            continue;
+        }
+        wrongLevel += device->level != node.last.binCapacity;
+        // with more bins about than the table holds, a quiet one can be forgotten and learned again
+        if (device->readings < node.sent) {
+            relearned++;
+        } else {
+            missedGaps += device->gaps < node.silences;
+        }
+    }
+    for (size_t i = 0; i < REGISTRY_SLOTS; i++) {
+        const DeviceState *device = registry->slot(i);
+        if (!device) {
+            continue;
+        }
+        unreachable += registry->find(device->id) != device;
+        badCounts += device->readings != device->accepted + device->duplicates + device->unchanged ||
+                     device->published != device->accepted;
+        duplicates += device->duplicates;
+        unchanged += device->unchanged;
+        late += device->late;
+        gaps += device->gaps;
+    }
+    for (const Arrival &arrival : stream) {
+        resends += arrival.resend;
+    }
+
+    printf("%d h, %d bins, %.0f%% of payloads twice, %.0f silences a day, %.1f bins replaced an hour\n", config.hours,
+           config.nodes, config.dup * 100, config.silences, config.churn);
+    printf("          readings  published  ns per reading  heap allocations\n");
+    printf("string    %8lu  %9lu  %14.1f  %16lu\n", string.readings, string.published, string.ns, string.allocations);
+    printf("registry  %8lu  %9lu  %14.1f  %16lu\n", table.readings, table.published, table.ns, table.allocations);
+    printf("registry: %zu bins, %lu forgotten for new ones, %zu bytes\n", registry->size(),
+           (unsigned long)registry->forgottenCount(), sizeof(DeviceRegistry));
+    printf("in the table now: %lu resends dropped, %lu unchanged dropped, %lu late, %lu gaps; %lu resends sent in all\n",
+           duplicates, unchanged, late, gaps, resends);
+    printf("bins lost %lu, wrong latest level %lu, counts off %lu, silences missed %lu, entries unreachable %lu, "
+           "forgotten in a silence %lu\n", lost, wrongLevel, badCounts, missedGaps, unreachable, relearned);
+
+    bool failed = lost > 0 || wrongLevel > 0 || badCounts > 0 || missedGaps > 0 || unreachable > 0 ||
+                  table.allocations > 0 || string.checksum == 0 || table.checksum == 0;
+    printf("%s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
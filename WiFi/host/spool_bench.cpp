@@ -0,0 +1,403 @@
+// Stress test of the MQTT bridge's flash spool (WiFi/mqttBridge/ReadingSpool.h) on Linux, with the
+// segments in plain files of a temporary directory instead of LittleFS.
+//
+// Readings arrive at --rate per second while the broker is down for --outage-hours, then it comes
+// back and the spool is replayed at MQTT_DRAIN_PER_LOOP readings per 2 ms pass, as loop() does.
+// A publish fails now and then. The bridge reboots every --crash-every minutes on average, and a
+// share --tear of those reboots hits an append halfway, leaving a torn record on flash. During the
+// replay it reboots every --replay-crash-every ms.
+//
+// Every reading carries its sequence number, and send and receive times made from it. The test
+// fails when a reading is published out of order or with other times, or goes missing without being in the RAM ring at a reboot or being dropped by the spool.
+// It also fails when the spool allocates from the heap, which is counted through operator new.
+// At the end a reboot tears the only reading left, and the replay has to drop the torn record and
+// empty the spool instead of reading it again on every pass.
+//
+//   g++ -std=c++11 -O2 -I../libraries/BinMessage spool_bench.cpp -o spool_bench
+//   ./spool_bench --outage-hours 6 --rate 2 --crash-every 30 --tear 0.5
+#include "../mqttBridge/MqttBatch.h"
+#include "../mqttBridge/ReadingSpool.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+struct BenchConfig {
+    double outageHours = 6;
+    double rate = 2;          // readings a second
+    double crashEvery = 30;   // minutes between reboots on average, 0 for none
+    double tear = 0.5;        // share of reboots that tear an append
+    double publishFail = 0.01; // share of publishes that fail after the broker is back
+    int replayCrashEvery = 200; // ms between reboots while the spool is replayed, 0 for none
+    unsigned seed = 1;
+};
+
+// operator new is counted only while the spool runs
+static bool counting = false;
+static unsigned long allocations = 0;
+
+void *operator new(size_t size) {
+    if (counting) {
+        allocations++;
+    }
+    void *p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+/*===================================================================*/
+/*                          File storage                             */
+/*===================================================================*/
+class FileSpoolStorage : public SpoolStorage {
+public:
+    explicit FileSpoolStorage(const std::string &directory) : tearNext(false), dir(directory), cursorPath(directory + "/cursor") {}
+
+    bool segmentRange(uint32_t &first, uint32_t &last) override {
+        DIR *d = opendir(dir.c_str());
+        if (!d) {
+            return false;
+        }
+        bool found = false;
+        for (struct dirent *entry = readdir(d); entry; entry = readdir(d)) {
+            char *end;
+            uint32_t segment = strtoul(entry->d_name, &end, 16);
+            if (*end != '\0' || end == entry->d_name || segment == 0) {
+                continue;
+            }
+            first = !found || segment < first ? segment : first;
+            last = !found || segment > last ? segment : last;
+            found = true;
+        }
+        closedir(d);
+        return found;
+    }
+
+    size_t segmentSize(uint32_t segment) override {
+        struct stat info;
+        return stat(path(segment), &info) == 0 ? (size_t)info.st_size : 0;
+    }
+
+    size_t read(uint32_t segment, size_t offset, uint8_t *data, size_t length) override {
+        FILE *file = fopen(path(segment), "rb");
+        if (!file) {
+            return 0;
+        }
+        size_t got = fseek(file, offset, SEEK_SET) == 0 ? fread(data, 1, length, file) : 0;
+        fclose(file);
+        return got;
+    }
+
+    size_t append(uint32_t segment, const uint8_t *data, size_t length) override {
+        FILE *file = fopen(path(segment), "ab");
+        if (!file) {
+            return 0;
+        }
+        // a reboot in the middle of the write, only a part of it reaches flash
+        size_t wanted = tearNext ? length / 2 + 1 : length;
+        size_t written = fwrite(data, 1, wanted, file);
+        fclose(file);
+        bytes += written;
+        tearNext = false;
+        return written;
+    }
+
+    void remove(uint32_t segment) override { unlink(path(segment)); }
+
+    size_t readCursor(uint8_t *data, size_t length) override {
+        FILE *file = fopen(cursorPath.c_str(), "rb");
+        if (!file) {
+            return 0;
+        }
+        size_t got = fread(data, 1, length, file);
+        fclose(file);
+        return got;
+    }
+
+    void writeCursor(const uint8_t *data, size_t length) override {
+        FILE *file = fopen(cursorPath.c_str(), "wb");
+        if (file) {
+            fwrite(data, 1, length, file);
+            fclose(file);
+        }
+        cursorWrites++;
+    }
+
+    size_t flashBytes() {
+        uint32_t first = 0, last = 0;
+        size_t total = 0;
+        if (segmentRange(first, last)) {
+            for (uint32_t segment = first; segment <= last; segment++) {
+                total += segmentSize(segment);
+            }
+        }
+        return total;
+    }
+
+    bool tearNext;
+    unsigned long long bytes = 0;
+    unsigned long cursorWrites = 0;
+
+private:
+    std::string dir;
+    std::string cursorPath;
+    char pathBuffer[512];
+
+    const char *path(uint32_t segment) {
+        snprintf(pathBuffer, sizeof(pathBuffer), "%s/%08x", dir.c_str(), segment);
+        return pathBuffer;
+    }
+};
+
+/*===================================================================*/
+/*                            Simulation                             */
+/*===================================================================*/
+// One pass of the bridge's processMessagesFromQueue(). publish(batch, count) is false for a failed
+// publish, which leaves the readings in the spool.
+template <typename Publish>
+static void drainPass(ReadingSpool &spool, SpooledReading *batch, Publish publish) {
+    for (size_t drained = 0; drained < MQTT_DRAIN_PER_LOOP;) {
+        size_t want = MQTT_DRAIN_PER_LOOP - drained < MQTT_BATCH_READINGS ? MQTT_DRAIN_PER_LOOP - drained : MQTT_BATCH_READINGS;
+        size_t count = spool.front(batch, want);
+        if (count == 0) {
+            spool.pop(); // the records front() went over all had a bad CRC
+            break;
+        }
+        if (!publish(batch, count)) {
+            break;
+        }
+        spool.pop();
+        drained += count;
+    }
+}
+
+// A reboot tears the append of the one reading in RAM, so flash holds a torn record and nothing
+// else. True when the replay drops it and the spool is empty within a few passes.
+static bool tornTailDrains(FileSpoolStorage &storage) {
+    {
+        ReadingSpool before(storage);
+        before.begin();
+        SpooledReading reading = {{2223841013u, 50.0f, 1}, 3, 5};
+        before.push(reading, 0);
+        storage.tearNext = true;
+        before.flush();
+    }
+
+    ReadingSpool spool(storage);
+    spool.begin();
+    bool torn = spool.size() == 1;
+    size_t published = 0;
+    SpooledReading batch[MQTT_BATCH_READINGS];
+    for (int pass = 0; pass < 10 && spool.size() > 0; pass++) {
+        drainPass(spool, batch, [&](const SpooledReading *, size_t count) {
+            published += count;
+            return true;
+        });
+    }
+    bool drained = torn && spool.size() == 0 && published == 0 && storage.flashBytes() == 0;
+    printf("torn last record    %10s  (%zu left in the spool)\n", drained ? "dropped" : "stuck", spool.size());
+    return drained;
+}
+
+struct Result {
+    uint32_t produced = 0;
+    uint32_t published = 0;   // distinct readings
+    uint32_t duplicates = 0;
+    uint32_t outOfOrder = 0;
+    uint32_t wrongTimes = 0;  // send or receive time not the ones pushed
+    uint32_t lostInRam = 0;   // in the RAM ring at a reboot
+    uint32_t lostTorn = 0;    // in an append a reboot tore
+    uint32_t dropped = 0;
+    uint32_t corrupt = 0;
+    uint32_t missing = 0;
+    unsigned long reboots = 0;
+    unsigned long tornWrites = 0;
+    size_t peakFlash = 0;
+    size_t peakQueue = 0;
+    double replaySeconds = 0;
+};
+
+int main(int argc, char **argv) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--outage-hours" && i + 1 < argc) {
+            config.outageHours = atof(argv[++i]);
+        } else if (arg == "--rate" && i + 1 < argc) {
+            config.rate = atof(argv[++i]);
+        } else if (arg == "--crash-every" && i + 1 < argc) {
+            config.crashEvery = atof(argv[++i]);
+        } else if (arg == "--tear" && i + 1 < argc) {
+            config.tear = atof(argv[++i]);
+        } else if (arg == "--publish-fail" && i + 1 < argc) {
+            config.publishFail = atof(argv[++i]);
+        } else if (arg == "--replay-crash-every" && i + 1 < argc) {
+            config.replayCrashEvery = atoi(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            config.seed = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--outage-hours h] [--rate per s] [--crash-every min] [--tear p] "
+                            "[--publish-fail p] [--replay-crash-every ms] [--seed n]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (config.outageHours < 0 || config.rate <= 0 || config.crashEvery < 0) {
+        fprintf(stderr, "--rate must be positive, --outage-hours and --crash-every not negative\n");
+        return 1;
+    }
+
+    char dirTemplate[] = "/tmp/spool_bench.XXXXXX";
+    if (!mkdtemp(dirTemplate)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    FileSpoolStorage storage(dirTemplate);
+    std::mt19937 random(config.seed);
+    std::uniform_real_distribution<double> unit(0, 1);
+
+    const uint32_t STEP = 2;     // ms, one pass of loop()
+    const uint32_t outageEnd = (uint32_t)(config.outageHours * 3600000);
+    const uint32_t arrivalEvery = (uint32_t)(1000 / config.rate);
+    const double crashChance = config.crashEvery > 0 ? STEP / (config.crashEvery * 60000) : 0;
+
+    Result result;
+    std::vector<uint8_t> seen;   // per sequence number: 0 not yet, 1 published, 2 lost at a reboot
+    seen.reserve(outageEnd / arrivalEvery + 1000000);
+    uint32_t highest = 0;        // highest sequence number published
+    bool any = false;
+    ReadingSpool *spool = new ReadingSpool(storage);
+    counting = true;
+    spool->begin();
+
+    uint32_t now = 0;
+    uint32_t nextArrival = 0;
+    SpooledReading batch[MQTT_BATCH_READINGS];
+    for (;; now += STEP) {
+        bool outage = now < outageEnd;
+        if (!outage && spool->size() == 0) {
+            break;
+        }
+        if (outage && now >= nextArrival) {
+            counting = false;
+            seen.push_back(0);
+            counting = true;
+            uint32_t sequence = result.produced++;
+            SpooledReading reading = {{2223841013u, 50.0f, sequence}, sequence * 3, sequence * 5};
+            spool->push(reading, now);
+            nextArrival += arrivalEvery;
+        }
+        if (spool->flushDue(now)) {
+            spool->flush();
+        }
+        if (!outage) {
+            drainPass(*spool, batch, [&](const SpooledReading *batch, size_t count) {
+                if (unit(random) < config.publishFail) {
+                    return false;
+                }
+                counting = false;
+                for (size_t i = 0; i < count; i++) {
+                    uint32_t sequence = batch[i].reading.rootTimestampSent;
+                    result.wrongTimes += batch[i].sentAt != sequence * 3 || batch[i].receivedAt != sequence * 5;
+                    if (seen[sequence] == 1) {
+                        result.duplicates++;
+                    } else {
+                        if (any && sequence < highest && seen[sequence] == 0) {
+                            result.outOfOrder++;
+                        }
+                        seen[sequence] = 1;
+                        result.published++;
+                    }
+                    highest = !any || sequence > highest ? sequence : highest;
+                    any = true;
+                }
+                counting = true;
+                return true;
+            });
+        }
+        counting = false;
+        result.peakQueue = spool->size() > result.peakQueue ? spool->size() : result.peakQueue;
+        if (now % 60000 == 0) {
+            size_t flash = storage.flashBytes();
+            result.peakFlash = flash > result.peakFlash ? flash : result.peakFlash;
+        }
+
+        // a reboot: what is in RAM is gone, a torn append leaves half its bytes
+        bool replayCrash = !outage && config.replayCrashEvery > 0 && (now - outageEnd) % config.replayCrashEvery == 0 &&
+                           now > outageEnd;
+        if (unit(random) < crashChance || replayCrash) {
+            result.reboots++;
+            uint32_t lost = spool->buffered();
+            if (lost > 0 && unit(random) < config.tear) {
+                // the records before the tear reach flash
+                uint32_t unwritten = spool->unwrittenCount();
+                storage.tearNext = true;
+                counting = true;
+                spool->flush();
+                counting = false;
+                result.tornWrites++;
+                lost = spool->unwrittenCount() - unwritten;
+                result.lostTorn += lost;
+            } else {
+                result.lostInRam += lost;
+            }
+            // the newest readings are the ones lost
+            for (uint32_t sequence = result.produced - lost; sequence < result.produced; sequence++) {
+                seen[sequence] = 2;
+            }
+            result.dropped += spool->droppedCount();
+            result.corrupt += spool->corruptCount();
+            delete spool;
+            spool = new ReadingSpool(storage);
+            counting = true;
+            spool->begin();
+        }
+        counting = true;
+    }
+    counting = false;
+    result.replaySeconds = (now - outageEnd) / 1000.0;
+    result.dropped += spool->droppedCount();
+    result.corrupt += spool->corruptCount();
+    // readings the spool dropped when it was full were never published either
+    for (uint32_t sequence = 0; sequence < result.produced; sequence++) {
+        result.missing += seen[sequence] == 0;
+    }
+    result.missing -= result.missing >= result.dropped ? result.dropped : result.missing;
+
+    printf("%.1f h outage, %.1f readings a second, a reboot every %.0f min on average, %.0f%% of them tear an append\n",
+           config.outageHours, config.rate, config.crashEvery, config.tear * 100);
+    printf("readings            %10u\n", result.produced);
+    printf("published           %10u  (%u again after a reboot)\n", result.published, result.duplicates);
+    printf("lost in RAM         %10u  at %lu reboots\n", result.lostInRam, result.reboots);
+    printf("lost in torn writes %10u  in %lu appends\n", result.lostTorn, result.tornWrites);
+    printf("dropped, spool full %10u\n", result.dropped);
+    printf("skipped, bad CRC    %10u\n", result.corrupt);
+    printf("missing             %10u\n", result.missing);
+    printf("out of order        %10u\n", result.outOfOrder);
+    printf("wrong times         %10u\n", result.wrongTimes);
+    printf("peak readings queued %9zu, peak flash %zu bytes, %llu bytes written, %lu cursor writes\n",
+           result.peakQueue, result.peakFlash, storage.bytes, storage.cursorWrites);
+    printf("replay took %.1f s, heap allocations by the spool: %lu\n", result.replaySeconds, allocations);
+
+    delete spool;
+    bool tornTail = tornTailDrains(storage);
+    std::string cleanup = std::string("rm -rf ") + dirTemplate;
+    if (system(cleanup.c_str()) != 0) {
+        fprintf(stderr, "could not remove %s\n", dirTemplate);
+    }
+
+    bool failed = result.missing > 0 || result.outOfOrder > 0 || result.wrongTimes > 0 || allocations > 0 || !tornTail;
+    printf("%s\n", failed ? "FAILED" : "ok");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,281 @@
+// UDP load generator for WiFi_Server: fires bursts of reading frames at the server, --gap-us
+// apart, and counts the ACKs that come back. It reports the readings sent and ACKed, the
+// sustained ACKs per second and the drop rate.
+//
+// Against a server on the network, --bind is this host's address on it. The readings carry it
+// as their sender, and the server ACKs them on port 4210 there:
+//   ./udp_load --server 192.168.1.20 --bind 192.168.1.30 --seconds 30 --burst 50 --burst-every 100
+//
+// Without --server, a server emulated in a thread receives on 127.0.0.1, and the generator binds
+// 127.0.0.2. Its socket holds --rcvbuf bytes, a handful of datagrams as lwIP's receive mailbox does.
+// The emulation shows the receive loop, not the ESP32's speed:
+//   old  the loop before: a ping, at most one datagram, then delay(1000)
+//   new  receivePackets() drains up to UDP_DRAIN_PER_LOOP datagrams per pass, and pings every
+//        PING_INTERVAL, with --pass-us for the rest of a pass
+//
+//   g++ -std=c++11 -O2 -pthread -I../libraries/BinMessage udp_load.cpp -o udp_load
+//   ./udp_load --emulate old --seconds 10 --burst 50 --burst-every 100
+//   ./udp_load --emulate new --seconds 10 --burst 50 --burst-every 100
+#include <BinMessage.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+struct BenchConfig {
+    std::string server;          // empty to emulate one
+    std::string bind;
+    int port = 4210;
+    double seconds = 10;
+    int burst = 50;              // readings in a burst
+    int burstEvery = 100;        // ms
+    int gapUs = 300;             // between two readings of a burst, about a small frame's airtime
+    std::string emulate = "new";
+    int rcvbuf = 2304;           // bytes of the emulated server's socket, Linux's least, about 6 datagrams
+    int passUs = 1000;           // rest of a loop() pass of the emulated server
+};
+
+// WiFi_Server's constants
+static const int UDP_DRAIN_PER_LOOP = 64;
+static const int PING_INTERVAL_MS = 1000;
+static const double GRACE_SECONDS = 2; // late ACKs are still counted
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static int udp_socket(const char *address, int port, int rcvbuf) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (rcvbuf > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes));
+    sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &local.sin_addr) != 1 || bind(fd, (sockaddr *)&local, sizeof(local)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// IPAddress keeps the first octet in the low byte, as the readings' rootSender does
+static uint32_t ip_value(const char *address) {
+    in_addr a;
+    inet_pton(AF_INET, address, &a);
+    const uint8_t *b = (const uint8_t *)&a.s_addr;
+    return b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+static sockaddr_in ip_address(uint32_t value, int port) {
+    sockaddr_in to = {};
+    to.sin_family = AF_INET;
+    to.sin_port = htons(port);
+    uint8_t *b = (uint8_t *)&to.sin_addr.s_addr;
+    for (int i = 0; i < 4; i++) {
+        b[i] = value >> (8 * i);
+    }
+    return to;
+}
+
+/*===================================================================*/
+/*                          Emulated server                          */
+/*===================================================================*/
+struct EmulatedServer {
+    const BenchConfig &config;
+    int fd;
+    std::atomic<bool> stop;
+    unsigned long handled = 0;
+    unsigned long passes = 0;
+
+    EmulatedServer(const BenchConfig &c, int socket) : config(c), fd(socket), stop(false) {}
+
+    // handlePacket(): a reading is ACKed to its sender
+    void handle(const uint8_t *packet, int len) {
+        BinReading reading;
+        if (binMessageType(packet, len) != BIN_MSG_READING || !decodeReading(packet, len, reading)) {
+            return;
+        }
+        BinAck ack = {reading.rootSender, ip_value("127.0.0.1")};
+        uint8_t frame[BIN_MESSAGE_MAX_SIZE];
+        size_t length = encodeAck(ack, frame, sizeof(frame));
+        sockaddr_in to = ip_address(reading.rootSender, config.port);
+        sendto(fd, frame, length, 0, (sockaddr *)&to, sizeof(to));
+        handled++;
+    }
+
+    void ping() {
+        BinPing ping = {{0x24, 0x0a, 0xc4, 0x00, 0x00, 0x01}, true};
+        uint8_t frame[BIN_MESSAGE_MAX_SIZE];
+        size_t length = encodePing(ping, frame, sizeof(frame));
+        sockaddr_in to = ip_address(ip_value("127.255.255.255"), config.port);
+        sendto(fd, frame, length, 0, (sockaddr *)&to, sizeof(to));
+    }
+
+    // parsePacket() and read(): a datagram, or 0 when none waits
+    int receive(uint8_t *buffer, size_t size) {
+        ssize_t len = recv(fd, buffer, size, MSG_DONTWAIT);
+        return len > 0 ? (int)len : 0;
+    }
+
+    void run() {
+        uint8_t packetBuffer[255];
+        auto start = std::chrono::steady_clock::now();
+        double lastPing = -1;
+        while (!stop) {
+            passes++;
+            if (config.emulate == "old") {
+                ping();
+                int len = receive(packetBuffer, sizeof(packetBuffer));
+                if (len > 0) {
+                    handle(packetBuffer, len);
+                }
+                for (int ms = 0; ms < 1000 && !stop; ms += 10) {
+                    usleep(10000); // delay(1000)
+                }
+                continue;
+            }
+            double now = seconds_since(start) * 1000;
+            if (lastPing < 0 || now - lastPing >= PING_INTERVAL_MS) {
+                lastPing = now;
+                ping();
+            }
+            for (int drained = 0; drained < UDP_DRAIN_PER_LOOP; drained++) {
+                int len = receive(packetBuffer, sizeof(packetBuffer));
+                if (len == 0) {
+                    break;
+                }
+                handle(packetBuffer, len);
+            }
+            usleep(config.passUs);
+        }
+    }
+};
+
+/*===================================================================*/
+/*                             Generator                             */
+/*===================================================================*/
+int main(int argc, char **argv) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--server" && i + 1 < argc) {
+            config.server = argv[++i];
+        } else if (arg == "--bind" && i + 1 < argc) {
+            config.bind = argv[++i];
+        } else if (arg == "--port" && i + 1 < argc) {
+            config.port = atoi(argv[++i]);
+        } else if (arg == "--seconds" && i + 1 < argc) {
+            config.seconds = atof(argv[++i]);
+        } else if (arg == "--burst" && i + 1 < argc) {
+            config.burst = atoi(argv[++i]);
+        } else if (arg == "--burst-every" && i + 1 < argc) {
+            config.burstEvery = atoi(argv[++i]);
+        } else if (arg == "--gap-us" && i + 1 < argc) {
+            config.gapUs = atoi(argv[++i]);
+        } else if (arg == "--emulate" && i + 1 < argc) {
+            config.emulate = argv[++i];
+        } else if (arg == "--rcvbuf" && i + 1 < argc) {
+            config.rcvbuf = atoi(argv[++i]);
+        } else if (arg == "--pass-us" && i + 1 < argc) {
+            config.passUs = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--server ip --bind ip] [--port n] [--seconds s] [--burst n] [--burst-every ms] "
+                            "[--gap-us us] [--emulate old|new] [--rcvbuf bytes] [--pass-us us]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (config.seconds <= 0 || config.burst <= 0 || config.burstEvery <= 0 || config.gapUs < 0 || config.passUs < 0 ||
+        (config.emulate != "old" && config.emulate != "new") || (!config.server.empty() && config.bind.empty())) {
+        fprintf(stderr, "--seconds, --burst and --burst-every must be positive, --gap-us and --pass-us not negative, "
+                        "--emulate old or new, and --server needs --bind\n");
+        return 1;
+    }
+
+    bool emulated = config.server.empty();
+    std::string serverAddress = emulated ? "127.0.0.1" : config.server;
+    std::string bindAddress = emulated ? "127.0.0.2" : config.bind;
+    int fd = udp_socket(bindAddress.c_str(), config.port, 0);
+    if (fd < 0) {
+        fprintf(stderr, "cannot bind %s:%d\n", bindAddress.c_str(), config.port);
+        return 1;
+    }
+    EmulatedServer *server = NULL;
+    std::thread serverThread;
+    if (emulated) {
+        int serverFd = udp_socket(serverAddress.c_str(), config.port, config.rcvbuf);
+        if (serverFd < 0) {
+            fprintf(stderr, "cannot bind %s:%d\n", serverAddress.c_str(), config.port);
+            return 1;
+        }
+        server = new EmulatedServer(config, serverFd);
+        serverThread = std::thread(&EmulatedServer::run, server);
+    }
+
+    sockaddr_in to = ip_address(ip_value(serverAddress.c_str()), config.port);
+    uint32_t sender = ip_value(bindAddress.c_str());
+    unsigned long sent = 0, acked = 0, refused = 0;
+    auto start = std::chrono::steady_clock::now();
+    double nextBurst = 0;
+    double lastAck = 0;
+    for (double now = 0; now < config.seconds + GRACE_SECONDS; now = seconds_since(start)) {
+        if (now < config.seconds && now >= nextBurst) {
+            for (int i = 0; i < config.burst; i++) {
+                BinReading reading = {sender, (float)(sent % 100), (uint32_t)sent};
+                uint8_t frame[BIN_MESSAGE_MAX_SIZE];
+                size_t length = encodeReading(reading, frame, sizeof(frame));
+                refused += sendto(fd, frame, length, 0, (sockaddr *)&to, sizeof(to)) < 0;
+                sent++;
+                if (config.gapUs > 0) {
+                    usleep(config.gapUs);
+                }
+            }
+            nextBurst += config.burstEvery / 1000.0;
+        }
+        uint8_t packet[255];
+        ssize_t len;
+        while ((len = recv(fd, packet, sizeof(packet), MSG_DONTWAIT)) > 0) {
+            BinAck ack;
+            // the server's pings come here too
+            if (decodeAck(packet, len, ack) && ack.to == sender) {
+                acked++;
+                lastAck = now;
+            }
+        }
+        usleep(200);
+    }
+    if (server) {
+        server->stop = true;
+        serverThread.join();
+    }
+
+    double activeSeconds = lastAck > config.seconds ? lastAck : config.seconds;
+    printf("%s, %d readings every %d ms for %.0f s\n",
+           emulated ? (config.emulate == "old" ? "emulated server, old loop" : "emulated server, draining loop")
+                    : serverAddress.c_str(),
+           config.burst, config.burstEvery, config.seconds);
+    printf("sent %lu, acked %lu, dropped %lu (%.1f%%), %.1f readings a second sustained\n", sent, acked, sent - acked,
+           sent ? 100.0 * (sent - acked) / sent : 0.0, acked / activeSeconds);
+    if (refused > 0) {
+        printf("%lu sends failed on this host\n", refused);
+    }
+    if (server) {
+        printf("server: %lu readings handled in %lu passes of loop()\n", server->handled, server->passes);
+        delete server;
+    }
+    return 0;
+}
@@ -0,0 +1,278 @@
+#ifndef Bin_Message
+#define Bin_Message
+
+// Binary messages shared by WiFi_Node, mqttBridge and WiFi_Server. Every frame starts with the
+// version of the layout it was written with and its type, followed by its fields little endian.
+// A later version only appends fields, so a decoder reads the fields it knows from any frame at
+// least as long as its own layout. JSON is only spoken on the MQTT side of the bridge.
+//
+// painlessMesh carries messages as strings, so over the mesh a frame travels as base64 text
+// (binMessageToText / binMessageFromText). WiFi_Server sends frames as they are over UDP.
+//
+// Nothing here allocates, frames are written to and read from buffers the caller owns.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BIN_MESSAGE_VERSION 2      // 2 appends the send time to reading frames
+#define BIN_MESSAGE_HEADER_SIZE 2  // version and type
+#define BIN_READING_SIZE 10        // fields of one reading, without the header
+#define BIN_MESSAGE_MAX_SIZE 16    // bytes of the longest frame of this version, the reading
+#define BIN_MESSAGE_TEXT_SIZE ((BIN_MESSAGE_MAX_SIZE * 4 + 2) / 3 + 1) // base64 of the longest frame and the zero
+// ms, a node reports its level at least this often even when it did not move. The bridge takes
+// these reports as the node's heartbeat and publishes every one.
+#define BIN_REPORT_MAX_INTERVAL 60000UL
+
+// Message types
+#define BIN_MSG_READING 1    // bin level of one node, 16 bytes
+#define BIN_MSG_NEW_SERVER 2 // the bridge adds a server to the nodes' knownServers, 6 bytes
+#define BIN_MSG_PING 3       // WiFi_Server presence broadcast, 9 bytes
+#define BIN_MSG_ACK 4        // WiFi_Server received a reading, 10 bytes
+// 5 is not used
+#define BIN_MSG_READING_ACK 6   // the bridge took a node's reading, 10 bytes
+
+/*===================================================================*/
+/*                     Custom Struct Declaration                     */
+/*===================================================================*/
+struct BinReading {
+    uint32_t rootSender;        // painlessMesh node id, or IPv4 address over UDP
+    float binCapacity;          // percent, sent in hundredths
+    uint32_t rootTimestampSent; // mesh time, or millis() over UDP
+};
+
+struct BinNewServer {
+    uint32_t serverId;
+};
+
+struct BinPing {
+    uint8_t mac[6]; // sender's station MAC, identifies it in the routing table
+    bool server;
+};
+
+struct BinAck {
+    uint32_t to;   // IPv4 address of the reading's sender
+    uint32_t from; // IPv4 address of the server
+};
+
+// Names the reading it acknowledges
+struct BinReadingAck {
+    uint32_t rootSender;
+    uint32_t rootTimestampSent;
+};
+
+/*===================================================================*/
+/*                       Field Helpers                               */
+/*===================================================================*/
+inline void binPutU16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+inline void binPutU32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+inline uint16_t binGetU16(const uint8_t *p) {
+    return p[0] | (uint16_t)p[1] << 8;
+}
+
+inline uint32_t binGetU32(const uint8_t *p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Writes the header, returns false when the frame does not fit
+inline bool binPutHeader(uint8_t *buf, size_t size, size_t frameSize, uint8_t type) {
+    if (size < frameSize) {
+        return false;
+    }
+    buf[0] = BIN_MESSAGE_VERSION;
+    buf[1] = type;
+    return true;
+}
+
+// Type of a frame, 0 when it is too short or not a frame of a known version
+inline uint8_t binMessageType(const uint8_t *buf, size_t len) {
+    if (len < BIN_MESSAGE_HEADER_SIZE || buf[0] < 1) {
+        return 0;
+    }
+    return buf[1];
+}
+
+/*===================================================================*/
+/*                       Encoders and Decoders                       */
+/*===================================================================*/
+// Encoders return the frame length, 0 when the buffer is too small. Decoders return false when
+// the frame is not of their type or shorter than their layout.
+// Fields of a reading, also kept by the bridge's spool
+inline void binPutReading(uint8_t *p, const BinReading &m) {
+    float hundredths = m.binCapacity * 100 + 0.5f;
+    binPutU32(p, m.rootSender);
+    binPutU16(p + 4, hundredths < 0 ? 0 : hundredths > 65535 ? 65535 : (uint16_t)hundredths);
+    binPutU32(p + 6, m.rootTimestampSent);
+}
+
+inline void binGetReading(const uint8_t *p, BinReading &m) {
+    m.rootSender = binGetU32(p);
+    m.binCapacity = binGetU16(p + 4) / 100.0f;
+    m.rootTimestampSent = binGetU32(p + 6);
+}
+
+// sentAt is the sender's mesh time when the frame left it, 0 when it keeps none
+inline size_t encodeReading(const BinReading &m, uint8_t *buf, size_t size, uint32_t sentAt = 0) {
+    if (!binPutHeader(buf, size, 16, BIN_MSG_READING)) {
+        return 0;
+    }
+    binPutReading(buf + 2, m);
+    binPutU32(buf + 12, sentAt);
+    return 16;
+}
+
+inline bool decodeReading(const uint8_t *buf, size_t len, BinReading &m) {
+    if (binMessageType(buf, len) != BIN_MSG_READING || len < 12) {
+        return false;
+    }
+    binGetReading(buf + 2, m);
+    return true;
+}
+
+// Send time of a reading frame, false for a version 1 frame, which has none
+inline bool decodeSentAt(const uint8_t *buf, size_t len, uint32_t &sentAt) {
+    if (binMessageType(buf, len) != BIN_MSG_READING || buf[0] < 2 || len < 16) {
+        return false;
+    }
+    sentAt = binGetU32(buf + 12);
+    return true;
+}
+
+inline size_t encodeNewServer(const BinNewServer &m, uint8_t *buf, size_t size) {
+    if (!binPutHeader(buf, size, 6, BIN_MSG_NEW_SERVER)) {
+        return 0;
+    }
+    binPutU32(buf + 2, m.serverId);
+    return 6;
+}
+
+inline bool decodeNewServer(const uint8_t *buf, size_t len, BinNewServer &m) {
+    if (binMessageType(buf, len) != BIN_MSG_NEW_SERVER || len < 6) {
+        return false;
+    }
+    m.serverId = binGetU32(buf + 2);
+    return true;
+}
+
+inline size_t encodePing(const BinPing &m, uint8_t *buf, size_t size) {
+    if (!binPutHeader(buf, size, 9, BIN_MSG_PING)) {
+        return 0;
+    }
+    for (int i = 0; i < 6; i++) {
+        buf[2 + i] = m.mac[i];
+    }
+    buf[8] = m.server ? 1 : 0;
+    return 9;
+}
+
+inline bool decodePing(const uint8_t *buf, size_t len, BinPing &m) {
+    if (binMessageType(buf, len) != BIN_MSG_PING || len < 9) {
+        return false;
+    }
+    for (int i = 0; i < 6; i++) {
+        m.mac[i] = buf[2 + i];
+    }
+    m.server = buf[8] & 1;
+    return true;
+}
+
+inline size_t encodeAck(const BinAck &m, uint8_t *buf, size_t size) {
+    if (!binPutHeader(buf, size, 10, BIN_MSG_ACK)) {
+        return 0;
+    }
+    binPutU32(buf + 2, m.to);
+    binPutU32(buf + 6, m.from);
+    return 10;
+}
+
+inline bool decodeAck(const uint8_t *buf, size_t len, BinAck &m) {
+    if (binMessageType(buf, len) != BIN_MSG_ACK || len < 10) {
+        return false;
+    }
+    m.to = binGetU32(buf + 2);
+    m.from = binGetU32(buf + 6);
+    return true;
+}
+
+inline size_t encodeReadingAck(const BinReadingAck &m, uint8_t *buf, size_t size) {
+    if (!binPutHeader(buf, size, 10, BIN_MSG_READING_ACK)) {
+        return 0;
+    }
+    binPutU32(buf + 2, m.rootSender);
+    binPutU32(buf + 6, m.rootTimestampSent);
+    return 10;
+}
+
+inline bool decodeReadingAck(const uint8_t *buf, size_t len, BinReadingAck &m) {
+    if (binMessageType(buf, len) != BIN_MSG_READING_ACK || len < 10) {
+        return false;
+    }
+    m.rootSender = binGetU32(buf + 2);
+    m.rootTimestampSent = binGetU32(buf + 6);
+    return true;
+}
+
+/*===================================================================*/
+/*                      Text Form for painlessMesh                   */
+/*===================================================================*/
+// Unpadded base64, zero terminated. Returns the text length, 0 when it does not fit.
+inline size_t binMessageToText(const uint8_t *frame, size_t len, char *text, size_t size) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t textLen = (len * 4 + 2) / 3;
+    if (len == 0 || textLen >= size) {
+        return 0;
+    }
+    size_t out = 0;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t bits = (uint32_t)frame[i] << 16;
+        if (i + 1 < len) bits |= (uint32_t)frame[i + 1] << 8;
+        if (i + 2 < len) bits |= frame[i + 2];
+        for (int shift = 18; shift >= 0 && out < textLen; shift -= 6) {
+            text[out++] = alphabet[(bits >> shift) & 0x3F];
+        }
+    }
+    text[out] = '\0';
+    return out;
+}
+
+// Inverse of binMessageToText, padding is accepted. Bytes past size are dropped, decoders only
+// read the fields they know. Returns the frame length, 0 when the text is not base64.
+inline size_t binMessageFromText(const char *text, size_t textLen, uint8_t *frame, size_t size) {
+    while (textLen > 0 && text[textLen - 1] == '=') {
+        textLen--;
+    }
+    size_t out = 0;
+    uint32_t bits = 0;
+    int bitCount = 0;
+    for (size_t i = 0; i < textLen; i++) {
+        char c = text[i];
+        int value = c >= 'A' && c <= 'Z' ? c - 'A'
+                  : c >= 'a' && c <= 'z' ? c - 'a' + 26
+                  : c >= '0' && c <= '9' ? c - '0' + 52
+                  : c == '+' ? 62 : c == '/' ? 63 : -1;
+        if (value < 0) {
+            return 0;
+        }
+        bits = bits << 6 | value;
+        bitCount += 6;
+        if (bitCount >= 8) {
+            bitCount -= 8;
+            if (out < size) {
+                frame[out] = bits >> bitCount;
+            }
+            out++;
+        }
+    }
+    return out < size ? out : size;
+}
+
+#endif
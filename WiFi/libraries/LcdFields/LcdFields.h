@@ -0,0 +1,114 @@
+#ifndef Lcd_Fields
+#define Lcd_Fields
+
+// Retained text lines for the M5StickC screens of WiFi_Node, mqttBridge and WiFi_Server.
+// Sketches set the text of a line whenever they like, which only touches RAM. render() redraws
+// the lines whose text changed, from their first changed character on, at most once every
+// LCD_FRAME_INTERVAL. Glyphs are drawn with their background, so only the part of the old text
+// that sticks out past the new one is blanked.
+//
+// Display is the type of M5.Lcd, or anything with the same setRotation, setTextColor,
+// fillScreen, fillRect, drawString, textWidth and fontHeight.
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LCD_MAX_LINES 16          // lines past the bottom of the screen are clipped by the display
+#define LCD_LINE_SIZE 48          // characters of a line, terminating zero included
+#define LCD_FRAME_INTERVAL 200UL  // ms, at most 5 frames a second
+
+template <typename Display>
+class LcdFields {
+public:
+    LcdFields(Display &display, uint8_t textFont) : lcd(display), font(textFont), lastFrame(0), framed(false) {
+        for (int i = 0; i < LCD_MAX_LINES; i++) {
+            text[i][0] = '\0';
+            shown[i][0] = '\0';
+            shownWidth[i] = 0;
+        }
+    }
+
+    // Clears the screen once, frames after that only draw what changed
+    void begin(uint8_t rotation, uint16_t foreground, uint16_t background) {
+        lcd.setRotation(rotation);
+        lcd.setTextColor(foreground, background);
+        lcd.fillScreen(background);
+        backgroundColor = background;
+    }
+
+    void set(uint8_t line, const char *value) {
+        if (line < LCD_MAX_LINES) {
+            strncpy(text[line], value, LCD_LINE_SIZE - 1);
+            text[line][LCD_LINE_SIZE - 1] = '\0';
+        }
+    }
+
+    void printf(uint8_t line, const char *format, ...) {
+        if (line >= LCD_MAX_LINES) {
+            return;
+        }
+        va_list args;
+        va_start(args, format);
+        vsnprintf(text[line], LCD_LINE_SIZE, format, args);
+        va_end(args);
+    }
+
+    // Blanks this line and every one below it
+    void clearFrom(uint8_t line) {
+        for (; line < LCD_MAX_LINES; line++) {
+            text[line][0] = '\0';
+        }
+    }
+
+    // Draws the lines that changed since the last frame and returns how many it drew. Nothing is
+    // drawn within LCD_FRAME_INTERVAL of the last frame, the changes wait for the next one.
+    uint8_t render(unsigned long now) {
+        if (framed && now - lastFrame < LCD_FRAME_INTERVAL) {
+            return 0;
+        }
+        uint8_t drawn = 0;
+        int16_t height = lcd.fontHeight(font);
+        for (uint8_t line = 0; line < LCD_MAX_LINES; line++) {
+            size_t same = 0;
+            while (text[line][same] != '\0' && text[line][same] == shown[line][same]) {
+                same++;
+            }
+            if (text[line][same] == shown[line][same]) {
+                continue;
+            }
+
+            // the unchanged start of the line stays as it is on the screen
+            char prefix[LCD_LINE_SIZE];
+            memcpy(prefix, text[line], same);
+            prefix[same] = '\0';
+            int16_t y = line * height;
+            int16_t x = same > 0 ? lcd.textWidth(prefix, font) : 0;
+            int16_t width = x + (text[line][same] != '\0' ? lcd.drawString(text[line] + same, x, y, font) : 0);
+            if (width < shownWidth[line]) {
+                lcd.fillRect(width, y, shownWidth[line] - width, height, backgroundColor);
+            }
+            strcpy(shown[line], text[line]);
+            shownWidth[line] = width;
+            drawn++;
+        }
+        if (drawn > 0) {
+            lastFrame = now;
+            framed = true;
+        }
+        return drawn;
+    }
+
+private:
+    Display &lcd;
+    uint8_t font;
+    uint16_t backgroundColor = 0;
+    char text[LCD_MAX_LINES][LCD_LINE_SIZE];  // what the sketch wants on the screen
+    char shown[LCD_MAX_LINES][LCD_LINE_SIZE]; // what the screen shows
+    int16_t shownWidth[LCD_MAX_LINES];        // pixels of each shown line
+    unsigned long lastFrame;
+    bool framed;
+};
+
+#endif
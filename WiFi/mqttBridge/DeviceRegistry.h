@@ -0,0 +1,176 @@
+#ifndef Device_Registry
+#define Device_Registry
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <BinMessage.h>
+
+// The bridge's latest state of every bin, in a fixed open-addressing table keyed by mesh node id.
+// ingest() finds a node's entry in O(1) with linear probing, and decides whether its reading is
+// worth publishing: a resend of the latest reading is not, nor a level that moved less than
+// REGISTRY_UNCHANGED_LEVEL since the last one published, until REGISTRY_REFRESH_INTERVAL passed.
+// The node's BIN_REPORT_MAX_INTERVAL sets both intervals: each of its heartbeats is published,
+// and three missed in a row count as a gap.
+// Each entry keeps its node id as text, so the JSON towards MQTT needs no String per reading.
+// Times are millis() unless said otherwise.
+#define REGISTRY_BITS 6
+#define REGISTRY_SLOTS (1 << REGISTRY_BITS)
+#define REGISTRY_MAX_DEVICES (REGISTRY_SLOTS * 3 / 4) // past this the longest quiet device is forgotten
+#define REGISTRY_UNCHANGED_LEVEL 1.0f                 // percent
+#define REGISTRY_REFRESH_INTERVAL (BIN_REPORT_MAX_INTERVAL / 2) // an unchanged level after this long is
+                                                                // published, a heartbeat late in the mesh too
+#define REGISTRY_GAP_INTERVAL (BIN_REPORT_MAX_INTERVAL * 5 / 2) // silence that counts as a gap
+#define REGISTRY_NAME_SIZE 11                         // node id in decimal and the zero
+
+struct DeviceState {
+    uint32_t id;              // painlessMesh node id, 0 for a free slot
+    char name[REGISTRY_NAME_SIZE];
+    float level;              // percent, of the newest reading
+    uint32_t sampledAt;       // mesh time of the newest reading, us
+    unsigned long lastSeen;   // a reading of the node arrived
+    float publishedLevel;     // of the last reading published
+    unsigned long publishedAt;
+    uint32_t readings;        // received, duplicates included
+    uint32_t accepted;        // handed on to be published
+    uint32_t published;       // went out to MQTT, counted with countPublished()
+    uint32_t duplicates;      // resends of the newest reading, after an ACK was lost
+    uint32_t unchanged;       // suppressed for a level that did not move
+    uint32_t late;            // older than the newest reading, published but not the latest state
+    uint32_t gaps;            // silences past REGISTRY_GAP_INTERVAL between two readings
+};
+
+class DeviceRegistry {
+public:
+    DeviceRegistry() { clear(); }
+
+    void clear() {
+        memset(slots, 0, sizeof(slots));
+        count = 0;
+        forgotten = 0;
+    }
+
+    // Takes a reading that arrived at now, true when it should be published
+    bool ingest(const BinReading &reading, unsigned long now) {
+        DeviceState *device = insert(reading.rootSender, now);
+        if (!device) {
+            return true; // node id 0, not a mesh node
+        }
+        bool first = device->readings++ == 0;
+        // after a long silence the mesh times cannot be compared, they wrap every 71 min
+        bool quiet = !first && now - device->lastSeen > REGISTRY_GAP_INTERVAL;
+        int32_t newer = (int32_t)(reading.rootTimestampSent - device->sampledAt);
+        device->lastSeen = now;
+        if (quiet) {
+            device->gaps++;
+        } else if (!first && newer == 0) {
+            device->duplicates++;
+            return false;
+        } else if (!first && newer < 0) {
+            device->late++;
+            device->accepted++;
+            return true;
+        }
+        device->level = reading.binCapacity;
+        device->sampledAt = reading.rootTimestampSent;
+
+        float moved = reading.binCapacity - device->publishedLevel;
+        if (!first && moved < REGISTRY_UNCHANGED_LEVEL && moved > -REGISTRY_UNCHANGED_LEVEL &&
+            now - device->publishedAt < REGISTRY_REFRESH_INTERVAL) {
+            device->unchanged++;
+            return false;
+        }
+        device->publishedLevel = reading.binCapacity;
+        device->publishedAt = now;
+        device->accepted++;
+        return true;
+    }
+
+    // Counts a reading of the node that was published. A node forgotten in the meantime is not
+    // counted.
+    void countPublished(uint32_t id) {
+        DeviceState *device = const_cast<DeviceState *>(find(id));
+        if (device) {
+            device->published++;
+        }
+    }
+
+    // The node's entry, NULL when it is not known
+    const DeviceState *find(uint32_t id) const {
+        if (id == 0) {
+            return NULL;
+        }
+        for (uint32_t i = home(id);; i = (i + 1) & (REGISTRY_SLOTS - 1)) {
+            if (slots[i].id == id) {
+                return &slots[i];
+            }
+            if (slots[i].id == 0) {
+                return NULL;
+            }
+        }
+    }
+
+    // Entries in slot order, for the state of all bins. index runs up to REGISTRY_SLOTS, free
+    // slots are NULL.
+    const DeviceState *slot(size_t index) const { return slots[index].id != 0 ? &slots[index] : NULL; }
+
+    size_t size() const { return count; }
+    uint32_t forgottenCount() const { return forgotten; } // devices dropped for a new one
+
+private:
+    DeviceState slots[REGISTRY_SLOTS];
+    size_t count;
+    uint32_t forgotten;
+
+    // Fibonacci hashing, node ids are close together when nodes are of one batch
+    static uint32_t home(uint32_t id) { return (uint32_t)(id * 2654435769u) >> (32 - REGISTRY_BITS); }
+
+    DeviceState *insert(uint32_t id, unsigned long now) {
+        if (id == 0) {
+            return NULL;
+        }
+        uint32_t i = home(id);
+        for (; slots[i].id != 0; i = (i + 1) & (REGISTRY_SLOTS - 1)) {
+            if (slots[i].id == id) {
+                return &slots[i];
+            }
+        }
+        if (count == REGISTRY_MAX_DEVICES) {
+            removeQuietest(now);
+            return insert(id, now);
+        }
+        DeviceState &device = slots[i];
+        memset(&device, 0, sizeof(device));
+        device.id = id;
+        snprintf(device.name, sizeof(device.name), "%lu", (unsigned long)id);
+        count++;
+        return &device;
+    }
+
+    // Makes room for a new device. The scan only runs on a full table.
+    void removeQuietest(unsigned long now) {
+        size_t quietest = REGISTRY_SLOTS;
+        for (size_t i = 0; i < REGISTRY_SLOTS; i++) {
+            if (slots[i].id != 0 &&
+                (quietest == REGISTRY_SLOTS || now - slots[i].lastSeen > now - slots[quietest].lastSeen)) {
+                quietest = i;
+            }
+        }
+        // backward shift: later entries of the probe run move up, so lookups need no tombstones
+        uint32_t hole = quietest;
+        for (uint32_t i = (hole + 1) & (REGISTRY_SLOTS - 1); slots[i].id != 0; i = (i + 1) & (REGISTRY_SLOTS - 1)) {
+            uint32_t want = home(slots[i].id);
+            // the entry may fill the hole when its home is not between the hole and it
+            if (((i - want) & (REGISTRY_SLOTS - 1)) >= ((i - hole) & (REGISTRY_SLOTS - 1))) {
+                slots[hole] = slots[i];
+                hole = i;
+            }
+        }
+        slots[hole].id = 0;
+        count--;
+        forgotten++;
+    }
+};
+
+#endif
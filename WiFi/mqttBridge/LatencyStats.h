@@ -0,0 +1,212 @@
+#ifndef Latency_Stats
+#define Latency_Stats
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Rolling latency percentiles of the readings the bridge publishes, for each hop and for each
+// source node. A histogram has four log-scale buckets per doubling of the milliseconds, so a
+// percentile is off by at most an eighth. It counts in two halves of LATENCY_WINDOW, and rotate()
+// every half window forgets the older one, so the percentiles cover the last one to two halves.
+#define LATENCY_BUCKETS 80          // the last one also holds everything past about 30 min
+#define LATENCY_WINDOW 60000UL      // ms
+#define LATENCY_MAX_NODES 16        // readings of further nodes only count in the hops
+
+// Hops of a reading, by the mesh times it carries
+#define LATENCY_HOP_QUEUE 0         // sampled to sent, the wait in the node's queue
+#define LATENCY_HOP_MESH 1          // sent to received by the bridge
+#define LATENCY_HOP_BRIDGE 2        // received to published, the wait in the bridge's spool
+#define LATENCY_HOP_TOTAL 3         // sampled to published
+#define LATENCY_HOPS 4
+
+// Bucket of a latency in ms: exact below 4 ms, then four to a doubling
+inline uint8_t latencyBucket(uint32_t ms) {
+    if (ms < 4) {
+        return ms;
+    }
+    uint8_t log2 = 2;
+    while (ms >> (log2 + 1)) {
+        log2++;
+    }
+    uint32_t bucket = 4 * (log2 - 1) + ((ms >> (log2 - 2)) & 3);
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+// Middle of the latencies a bucket holds
+inline uint32_t latencyBucketValue(uint8_t bucket) {
+    if (bucket < 4) {
+        return bucket;
+    }
+    uint8_t shift = bucket / 4 - 1;
+    return ((uint32_t)(4 + bucket % 4) << shift) + ((1UL << shift) >> 1);
+}
+
+class LatencyHistogram {
+public:
+    LatencyHistogram() { clear(); }
+
+    void clear() {
+        memset(current, 0, sizeof(current));
+        memset(previous, 0, sizeof(previous));
+    }
+
+    void add(uint32_t ms) {
+        uint16_t &count = current[latencyBucket(ms)];
+        if (count < 0xffff) {
+            count++;
+        }
+    }
+
+    // The current half becomes the previous one
+    void rotate() {
+        memcpy(previous, current, sizeof(previous));
+        memset(current, 0, sizeof(current));
+    }
+
+    uint32_t count() const {
+        uint32_t n = 0;
+        for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) {
+            n += current[i] + previous[i];
+        }
+        return n;
+    }
+
+    // Latency in ms that percent of the window's readings did not exceed, 0 when there are none
+    uint32_t percentile(uint8_t percent) const {
+        uint32_t n = count();
+        uint32_t rank = (n * percent + 99) / 100;
+        rank = rank > 0 ? rank : 1;
+        uint32_t seen = 0;
+        for (uint8_t i = 0; i < LATENCY_BUCKETS && n > 0; i++) {
+            seen += current[i] + previous[i];
+            if (seen >= rank) {
+                return latencyBucketValue(i);
+            }
+        }
+        return 0;
+    }
+
+private:
+    uint16_t current[LATENCY_BUCKETS];
+    uint16_t previous[LATENCY_BUCKETS];
+};
+
+class LatencyStats {
+public:
+    LatencyStats() : nodeCount(0), untracked(0) {}
+
+    // Takes one published reading of node. The times are mesh times in us: sampled and sent by
+    // the node, received and published by the bridge.
+    void record(uint32_t node, uint32_t sampledAt, uint32_t sentAt, uint32_t receivedAt, uint32_t publishedAt) {
+        uint32_t total = elapsedMs(sampledAt, publishedAt);
+        hops[LATENCY_HOP_QUEUE].add(elapsedMs(sampledAt, sentAt));
+        hops[LATENCY_HOP_MESH].add(elapsedMs(sentAt, receivedAt));
+        hops[LATENCY_HOP_BRIDGE].add(elapsedMs(receivedAt, publishedAt));
+        hops[LATENCY_HOP_TOTAL].add(total);
+
+        LatencyHistogram *histogram = nodeHistogram(node);
+        if (histogram) {
+            histogram->add(total);
+        } else {
+            untracked++;
+        }
+    }
+
+    // Starts a new half window. Nodes without readings in the whole window give up their place.
+    void rotate() {
+        for (uint8_t i = 0; i < LATENCY_HOPS; i++) {
+            hops[i].rotate();
+        }
+        uint8_t kept = 0;
+        for (uint8_t i = 0; i < nodeCount; i++) {
+            nodes[i].histogram.rotate();
+            if (nodes[i].histogram.count() > 0) {
+                if (kept != i) {
+                    nodes[kept] = nodes[i];
+                }
+                kept++;
+            }
+        }
+        nodeCount = kept;
+        untracked = 0;
+    }
+
+    const LatencyHistogram &hop(uint8_t index) const { return hops[index]; }
+    uint8_t trackedNodes() const { return nodeCount; }
+
+    // The metrics payload, returns its length, 0 when it does not fit size:
+    // {"windowMs":60000,"hops":{"queue":{"n":12,"p50":4,"p95":9,"p99":9},...},
+    //  "nodes":{"2223841013":{"n":12,...},...},"untracked":0}
+    size_t toJson(char *out, size_t size) const {
+        static const char *const names[LATENCY_HOPS] = {"queue", "mesh", "bridge", "total"};
+        size_t length = 0;
+        bool fits = append(out, size, length, "{\"windowMs\":%lu,\"hops\":{", LATENCY_WINDOW);
+        for (uint8_t i = 0; i < LATENCY_HOPS; i++) {
+            fits = fits && appendHistogram(out, size, length, i > 0, names[i], hops[i]);
+        }
+        fits = fits && append(out, size, length, "},\"nodes\":{");
+        for (uint8_t i = 0; i < nodeCount; i++) {
+            char id[11];
+            snprintf(id, sizeof(id), "%lu", (unsigned long)nodes[i].id);
+            fits = fits && appendHistogram(out, size, length, i > 0, id, nodes[i].histogram);
+        }
+        fits = fits && append(out, size, length, "},\"untracked\":%lu}", (unsigned long)untracked);
+        return fits ? length : 0;
+    }
+
+private:
+    struct NodeLatency {
+        uint32_t id;
+        LatencyHistogram histogram;
+    };
+
+    LatencyHistogram hops[LATENCY_HOPS];
+    NodeLatency nodes[LATENCY_MAX_NODES];
+    uint8_t nodeCount;
+    uint32_t untracked; // readings of nodes past LATENCY_MAX_NODES in this half window
+
+    // Mesh time wraps every 71 min. A difference that comes out negative, from two nodes' clocks
+    // a little apart or a bridge reboot in between, counts as 0.
+    static uint32_t elapsedMs(uint32_t from, uint32_t to) {
+        int32_t us = (int32_t)(to - from);
+        return us > 0 ? us / 1000 : 0;
+    }
+
+    LatencyHistogram *nodeHistogram(uint32_t node) {
+        for (uint8_t i = 0; i < nodeCount; i++) {
+            if (nodes[i].id == node) {
+                return &nodes[i].histogram;
+            }
+        }
+        if (nodeCount == LATENCY_MAX_NODES) {
+            return NULL;
+        }
+        nodes[nodeCount].id = node;
+        nodes[nodeCount].histogram.clear();
+        return &nodes[nodeCount++].histogram;
+    }
+
+    static bool append(char *out, size_t size, size_t &length, const char *format, ...) {
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(out + length, size - length, format, args);
+        va_end(args);
+        if (written < 0 || (size_t)written >= size - length) {
+            return false;
+        }
+        length += written;
+        return true;
+    }
+
+    static bool appendHistogram(char *out, size_t size, size_t &length, bool comma, const char *name,
+                                const LatencyHistogram &histogram) {
+        return append(out, size, length, "%s\"%s\":{\"n\":%lu,\"p50\":%lu,\"p95\":%lu,\"p99\":%lu}", comma ? "," : "",
+                      name, (unsigned long)histogram.count(), (unsigned long)histogram.percentile(50),
+                      (unsigned long)histogram.percentile(95), (unsigned long)histogram.percentile(99));
+    }
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef Little_Fs_Spool_Storage
+#define Little_Fs_Spool_Storage
+
+#include <LittleFS.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ReadingSpool.h"
+
+#define SPOOL_DIRECTORY "/spool"      // one file per segment, named by its number in hex
+#define SPOOL_CURSOR_PATH "/spool.cur"
+
+// The bridge's spool segments on LittleFS. begin() needs LittleFS mounted.
+class LittleFsSpoolStorage : public SpoolStorage {
+public:
+    void begin() {
+        if (!LittleFS.exists(SPOOL_DIRECTORY)) {
+            LittleFS.mkdir(SPOOL_DIRECTORY);
+        }
+    }
+
+    bool segmentRange(uint32_t &first, uint32_t &last) override {
+        File directory = LittleFS.open(SPOOL_DIRECTORY);
+        if (!directory || !directory.isDirectory()) {
+            return false;
+        }
+        bool found = false;
+        for (File file = directory.openNextFile(); file; file = directory.openNextFile()) {
+            // older cores give the whole path
+            const char *name = strrchr(file.name(), '/');
+            name = name ? name + 1 : file.name();
+            char *end;
+            uint32_t segment = strtoul(name, &end, 16);
+            if (*end != '\0' || segment == 0) {
+                continue;
+            }
+            first = !found || segment < first ? segment : first;
+            last = !found || segment > last ? segment : last;
+            found = true;
+        }
+        return found;
+    }
+
+    size_t segmentSize(uint32_t segment) override {
+        char path[24];
+        File file = LittleFS.open(segmentPath(path, segment), "r");
+        return file ? file.size() : 0;
+    }
+
+    size_t read(uint32_t segment, size_t offset, uint8_t *data, size_t length) override {
+        char path[24];
+        File file = LittleFS.open(segmentPath(path, segment), "r");
+        if (!file || !file.seek(offset)) {
+            return 0;
+        }
+        return file.read(data, length);
+    }
+
+    size_t append(uint32_t segment, const uint8_t *data, size_t length) override {
+        char path[24];
+        File file = LittleFS.open(segmentPath(path, segment), "a");
+        return file ? file.write(data, length) : 0;
+    }
+
+    void remove(uint32_t segment) override {
+        char path[24];
+        LittleFS.remove(segmentPath(path, segment));
+    }
+
+    size_t readCursor(uint8_t *data, size_t length) override {
+        File file = LittleFS.open(SPOOL_CURSOR_PATH, "r");
+        return file ? file.read(data, length) : 0;
+    }
+
+    void writeCursor(const uint8_t *data, size_t length) override {
+        File file = LittleFS.open(SPOOL_CURSOR_PATH, "w");
+        if (file) {
+            file.write(data, length);
+        }
+    }
+
+private:
+    static const char *segmentPath(char *path, uint32_t segment) {
+        snprintf(path, 24, SPOOL_DIRECTORY "/%08lx", (unsigned long)segment);
+        return path;
+    }
+};
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef Mqtt_Batch
+#define Mqtt_Batch
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Times are millis()
+#define MQTT_RECONNECT_MIN 1000UL   // first retry after the broker went away, doubles with every failure
+#define MQTT_RECONNECT_MAX 60000UL
+#define MQTT_BUFFER_SIZE 2048       // PubSubClient's packet buffer, a batch fills it up to the header
+#define MQTT_PACKET_OVERHEAD 7      // PubSubClient's fixed header and the topic length bytes
+#define MQTT_DRAIN_PER_LOOP 32      // readings published at most per pass of loop()
+#define MQTT_BATCH_LINGER 100UL     // a reading waits this long for others to share its publish
+
+// The readings' publishes, packed as JSON arrays
+#define MQTT_TOPIC "dustbinInfo"
+#define MQTT_PAYLOAD_MAX (MQTT_BUFFER_SIZE - MQTT_PACKET_OVERHEAD - (sizeof(MQTT_TOPIC) - 1))
+#define MESSAGE_JSON_SIZE 160       // one reading as a JSON object
+#define MQTT_BATCH_READINGS (MQTT_PAYLOAD_MAX / (MESSAGE_JSON_SIZE + 1)) // readings that always fit one publish
+
+// When to try the broker again. connect() blocks for the TCP timeout while the broker is down, so
+// the attempts back off from MQTT_RECONNECT_MIN to MQTT_RECONNECT_MAX.
+class ReconnectBackoff {
+public:
+    ReconnectBackoff() : interval(0), retryAt(0) {}
+
+    bool due(unsigned long now) const { return interval == 0 || (long)(now - retryAt) >= 0; }
+
+    void failed(unsigned long now) {
+        interval = interval == 0 ? MQTT_RECONNECT_MIN : interval * 2;
+        if (interval > MQTT_RECONNECT_MAX) {
+            interval = MQTT_RECONNECT_MAX;
+        }
+        retryAt = now + interval;
+    }
+
+    // A connect, or a new network, tries the broker right away next time
+    void reset() { interval = 0; }
+
+private:
+    unsigned long interval; // 0 until connect() failed
+    unsigned long retryAt;
+};
+
+// Packs JSON objects into one JSON array in a caller buffer, the payload of one publish
+class PublishBatch {
+public:
+    PublishBatch(char *buffer, size_t capacity) : out(buffer), size(capacity), length(0), items(0) { clear(); }
+
+    void clear() {
+        length = 0;
+        items = 0;
+        if (size > 0) {
+            out[0] = '\0';
+        }
+    }
+
+    // False when the object and the closing bracket do not fit, the batch is left as it was
+    bool add(const char *object, size_t objectLength) {
+        // "[" or ",", the object, then "]" and the terminating zero
+        if (length + 1 + objectLength + 2 > size) {
+            return false;
+        }
+        out[length++] = items == 0 ? '[' : ',';
+        memcpy(out + length, object, objectLength);
+        length += objectLength;
+        out[length] = '\0';
+        items++;
+        return true;
+    }
+
+    // Closes the array and returns the payload, an empty batch is "[]"
+    const char *finish() {
+        if (items == 0) {
+            out[length++] = '[';
+        }
+        out[length++] = ']';
+        out[length] = '\0';
+        return out;
+    }
+
+    size_t count() const { return items; }
+    size_t bytes() const { return length; }
+
+private:
+    char *out;
+    size_t size;
+    size_t length;
+    size_t items;
+};
+
+#endif
@@ -0,0 +1,405 @@
+#ifndef Reading_Spool
+#define Reading_Spool
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <BinMessage.h>
+
+// Store-and-forward for the readings the bridge has not published yet. New readings go into a RAM
+// ring and are written to flash in one append when the ring is full or after SPOOL_FLUSH_INTERVAL,
+// so while the broker is up they are published straight from RAM and never touch flash. On flash
+// the readings sit in append-only segment files of SPOOL_SEGMENT_RECORDS, each with a header and a
+// CRC per record. A torn write at a crash loses at most the records it was writing. Replay goes
+// oldest first, a segment is removed once it is published, and the replay cursor is saved every
+// SPOOL_CURSOR_EVERY readings, so a reboot publishes at most that many again.
+#define SPOOL_BUFFER_RECORDS 64      // readings held in RAM before they are written to flash
+#define SPOOL_FLUSH_INTERVAL 2000UL  // ms a reading stays in RAM at most
+#define SPOOL_SEGMENT_RECORDS 1024   // readings per segment file
+#define SPOOL_MAX_SEGMENTS 48        // past this the oldest segment is dropped, about 980 KB of flash
+#define SPOOL_CURSOR_EVERY 64        // readings published between two saves of the replay cursor
+#define SPOOL_MAGIC 0x4c505331UL     // "1SPL" on flash
+#define SPOOL_HEADER_SIZE 12         // magic, segment number, record size, reserved, CRC
+#define SPOOL_READING_SIZE (BIN_READING_SIZE + 8) // a reading, its send and receive time
+#define SPOOL_RECORD_SIZE (SPOOL_READING_SIZE + 2) // and its CRC
+#define SPOOL_SEGMENT_SIZE (SPOOL_HEADER_SIZE + SPOOL_SEGMENT_RECORDS * SPOOL_RECORD_SIZE)
+#define SPOOL_CURSOR_SIZE 10         // segment, offset, CRC
+
+// A reading and the mesh times of its way to the bridge, for the latency metrics
+struct SpooledReading {
+    BinReading reading;
+    uint32_t sentAt;     // the node sent it, its sample time for a node that does not say
+    uint32_t receivedAt; // the bridge received it
+};
+
+// CRC-16/CCITT-FALSE
+inline uint16_t spoolCrc(const uint8_t *data, size_t length) {
+    uint16_t crc = 0xffff;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+// Where the spool keeps its segments: LittleFS on the bridge, plain files on a host
+class SpoolStorage {
+public:
+    virtual ~SpoolStorage() {}
+
+    // Lowest and highest segment number present, false when there is none
+    virtual bool segmentRange(uint32_t &first, uint32_t &last) = 0;
+    // Bytes in the segment, 0 when it is missing
+    virtual size_t segmentSize(uint32_t segment) = 0;
+    virtual size_t read(uint32_t segment, size_t offset, uint8_t *data, size_t length) = 0;
+    // Appends to the segment, which is created when missing, and returns the bytes written
+    virtual size_t append(uint32_t segment, const uint8_t *data, size_t length) = 0;
+    virtual void remove(uint32_t segment) = 0;
+    // The replay cursor, a few bytes rewritten as a whole
+    virtual size_t readCursor(uint8_t *data, size_t length) = 0;
+    virtual void writeCursor(const uint8_t *data, size_t length) = 0;
+};
+
+class ReadingSpool {
+public:
+    explicit ReadingSpool(SpoolStorage &spoolStorage) : storage(spoolStorage) { clear(); }
+
+    // Picks up what the last run left on flash. Segments with a bad header and segments before the
+    // saved cursor are removed. New readings go on in the last segment, or in a new one when the
+    // last one is full or ends in a torn record.
+    void begin() {
+        clear();
+        uint8_t cursor[SPOOL_CURSOR_SIZE];
+        uint32_t cursorSegment = 0;
+        uint32_t cursorOffset = 0;
+        if (storage.readCursor(cursor, sizeof(cursor)) == sizeof(cursor) &&
+            spoolCrc(cursor, 8) == binGetU16(cursor + 8)) {
+            cursorSegment = binGetU32(cursor);
+            cursorOffset = binGetU32(cursor + 4);
+        }
+
+        uint32_t first, last;
+        if (!storage.segmentRange(first, last)) {
+            first = 1;
+            last = 0;
+        }
+        head = 0;
+        size_t lastSize = 0; // of the last segment, when it is valid
+        for (uint32_t segment = first; segment <= last && segment != 0; segment++) {
+            size_t size = storage.segmentSize(segment);
+            uint8_t header[SPOOL_HEADER_SIZE];
+            if (size == 0) {
+                continue;
+            }
+            if (segment < cursorSegment || storage.read(segment, 0, header, sizeof(header)) != sizeof(header) ||
+                !validHeader(header, segment)) {
+                storage.remove(segment);
+                continue;
+            }
+            size_t offset = SPOOL_HEADER_SIZE;
+            if (head == 0) {
+                head = segment;
+                if (segment == cursorSegment && cursorOffset > SPOOL_HEADER_SIZE && cursorOffset <= size) {
+                    offset = cursorOffset - (cursorOffset - SPOOL_HEADER_SIZE) % SPOOL_RECORD_SIZE;
+                }
+                headOffset = offset;
+            }
+            flashCount += recordsIn(size) - recordsIn(offset);
+            lastSize = segment == last ? size : 0;
+        }
+        tail = (last > cursorSegment ? last : cursorSegment) + 1;
+        if (lastSize > 0 && lastSize < SPOOL_SEGMENT_SIZE && padTornRecord(last, lastSize)) {
+            tail = last;
+            tailSize = lastSize;
+        }
+        if (head == 0) {
+            head = tail;
+        }
+    }
+
+    // Takes a reading, now is millis(). A full RAM ring is written to flash first.
+    void push(const SpooledReading &reading, unsigned long now) {
+        if (ramCount == SPOOL_BUFFER_RECORDS) {
+            flush();
+        }
+        if (ramCount == 0) {
+            bufferedSince = now;
+        }
+        ram[(ramStart + ramCount) % SPOOL_BUFFER_RECORDS] = reading;
+        ramCount++;
+    }
+
+    // True when the oldest reading in RAM waited SPOOL_FLUSH_INTERVAL for flash
+    bool flushDue(unsigned long now) const { return ramCount > 0 && now - bufferedSince >= SPOOL_FLUSH_INTERVAL; }
+
+    // Writes the RAM ring to the tail segment. Readings that do not make it to flash are dropped.
+    void flush() {
+        peekSpan = 0;
+        peekRam = 0;
+        peekBad = 0;
+        while (ramCount > 0) {
+            if (tailSize == 0 && tail - head >= SPOOL_MAX_SEGMENTS) {
+                dropHead();
+            }
+            size_t length = 0;
+            if (tailSize == 0) {
+                putHeader(io, tail);
+                length = SPOOL_HEADER_SIZE;
+            }
+            size_t room = (SPOOL_SEGMENT_SIZE - (tailSize > 0 ? tailSize : SPOOL_HEADER_SIZE)) / SPOOL_RECORD_SIZE;
+            size_t count = ramCount < room ? ramCount : room;
+            for (size_t i = 0; i < count; i++) {
+                uint8_t *record = io + length;
+                putRecord(record, ram[(ramStart + i) % SPOOL_BUFFER_RECORDS]);
+                length += SPOOL_RECORD_SIZE;
+            }
+
+            size_t written = storage.append(tail, io, length);
+            size_t size = written == length ? tailSize + length : storage.segmentSize(tail);
+            size_t added = recordsIn(size) - recordsIn(tailSize);
+            flashCount += added;
+            unwrittenReadings += count - added;
+            bytesWritten += written;
+            ramStart = (ramStart + count) % SPOOL_BUFFER_RECORDS;
+            ramCount -= count;
+            tailSize = size;
+            // a segment that could not be written to is left as it is
+            if (written != length || tailSize >= SPOOL_SEGMENT_SIZE) {
+                tail++;
+                tailSize = 0;
+            }
+        }
+    }
+
+    // Copies up to max of the oldest readings to out without removing them, pop() removes them
+    size_t front(SpooledReading *out, size_t max) {
+        size_t count = 0;
+        uint32_t segment = head;
+        size_t offset = headOffset;
+        size_t left = flashCount;
+        size_t end = left > 0 ? segmentEnd(segment) : 0;
+        peekSpan = 0;
+        peekBad = 0;
+        while (count < max && left > 0) {
+            if (offset + SPOOL_RECORD_SIZE > end) {
+                if (segment >= tail) {
+                    // flash holds fewer readings than counted, the count is put right with pop()
+                    peekSpan += left;
+                    peekBad += left;
+                    left = 0;
+                    break;
+                }
+                segment++;
+                offset = SPOOL_HEADER_SIZE;
+                end = segmentEnd(segment);
+                continue;
+            }
+            size_t want = (end - offset) / SPOOL_RECORD_SIZE;
+            want = want < max - count ? want : max - count;
+            want = want < SPOOL_BUFFER_RECORDS ? want : SPOOL_BUFFER_RECORDS;
+            size_t got = storage.read(segment, offset, io, want * SPOOL_RECORD_SIZE) / SPOOL_RECORD_SIZE;
+            if (got == 0) {
+                // the rest of this segment cannot be read
+                size_t skipped = (end - offset) / SPOOL_RECORD_SIZE;
+                skipped = skipped < left ? skipped : left;
+                left -= skipped;
+                peekSpan += skipped;
+                peekBad += skipped;
+                offset = end;
+                continue;
+            }
+            for (size_t i = 0; i < got; i++) {
+                const uint8_t *record = io + i * SPOOL_RECORD_SIZE;
+                if (spoolCrc(record, SPOOL_READING_SIZE) == binGetU16(record + SPOOL_READING_SIZE)) {
+                    getRecord(record, out[count++]);
+                } else {
+                    peekBad++;
+                }
+                offset += SPOOL_RECORD_SIZE;
+                left--;
+                peekSpan++;
+            }
+        }
+        peekSegment = segment;
+        peekOffset = offset;
+
+        // RAM holds the newest readings, they come after everything on flash
+        peekRam = 0;
+        if (left == 0) {
+            for (; count < max && peekRam < ramCount; peekRam++) {
+                out[count++] = ram[(ramStart + peekRam) % SPOOL_BUFFER_RECORDS];
+            }
+        }
+        return count;
+    }
+
+    // Removes the readings the last front() returned, once they are published, and the records with
+    // a bad CRC it went over. Also call it when front() returned none.
+    void pop() {
+        if (peekSpan > 0) {
+            for (; head < peekSegment; head++) {
+                storage.remove(head);
+            }
+            headOffset = peekOffset;
+            flashCount -= peekSpan;
+            corruptReadings += peekBad;
+            sinceCursor += peekSpan;
+            if (flashCount == 0) {
+                // every reading on flash is out, the tail segment goes too
+                for (; head < tail; head++) {
+                    storage.remove(head);
+                }
+                if (tailSize > 0) {
+                    storage.remove(tail);
+                    tail++;
+                    tailSize = 0;
+                }
+                head = tail;
+                headOffset = SPOOL_HEADER_SIZE;
+                saveCursor();
+            } else if (sinceCursor >= SPOOL_CURSOR_EVERY) {
+                saveCursor();
+            }
+        }
+        ramStart = (ramStart + peekRam) % SPOOL_BUFFER_RECORDS;
+        ramCount -= peekRam;
+        peekSpan = 0;
+        peekRam = 0;
+        peekBad = 0;
+    }
+
+    size_t size() const { return flashCount + ramCount; }
+    size_t buffered() const { return ramCount; }
+    size_t onFlash() const { return flashCount; }
+    uint32_t droppedCount() const { return droppedReadings; }     // lost to a full spool
+    uint32_t unwrittenCount() const { return unwrittenReadings; } // lost to a failed write
+    uint32_t corruptCount() const { return corruptReadings; }  // skipped for a bad CRC
+    uint32_t bytesOnFlash() const { return bytesWritten; }     // appended since begin()
+
+private:
+    SpoolStorage &storage;
+    SpooledReading ram[SPOOL_BUFFER_RECORDS];
+    size_t ramStart;
+    size_t ramCount;
+    unsigned long bufferedSince;
+    uint32_t head;        // oldest segment with readings left
+    size_t headOffset;    // byte of the next reading in head
+    uint32_t tail;        // segment new readings are appended to
+    size_t tailSize;      // bytes in tail, 0 before it is created
+    size_t flashCount;    // readings on flash past the cursor
+    uint32_t peekSegment; // where the cursor goes with pop()
+    size_t peekOffset;
+    size_t peekSpan;      // flash records front() went over, bad ones included
+    size_t peekBad;
+    size_t peekRam;       // readings front() took from RAM
+    size_t sinceCursor;
+    uint32_t droppedReadings;
+    uint32_t unwrittenReadings;
+    uint32_t corruptReadings;
+    uint32_t bytesWritten;
+    uint8_t io[SPOOL_HEADER_SIZE + SPOOL_BUFFER_RECORDS * SPOOL_RECORD_SIZE];
+
+    void clear() {
+        ramStart = 0;
+        ramCount = 0;
+        bufferedSince = 0;
+        head = 1;
+        headOffset = SPOOL_HEADER_SIZE;
+        tail = 1;
+        tailSize = 0;
+        flashCount = 0;
+        peekSegment = 0;
+        peekOffset = 0;
+        peekSpan = 0;
+        peekBad = 0;
+        peekRam = 0;
+        sinceCursor = 0;
+        droppedReadings = 0;
+        unwrittenReadings = 0;
+        corruptReadings = 0;
+        bytesWritten = 0;
+    }
+
+    static size_t recordsIn(size_t size) {
+        return size > SPOOL_HEADER_SIZE ? (size - SPOOL_HEADER_SIZE) / SPOOL_RECORD_SIZE : 0;
+    }
+
+    static void putRecord(uint8_t *p, const SpooledReading &m) {
+        binPutReading(p, m.reading);
+        binPutU32(p + BIN_READING_SIZE, m.sentAt);
+        binPutU32(p + BIN_READING_SIZE + 4, m.receivedAt);
+        binPutU16(p + SPOOL_READING_SIZE, spoolCrc(p, SPOOL_READING_SIZE));
+    }
+
+    static void getRecord(const uint8_t *p, SpooledReading &m) {
+        binGetReading(p, m.reading);
+        m.sentAt = binGetU32(p + BIN_READING_SIZE);
+        m.receivedAt = binGetU32(p + BIN_READING_SIZE + 4);
+    }
+
+    size_t segmentEnd(uint32_t segment) { return segment == tail ? tailSize : storage.segmentSize(segment); }
+
+    static void putHeader(uint8_t *p, uint32_t segment) {
+        binPutU32(p, SPOOL_MAGIC);
+        binPutU32(p + 4, segment);
+        p[8] = SPOOL_RECORD_SIZE;
+        p[9] = 0;
+        binPutU16(p + 10, spoolCrc(p, 10));
+    }
+
+    static bool validHeader(const uint8_t *p, uint32_t segment) {
+        return binGetU32(p) == SPOOL_MAGIC && binGetU32(p + 4) == segment && p[8] == SPOOL_RECORD_SIZE &&
+               binGetU16(p + 10) == spoolCrc(p, 10);
+    }
+
+    // A record torn at the last reboot is filled up to a whole record with a bad CRC, which replay
+    // skips, so that new readings can go on in the same segment. False when that fails.
+    bool padTornRecord(uint32_t segment, size_t &size) {
+        size_t torn = (size - SPOOL_HEADER_SIZE) % SPOOL_RECORD_SIZE;
+        if (torn == 0) {
+            return true;
+        }
+        uint8_t record[SPOOL_RECORD_SIZE];
+        if (storage.read(segment, size - torn, record, torn) != torn) {
+            return false;
+        }
+        memset(record + torn, 0xff, SPOOL_RECORD_SIZE - torn);
+        if (spoolCrc(record, SPOOL_READING_SIZE) == binGetU16(record + SPOOL_READING_SIZE)) {
+            record[SPOOL_RECORD_SIZE - 1] ^= 0xff;
+        }
+        size_t pad = SPOOL_RECORD_SIZE - torn;
+        size_t written = storage.append(segment, record + torn, pad);
+        size += written;
+        if (written != pad) {
+            return false;
+        }
+        flashCount++;
+        return true;
+    }
+
+    // The spool is full, the oldest segment makes room
+    void dropHead() {
+        size_t end = segmentEnd(head);
+        size_t left = end > headOffset ? (end - headOffset) / SPOOL_RECORD_SIZE : 0;
+        left = left < flashCount ? left : flashCount;
+        flashCount -= left;
+        droppedReadings += left;
+        storage.remove(head);
+        head++;
+        headOffset = SPOOL_HEADER_SIZE;
+        saveCursor();
+    }
+
+    void saveCursor() {
+        uint8_t cursor[SPOOL_CURSOR_SIZE];
+        binPutU32(cursor, head);
+        binPutU32(cursor + 4, headOffset);
+        binPutU16(cursor + 8, spoolCrc(cursor, 8));
+        storage.writeCursor(cursor, sizeof(cursor));
+        sinceCursor = 0;
+    }
+};
+
+#endif
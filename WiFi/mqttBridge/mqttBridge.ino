@@ -9,12 +9,17 @@
 //************************************************************
 
 #include <ArduinoJson.h>
-#include <queue>
+#include <BinMessage.h>
+#include <LcdFields.h>
 #include <painlessMesh.h>
 #include <PubSubClient.h>
 #include <WiFiClient.h>
 #include "M5StickCPlus.h"
 #include <XxHash_arduino.h>
+#include "MqttBatch.h"
+#include "LittleFsSpoolStorage.h"
+#include "LatencyStats.h"
+#include "DeviceRegistry.h"
 
 #define   MESH_PREFIX     "dustbin"
 #define   MESH_PASSWORD   "password"
@@ -24,15 +29,24 @@
 #define   STATION_PASSWORD "lsps353ycss"
 
 #define HOSTNAME "MQTT_Bridge"
-#define MQTT_TOPIC "dustbinInfo"
+#define MQTT_METRICS_TOPIC "dustbinMetrics" // latency percentiles, every half LATENCY_WINDOW
+#define MQTT_STATE_TOPIC "dustbinState"     // latest state of all bins, when asked on MQTT_STATE_REQUEST_TOPIC
+#define MQTT_STATE_REQUEST_TOPIC "query/bins"
 #define MESH_CLIENT_NAME "painlessMeshClient"
+#define MQTT_METRICS_PAYLOAD_MAX (MQTT_BUFFER_SIZE - MQTT_PACKET_OVERHEAD - (sizeof(MQTT_METRICS_TOPIC) - 1))
+#define MQTT_STATE_PAYLOAD_MAX (MQTT_BUFFER_SIZE - MQTT_PACKET_OVERHEAD - (sizeof(MQTT_STATE_TOPIC) - 1))
+#define DEVICE_JSON_SIZE 256  // one bin's state as a JSON object
 /*===================================================================*/
 /*                     Custom Struct Declaration                     */
 /*===================================================================*/
+// The times are mesh times in us, from the node's sample to the bridge's publish
 struct CustomMessage {
-  String rootSender;
+  uint32_t rootSender;
   float binCapacity;
-  uint32_t timestamp;
+  uint32_t timestamp; // the node took the reading
+  uint32_t sentAt;    // the node sent it
+  uint32_t receivedAt;
+  uint32_t publishedAt;
 };
 
 /*===================================================================*/
@@ -42,19 +56,23 @@ void receivedCallback(const uint32_t &from, const String &msg);
 void onChangedCallback();
 void mqttCallback(char* topic, byte* payload, unsigned int length);
 void displayLCD();
-void resubscribe();
+void renderLCD();
+void maintainMqtt();
+void publishMetrics();
+void publishDeviceStates();
 
-// JSON management
-String serializeMessage(const CustomMessage& message);
-CustomMessage deserializeMessage(const String& jsonString);
+// JSON towards MQTT, binary frames in the mesh
+size_t serializeMessage(const CustomMessage& message, char* out, size_t size);
+bool deserializeMessage(const uint8_t* frame, size_t length, CustomMessage& message);
+void sendReadingAck(uint32_t to, const CustomMessage& message);
 
 // Queue management
 void processMessagesFromQueue();
 void addToMessageQueue(const CustomMessage& message);
 
 // Tasks
-Task taskProcessQueue( TASK_SECOND * 10, TASK_FOREVER, &processMessagesFromQueue);
-Task taskResubscribe( TASK_SECOND * 60, TASK_FOREVER, &resubscribe);
+Task taskRenderLCD( TASK_MILLISECOND * LCD_FRAME_INTERVAL, TASK_FOREVER, &renderLCD);
+Task taskPublishMetrics( TASK_MILLISECOND * LATENCY_WINDOW / 2, TASK_FOREVER, &publishMetrics);
 /*===================================================================*/
 /*                         Global variables                          */
 /*===================================================================*/
@@ -70,12 +88,21 @@ IPAddress getlocalIP();
 IPAddress myIP(0,0,0,0);
 IPAddress mqttBroker(192, 168, 68, 103);
 PubSubClient mqttClient(mqttBroker, 1883, mqttCallback, wifiClient);
-// Priority Queue Declaration, makes the earliest receieved messages in the queue to go first
-std::priority_queue<CustomMessage, std::vector<CustomMessage>, std::function<bool(const CustomMessage&, const CustomMessage&)>> messageQueue(
-  [](const CustomMessage& msg1, const CustomMessage& msg2) {
-      return msg1.timestamp < msg2.timestamp; // Earlier messages go first
-  }
-);
+// One session for the bridge's lifetime, retried with backoff when it drops
+ReconnectBackoff mqttBackoff;
+char publishBuffer[MQTT_PAYLOAD_MAX + 1];
+unsigned long queuedSince = 0; // millis() when the oldest unpublished reading was queued
+// The screen only redraws the lines that changed, from taskRenderLCD
+LcdFields<M5Display> lcd(M5.Lcd, 2);
+// Readings wait here until they are published, in RAM and on flash while the broker is away.
+// The earliest received go first.
+LittleFsSpoolStorage spoolStorage;
+ReadingSpool messageQueue(spoolStorage);
+// Where the published readings' time went, by hop and by node
+LatencyStats latencyStats;
+// Latest state of every bin, it decides which readings are worth publishing
+DeviceRegistry devices;
+bool stateRequested = false; // a query on MQTT_STATE_REQUEST_TOPIC waits for loop()
 
 /*===================================================================*/
 /*                         Initialize Server                         */
@@ -85,12 +112,19 @@ void setup() {
 
   M5.begin();
 
+  // readings the last run could not publish are sent first
+  LittleFS.begin(true);
+  spoolStorage.begin();
+  messageQueue.begin();
+  Serial.printf("Spool holds %u readings\n", (unsigned)messageQueue.size());
+
   mesh.setDebugMsgTypes( ERROR | STARTUP | CONNECTION );  // set before init() so that you can see startup messages
   mesh.init( MESH_PREFIX, MESH_PASSWORD, MESH_PORT, WIFI_AP_STA, 6 );
   mesh.onReceive(&receivedCallback);
   mesh.onChangedConnections(&onChangedCallback);
   mesh.stationManual(STATION_SSID, STATION_PASSWORD);
   mesh.setHostname(HOSTNAME);
+  mqttClient.setBufferSize(MQTT_BUFFER_SIZE);
   
   /* Comment mesh.setRoot() to make it not be the master bridge to avoid sub-meshes
   That way, this node bridge will join as server
@@ -101,14 +135,15 @@ void setup() {
   mesh.setContainsRoot(true);
 
   // Show the initial display
+  lcd.begin(3, WHITE, BLACK);
   displayLCD();
 
   // initialize all scheduled tasks
   taskScheduler.init();
-  taskScheduler.addTask(taskProcessQueue);
-  taskScheduler.addTask(taskResubscribe);
-  taskProcessQueue.enable();
-  taskResubscribe.enable();
+  taskScheduler.addTask(taskRenderLCD);
+  taskRenderLCD.enable();
+  taskScheduler.addTask(taskPublishMetrics);
+  taskPublishMetrics.enable();
 }
 
 void loop() {
@@ -120,11 +155,17 @@ void loop() {
     myIP = getlocalIP();
     Serial.println("My IP is " + myIP.toString());
     displayLCD();
+    // a new network, the broker is tried right away
+    mqttBackoff.reset();
+  }
 
-    if (mqttClient.connect(MESH_CLIENT_NAME)) {
-      mqttClient.subscribe("update/#");
-      Serial.println("MQTT Client is connected!");
-    } 
+  maintainMqtt();
+  processMessagesFromQueue();
+  if (stateRequested && mqttClient.connected()) {
+    publishDeviceStates();
+  }
+  if (messageQueue.flushDue(millis())) {
+    messageQueue.flush();
   }
   
   // executed any queued up tasks in the scheduler
@@ -132,89 +173,224 @@ void loop() {
 
 }
 
+// Only sets the lines, renderLCD() draws the ones that changed
 void displayLCD(){
-  M5.Lcd.setRotation(3);
-  M5.Lcd.fillScreen(BLACK);
-  M5.Lcd.setCursor(0, 0, 2);
-  M5.Lcd.println("Mesh Network IP: " + mesh.getAPIP().toString());
-  M5.Lcd.println(mesh.getNodeId());
-  M5.Lcd.println("My IP Address is: " + getlocalIP().toString());
-  M5.Lcd.println("Routing Table:");
+  lcd.printf(0, "Mesh Network IP: %s", mesh.getAPIP().toString().c_str());
+  lcd.printf(1, "%u", mesh.getNodeId());
+  lcd.printf(2, "My IP: %s", getlocalIP().toString().c_str());
+  lcd.set(3, "Routing Table:");
 
   // For showing all the connected nodes in the mesh de-centralized network
-  SimpleList<uint32_t>::iterator node = nodes.begin();
+  uint8_t line = 4;
   for (uint32_t node : nodes) {
-    M5.Lcd.print("Node ID: ");
-    M5.Lcd.println(node);
+    lcd.printf(line++, "Node ID: %u", node);
   }
+  lcd.clearFrom(line);
+}
+
+void renderLCD(){
+  lcd.render(millis());
 }
 
-// Flattens the message into a jsonDocument that is ready to be sent over the phyiscal layer
-String serializeMessage(const CustomMessage& message) {
+// Flattens the message into a jsonDocument that is ready to be sent over the phyiscal layer, and
+// returns its length in out
+size_t serializeMessage(const CustomMessage& message, char* out, size_t size) {
   StaticJsonDocument<200> doc;
 
-  doc["rootSender"] = message.rootSender;
+  // published as a string, as the nodes' JSON had it. The registry keeps it as text, so no String
+  // is made per reading.
+  const DeviceState* device = devices.find(message.rootSender);
+  char name[REGISTRY_NAME_SIZE];
+  if (!device) {
+    snprintf(name, sizeof(name), "%lu", (unsigned long)message.rootSender);
+  }
+  doc["rootSender"] = device ? device->name : name;
   doc["binCapacity"] = message.binCapacity;
   doc["timestamp"] = message.timestamp;
+  doc["sentAt"] = message.sentAt;
+  doc["receivedAt"] = message.receivedAt;
+  doc["publishedAt"] = message.publishedAt;
 
-  String serializedMessage;
-  serializeJson(doc, serializedMessage);
-  return serializedMessage;
+  return serializeJson(doc, out, size);
 }
 
-// Inverse of serializeMessage, unflattens the physical data into a JSON and then transforms into a CustomMessage
-CustomMessage deserializeMessage(const String& jsonString) {
-  StaticJsonDocument<200> doc;
-  deserializeJson(doc, jsonString);
-
-  CustomMessage message;
-  // Uses the JSON Document with the appropriate keys to create a CustomMessage
-  message.rootSender = doc["rootSender"].as<String>();
-  message.binCapacity = doc["binCapacity"].as<float>();
-  message.timestamp = mesh.getNodeTime(); // assigns the mesh network's sync-ish'd timestamp
+// Turns a node's reading into a CustomMessage. False when the frame is not a reading
+bool deserializeMessage(const uint8_t* frame, size_t length, CustomMessage& message) {
+  BinReading reading;
+  if (!decodeReading(frame, length, reading)) {
+    return false;
+  }
 
-  return message;
+  message.rootSender = reading.rootSender;
+  message.binCapacity = reading.binCapacity;
+  message.timestamp = reading.rootTimestampSent;
+  message.receivedAt = mesh.getNodeTime();
+  // a node of the first frame version does not say, its queue wait then counts as mesh time
+  if (!decodeSentAt(frame, length, message.sentAt)) {
+    message.sentAt = message.timestamp;
+  }
+  message.publishedAt = 0;
+  return true;
 }
 
 void receivedCallback( const uint32_t &from, const String &msg ) {
   Serial.printf("bridge: Received from %u msg=%s, server time: %u\n", from, msg.c_str(), mesh.getNodeTime());
 
-  StaticJsonDocument<200> doc;
-  deserializeJson(doc, msg);
+  uint8_t frame[BIN_MESSAGE_MAX_SIZE];
+  size_t length = binMessageFromText(msg.c_str(), msg.length(), frame, sizeof(frame));
 
   // properly handle the broadcast of updating other knownServers if any as bridge servers don't have to care about it
-  if(doc["update"] == "update")
+  if(binMessageType(frame, length) == BIN_MSG_NEW_SERVER)
   {
     Serial.println("Broadcast message received, dropping it");
     return;
   }
 
   CustomMessage receivedMessage;
-  receivedMessage = deserializeMessage(msg);
-  // add the message to a queue to process later so it won't introduce delays and not to drop any packets to provide QOS 1
-  addToMessageQueue(receivedMessage);
+  if (!deserializeMessage(frame, length, receivedMessage)) {
+    return;
+  }
+  // a resend, or a level that did not move, is only counted in the registry
+  BinReading reading = {receivedMessage.rootSender, receivedMessage.binCapacity, receivedMessage.timestamp};
+  if (devices.ingest(reading, millis())) {
+    // add the message to the spool to process later so it won't introduce delays, and it survives a broker outage or a reboot to provide QOS 1
+    addToMessageQueue(receivedMessage);
+  }
+  // a dropped resend is ACKed too, or the node would keep sending it
+  sendReadingAck(from, receivedMessage);
+}
 
+// Tells the node its reading arrived. The node measures its round trip to this bridge with it and
+// fails over to another bridge when the ACK does not come.
+void sendReadingAck(uint32_t to, const CustomMessage& message) {
+  BinReadingAck ack = {message.rootSender, message.timestamp};
+  uint8_t ackFrame[BIN_MESSAGE_MAX_SIZE];
+  char text[BIN_MESSAGE_TEXT_SIZE];
+  binMessageToText(ackFrame, encodeReadingAck(ack, ackFrame, sizeof(ackFrame)), text, sizeof(text));
+  String msg(text);
+  mesh.sendSingle(to, msg);
 }
 
-// Function to resubscribe to all topics in mqttBroker when the mqtt broker fails
-void resubscribe(){
-  mqttClient.subscribe("update/#");
+// Keeps the one MQTT session up and subscribed. A dropped session is retried with backoff, as
+// connect() blocks loop() for the TCP timeout while the broker is down.
+void maintainMqtt() {
+  if (mqttClient.connected() || myIP == IPAddress(0,0,0,0) || !mqttBackoff.due(millis())) {
+    return;
+  }
+  if (mqttClient.connect(MESH_CLIENT_NAME)) {
+    mqttClient.subscribe("update/#");
+    mqttClient.subscribe(MQTT_STATE_REQUEST_TOPIC);
+    mqttBackoff.reset();
+    Serial.println("MQTT Client is connected!");
+  } else {
+    mqttBackoff.failed(millis());
+    Serial.println("MQTT connect failed, state " + String(mqttClient.state()));
+  }
 }
 
+// Publishes at most MQTT_DRAIN_PER_LOOP queued readings per pass of loop(), packed as JSON arrays
+// into as few publishes as the MQTT buffer allows. A burst is spread over several passes, so
+// mesh.update() keeps running in between.
 void processMessagesFromQueue() {
-  if (mqttClient.connect(MESH_CLIENT_NAME)) {
-    while(!messageQueue.empty()) {
-      CustomMessage message = messageQueue.top();
+  if (!mqttClient.connected()) {
+    return; // the readings wait in the queue until maintainMqtt() is back
+  }
+  // a few readings wait a moment for more to fill the publish
+  if (messageQueue.size() < MQTT_DRAIN_PER_LOOP && millis() - queuedSince < MQTT_BATCH_LINGER) {
+    return;
+  }
+  SpooledReading readings[MQTT_BATCH_READINGS];
+  size_t drained = 0;
+  while (drained < MQTT_DRAIN_PER_LOOP) {
+    size_t want = MQTT_DRAIN_PER_LOOP - drained < MQTT_BATCH_READINGS ? MQTT_DRAIN_PER_LOOP - drained : MQTT_BATCH_READINGS;
+    size_t count = messageQueue.front(readings, want);
+    if (count == 0) {
+      // front() may have gone over records with a bad CRC only, they are dropped
       messageQueue.pop();
-      String jsonString = serializeMessage(message);
-      Serial.println("JSON String: " + jsonString);
-      mqttClient.publish(MQTT_TOPIC, jsonString.c_str());
+      break;
+    }
+    PublishBatch payload(publishBuffer, sizeof(publishBuffer));
+    uint32_t publishedAt = mesh.getNodeTime();
+    for (size_t i = 0; i < count; i++) {
+      const BinReading &reading = readings[i].reading;
+      CustomMessage message = {reading.rootSender, reading.binCapacity, reading.rootTimestampSent,
+                               readings[i].sentAt, readings[i].receivedAt, publishedAt};
+      char object[MESSAGE_JSON_SIZE];
+      payload.add(object, serializeMessage(message, object, sizeof(object)));
+    }
+    if (!mqttClient.publish(MQTT_TOPIC, payload.finish())) {
+      return; // the session dropped, the readings stay in the spool for the reconnect
+    }
+    for (size_t i = 0; i < count; i++) {
+      latencyStats.record(readings[i].reading.rootSender, readings[i].reading.rootTimestampSent, readings[i].sentAt,
+                          readings[i].receivedAt, publishedAt);
+      devices.countPublished(readings[i].reading.rootSender);
     }
-  } 
+    messageQueue.pop();
+    drained += count;
+    Serial.printf("Published %u readings, %u bytes\n", (unsigned)payload.count(), (unsigned)payload.bytes());
+  }
+  queuedSince = millis();
 }
 
 void addToMessageQueue(const CustomMessage& message) {
-  messageQueue.push(message);
+  if (messageQueue.size() == 0) {
+    queuedSince = millis();
+  }
+  SpooledReading reading = {{message.rootSender, message.binCapacity, message.timestamp}, message.sentAt,
+                            message.receivedAt};
+  messageQueue.push(reading, millis());
+}
+
+// Publishes the latency percentiles of the last window and starts the next half. A window the
+// broker missed is not sent later.
+void publishMetrics() {
+  // the metrics topic is the longer one, so its payload also fits publishBuffer
+  size_t length = latencyStats.toJson(publishBuffer, MQTT_METRICS_PAYLOAD_MAX + 1);
+  if (length > 0 && mqttClient.connected()) {
+    mqttClient.publish(MQTT_METRICS_TOPIC, publishBuffer);
+  }
+  latencyStats.rotate();
+}
+
+// Publishes the latest state of every bin the registry knows on MQTT_STATE_TOPIC, as JSON arrays
+// of as many bins as fit one publish. lastSeen is ms ago. The query is answered once the last
+// publish went out; after a failed one loop() sends the whole state again.
+void publishDeviceStates() {
+  unsigned long now = millis();
+  PublishBatch payload(publishBuffer, MQTT_STATE_PAYLOAD_MAX + 1);
+  for (size_t i = 0; i < REGISTRY_SLOTS; i++) {
+    const DeviceState* device = devices.slot(i);
+    if (!device) {
+      continue;
+    }
+    StaticJsonDocument<DEVICE_JSON_SIZE> doc;
+    doc["rootSender"] = device->name;
+    doc["binCapacity"] = device->level;
+    doc["timestamp"] = device->sampledAt;
+    doc["lastSeen"] = now - device->lastSeen;
+    doc["readings"] = device->readings;
+    doc["accepted"] = device->accepted;
+    doc["published"] = device->published;
+    doc["duplicates"] = device->duplicates;
+    doc["unchanged"] = device->unchanged;
+    doc["late"] = device->late;
+    doc["gaps"] = device->gaps;
+    char object[DEVICE_JSON_SIZE];
+    size_t length = serializeJson(doc, object, sizeof(object));
+    if (!payload.add(object, length)) {
+      if (!mqttClient.publish(MQTT_STATE_TOPIC, payload.finish())) {
+        return;
+      }
+      payload.clear();
+      payload.add(object, length);
+    }
+  }
+  // an empty registry answers []
+  if ((payload.count() > 0 || devices.size() == 0) && !mqttClient.publish(MQTT_STATE_TOPIC, payload.finish())) {
+    return;
+  }
+  stateRequested = false;
 }
 
 // whenever the mesh network changes, adding or deleting nodes. It will update the nodes variable and then redisplay the network's routing table
@@ -226,6 +402,12 @@ void onChangedCallback(){
 
 // used for when broker sends a message to this bridge network to get the callback targetStr information, but not applicable for our usecase thus far
 void mqttCallback(char* topic, uint8_t* payload, unsigned int length) {
+  // answered from loop(), a publish from here would overwrite the payload in PubSubClient's buffer
+  if (strcmp(topic, MQTT_STATE_REQUEST_TOPIC) == 0) {
+    stateRequested = true;
+    return;
+  }
+
   StaticJsonDocument<200> doc;
   deserializeJson(doc, payload);
   String auth = doc["auth"].as<String>();
@@ -247,10 +429,11 @@ void mqttCallback(char* topic, uint8_t* payload, unsigned int length) {
   }
   if(hashesMatch)
   {
-    String msg;
-    msg += "{\"update\":\"update\",\"newServer\":";
-    msg += serverToAdd;
-    msg += "}";
+    BinNewServer update = {serverToAdd};
+    uint8_t frame[BIN_MESSAGE_MAX_SIZE];
+    char text[BIN_MESSAGE_TEXT_SIZE];
+    binMessageToText(frame, encodeNewServer(update, frame, sizeof(frame)), text, sizeof(text));
+    String msg(text);
     // broadcasts the new server the mesh bin nodes should add into their knownServers list
     mesh.sendBroadcast(msg);
     Serial.println("Broadcasting: " + msg);
@@ -0,0 +1,61 @@
+// Host stand-in for the parts of the Arduino core used by the LoRa sketches.
+// millis() and delay() run on the virtual clock of host::environment, so a
+// sketch that waits 15 seconds costs no wall clock time.
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define DEC 10
+#define HEX 16
+
+unsigned long millis();
+void delay(unsigned long ms);
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+class HardwareSerial
+{
+public:
+  void begin(unsigned long baud);
+
+  size_t print(const char *str);
+  size_t print(char c);
+  size_t print(unsigned char n, int base = DEC);
+  size_t print(int n, int base = DEC);
+  size_t print(unsigned int n, int base = DEC);
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(double n, int digits = 2);
+
+  size_t println();
+  template <typename T>
+  size_t println(T value)
+  {
+    size_t n = print(value);
+    return n + println();
+  }
+  template <typename T>
+  size_t println(T value, int format)
+  {
+    size_t n = print(value, format);
+    return n + println();
+  }
+
+private:
+  unsigned long _baud;
+
+  // Echoes the text when host::verbose and charges its transmit time to the sketch
+  size_t write(const char *str, size_t len);
+};
+
+extern HardwareSerial Serial;
+
+#endif
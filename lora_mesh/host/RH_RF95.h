@@ -0,0 +1,148 @@
+// Host stand-in for the RadioHead RH_RF95 driver. Frames are handed to
+// host::environment, which decides who hears them and when. The driver keeps
+// the real half-duplex behaviour: a frame that arrives while the radio is
+// transmitting or idle is lost, and a new frame overwrites an unread one.
+#ifndef HOST_RH_RF95_H
+#define HOST_RH_RF95_H
+
+#include "Arduino.h"
+
+#define RH_RF95_HEADER_LEN 4
+#define RH_RF95_MAX_PAYLOAD_LEN 255
+#define RH_RF95_MAX_MESSAGE_LEN (RH_RF95_MAX_PAYLOAD_LEN - RH_RF95_HEADER_LEN)
+
+class RH_RF95
+{
+public:
+  typedef enum
+  {
+    Bw125Cr45Sf128 = 0,
+    Bw500Cr45Sf128,
+    Bw31_25Cr48Sf512,
+    Bw125Cr48Sf4096,
+    Bw125Cr45Sf2048,
+  } ModemConfigChoice;
+
+  typedef enum
+  {
+    RHModeInitialising = 0,
+    RHModeSleep,
+    RHModeIdle,
+    RHModeTx,
+    RHModeRx,
+    RHModeCad,
+  } RHMode;
+
+  RH_RF95(uint8_t slaveSelectPin = 10, uint8_t interruptPin = 2);
+
+  bool init();
+  bool setFrequency(float centre);
+  void setTxPower(int8_t power, bool useRFO = false);
+  bool setModemConfig(ModemConfigChoice index);
+  void setSpreadingFactor(uint8_t sf);
+  void setSignalBandwidth(long sbw);
+  void setCodingRate4(uint8_t denominator);
+  void setPreambleLength(uint16_t bytes);
+
+  bool available();
+  bool recv(uint8_t *buf, uint8_t *len);
+  bool send(const uint8_t *data, uint8_t len);
+  bool waitPacketSent();
+  bool waitAvailableTimeout(uint16_t timeout);
+  bool isChannelActive();
+  uint8_t maxMessageLength() { return RH_RF95_MAX_MESSAGE_LEN; }
+
+  bool sleep();
+  void setModeIdle();
+  void setModeRx();
+  RHMode mode();
+
+  int16_t lastRssi() { return _lastRssi; }
+  int lastSNR() { return _lastSNR; }
+  uint16_t txGood() { return txFrames; }
+  uint16_t rxGood() { return rxFrames; }
+
+  /* ===== host only ===== */
+  // Time on air in ms of a frame with a payload of len bytes under the current modem config
+  unsigned long timeOnAir(uint8_t len) const;
+  // Called by the environment when a frame addressed to this radio finishes arriving
+  void deliver(const uint8_t *data, uint8_t len, int16_t rssi, int8_t snr);
+  // True when a received frame is waiting, without switching the radio to RX like available()
+  bool frameWaiting() const { return _rxBufValid; }
+
+  uint8_t spreadingFactor() const { return _sf; }
+  long bandwidth() const { return _bw; }
+  uint8_t codingRate4() const { return _cr; }
+  int8_t txPower() const { return _txPower; }
+  uint16_t preambleLength() const { return _preamble; }
+  // ms the radio spent in mode so far, for energy estimates
+  unsigned long timeInMode(RHMode mode);
+
+  unsigned long txFrames;        // frames handed to the environment
+  unsigned long rxFrames;        // frames read by the sketch
+  unsigned long rxMissed;        // frames lost because the radio was not in RX
+  unsigned long rxOverwritten;   // frames lost because the previous one was never read
+  unsigned long txAirtime;       // total ms spent transmitting
+  unsigned long cadChecks;       // isChannelActive() calls
+  unsigned long cadBusy;         // of them found the channel busy
+
+private:
+  RHMode _mode;
+  unsigned long _modeSince;
+  unsigned long _modeTime[RHModeCad + 1];
+  unsigned long _txEnd;
+  uint8_t _sf;
+  long _bw;
+  uint8_t _cr;
+  uint16_t _preamble;
+  int8_t _txPower;
+  uint8_t _rxBuf[RH_RF95_MAX_PAYLOAD_LEN];
+  uint8_t _rxLen;
+  bool _rxBufValid;
+  int16_t _lastRssi;
+  int _lastSNR;
+
+  void updateMode();
+  void setMode(RHMode mode);
+};
+
+namespace host
+{
+  // The world a sketch runs in: owns the virtual clock and the radio channel
+  class Environment
+  {
+  public:
+    virtual ~Environment() {}
+    virtual unsigned long now() = 0;
+    // Let virtual time pass up to deadline, returning early as soon as radio
+    // (if given) has a frame waiting
+    virtual void runUntil(unsigned long deadline, RH_RF95 *radio) = 0;
+    // radio started transmitting data, which occupies the channel for airtime ms
+    virtual void transmit(RH_RF95 &radio, const uint8_t *data, uint8_t len, unsigned long airtime) = 0;
+    // The sketch on radio read data with recv()
+    virtual void received(RH_RF95 &radio, const uint8_t *data, uint8_t len)
+    {
+      (void)radio, (void)data, (void)len;
+    }
+    // Whether radio detected LoRa activity during the duration ms of CAD that just ended
+    virtual bool channelActive(RH_RF95 &radio, unsigned long duration)
+    {
+      (void)radio, (void)duration;
+      return false;
+    }
+    // The sketch wrote len characters to Serial, which sends them at baud
+    virtual void serialWrite(size_t len, unsigned long baud)
+    {
+      (void)len, (void)baud;
+    }
+  };
+
+  extern Environment *environment;
+  extern bool verbose; // echo sketch Serial output to stdout
+
+  // NODE_ID of the sketch that is running, defined by hosts that build sketches
+  // with -DNODE_ID=host::nodeId() to run many copies of one sketch
+  uint8_t nodeId();
+}
+
+#endif
@@ -0,0 +1,7 @@
+// Host stand-in for the Arduino SPI library, the simulated radio does not use the bus
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+
+#include "Arduino.h"
+
+#endif
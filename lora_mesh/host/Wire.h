@@ -0,0 +1,7 @@
+// Host stand-in for the Arduino Wire library, the sketches include it but never use it
+#ifndef HOST_WIRE_H
+#define HOST_WIRE_H
+
+#include "Arduino.h"
+
+#endif
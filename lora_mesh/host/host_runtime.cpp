@@ -0,0 +1,399 @@
+// Implementation of the host stand-ins declared in Arduino.h and RH_RF95.h
+#include "Arduino.h"
+#include "RH_RF95.h"
+
+#include <math.h>
+
+namespace host
+{
+  Environment *environment = 0;
+  bool verbose = false;
+}
+
+/* ========================================================== */
+/* ======================= ARDUINO CORE ===================== */
+/* ========================================================== */
+HardwareSerial Serial;
+
+unsigned long millis()
+{
+  // Sketch globals such as lastReceivedForwardingNode read the clock before main()
+  return host::environment ? host::environment->now() : 0;
+}
+
+void delay(unsigned long ms)
+{
+  host::environment->runUntil(millis() + ms, 0);
+}
+
+long random(long howbig)
+{
+  if (howbig <= 0)
+  {
+    return 0;
+  }
+  return rand() % howbig;
+}
+
+long random(long howsmall, long howbig)
+{
+  if (howsmall >= howbig)
+  {
+    return howsmall;
+  }
+  return howsmall + random(howbig - howsmall);
+}
+
+void randomSeed(unsigned long seed)
+{
+  srand(seed);
+}
+
+void HardwareSerial::begin(unsigned long baud)
+{
+  _baud = baud;
+}
+
+size_t HardwareSerial::write(const char *str, size_t len)
+{
+  if (host::verbose)
+  {
+    fwrite(str, 1, len, stdout);
+  }
+  if (_baud)
+  {
+    host::environment->serialWrite(len, _baud);
+  }
+  return len;
+}
+
+size_t HardwareSerial::print(const char *str)
+{
+  return write(str, strlen(str));
+}
+
+size_t HardwareSerial::print(char c)
+{
+  return write(&c, 1);
+}
+
+size_t HardwareSerial::print(unsigned char n, int base)
+{
+  return print((unsigned long)n, base);
+}
+
+size_t HardwareSerial::print(int n, int base)
+{
+  return print((long)n, base);
+}
+
+size_t HardwareSerial::print(unsigned int n, int base)
+{
+  return print((unsigned long)n, base);
+}
+
+size_t HardwareSerial::print(long n, int base)
+{
+  char buf[24];
+  return write(buf, snprintf(buf, sizeof(buf), base == HEX ? "%lX" : "%ld", n));
+}
+
+size_t HardwareSerial::print(unsigned long n, int base)
+{
+  char buf[24];
+  return write(buf, snprintf(buf, sizeof(buf), base == HEX ? "%lX" : "%lu", n));
+}
+
+size_t HardwareSerial::print(double n, int digits)
+{
+  char buf[48];
+  int len = snprintf(buf, sizeof(buf), "%.*f", digits, n);
+  return write(buf, len < (int)sizeof(buf) ? len : sizeof(buf) - 1);
+}
+
+size_t HardwareSerial::println()
+{
+  return write("\r\n", 2);
+}
+/* ========================================================== */
+/* ======================= ARDUINO CORE ===================== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ========================= RH_RF95 ======================== */
+/* ========================================================== */
+RH_RF95::RH_RF95(uint8_t slaveSelectPin, uint8_t interruptPin)
+    : txFrames(0), rxFrames(0), rxMissed(0), rxOverwritten(0), txAirtime(0), cadChecks(0), cadBusy(0),
+      _mode(RHModeInitialising), _modeSince(0), _modeTime(), _txEnd(0), _sf(7), _bw(125000), _cr(5), _preamble(8),
+      _txPower(13), _rxLen(0), _rxBufValid(false), _lastRssi(0), _lastSNR(0)
+{
+  (void)slaveSelectPin;
+  (void)interruptPin;
+}
+
+bool RH_RF95::init()
+{
+  setMode(RHModeIdle);
+  return true;
+}
+
+bool RH_RF95::setFrequency(float centre)
+{
+  (void)centre;
+  return true;
+}
+
+void RH_RF95::setTxPower(int8_t power, bool useRFO)
+{
+  (void)useRFO;
+  _txPower = power;
+}
+
+bool RH_RF95::setModemConfig(ModemConfigChoice index)
+{
+  switch (index)
+  {
+  case Bw125Cr45Sf128:
+    _bw = 125000, _cr = 5, _sf = 7;
+    return true;
+  case Bw500Cr45Sf128:
+    _bw = 500000, _cr = 5, _sf = 7;
+    return true;
+  case Bw31_25Cr48Sf512:
+    _bw = 31250, _cr = 8, _sf = 9;
+    return true;
+  case Bw125Cr48Sf4096:
+    _bw = 125000, _cr = 8, _sf = 12;
+    return true;
+  case Bw125Cr45Sf2048:
+    _bw = 125000, _cr = 5, _sf = 11;
+    return true;
+  }
+  return false;
+}
+
+void RH_RF95::setSpreadingFactor(uint8_t sf)
+{
+  if (sf < 6)
+  {
+    sf = 6;
+  }
+  else if (sf > 12)
+  {
+    sf = 12;
+  }
+  _sf = sf;
+}
+
+void RH_RF95::setSignalBandwidth(long sbw)
+{
+  _bw = sbw;
+}
+
+void RH_RF95::setCodingRate4(uint8_t denominator)
+{
+  if (denominator < 5)
+  {
+    denominator = 5;
+  }
+  else if (denominator > 8)
+  {
+    denominator = 8;
+  }
+  _cr = denominator;
+}
+
+void RH_RF95::setPreambleLength(uint16_t bytes)
+{
+  _preamble = bytes;
+}
+
+// Semtech AN1200.13 time on air, explicit header and CRC on like RadioHead configures it
+unsigned long RH_RF95::timeOnAir(uint8_t len) const
+{
+  double symbolTime = (double)(1UL << _sf) / _bw * 1000.0;
+  int lowDataRateOptimize = symbolTime > 16.0 ? 1 : 0;
+  int payloadLen = len + RH_RF95_HEADER_LEN;
+
+  double numerator = 8.0 * payloadLen - 4.0 * _sf + 28 + 16;
+  double payloadSymbols = ceil(numerator / (4.0 * (_sf - 2 * lowDataRateOptimize))) * _cr;
+  if (payloadSymbols < 0)
+  {
+    payloadSymbols = 0;
+  }
+  payloadSymbols += 8;
+
+  double airtime = (_preamble + 4.25 + payloadSymbols) * symbolTime;
+  return (unsigned long)ceil(airtime);
+}
+
+void RH_RF95::updateMode()
+{
+  if (_mode == RHModeTx && host::environment->now() >= _txEnd)
+  {
+    // The radio went idle when the frame ended, not when the sketch looked
+    _modeTime[RHModeTx] += _txEnd - _modeSince;
+    _modeSince = _txEnd;
+    _mode = RHModeIdle;
+  }
+}
+
+void RH_RF95::setMode(RHMode mode)
+{
+  unsigned long now = host::environment->now();
+  _modeTime[_mode] += now - _modeSince;
+  _modeSince = now;
+  _mode = mode;
+}
+
+unsigned long RH_RF95::timeInMode(RHMode mode)
+{
+  updateMode();
+  unsigned long time = _modeTime[mode];
+  if (mode == _mode)
+  {
+    time += host::environment->now() - _modeSince;
+  }
+  return time;
+}
+
+RH_RF95::RHMode RH_RF95::mode()
+{
+  updateMode();
+  return _mode;
+}
+
+bool RH_RF95::available()
+{
+  updateMode();
+  if (_mode == RHModeTx)
+  {
+    return false;
+  }
+  setModeRx();
+  return _rxBufValid;
+}
+
+bool RH_RF95::recv(uint8_t *buf, uint8_t *len)
+{
+  if (!available())
+  {
+    return false;
+  }
+  if (buf && len)
+  {
+    if (*len > _rxLen)
+    {
+      *len = _rxLen;
+    }
+    memcpy(buf, _rxBuf, *len);
+    host::environment->received(*this, buf, *len);
+  }
+  _rxBufValid = false;
+  rxFrames++;
+  return true;
+}
+
+bool RH_RF95::send(const uint8_t *data, uint8_t len)
+{
+  if (len > RH_RF95_MAX_MESSAGE_LEN)
+  {
+    return false;
+  }
+  waitPacketSent();
+
+  unsigned long airtime = timeOnAir(len);
+  setMode(RHModeTx);
+  _txEnd = host::environment->now() + airtime;
+  txFrames++;
+  txAirtime += airtime;
+  host::environment->transmit(*this, data, len, airtime);
+  return true;
+}
+
+bool RH_RF95::waitPacketSent()
+{
+  if (_mode == RHModeTx)
+  {
+    host::environment->runUntil(_txEnd, 0);
+    updateMode();
+  }
+  return true;
+}
+
+bool RH_RF95::waitAvailableTimeout(uint16_t timeout)
+{
+  unsigned long deadline = host::environment->now() + timeout;
+  while (!available())
+  {
+    if (host::environment->now() >= deadline)
+    {
+      return false;
+    }
+    host::environment->runUntil(deadline, this);
+  }
+  return true;
+}
+
+// CAD listens for about two symbols, the modem cannot receive meanwhile
+bool RH_RF95::isChannelActive()
+{
+  waitPacketSent();
+  unsigned long duration = (2000UL * (1UL << _sf) + _bw - 1) / _bw;
+  setMode(RHModeCad);
+  host::environment->runUntil(host::environment->now() + duration, 0);
+  bool active = host::environment->channelActive(*this, duration);
+  setMode(RHModeIdle);
+  cadChecks++;
+  cadBusy += active;
+  return active;
+}
+
+bool RH_RF95::sleep()
+{
+  updateMode();
+  if (_mode != RHModeSleep)
+  {
+    setMode(RHModeSleep);
+  }
+  return true;
+}
+
+void RH_RF95::setModeIdle()
+{
+  updateMode();
+  if (_mode != RHModeIdle)
+  {
+    setMode(RHModeIdle);
+  }
+}
+
+void RH_RF95::setModeRx()
+{
+  if (_mode != RHModeRx)
+  {
+    setMode(RHModeRx);
+  }
+}
+
+void RH_RF95::deliver(const uint8_t *data, uint8_t len, int16_t rssi, int8_t snr)
+{
+  updateMode();
+  if (_mode != RHModeRx)
+  {
+    rxMissed++;
+    return;
+  }
+  if (_rxBufValid)
+  {
+    rxOverwritten++;
+  }
+  memcpy(_rxBuf, data, len);
+  _rxLen = len;
+  _rxBufValid = true;
+  _lastRssi = rssi;
+  _lastSNR = snr;
+}
+/* ========================================================== */
+/* ========================= RH_RF95 ======================== */
+/* ========================================================== */
@@ -0,0 +1,903 @@
+// Discrete-event simulator for the whole LoRa mesh on the host.
+//
+// Every node runs the real sketch: lora_server.ino as node 0, lora_node.ino
+// built as the relay (NODE_PRESET 1) as node 1 and lora_node.ino built as a
+// bin behind it (NODE_PRESET 2) as every alert node.
+// Each sketch is built once as a shared object and loaded again for every node
+// (from a private copy, so each node gets its own globals), and runs as a
+// coroutine on one virtual clock. The channel models log-distance path loss
+// with per-link shadowing, propagation delay, half-duplex radios, collisions
+// with a capture threshold and extra random frame loss.
+//
+// Bins fill at a steady rate, each at its own, and the sketches read the level
+// with sensor noise. A reading crossing ALERT_THRESHOLD starts the clock and the
+// server reading a capacity record of the bin stops it. An alert the server
+// already holds a forecast for counts as delivered when it is raised.
+// Alerts raised in the last --drain seconds are not counted, so in-flight
+// alerts are not lost. Delivered alerts empty the bin.
+// Radio energy of the nodes is estimated from the time each radio spent in
+// every mode and the SX1276 supply currents.
+//
+//   g++ -std=c++11 -O2 -fPIC -shared -Wl,-Bsymbolic -I. -include Arduino.h -x c++ ../lora_server/lora_server.ino -o lora_server.so
+//   g++ -std=c++11 -O2 -fPIC -shared -Wl,-Bsymbolic -I. -include Arduino.h -DNODE_PRESET=1 '-DNODE_ID=host::nodeId()' -x c++ ../lora_node/lora_node.ino -o lora_relay.so
+//   g++ -std=c++11 -O2 -fPIC -shared -Wl,-Bsymbolic -I. -include Arduino.h -DNODE_PRESET=2 '-DNODE_ID=host::nodeId()' -x c++ ../lora_node/lora_node.ino -o lora_leaf.so
+//   g++ -std=c++11 -O2 -rdynamic -I. mesh_sim.cpp host_runtime.cpp -o mesh_sim -ldl
+//   ./mesh_sim --leaves 200 --radius 2000 --fill-interval 600000 --duration 3600
+#include "Arduino.h"
+#include "RH_RF95.h"
+
+// Wire format only, the sketches themselves are loaded at run time
+namespace wire
+{
+#include "../lora_node/lora_node.h"
+}
+
+#include <dlfcn.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <queue>
+#include <string>
+#include <vector>
+
+#define RELAY_ID 1
+#define FIRST_LEAF_ID 2
+#define MAX_LEAVES (255 - FIRST_LEAF_ID)
+#define MAX_HOPS 16
+#define STACK_SIZE (64 * 1024)
+#define SPEED_OF_LIGHT 299792458.0
+#define PATH_LOSS_1M 31.7    // free space loss at 1 m and 920 MHz
+#define NOISE_FIGURE 6.0     // dB, SX1276
+#define CAPTURE_THRESHOLD 6  // dB a frame must beat every overlapping frame by to survive
+#define SUPPLY_VOLTAGE 3.3
+#define RX_CURRENT 10.8      // mA, SX1276 datasheet, 125 kHz bandwidth
+#define IDLE_CURRENT 1.6     // mA, standby
+#define SLEEP_CURRENT 0.0002 // mA
+#define FILL_STEP 10000000ULL // us between two updates of the bin levels
+#define SERIAL_BUFFER 64      // characters HardwareSerial queues before print() blocks, as on the AVR core
+
+struct SimConfig
+{
+  int leaves = 100;
+  double radius = 2000;           // m, leaves are spread over a disc around the relay
+  double serverDistance = 1000;   // m between server and relay
+  double pathLossExponent = 3.0;
+  double shadowing = 4.0;         // dB standard deviation, fixed per link
+  double loss = 0.0;              // chance a frame that survived the channel is still lost
+  unsigned long fillInterval = 600000; // mean time for an emptied bin to fill up again
+  double fillSpread = 0.5;        // fill times vary by this fraction around fillInterval, 0 fills every bin alike
+  double fillNoise = 1.0;         // percent standard deviation of a bin level reading
+  bool emptiedTogether = false;   // every bin starts empty, otherwise at a random level below ALERT_THRESHOLD
+  bool cadPayload = false;        // CAD detects whole frames as the SX126x does, the SX1276 only sees preambles
+  unsigned long bootSpread = 60000;    // nodes power up at random within this many ms
+  unsigned long duration = 3600;  // seconds of virtual time alerts are raised in
+  unsigned long drain = 120;      // seconds to let in-flight alerts finish
+  unsigned seed = 1;
+  std::string serverSketch = "./lora_server.so";
+  std::string relaySketch = "./lora_relay.so";
+  std::string leafSketch = "./lora_leaf.so";
+};
+
+// A frame arriving at one radio
+struct Reception
+{
+  unsigned long id; // transmission it belongs to
+  uint64_t start;
+  uint64_t end;
+  uint64_t preambleEnd; // CAD on the SX1276 only detects the frame until then
+  double rssi;
+  bool corrupted;  // overlapped a frame it could not capture over
+  bool halfDuplex; // the receiver transmitted while it was arriving
+  std::vector<uint8_t> data;
+};
+
+struct SimNode
+{
+  uint8_t id;
+  double x, y;
+  void *handle;
+  void (*setup)();
+  void (*loop)();
+  RH_RF95 *radio;
+  uint8_t *binCapacity;            // alert nodes only
+  unsigned long *retransmissions;  // not on the server
+  unsigned long *airtimeUsed;
+  unsigned long *duplicatesAcked;   // not on the server
+  unsigned long *duplicatesDropped; // not on the server
+  unsigned long *duplicatesReceived; // server only
+  unsigned long *dataRateCommands;   // server only
+  int8_t *dataTxPower;               // not on the server
+  bool (*hasRoute)();               // not on the server
+  uint8_t (*nextHop)();
+
+  ucontext_t context;
+  std::vector<char> stack;
+  bool started;
+  bool sleeping;          // inside runUntil()
+  RH_RF95 *waitRadio;     // wake early when this radio has a frame waiting
+  unsigned long generation; // bumps on every runUntil(), stale wake events check it
+  uint64_t txEnd;
+  double txCharge;        // mA ms spent transmitting, the current depends on the power
+  uint64_t serialIdle;    // when the last character written to Serial is out
+  std::vector<Reception> receptions;
+
+  bool alertRaised;
+  bool alertCounted;      // raised before the drain period started
+  uint64_t alertTime;
+  uint64_t fillTime;      // us from empty to full
+  uint64_t fullTime;
+  bool forecastKnown;     // the server has a forecast since the bin was emptied
+  uint64_t forecastTime;  // when the server got the first one
+  uint64_t forecastFull;  // when the latest one says the bin is full
+};
+
+enum EventType
+{
+  EVENT_WAKE,
+  EVENT_RX_END,
+  EVENT_FILL,
+};
+
+struct Event
+{
+  uint64_t time; // us
+  unsigned long sequence;
+  EventType type;
+  int node;
+  unsigned long tag; // generation for EVENT_WAKE, transmission id for EVENT_RX_END
+  bool operator<(const Event &other) const
+  {
+    return time != other.time ? time > other.time : sequence > other.sequence;
+  }
+};
+
+class SimEnvironment : public host::Environment
+{
+public:
+  SimEnvironment(const SimConfig &config) : config(config), clock(0), sequence(0), transmissions(0), current(-1) {}
+
+  unsigned long now() { return (unsigned long)(clock / 1000); }
+
+  uint8_t currentNodeId() { return current >= 0 ? nodes[current].id : 0; }
+
+  void runUntil(unsigned long deadline, RH_RF95 *radio)
+  {
+    if (current < 0)
+    {
+      fprintf(stderr, "runUntil() called outside a sketch\n");
+      exit(1);
+    }
+    SimNode &node = nodes[current];
+    if (radio && radio->frameWaiting())
+    {
+      return;
+    }
+    node.generation++;
+    node.sleeping = true;
+    node.waitRadio = radio;
+    schedule(std::max(clock, (uint64_t)deadline * 1000), EVENT_WAKE, current, node.generation);
+    swapcontext(&node.context, &scheduler);
+  }
+
+  void transmit(RH_RF95 &radio, const uint8_t *data, uint8_t len, unsigned long airtime)
+  {
+    int sender = current;
+    SimNode &node = nodes[sender];
+    unsigned long id = transmissions++;
+    node.txEnd = clock + airtime * 1000ULL;
+    node.txCharge += txCurrent(radio.txPower()) * airtime;
+    framesSent++;
+    if (len >= 2 && data[1] == MSG_TYPE_REQ_FORWARD_NODE)
+    {
+      joinRequests++;
+    }
+    if (len >= 2 && (data[1] == MSG_TYPE_ACK_SUCCEED || data[1] == MSG_TYPE_ACK_BATCH || data[1] == MSG_TYPE_ACK_BITMAP))
+    {
+      ackFrames++;
+    }
+
+    // Half-duplex: whatever the sender was receiving is gone
+    for (size_t i = 0; i < node.receptions.size(); i++)
+    {
+      node.receptions[i].halfDuplex = true;
+    }
+
+    for (size_t r = 0; r < nodes.size(); r++)
+    {
+      SimNode &receiver = nodes[r];
+      if ((int)r == sender || receiver.radio->spreadingFactor() != radio.spreadingFactor())
+      {
+        continue;
+      }
+      double rssi = radio.txPower() - pathLoss[sender * nodes.size() + r];
+      if (rssi - noiseFloor(radio) < demodulationFloor(radio.spreadingFactor()))
+      {
+        continue;
+      }
+
+      Reception reception;
+      reception.id = id;
+      reception.start = clock + (uint64_t)(distance(node, receiver) / SPEED_OF_LIGHT * 1e6);
+      reception.end = reception.start + airtime * 1000ULL;
+      reception.preambleEnd = reception.start + (uint64_t)((radio.preambleLength() + 4.25) * (1UL << radio.spreadingFactor()) * 1e6 /
+                                                           radio.bandwidth());
+      reception.rssi = rssi;
+      reception.corrupted = false;
+      reception.halfDuplex = receiver.txEnd > reception.start;
+      reception.data.assign(data, data + len);
+
+      for (size_t i = 0; i < receiver.receptions.size(); i++)
+      {
+        Reception &other = receiver.receptions[i];
+        if (other.start < reception.end && reception.start < other.end)
+        {
+          if (reception.rssi - other.rssi < CAPTURE_THRESHOLD)
+          {
+            other.corrupted = true;
+          }
+          if (other.rssi - reception.rssi < CAPTURE_THRESHOLD)
+          {
+            reception.corrupted = true;
+          }
+        }
+      }
+      receiver.receptions.push_back(reception);
+      schedule(reception.end, EVENT_RX_END, r, id);
+    }
+  }
+
+  // CAD sees any frame at or above the demodulation floor that was on air during it
+  bool channelActive(RH_RF95 &/*radio*/, unsigned long duration)
+  {
+    SimNode &node = nodes[current];
+    uint64_t start = clock - std::min<uint64_t>(clock, duration * 1000ULL);
+    for (size_t i = 0; i < node.receptions.size(); i++)
+    {
+      Reception &reception = node.receptions[i];
+      uint64_t end = config.cadPayload ? reception.end : reception.preambleEnd;
+      if (reception.start < clock && end > start)
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Serial sends 10 bits per character. print() returns once the text fits the TX buffer, the
+  // sketch does nothing else until then.
+  void serialWrite(size_t len, unsigned long baud)
+  {
+    if (current < 0)
+    {
+      return;
+    }
+    SimNode &node = nodes[current];
+    uint64_t charTime = 10000000ULL / baud;
+    node.serialIdle = std::max(node.serialIdle, clock) + len * charTime;
+    serialChars += len;
+    if (node.serialIdle > clock + SERIAL_BUFFER * charTime)
+    {
+      uint64_t resume = node.serialIdle - SERIAL_BUFFER * charTime;
+      serialBlocked += resume - clock;
+      runUntil((unsigned long)((resume + 999) / 1000), 0);
+    }
+  }
+
+  // The server read a frame: capacity records addressed to it end their alerts, telemetry is counted
+  void received(RH_RF95 &radio, const uint8_t *data, uint8_t len)
+  {
+    if (&radio != nodes[0].radio || len < 2 || data[0] != AUTH_KEY)
+    {
+      return;
+    }
+    wire::Frame frame;
+    memcpy(&frame, data, std::min<size_t>(len, sizeof(frame)));
+    if (frame.packet.msgType == MSG_TYPE_CAPACITY && frame.packet.data.capacityPacket.receiverNode.nodeId == SERVER_ID)
+    {
+      wire::CapacityPacket &cpacket = frame.packet.data.capacityPacket;
+      reportReceived(cpacket.alertNode.nodeId, cpacket.binCapacity, cpacket.minutesToFull);
+    }
+    else if (frame.packet.msgType == MSG_TYPE_CAPACITY_BATCH && frame.batchPacket.data.receiverNode.nodeId == SERVER_ID)
+    {
+      for (int i = 0; i < frame.batchPacket.data.recordCount && i < MAX_BATCH_RECORDS; i++)
+      {
+        wire::CapacityRecord &record = frame.batchPacket.data.records[i];
+        reportReceived(record.alertNode.nodeId, record.binCapacity, record.minutesToFull);
+      }
+    }
+    else if (frame.packet.msgType == MSG_TYPE_STATS && frame.statsFrame.data.receiverNode.nodeId == SERVER_ID)
+    {
+      statsReports++;
+    }
+  }
+
+  bool load()
+  {
+    if (!mkdtemp(tempDir))
+    {
+      perror("mkdtemp");
+      return false;
+    }
+
+    addNode(SERVER_ID, config.serverSketch, -config.serverDistance, 0);
+    addNode(RELAY_ID, config.relaySketch, 0, 0);
+    for (int i = 0; i < config.leaves; i++)
+    {
+      // Uniform over the disc around the relay
+      double r = config.radius * sqrt(uniform());
+      double a = 2 * M_PI * uniform();
+      addNode(FIRST_LEAF_ID + i, config.leafSketch, r * cos(a), r * sin(a));
+    }
+    rmdir(tempDir);
+
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+      if (!nodes[i].handle)
+      {
+        return false;
+      }
+    }
+
+    // Shadowing is fixed per link and the same both ways
+    pathLoss.assign(nodes.size() * nodes.size(), 0);
+    for (size_t a = 0; a < nodes.size(); a++)
+    {
+      for (size_t b = a + 1; b < nodes.size(); b++)
+      {
+        double d = std::max(1.0, distance(nodes[a], nodes[b]));
+        double loss = PATH_LOSS_1M + 10 * config.pathLossExponent * log10(d) + config.shadowing * gaussian();
+        pathLoss[a * nodes.size() + b] = loss;
+        pathLoss[b * nodes.size() + a] = loss;
+      }
+    }
+    return true;
+  }
+
+  void run()
+  {
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+      schedule(i == 0 ? 0 : random(config.bootSpread) * 1000ULL, EVENT_WAKE, i, 0);
+      if (nodes[i].binCapacity && nodes[i].id >= FIRST_LEAF_ID)
+      {
+        empty(i, config.emptiedTogether ? 0 : uniform() * ALERT_THRESHOLD);
+        schedule(random(FILL_STEP / 1000) * 1000ULL, EVENT_FILL, i, 0);
+      }
+    }
+
+    uint64_t end = (config.duration + config.drain) * 1000000ULL;
+    while (!events.empty() && events.top().time <= end)
+    {
+      Event event = events.top();
+      events.pop();
+      clock = std::max(clock, event.time);
+      switch (event.type)
+      {
+      case EVENT_WAKE:
+        wake(event.node, event.tag);
+        break;
+      case EVENT_RX_END:
+        receptionEnded(event.node, event.tag);
+        break;
+      case EVENT_FILL:
+        fill(event.node);
+        break;
+      }
+    }
+    clock = std::max(clock, end);
+  }
+
+  std::vector<SimNode> nodes;
+  std::vector<unsigned long> latencies;
+  std::vector<unsigned long> leadTimes;      // ms a good forecast reached the server before the alert
+  std::vector<unsigned long> forecastErrors; // ms the forecast the server held at the alert was off the real time to full
+  std::vector<unsigned long> reportsPerMinute;
+  unsigned long reports = 0; // capacity records the server read
+  unsigned long forecasts = 0;
+  unsigned long alerts = 0;
+  unsigned long duplicates = 0;
+  unsigned long framesSent = 0;
+  unsigned long statsReports = 0; // telemetry frames the server read
+  unsigned long joinRequests = 0;
+  unsigned long ackFrames = 0;    // plain, batch and aggregated ACKs
+  unsigned long serialChars = 0;
+  uint64_t serialBlocked = 0;     // us sketches spent waiting for Serial
+  unsigned long receptions = 0;
+  unsigned long collisions = 0;
+  unsigned long halfDuplexLosses = 0;
+  unsigned long randomLosses = 0;
+
+  bool inRange(size_t a, size_t b)
+  {
+    return TX_POWER_DEFAULT - pathLoss[a * nodes.size() + b] - noiseFloor(*nodes[a].radio) >=
+           demodulationFloor(nodes[a].radio->spreadingFactor());
+  }
+
+  // Nodes with a path to the server over links that work both ways, whether the sketches found it or not
+  std::vector<bool> reachable()
+  {
+    std::vector<bool> seen(nodes.size(), false);
+    std::vector<size_t> pending(1, 0);
+    seen[0] = true;
+    while (!pending.empty())
+    {
+      size_t a = pending.back();
+      pending.pop_back();
+      for (size_t b = 0; b < nodes.size(); b++)
+      {
+        if (!seen[b] && inRange(a, b) && inRange(b, a))
+        {
+          seen[b] = true;
+          pending.push_back(b);
+        }
+      }
+    }
+    return seen;
+  }
+
+  // Hops from a node to the server along the next hops the sketches chose, -1 without a route or in a loop
+  int hops(size_t index)
+  {
+    for (int hops = 1; hops <= MAX_HOPS; hops++)
+    {
+      SimNode &node = nodes[index];
+      if (!node.hasRoute || !node.nextHop)
+      {
+        return -1;
+      }
+      current = index; // the sketch asks for NODE_ID
+      bool route = node.hasRoute();
+      uint8_t next = node.nextHop();
+      current = -1;
+      if (!route || next >= nodes.size())
+      {
+        return -1;
+      }
+      if (next == SERVER_ID)
+      {
+        return hops;
+      }
+      index = next; // node ids are indexes
+    }
+    return -1;
+  }
+
+private:
+  SimConfig config;
+  uint64_t clock; // us
+  unsigned long sequence;
+  unsigned long transmissions;
+  int current; // node whose sketch is running, -1 in the scheduler
+  ucontext_t scheduler;
+  std::priority_queue<Event> events;
+  std::vector<double> pathLoss; // dB, [sender * nodes + receiver]
+  char tempDir[32] = "/tmp/mesh_sim.XXXXXX";
+
+  static void nodeMain(int index);
+
+  void schedule(uint64_t time, EventType type, int node, unsigned long tag)
+  {
+    events.push(Event{time, sequence++, type, node, tag});
+  }
+
+  double uniform() { return (rand() + 1.0) / (RAND_MAX + 2.0); }
+
+  double gaussian() { return sqrt(-2 * log(uniform())) * cos(2 * M_PI * uniform()); }
+
+  // mA drawn on PA_BOOST at power dBm, interpolated between SX1276 datasheet points
+  static double txCurrent(int8_t power)
+  {
+    static const double points[][2] = {{7, 20}, {13, 29}, {17, 87}, {20, 120}};
+    int i = 1;
+    while (i < 3 && power > points[i][0])
+    {
+      i++;
+    }
+    double current = points[i - 1][1] + (power - points[i - 1][0]) * (points[i][1] - points[i - 1][1]) / (points[i][0] - points[i - 1][0]);
+    return std::max(current, points[0][1]);
+  }
+
+  static double distance(const SimNode &a, const SimNode &b) { return hypot(a.x - b.x, a.y - b.y); }
+
+  static double noiseFloor(RH_RF95 &radio) { return -174 + 10 * log10((double)radio.bandwidth()) + NOISE_FIGURE; }
+
+  // Lowest SNR the demodulator copes with, SX1276 datasheet
+  static double demodulationFloor(uint8_t sf) { return -7.5 - 2.5 * (sf - 7); }
+
+  // Each node gets a private copy of its sketch so dlopen() hands out fresh globals
+  void addNode(uint8_t id, const std::string &sketch, double x, double y)
+  {
+    SimNode node = SimNode();
+    node.id = id;
+    node.x = x;
+    node.y = y;
+
+    std::string copy = std::string(tempDir) + "/node_" + std::to_string(id) + ".so";
+    {
+      std::ifstream in(sketch.c_str(), std::ios::binary);
+      std::ofstream out(copy.c_str(), std::ios::binary);
+      out << in.rdbuf();
+    }
+    current = nodes.size(); // static initialisers may ask for NODE_ID
+    nodes.push_back(node);
+    void *handle = dlopen(copy.c_str(), RTLD_NOW | RTLD_LOCAL);
+    unlink(copy.c_str());
+    current = -1;
+    if (!handle)
+    {
+      fprintf(stderr, "%s: %s\n", sketch.c_str(), dlerror());
+      return;
+    }
+
+    SimNode &loaded = nodes.back();
+    loaded.setup = (void (*)())dlsym(handle, "_Z5setupv");
+    loaded.loop = (void (*)())dlsym(handle, "_Z4loopv");
+    loaded.radio = (RH_RF95 *)dlsym(handle, "rf95");
+    loaded.binCapacity = (uint8_t *)dlsym(handle, "binCapacity");
+    loaded.retransmissions = (unsigned long *)dlsym(handle, "retransmissions");
+    loaded.airtimeUsed = (unsigned long *)dlsym(handle, "airtimeUsed");
+    loaded.duplicatesAcked = (unsigned long *)dlsym(handle, "duplicatesAcked");
+    loaded.duplicatesDropped = (unsigned long *)dlsym(handle, "duplicatesDropped");
+    loaded.duplicatesReceived = (unsigned long *)dlsym(handle, "duplicatesReceived");
+    loaded.dataRateCommands = (unsigned long *)dlsym(handle, "dataRateCommands");
+    loaded.dataTxPower = (int8_t *)dlsym(handle, "dataTxPower");
+    loaded.hasRoute = (bool (*)())dlsym(handle, "_Z9has_routev");
+    loaded.nextHop = (uint8_t (*)())dlsym(handle, "_Z8next_hopv");
+    if (!loaded.setup || !loaded.loop || !loaded.radio)
+    {
+      fprintf(stderr, "%s: not a sketch built for the host\n", sketch.c_str());
+      return;
+    }
+    loaded.handle = handle;
+  }
+
+  void wake(int index, unsigned long generation)
+  {
+    SimNode &node = nodes[index];
+    if (!node.started)
+    {
+      node.started = true;
+      node.stack.resize(STACK_SIZE);
+      getcontext(&node.context);
+      node.context.uc_stack.ss_sp = &node.stack[0];
+      node.context.uc_stack.ss_size = node.stack.size();
+      node.context.uc_link = &scheduler;
+      makecontext(&node.context, (void (*)())nodeMain, 1, index);
+    }
+    else if (!node.sleeping || generation != node.generation)
+    {
+      return;
+    }
+
+    node.sleeping = false;
+    node.waitRadio = 0;
+    current = index;
+    swapcontext(&scheduler, &node.context);
+    current = -1;
+  }
+
+  void receptionEnded(int index, unsigned long id)
+  {
+    SimNode &node = nodes[index];
+    for (size_t i = 0; i < node.receptions.size(); i++)
+    {
+      if (node.receptions[i].id != id)
+      {
+        continue;
+      }
+      Reception reception = node.receptions[i];
+      node.receptions.erase(node.receptions.begin() + i);
+
+      receptions++;
+      if (reception.halfDuplex)
+      {
+        halfDuplexLosses++;
+      }
+      else if (reception.corrupted)
+      {
+        collisions++;
+      }
+      else if (uniform() < config.loss)
+      {
+        randomLosses++;
+      }
+      else
+      {
+        double snr = reception.rssi - noiseFloor(*node.radio);
+        node.radio->deliver(&reception.data[0], reception.data.size(), (int16_t)lround(reception.rssi), (int8_t)lround(snr));
+        if (node.sleeping && node.waitRadio == node.radio && node.radio->frameWaiting())
+        {
+          schedule(clock, EVENT_WAKE, index, node.generation);
+        }
+      }
+      return;
+    }
+  }
+
+  // Start the bin over at level percent, only the first fill starts above 0
+  void empty(int index, double level = 0)
+  {
+    SimNode &node = nodes[index];
+    double spread = config.fillSpread * (2 * uniform() - 1);
+    node.alertRaised = false;
+    node.forecastKnown = false;
+    node.fillTime = (uint64_t)(config.fillInterval * 1000.0 * std::max(0.1, 1 + spread));
+    node.fullTime = clock + (uint64_t)(node.fillTime * (100 - level) / 100);
+    *node.binCapacity = (uint8_t)level;
+  }
+
+  // The level the sketch reads on its next loop(), a reading crossing the threshold raises the alert
+  void fill(int index)
+  {
+    SimNode &node = nodes[index];
+    double level = 100.0 - 100.0 * (int64_t)(node.fullTime - clock) / node.fillTime + config.fillNoise * gaussian();
+    *node.binCapacity = (uint8_t)std::min(100.0, std::max(0.0, level + 0.5));
+    schedule(clock + FILL_STEP, EVENT_FILL, index, 0);
+    if (node.alertRaised || *node.binCapacity < ALERT_THRESHOLD)
+    {
+      return;
+    }
+
+    node.alertRaised = true;
+    node.alertCounted = clock < config.duration * 1000000ULL;
+    node.alertTime = clock;
+    if (node.alertCounted)
+    {
+      alerts++;
+    }
+    if (node.forecastKnown)
+    {
+      if (node.alertCounted)
+      {
+        uint64_t full = node.fullTime;
+        leadTimes.push_back((clock - node.forecastTime) / 1000);
+        forecastErrors.push_back((full > node.forecastFull ? full - node.forecastFull : node.forecastFull - full) / 1000);
+      }
+      alertDelivered(index);
+    }
+  }
+
+  void reportReceived(uint8_t alertId, uint8_t /*binCapacity*/, uint16_t minutesToFull)
+  {
+    reports++;
+    size_t minute = clock / 60000000ULL;
+    reportsPerMinute.resize(std::max(reportsPerMinute.size(), minute + 1));
+    reportsPerMinute[minute]++;
+    if (alertId >= nodes.size() || !nodes[alertId].binCapacity || alertId < FIRST_LEAF_ID)
+    {
+      return;
+    }
+
+    SimNode &node = nodes[alertId]; // node ids are indexes
+    if (minutesToFull != FULL_UNKNOWN && !node.alertRaised)
+    {
+      if (!node.forecastKnown)
+      {
+        node.forecastKnown = true;
+        node.forecastTime = clock;
+      }
+      node.forecastFull = clock + minutesToFull * 60000000ULL;
+      forecasts++;
+      return;
+    }
+    if (!node.alertRaised)
+    {
+      duplicates++;
+      return;
+    }
+    alertDelivered(alertId);
+  }
+
+  // The bin is emptied as soon as the server knows about it
+  void alertDelivered(int index)
+  {
+    SimNode &node = nodes[index];
+    if (node.alertCounted)
+    {
+      latencies.push_back((clock - node.alertTime) / 1000);
+    }
+    empty(index);
+  }
+};
+
+static SimEnvironment *simulation = 0;
+
+void SimEnvironment::nodeMain(int index)
+{
+  SimNode &node = simulation->nodes[index];
+  node.setup();
+  for (;;)
+  {
+    node.loop();
+  }
+}
+
+uint8_t host::nodeId()
+{
+  return simulation ? simulation->currentNodeId() : 0;
+}
+
+static unsigned long percentile(std::vector<unsigned long> &values, double p)
+{
+  if (values.empty())
+  {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  size_t index = (size_t)(p * (values.size() - 1) + 0.5);
+  return values[index];
+}
+
+int main(int argc, char **argv)
+{
+  SimConfig config;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--leaves") && i + 1 < argc)
+      config.leaves = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--radius") && i + 1 < argc)
+      config.radius = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--server-distance") && i + 1 < argc)
+      config.serverDistance = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--path-loss-exponent") && i + 1 < argc)
+      config.pathLossExponent = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--shadowing") && i + 1 < argc)
+      config.shadowing = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--loss") && i + 1 < argc)
+      config.loss = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--fill-interval") && i + 1 < argc)
+      config.fillInterval = strtoul(argv[++i], 0, 10);
+    else if (!strcmp(argv[i], "--fill-spread") && i + 1 < argc)
+      config.fillSpread = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--fill-noise") && i + 1 < argc)
+      config.fillNoise = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--emptied-together"))
+      config.emptiedTogether = true;
+    else if (!strcmp(argv[i], "--cad-payload"))
+      config.cadPayload = true;
+    else if (!strcmp(argv[i], "--boot-spread") && i + 1 < argc)
+      config.bootSpread = strtoul(argv[++i], 0, 10);
+    else if (!strcmp(argv[i], "--duration") && i + 1 < argc)
+      config.duration = strtoul(argv[++i], 0, 10);
+    else if (!strcmp(argv[i], "--drain") && i + 1 < argc)
+      config.drain = strtoul(argv[++i], 0, 10);
+    else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+      config.seed = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--server") && i + 1 < argc)
+      config.serverSketch = argv[++i];
+    else if (!strcmp(argv[i], "--relay") && i + 1 < argc)
+      config.relaySketch = argv[++i];
+    else if (!strcmp(argv[i], "--leaf") && i + 1 < argc)
+      config.leafSketch = argv[++i];
+    else if (!strcmp(argv[i], "--verbose"))
+      host::verbose = true;
+    else
+    {
+      fprintf(stderr, "usage: %s [--leaves n] [--radius m] [--server-distance m] [--path-loss-exponent n] [--shadowing db]\n"
+                      "       [--loss p] [--fill-interval ms] [--fill-spread f] [--fill-noise pct] [--emptied-together]\n"
+                      "       [--cad-payload] [--boot-spread ms] [--duration s] [--drain s] [--seed n]\n"
+                      "       [--server so] [--relay so] [--leaf so] [--verbose]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (config.leaves < 0 || config.leaves > MAX_LEAVES)
+  {
+    fprintf(stderr, "--leaves must be between 0 and %d\n", MAX_LEAVES);
+    return 1;
+  }
+
+  srand(config.seed);
+  SimEnvironment environment(config);
+  simulation = &environment;
+  host::environment = &environment;
+  if (!environment.load())
+  {
+    return 1;
+  }
+
+  std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+  environment.run();
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+  std::vector<SimNode> &nodes = environment.nodes;
+  std::vector<bool> reachable = environment.reachable();
+  int leavesReachable = 0, leavesRouted = 0, totalHops = 0;
+  unsigned long retransmissions = 0, airtime = 0, maxAirtime = 0, cadChecks = 0, cadBusy = 0;
+  unsigned long duplicatesAcked = 0, duplicatesDropped = 0, duplicatesReceived = 0;
+  int lowered = 0, raised = 0;
+  double radioOn = 0, charge = 0; // ms and mA ms over every node but the server
+  for (size_t i = 0; i < nodes.size(); i++)
+  {
+    if (nodes[i].id != 0)
+    {
+      RH_RF95 &radio = *nodes[i].radio;
+      // CAD draws about the RX current
+      unsigned long rx = radio.timeInMode(RH_RF95::RHModeRx) + radio.timeInMode(RH_RF95::RHModeCad);
+      radioOn += rx + radio.timeInMode(RH_RF95::RHModeTx);
+      charge += nodes[i].txCharge + RX_CURRENT * rx +
+                IDLE_CURRENT * radio.timeInMode(RH_RF95::RHModeIdle) + SLEEP_CURRENT * radio.timeInMode(RH_RF95::RHModeSleep);
+    }
+    if (nodes[i].id >= FIRST_LEAF_ID)
+    {
+      int hops = environment.hops(i);
+      leavesReachable += reachable[i];
+      leavesRouted += hops > 0;
+      totalHops += hops > 0 ? hops : 0;
+    }
+    if (nodes[i].retransmissions)
+    {
+      retransmissions += *nodes[i].retransmissions;
+    }
+    if (nodes[i].duplicatesAcked)
+    {
+      duplicatesAcked += *nodes[i].duplicatesAcked;
+      duplicatesDropped += *nodes[i].duplicatesDropped;
+    }
+    if (nodes[i].duplicatesReceived)
+    {
+      duplicatesReceived += *nodes[i].duplicatesReceived;
+    }
+    if (nodes[i].dataTxPower)
+    {
+      lowered += *nodes[i].dataTxPower < TX_POWER_DEFAULT;
+      raised += *nodes[i].dataTxPower > TX_POWER_DEFAULT;
+    }
+    airtime += nodes[i].radio->txAirtime;
+    cadChecks += nodes[i].radio->cadChecks;
+    cadBusy += nodes[i].radio->cadBusy;
+    maxAirtime = std::max(maxAirtime, nodes[i].radio->txAirtime);
+  }
+
+  double seconds = config.duration + config.drain;
+  std::vector<unsigned long> &latencies = environment.latencies;
+  printf("nodes                  server, relay, %d leaves (%d can reach the server, %d have a route)\n", config.leaves,
+         leavesReachable, leavesRouted);
+  printf("hops to server         %.2f on average\n", leavesRouted ? (double)totalHops / leavesRouted : 0.0);
+  printf("alerts                 %lu (mean fill time %lu ms)\n", environment.alerts, config.fillInterval);
+  printf("delivered              %lu (%.1f%%)\n", (unsigned long)latencies.size(),
+         environment.alerts ? 100.0 * latencies.size() / environment.alerts : 0.0);
+  printf("duplicates at server   %lu (%lu recognised by the server)\n", environment.duplicates, duplicatesReceived);
+  printf("duplicates suppressed  %lu ACKed by relays, %lu dropped while in flight\n", duplicatesAcked, duplicatesDropped);
+  printf("alert latency p50      %lu ms\n", percentile(latencies, 0.50));
+  printf("alert latency p95      %lu ms\n", percentile(latencies, 0.95));
+  printf("alert latency p99      %lu ms\n", percentile(latencies, 0.99));
+  printf("alert latency max      %lu ms\n", percentile(latencies, 1.0));
+  std::vector<unsigned long> &leadTimes = environment.leadTimes;
+  std::vector<unsigned long> &forecastErrors = environment.forecastErrors;
+  printf("known in advance       %lu alerts (%.1f%%), lead time p50 %lu ms\n", (unsigned long)leadTimes.size(),
+         environment.alerts ? 100.0 * leadTimes.size() / environment.alerts : 0.0, percentile(leadTimes, 0.50));
+  printf("forecasts              %lu, error at the alert p50 %lu ms, p95 %lu ms\n", environment.forecasts,
+         percentile(forecastErrors, 0.50), percentile(forecastErrors, 0.95));
+  std::vector<unsigned long> &perMinute = environment.reportsPerMinute;
+  printf("reports at server      %lu, at most %lu in one minute\n", environment.reports,
+         perMinute.empty() ? 0 : *std::max_element(perMinute.begin(), perMinute.end()));
+  printf("retransmissions        %lu (%.2f per alert)\n", retransmissions,
+         environment.alerts ? (double)retransmissions / environment.alerts : 0.0);
+  printf("frames sent            %lu (%lu forwarding node requests)\n", environment.framesSent, environment.joinRequests);
+  printf("ACK frames             %lu (%.2f per delivered alert)\n", environment.ackFrames,
+         latencies.empty() ? 0.0 : (double)environment.ackFrames / latencies.size());
+  printf("telemetry at server    %lu reports\n", environment.statsReports);
+  printf("serial output          %lu chars, sketches blocked %.2f%% of the time\n", environment.serialChars,
+         100.0 * environment.serialBlocked / (nodes.size() * seconds * 1e6));
+  printf("receptions             %lu (%lu collided, %lu half-duplex, %lu random loss)\n", environment.receptions,
+         environment.collisions, environment.halfDuplexLosses, environment.randomLosses);
+  printf("listen before talk     %lu CADs, %lu found the channel busy\n", cadChecks, cadBusy);
+  printf("data rate commands     %lu (%d nodes send data below, %d above the default power at the end)\n",
+         nodes[0].dataRateCommands ? *nodes[0].dataRateCommands : 0, lowered, raised);
+  printf("relay duty cycle       %.2f%%\n", 100.0 * nodes[1].radio->txAirtime / (seconds * 1000));
+  printf("server duty cycle      %.2f%%\n", 100.0 * nodes[0].radio->txAirtime / (seconds * 1000));
+  printf("busiest node           %.2f%% duty cycle, %.2f%% channel busy overall\n", 100.0 * maxAirtime / (seconds * 1000),
+         100.0 * airtime / (seconds * 1000));
+  double energy = charge * SUPPLY_VOLTAGE / 1000; // mJ
+  size_t radios = nodes.size() - 1;
+  printf("radio on (RX or TX)    %.2f%% of the time on the nodes\n", 100.0 * radioOn / (radios * seconds * 1000));
+  printf("node radio energy      %.1f mJ per node-hour, %.2f mJ per delivered alert\n",
+         energy / radios / (seconds / 3600), latencies.empty() ? 0.0 : energy / latencies.size());
+  printf("simulated              %.0f s in %.2f s wall clock (%.0fx real time)\n", seconds, wall, seconds / wall);
+  return 0;
+}
@@ -0,0 +1,441 @@
+// Relay throughput and ACK latency bench for the lora_node relay (NODE_PRESET 1) on the host.
+//
+// The real lora_node sketch runs as the relay. Its server (node 0) and the
+// leaf nodes feeding it are scripted here: leaves send capacity packets to
+// node 1 and retransmit like the firmware does, the server ACKs every capacity
+// packet it hears. Everything runs on a virtual clock.
+// --airtime prints what time_on_air() from the sketch gives per report for
+// single capacity packets and capacity batches under the configured modem settings.
+//
+//   g++ -std=c++11 -O2 -I. relay_bench.cpp host_runtime.cpp -o relay_bench
+//   g++ -std=c++11 -O2 -I. -DMAX_PENDING_ACKS=1 relay_bench.cpp host_runtime.cpp -o relay_bench_stop_and_wait
+//   g++ -std=c++11 -O2 -I. -DDUTY_CYCLE_PERCENT=100 relay_bench.cpp host_runtime.cpp -o relay_bench_no_duty_cycle
+//   ./relay_bench --leaves 6 --interval 20000 --duration 3600
+#include "Arduino.h"
+#include "RH_RF95.h"
+
+// The scripted server sends no beacons, the relay runs unslotted
+#define SLOTTED_SCHEDULE 0
+#include "../lora_node/lora_node.ino"
+
+#include <math.h>
+
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <vector>
+
+#define RELAY_ID NODE_ID
+#define FIRST_LEAF_ID 2
+#define LEAF_ACK_TIMEOUT 5000
+#define LEAF_MAX_RETRANSMITS 3
+#define SERVER_TURNAROUND 20 // ms between hearing a frame and starting the ACK
+
+struct BenchConfig
+{
+  int leaves = 4;
+  unsigned long interval = 30000; // mean time between reports of one leaf
+  unsigned long duration = 3600;  // seconds of virtual time
+  double ackLoss = 0.0;           // chance the server misses a capacity packet
+  unsigned seed = 1;
+};
+
+// A transmission on the shared channel, kept around to detect overlaps
+struct Transmission
+{
+  unsigned long start;
+  unsigned long end;
+  int sender;
+};
+
+struct Leaf
+{
+  uint8_t id;
+  bool outstanding;
+  unsigned long reportTime; // when the current report was first sent
+  uint8_t retransmits;
+  uint8_t seq;              // alertSeq of the current report
+  unsigned long generation; // bumps on every new report, stale timers check it
+};
+
+class BenchEnvironment : public host::Environment
+{
+public:
+  BenchEnvironment(const BenchConfig &config) : config(config), clock(0), sequence(0), serverBusyUntil(0) {}
+
+  unsigned long now() { return clock; }
+
+  void schedule(unsigned long time, std::function<void()> fn)
+  {
+    events.push(Event{time, sequence++, fn});
+  }
+
+  void runUntil(unsigned long deadline, RH_RF95 *radio)
+  {
+    while (!events.empty() && events.top().time <= deadline)
+    {
+      Event event = events.top();
+      events.pop();
+      clock = std::max(clock, event.time);
+      event.fn();
+      if (radio && radio->frameWaiting())
+      {
+        return;
+      }
+    }
+    clock = std::max(clock, deadline);
+  }
+
+  // The relay transmitted: the server and the leaves hear it once it is on air
+  void transmit(RH_RF95 &radio, const uint8_t *data, uint8_t len, unsigned long airtime)
+  {
+    (void)radio;
+    Frame frame;
+    memcpy(&frame, data, std::min<size_t>(len, sizeof(frame)));
+    unsigned long start = clock;
+    channel.push_back(Transmission{start, start + airtime, RELAY_ID});
+    schedule(start + airtime, [this, frame, start, airtime]() { relayFrameHeard(frame, start, airtime); });
+  }
+
+  // A scripted node transmits, the relay hears it unless another frame overlapped it
+  void peerTransmit(int sender, const Packet &packet)
+  {
+    uint8_t len = packet_length(packet);
+    unsigned long airtime = rf95.timeOnAir(len);
+    unsigned long start = clock;
+    channel.push_back(Transmission{start, start + airtime, sender});
+    schedule(start + airtime, [this, packet, len, start, airtime, sender]() {
+      if (collided(start, sender, airtime))
+      {
+        collisions++;
+        return;
+      }
+      rf95.deliver((const uint8_t *)&packet, len, -60, 9);
+    });
+  }
+
+  void startLeaves()
+  {
+    for (int i = 0; i < config.leaves; i++)
+    {
+      Leaf leaf = {(uint8_t)(FIRST_LEAF_ID + i), false, 0, 0, 0, 0};
+      leaves.push_back(leaf);
+    }
+    for (size_t i = 0; i < leaves.size(); i++)
+    {
+      scheduleReport(i);
+    }
+  }
+
+  std::vector<unsigned long> latencies;
+  unsigned long reports = 0;
+  unsigned long lostReports = 0;
+  unsigned long leafRetransmits = 0;
+  unsigned long serverCapacityFrames = 0;
+  unsigned long batchedRecords = 0;
+  unsigned long serverAirtime = 0;
+  unsigned long uplinkAirtime = 0; // relay frames addressed to the server
+  unsigned long collisions = 0;
+
+private:
+  struct Event
+  {
+    unsigned long time;
+    unsigned long sequence;
+    std::function<void()> fn;
+    bool operator<(const Event &other) const
+    {
+      return time != other.time ? time > other.time : sequence > other.sequence;
+    }
+  };
+
+  BenchConfig config;
+  unsigned long clock;
+  unsigned long sequence;
+  unsigned long serverBusyUntil;
+  std::priority_queue<Event> events;
+  std::vector<Transmission> channel;
+  std::vector<Leaf> leaves;
+
+  bool collided(unsigned long start, int sender, unsigned long airtime)
+  {
+    unsigned long end = start + airtime;
+    bool overlap = false;
+    for (size_t i = 0; i < channel.size(); i++)
+    {
+      const Transmission &other = channel[i];
+      if (other.sender != sender && other.sender != RELAY_ID && other.start < end && start < other.end)
+      {
+        overlap = true;
+      }
+    }
+    // Forget transmissions that can no longer overlap anything
+    channel.erase(std::remove_if(channel.begin(), channel.end(),
+                                 [this](const Transmission &t) { return t.end + 10000 < clock; }),
+                  channel.end());
+    return overlap;
+  }
+
+  unsigned long exponential(unsigned long mean)
+  {
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return (unsigned long)(-log(u) * mean);
+  }
+
+  void scheduleReport(size_t index)
+  {
+    schedule(clock + exponential(config.interval), [this, index]() { sendReport(index); });
+  }
+
+  void sendReport(size_t index)
+  {
+    Leaf &leaf = leaves[index];
+    leaf.outstanding = true;
+    leaf.reportTime = clock;
+    leaf.retransmits = 0;
+    leaf.seq++;
+    leaf.generation++;
+    reports++;
+    transmitReport(index);
+  }
+
+  void transmitReport(size_t index)
+  {
+    Leaf &leaf = leaves[index];
+    Packet packet;
+    packet.authKey = AUTH_KEY;
+    packet.msgType = MSG_TYPE_CAPACITY;
+    packet.data.capacityPacket.alertNode.nodeId = leaf.id;
+    packet.data.capacityPacket.senderNode.nodeId = leaf.id;
+    packet.data.capacityPacket.receiverNode.nodeId = RELAY_ID;
+    packet.data.capacityPacket.binCapacity = ALERT_THRESHOLD + random(20);
+    packet.data.capacityPacket.pathCost = ROUTE_COST_INFINITE - 1; // behind the relay, whatever its cost
+    packet.data.capacityPacket.alertSeq = leaf.seq;
+    packet.data.capacityPacket.txPower = TX_POWER_DEFAULT;
+    packet.data.capacityPacket.minutesToFull = FULL_UNKNOWN;
+    peerTransmit(leaf.id, packet);
+
+    unsigned long generation = leaf.generation;
+    uint8_t attempt = leaf.retransmits;
+    schedule(clock + LEAF_ACK_TIMEOUT, [this, index, generation, attempt]() {
+      Leaf &leaf = leaves[index];
+      if (!leaf.outstanding || leaf.generation != generation || leaf.retransmits != attempt)
+      {
+        return;
+      }
+      if (leaf.retransmits < LEAF_MAX_RETRANSMITS)
+      {
+        leaf.retransmits++;
+        leafRetransmits++;
+        transmitReport(index);
+      }
+      else
+      {
+        leaf.outstanding = false;
+        lostReports++;
+        scheduleReport(index);
+      }
+    });
+  }
+
+  void relayFrameHeard(const Frame &frame, unsigned long start, unsigned long airtime)
+  {
+    const Packet &packet = frame.packet;
+    if (packet.authKey != AUTH_KEY)
+    {
+      return;
+    }
+
+    if (packet.msgType == MSG_TYPE_CAPACITY_BATCH && frame.batchPacket.data.receiverNode.nodeId == SERVER_ID)
+    {
+      serverCapacityFrames++;
+      uplinkAirtime += airtime;
+      if (collided(start, RELAY_ID, airtime) || (double)rand() / RAND_MAX < config.ackLoss)
+      {
+        return;
+      }
+      batchedRecords += frame.batchPacket.data.recordCount;
+      Packet ack;
+      ack.authKey = AUTH_KEY;
+      ack.msgType = MSG_TYPE_ACK_BATCH;
+      ack.data.batchAckPacket.receiverNode = frame.batchPacket.data.senderNode;
+      ack.data.batchAckPacket.batchId = frame.batchPacket.data.batchId;
+      ack.data.batchAckPacket.senderNode.nodeId = SERVER_ID;
+      serverTransmit(ack);
+    }
+    else if (packet.msgType == MSG_TYPE_CAPACITY && packet.data.capacityPacket.receiverNode.nodeId == SERVER_ID)
+    {
+      serverCapacityFrames++;
+      uplinkAirtime += airtime;
+      if (collided(start, RELAY_ID, airtime) || (double)rand() / RAND_MAX < config.ackLoss)
+      {
+        return;
+      }
+      Packet ack;
+      ack.authKey = AUTH_KEY;
+      ack.msgType = MSG_TYPE_ACK_SUCCEED;
+      ack.data.ackPacket.alertNode = packet.data.capacityPacket.alertNode;
+      ack.data.ackPacket.receiverNode = packet.data.capacityPacket.senderNode;
+      ack.data.ackPacket.senderNode.nodeId = SERVER_ID;
+      ack.data.ackPacket.alertSeq = packet.data.capacityPacket.alertSeq;
+      serverTransmit(ack);
+    }
+    else if (packet.msgType == MSG_TYPE_REQ_FORWARD_NODE)
+    {
+      Packet response;
+      response.authKey = AUTH_KEY;
+      response.msgType = MSG_TYPE_RES_FORWARD_NODE;
+      response.data.nodePacket.node.nodeId = SERVER_ID;
+      response.data.nodePacket.pathCost = 0;
+      response.data.nodePacket.parentNode.nodeId = SERVER_ID;
+      response.data.nodePacket.routeSeq = 0;
+      serverTransmit(response);
+    }
+    else if (packet.msgType == MSG_TYPE_ACK_SUCCEED)
+    {
+      for (size_t i = 0; i < leaves.size(); i++)
+      {
+        Leaf &leaf = leaves[i];
+        if (leaf.outstanding && leaf.id == packet.data.ackPacket.receiverNode.nodeId &&
+            leaf.id == packet.data.ackPacket.alertNode.nodeId && leaf.seq == packet.data.ackPacket.alertSeq)
+        {
+          leaf.outstanding = false;
+          latencies.push_back(clock - leaf.reportTime);
+          scheduleReport(i);
+        }
+      }
+    }
+    else if (packet.msgType == MSG_TYPE_ACK_BITMAP)
+    {
+      // The relay passes the ACKs of one capacity batch down in a single frame
+      const AckBitmapPacket &ack = frame.ackBitmapFrame.data;
+      for (size_t i = 0; i < leaves.size(); i++)
+      {
+        Leaf &leaf = leaves[i];
+        for (int r = 0; r < ack.recordCount && r < MAX_ACK_RECORDS; r++)
+        {
+          uint8_t age = ack.records[r].highestSeq - leaf.seq;
+          if (leaf.outstanding && ack.records[r].alertNode.nodeId == leaf.id && age < SEQ_WINDOW_SIZE &&
+              (ack.records[r].seen & (1U << age)))
+          {
+            leaf.outstanding = false;
+            latencies.push_back(clock - leaf.reportTime);
+            scheduleReport(i);
+          }
+        }
+      }
+    }
+  }
+
+  // The server has a single radio, so its responses queue up behind each other
+  void serverTransmit(const Packet &packet)
+  {
+    unsigned long start = std::max(clock + SERVER_TURNAROUND, serverBusyUntil);
+    serverBusyUntil = start + rf95.timeOnAir(packet_length(packet));
+    serverAirtime += rf95.timeOnAir(packet_length(packet));
+    schedule(start, [this, packet]() { peerTransmit(SERVER_ID, packet); });
+  }
+};
+
+static unsigned long percentile(std::vector<unsigned long> &values, double p)
+{
+  if (values.empty())
+  {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  size_t index = (size_t)(p * (values.size() - 1) + 0.5);
+  return values[index];
+}
+
+// Airtime per delivered report on the relay to server hop, ACK included
+static void print_airtime_table()
+{
+  Packet packet;
+  packet.msgType = MSG_TYPE_ACK_SUCCEED;
+  unsigned long ack = time_on_air(packet_length(packet));
+  packet.msgType = MSG_TYPE_CAPACITY;
+  packet.data.capacityPacket.txPower = TX_POWER_DEFAULT;
+  uint8_t single = packet_length(packet);
+  printf("SF%d BW%ld CR4/%d preamble %d\n", LORA_SPREADING_FACTOR, (long)LORA_BANDWIDTH, LORA_CODING_RATE, LORA_PREAMBLE_LENGTH);
+  printf("records  frame bytes  frame ms  ack ms  ms per report\n");
+  printf("%7d  %11d  %8lu  %6lu  %13.1f  (capacity packet)\n", 1, single, time_on_air(single), ack,
+         (double)(time_on_air(single) + ack));
+  for (int records = 2; records <= MAX_BATCH_RECORDS; records++)
+  {
+    BatchPacket batch;
+    batch.data.recordCount = records;
+    uint8_t len = batch_packet_length(batch);
+    printf("%7d  %11d  %8lu  %6lu  %13.1f\n", records, len, time_on_air(len), ack,
+           (double)(time_on_air(len) + ack) / records);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  BenchConfig config;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--leaves") && i + 1 < argc)
+      config.leaves = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--interval") && i + 1 < argc)
+      config.interval = strtoul(argv[++i], 0, 10);
+    else if (!strcmp(argv[i], "--duration") && i + 1 < argc)
+      config.duration = strtoul(argv[++i], 0, 10);
+    else if (!strcmp(argv[i], "--ack-loss") && i + 1 < argc)
+      config.ackLoss = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+      config.seed = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--verbose"))
+      host::verbose = true;
+    else if (!strcmp(argv[i], "--airtime"))
+    {
+      print_airtime_table();
+      return 0;
+    }
+    else
+    {
+      fprintf(stderr, "usage: %s [--leaves n] [--interval ms] [--duration s] [--ack-loss p] [--seed n] [--verbose] [--airtime]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  srand(config.seed);
+  BenchEnvironment environment(config);
+  host::environment = &environment;
+
+  setup();
+  environment.startLeaves();
+
+  unsigned long end = millis() + config.duration * 1000UL;
+  while (millis() < end)
+  {
+    loop();
+  }
+
+  double minutes = config.duration / 60.0;
+  printf("max pending acks       %d\n", MAX_PENDING_ACKS);
+  printf("leaves                 %d (mean report interval %lu ms)\n", config.leaves, config.interval);
+  printf("reports                %lu\n", environment.reports);
+  printf("delivered              %lu (%.1f%%)\n", (unsigned long)environment.latencies.size(),
+         environment.reports ? 100.0 * environment.latencies.size() / environment.reports : 0.0);
+  printf("lost                   %lu\n", environment.lostReports);
+  printf("relay throughput       %.2f reports/min\n", environment.latencies.size() / minutes);
+  printf("ack latency p50        %lu ms\n", percentile(environment.latencies, 0.50));
+  printf("ack latency p95        %lu ms\n", percentile(environment.latencies, 0.95));
+  printf("ack latency p99        %lu ms\n", percentile(environment.latencies, 0.99));
+  printf("leaf retransmits       %lu\n", environment.leafRetransmits);
+  printf("relay frames sent      %lu (%lu to server, %lu records in batches)\n", rf95.txFrames,
+         environment.serverCapacityFrames, environment.batchedRecords);
+  double delivered = environment.latencies.empty() ? 1.0 : (double)environment.latencies.size();
+  printf("airtime per report     %.1f ms relay to server, %.1f ms server acks, %.1f ms relay total\n",
+         environment.uplinkAirtime / delivered, environment.serverAirtime / delivered, rf95.txAirtime / delivered);
+  printf("relay airtime budget   %lu ms used (%.2f%% duty cycle, limit %d%%), %lu ms left\n", airtimeUsed,
+         100.0 * airtimeUsed / (config.duration * 1000.0), DUTY_CYCLE_PERCENT, airtime_remaining());
+  printf("relay capacity queue   %lu coalesced, %lu dropped or evicted when full\n", capacityCoalesced, capacityEvicted);
+  printf("relay duplicates       %lu acked at relay, %lu dropped\n", duplicatesAcked, duplicatesDropped);
+  printf("relay tx scheduler     %lu deferred, %lu dropped\n", txDeferred, txDropped);
+  printf("relay frames missed    %lu not in rx, %lu overwritten\n", rf95.rxMissed, rf95.rxOverwritten);
+  printf("collisions at relay    %lu\n", environment.collisions);
+  return 0;
+}
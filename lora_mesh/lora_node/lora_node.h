@@ -0,0 +1,722 @@
+#include <SPI.h>
+#include <RH_RF95.h>
+#include <Wire.h>
+#ifdef __AVR__
+#include <avr/sleep.h>
+#endif
+
+#include "node_config.h"
+
+/* ========================================================== */
+/* ================= RADIOHEAD DEFINITIONS ================== */
+/* ========================================================== */
+#define RFM95_CS 10
+#define RFM95_RST 9
+#define RFM95_INT 2
+
+// Frequency must match other nodes in mesh
+#define RF95_FREQ 920.0
+
+// Modem settings must match other nodes in mesh, also used to work out time on air
+#define LORA_SPREADING_FACTOR 7
+#define LORA_BANDWIDTH 125000
+#define LORA_CODING_RATE 5 // denominator of the 4/x coding rate
+#define LORA_PREAMBLE_LENGTH 8
+
+// Control frames always go out at TX_POWER_DEFAULT, data frames to the server at the power the server picks
+#define TX_POWER_DEFAULT 13 // dBm
+#define TX_POWER_MIN 2      // lowest the PA_BOOST output goes
+#define TX_POWER_MAX 20     // PA_BOOST limit, allowed at 920 MHz in AU915
+
+// Regional duty cycle limit, enforced by the TX scheduler under sendPacket()
+#ifndef DUTY_CYCLE_PERCENT
+#define DUTY_CYCLE_PERCENT 1
+#endif
+#define AIRTIME_BUCKET_SIZE 3600UL // ms of airtime that can be spent in one burst
+#define TX_QUEUE_SIZE 4            // frames waiting for airtime
+#define TX_PRIORITY_BEACON 0 // first in the slot, it carries the timing
+#define TX_PRIORITY_ACK 1
+#define TX_PRIORITY_ROUTE 2 // a lost route advertisement can leave alerts going round a loop
+#define TX_PRIORITY_ALERT 3
+#define TX_PRIORITY_JOIN 4
+#define TX_PRIORITY_STATS 5 // telemetry only uses airtime nothing else is waiting for
+
+// Listen before talk: a frame only goes on air after channel activity detection found the channel
+// clear. A busy channel backs the whole TX queue off for a random time, the window doubling with
+// every busy CAD in a row.
+#ifndef LISTEN_BEFORE_TALK
+#define LISTEN_BEFORE_TALK 1
+#endif
+#define CAD_BACKOFF_MAX_EXP 4 // backoff window stops growing at 16 times the frame's airtime
+
+// Beacon-synchronised schedule, must match the server. The server's beacon starts every superframe
+// of slotCount slots: slot 0 is the server's, the next contentionSlots are shared, and node n owns
+// slot contentionSlots + n. A node transmits in its own slot, listens in its next hop's, its
+// children's and one of the shared slots, and sleeps the radio and the MCU in between.
+#ifndef SLOTTED_SCHEDULE
+#define SLOTTED_SCHEDULE 1
+#endif
+#define SLOT_GUARD 10           // ms at either end of a slot nobody transmits in, covers clock drift and late wakeups
+#define SYNC_TIMEOUT_SUPERFRAMES 4 // superframes without a beacon from the next hop before listening all the time again
+#define ACK_TIMEOUT_SUPERFRAMES 1  // per ETX_ONE of route cost, every hop waits for its slot, ACKs come down right away
+#define NO_SLOT 255
+
+// Singleton instance of the radio driver
+RH_RF95 rf95(RFM95_CS, RFM95_INT);
+
+void (*resetFunc)(void) = 0; // declare reset function at address 0
+/* ========================================================== */
+/* ================= RADIOHEAD DEFINITIONS ================== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* =================== LOGGING DEFINITIONS ================== */
+/* ========================================================== */
+// Serial output is slow at 9600 baud and every string literal costs flash, so lines
+// below LOG_LEVEL are compiled out. Build with -DLOG_LEVEL=2 for per-frame traces.
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_SYS 1     // setup, faults, bin reports and telemetry
+#define LOG_LEVEL_TRAFFIC 2 // every frame sent, received and ACKed
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_SYS
+#endif
+
+// Stands in for Serial at a disabled level, calls to it compile to nothing
+struct NullLog
+{
+  template <typename T> size_t print(T, int = 0) { return 0; }
+  template <typename T> size_t println(T, int = 0) { return 0; }
+  size_t println() { return 0; }
+};
+
+#if LOG_LEVEL >= LOG_LEVEL_SYS
+#define SYS_LOG Serial
+#else
+#define SYS_LOG NullLog()
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_TRAFFIC
+#define TRAFFIC_LOG Serial
+#else
+#define TRAFFIC_LOG NullLog()
+#endif
+/* ========================================================== */
+/* =================== LOGGING DEFINITIONS ================== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* =============== MESH DEFINITIONS & STRUCTS =============== */
+/* ========================================================== */
+#define AUTH_KEY 0x01 // Shared secret key to authenticate nodes
+#ifndef MAX_PENDING_ACKS
+#define MAX_PENDING_ACKS (NODE_ROLES & NODE_ROLE_RELAY ? 4 : 1) // capacity packets that can be in flight waiting for an ACK
+#endif
+#define ACK_TIMEOUT 5000          // time to wait for an ACK from one hop away before retransmitting
+#define MAX_RETRANSMITS 3         // retransmits before the forwarding node is considered down
+#define JOIN_RETRY_INTERVAL 2000  // mean wait after the first forwarding node request, doubles with every request
+#define JOIN_BACKOFF_MAX_EXP 4    // the wait stops growing at 2^JOIN_BACKOFF_MAX_EXP times JOIN_RETRY_INTERVAL
+#define RETRY_BACKOFF_MAX_EXP 3   // capacity retransmissions wait up to 2^RETRY_BACKOFF_MAX_EXP airtimes past the ACK timeout
+#define JOIN_TIMEOUT 15000        // time to wait for any node to accept as forwarding node
+#define RECEIVE_POLL_TIMEOUT 100  // time loop() listens for a packet before servicing timers
+#define MAX_BATCH_RECORDS 10      // capacity records sharing one frame, must match the server
+#define BATCH_WINDOW 1000         // time a queued capacity packet waits for others to share its frame
+#define CAPACITY_AGE_STEP 1000    // queueing time worth one percent of bin capacity, so low bins are not starved
+#define ALERT_THRESHOLD 80
+#ifndef FILL_FORECAST
+#define FILL_FORECAST 1           // report forecasts of the time to full, 0 only alerts at ALERT_THRESHOLD
+#endif
+#define FILL_SAMPLE_INTERVAL 60000UL // time between two bin levels fed to the fill estimator
+#define FILL_FRACTION_BITS 8      // estimated level and rate are fixed point with this many fraction bits
+#define FILL_LEVEL_GAIN 4         // a sample moves the level estimate by 1/FILL_LEVEL_GAIN of its error
+#define FILL_RATE_GAIN 32         // and the rate estimate by 1/FILL_RATE_GAIN of it
+#define FILL_EMPTY_DROP 20        // percent a sample falls below the estimate when the bin was emptied
+#define FORECAST_MIN_SAMPLES 8    // samples after emptying before the rate is trusted, up to twice as many
+                                  // at random so bins emptied together do not report together
+#define FORECAST_MIN_CHANGE 5     // minutes a forecast must move by to be reported again
+#define FORECAST_CHANGE_DIVISOR 4 // or 1/FORECAST_CHANGE_DIVISOR of the time left, whichever is more
+#define FULL_UNKNOWN 0xFFFF       // minutesToFull of a bin that is not filling
+#define SEQ_WINDOW_SIZE 16        // recent alert sequence numbers remembered per alert node, one bit each
+#define MAX_ACK_RECORDS 8         // alert nodes one aggregated ACK covers, must match the server
+#ifndef ACK_AGGREGATE_WINDOW
+// ms an ACK waits for others to share its frame, must match the server. In slots every frame is
+// answered in the slot it came in, so only ACKs that are due together share a frame.
+#define ACK_AGGREGATE_WINDOW (SLOTTED_SCHEDULE ? 0 : 100)
+#endif
+#define SERVER_ID 0
+#define ROUTE_COST_INFINITE 255   // no route to the server
+#define ETX_ONE 10                // route costs are ETX in tenths, a perfect hop costs ETX_ONE
+#define ROUTE_ADVERTISE_INTERVAL (5UL * 60 * 1000) // relays with a route advertise it this often
+#define ROUTE_ADVERTISE_JITTER 1000 // random wait before answering a route request, so answers do not collide
+#define ROUTE_UPDATE_JITTER 10000  // random wait before passing on a new route sequence number, a whole neighbourhood hears it at once
+#define ROUTE_ADVERTISE_HOLDOFF 5000 // least time between two advertisements, so route changes cannot set off a storm
+#define ROUTE_SWITCH_THRESHOLD (ETX_ONE / 2) // cost a neighbour must save over the current next hop to replace it
+#define NEIGHBOUR_TIMEOUT (3 * ROUTE_ADVERTISE_INTERVAL) // neighbours not heard for this long are forgotten
+#define CHILD_TIMEOUT NEIGHBOUR_TIMEOUT // children not heard for this long are no longer listened to
+#define SNR_FLOOR (-(15 + 5 * (LORA_SPREADING_FACTOR - 7)) / 2) // dB, lowest SNR the modem demodulates
+#define STATS_INTERVAL (15UL * 60 * 1000) // telemetry counters are sent to the server this often, best effort
+#define ACK_RTT_BUCKETS 6         // ACK round-trip histogram buckets, the last one also counts longer trips
+#define ACK_RTT_BASE 250          // ms covered by the first bucket, every further one is 4 times wider
+#define SNR_MARGIN_GOOD 8         // dB above SNR_FLOOR from which a link costs no more than its ACK history
+#define MSG_TYPE_REQ_FORWARD_NODE 10
+#define MSG_TYPE_RES_FORWARD_NODE 14
+#define MSG_TYPE_CAPACITY 3
+#define MSG_TYPE_ACK_SUCCEED 4
+#define MSG_TYPE_ACK_FAILURE 5
+#define MSG_TYPE_CAPACITY_BATCH 6
+#define MSG_TYPE_ACK_BATCH 7
+#define MSG_TYPE_DATA_RATE 8
+#define MSG_TYPE_BEACON 9
+#define MSG_TYPE_STATS 11
+#define MSG_TYPE_ACK_BITMAP 12
+
+// Code for a role this node does not have is dropped by the compiler, and so
+// are the buffers only that code uses
+constexpr bool ALERT_ROLE = (NODE_ROLES & NODE_ROLE_ALERT) != 0;
+constexpr bool RELAY_ROLE = (NODE_ROLES & NODE_ROLE_RELAY) != 0;
+
+static_assert(ALERT_ROLE || RELAY_ROLE, "NODE_ROLES needs at least one role");
+static_assert(MAX_NODES > 0 && MAX_PENDING_ACKS > 0, "MAX_NODES and MAX_PENDING_ACKS must not be 0");
+static_assert(MAX_BATCH_RECORDS <= 16, "ackedRecords has a bit per batch record");
+static_assert(SEQ_WINDOW_SIZE <= 16, "SeqWindow has a bit per sequence number");
+static_assert(MAX_CHILDREN > 0, "MAX_CHILDREN must not be 0");
+
+struct Node
+{
+  uint8_t nodeId;
+};
+
+// Route request (MSG_TYPE_REQ_FORWARD_NODE) or advertisement (MSG_TYPE_RES_FORWARD_NODE)
+struct NodePacket
+{
+  Node node;
+  uint8_t pathCost; // sender's cost to the server, ROUTE_COST_INFINITE without a route
+  Node parentNode;  // sender's next hop towards the server
+  uint8_t routeSeq; // server's sequence number the cost was learned from
+};
+
+struct CapacityPacket
+{
+  Node alertNode; // the root node that sends alert
+  Node senderNode;
+  Node receiverNode;
+  uint8_t binCapacity;
+  uint8_t pathCost; // sender's cost to the server, a receiver that is no closer is part of a loop
+  uint8_t alertSeq; // new for every alert of the alert node, retransmissions and relays keep it
+  uint16_t minutesToFull; // alert node's forecast when it sent the alert, FULL_UNKNOWN without one
+  int8_t txPower;   // dBm the sender transmitted this frame at, stamped by the TX scheduler, last so it can be left out
+};
+
+struct AckPacket
+{
+  Node alertNode; // the root node that sends alert
+  Node receiverNode;
+  Node senderNode;
+  uint8_t alertSeq; // alert being acknowledged
+};
+
+// Alert sequence numbers of one alert node the server is known to have
+struct SeqWindow
+{
+  Node alertNode;
+  uint8_t highestSeq; // newest sequence number in the window
+  uint16_t seen;      // bit n is set when highestSeq - n was ACKed
+};
+
+// ACKs for the alerts of several alert nodes in one frame (MSG_TYPE_ACK_BITMAP). Every record is the
+// sender's window for one alert node, so it also covers earlier alerts whose ACK got lost. Nodes end
+// whatever they have in flight that a record covers, no matter which node the frame came from.
+struct AckBitmapPacket
+{
+  Node senderNode;
+  uint8_t recordCount;
+  SeqWindow records[MAX_ACK_RECORDS]; // only recordCount records are transmitted
+};
+
+struct CapacityRecord
+{
+  Node alertNode; // the root node that sends alert
+  uint8_t binCapacity;
+  uint8_t alertSeq;
+  uint16_t minutesToFull; // as in CapacityPacket
+};
+
+// Capacity packets from several alert nodes sharing one frame, acknowledged by one MSG_TYPE_ACK_BATCH
+struct CapacityBatchPacket
+{
+  Node senderNode;
+  Node receiverNode;
+  uint8_t batchId;
+  uint8_t recordCount;
+  uint8_t pathCost; // as in CapacityPacket
+  int8_t txPower;   // as in CapacityPacket
+  CapacityRecord records[MAX_BATCH_RECORDS]; // only recordCount records are transmitted
+};
+
+struct BatchAckPacket
+{
+  Node receiverNode;
+  uint8_t batchId;
+  Node senderNode;
+};
+
+// Data rate the server wants a node next to it to send its capacity frames at
+struct DataRatePacket
+{
+  Node receiverNode;
+  Node senderNode;
+  uint8_t spreadingFactor;
+  uint8_t bandwidthCode; // bandwidth is 125 kHz << bandwidthCode
+  int8_t txPower;        // dBm
+};
+
+// Start of a superframe, sent by the server and repeated by every relay at the start of its own slot.
+// The route it carries is advertised like a MSG_TYPE_RES_FORWARD_NODE.
+struct BeaconPacket
+{
+  NodePacket route;
+  uint8_t beaconSeq;     // superframe number
+  uint8_t slotCount;     // slots per superframe
+  uint8_t contentionSlots; // shared slots after the server's
+  uint16_t slotLength;   // ms
+  uint16_t offset;       // ms into the superframe the frame went on air, stamped by the TX scheduler
+  uint8_t highestNodeId; // highest node id at or below the sender, the server gives out slots up to it
+};
+
+// Telemetry counters of one node since it booted, forwarded to the server like a capacity packet but never ACKed
+struct StatsPacket
+{
+  Node senderNode;
+  Node receiverNode;
+  Node originNode;          // node the counters are from
+  uint8_t pathCost;         // as in CapacityPacket
+  uint16_t uptime;          // minutes
+  uint16_t txFrames;        // counted by the radio driver, wrap around
+  uint16_t rxFrames;
+  uint16_t retransmissions; // capacity packets and batches sent again
+  uint16_t ackTimeouts;     // ACKs that never came, the last attempt of a given up packet included
+  uint16_t routeChanges;    // times the next hop changed, losing the route included
+  uint8_t txQueueHighWater; // most frames that waited in the TX queue at once
+  uint8_t capacityQueueHighWater;
+  uint16_t ackRtt[ACK_RTT_BUCKETS]; // ACKs by time from the last attempt on air, bucket n up to ACK_RTT_BASE << 2n ms
+};
+
+union PacketData
+{
+  NodePacket nodePacket;
+  BeaconPacket beaconPacket;
+  CapacityPacket capacityPacket;
+  AckPacket ackPacket;
+  BatchAckPacket batchAckPacket;
+  DataRatePacket dataRatePacket;
+};
+
+struct Packet
+{
+  uint8_t authKey;
+  uint8_t msgType;
+  PacketData data;
+};
+
+struct BatchPacket
+{
+  uint8_t authKey;
+  uint8_t msgType;
+  CapacityBatchPacket data;
+};
+
+// Kept out of PacketData so pending ACKs do not grow by a StatsPacket
+struct StatsFrame
+{
+  uint8_t authKey;
+  uint8_t msgType;
+  StatsPacket data;
+};
+
+struct AckBitmapFrame
+{
+  uint8_t authKey;
+  uint8_t msgType;
+  AckBitmapPacket data;
+};
+
+// Receive buffer large enough for every kind of packet, authKey and msgType line up in all of them
+union Frame
+{
+  Packet packet;
+  BatchPacket batchPacket;
+  StatsFrame statsFrame;
+  AckBitmapFrame ackBitmapFrame;
+};
+
+static_assert(sizeof(BatchPacket) <= RH_RF95_MAX_MESSAGE_LEN, "MAX_BATCH_RECORDS does not fit in one frame");
+
+// Frame waiting in the TX scheduler for airtime
+struct TxFrame
+{
+  uint8_t priority;
+  uint8_t len;
+  unsigned long *sentTime; // set to the time the frame actually went on air, may be null
+  uint8_t data[sizeof(Frame)];
+};
+
+// Neighbour that can forward towards the server, learned from route requests and advertisements
+struct RouteEntry
+{
+  Node node;
+  Node parentNode;   // never route through a neighbour whose next hop is this node
+  uint8_t pathCost;  // the neighbour's own cost to the server
+  uint8_t routeSeq;  // server's sequence number that cost was learned from
+  uint8_t delivery;  // moving average of transmissions to it that were ACKed, 255 is all of them
+  int16_t rssi;      // moving averages over every frame heard from it
+  int8_t snr;
+  unsigned long lastHeard;
+};
+
+// Neighbour that routes through this node, its slot is listened in
+struct ChildEntry
+{
+  Node node;
+  uint8_t highestNodeId; // from its beacon, the node's own id until one is heard
+  unsigned long lastHeard;
+};
+
+// Capacity packet sent upstream that is still waiting for its ACK
+struct PendingAck
+{
+  Packet packet;
+  Node childNode; // node the ACK is passed back to, NODE_ID for own alerts
+  unsigned long lastSentTime;
+  uint16_t retryBackoff; // random wait on top of the ACK timeout, so frames lost together are not sent again together
+  uint8_t retransmits;
+  bool inUse;
+};
+
+// Capacity batch sent upstream that is still waiting for its ACK
+struct PendingBatch
+{
+  BatchPacket packet;
+  Node childNodes[MAX_BATCH_RECORDS]; // node each record's ACK is passed back to
+  uint16_t ackedRecords;              // bit per record already acknowledged on its own
+  unsigned long lastSentTime;
+  uint16_t retryBackoff;
+  uint8_t retransmits;
+  bool inUse;
+};
+
+// Capacity packet waiting in the relay queue, the oldest reading of its bin sets its age
+struct QueuedCapacity
+{
+  CapacityPacket packet;
+  unsigned long queuedTime;
+};
+
+struct RouteEntry routingTable[MAX_NODES];
+
+// Binary heap of at most one capacity packet per bin, the fullest and longest waiting at the top
+struct QueuedCapacity processCapacityPackets[MAX_CAPACITY_PACKETS];
+
+// Alerts the server is known to have, so copies sent again after a lost ACK are answered here
+// instead of forwarded
+struct SeqWindow ackedAlerts[MAX_SEQ_WINDOWS];
+
+struct ChildEntry children[MAX_CHILDREN];
+
+// Retransmit timers for every capacity packet in flight, serviced from loop()
+struct PendingAck pendingAcks[MAX_PENDING_ACKS];
+struct PendingBatch pendingBatch;
+
+// ACKs for children waiting for ACK_AGGREGATE_WINDOW to pass, one record per alert node
+struct AckBitmapPacket ackAggregate;
+
+// Frames ordered by priority, then by the order they were queued in
+struct TxFrame txQueue[TX_QUEUE_SIZE];
+/* ========================================================== */
+/* =============== MESH DEFINITIONS & STRUCTS =============== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ======================== VARIABLES ======================= */
+/* ========================================================== */
+uint8_t connectedNodes = 0;  // current number of neighbours in the routing table
+uint8_t capacityPackets = 0; // current number of capacity packets
+unsigned long capacityListStartTime = 0; // when the oldest queued capacity packet arrived
+unsigned long capacityCoalesced = 0; // capacity packets that replaced a queued one of the same bin
+unsigned long capacityEvicted = 0;   // capacity packets dropped or pushed out of a full queue
+uint8_t nextBatchId = 0;
+uint8_t binCapacity = INITIAL_BIN_CAPACITY; // simulated bin capacity (%)
+bool advertisePending = false;       // route advertisement waiting for its jitter to pass
+bool advertiseAnswerOnly = false;    // it only answers a route request, another node's answer makes it unnecessary
+unsigned long advertiseTime = 0;
+unsigned long lastAdvertiseTime = 0;
+uint8_t advertisedHop = SERVER_ID;     // next hop and cost neighbours last heard from this node
+uint8_t advertisedCost = ROUTE_COST_INFINITE;
+// Feasibility condition: within one route sequence number a neighbour is only taken as next hop
+// when it is closer to the server than this node ever advertised, so it cannot be routing
+// through this node even when advertisements were lost. The server's periodic advertisement
+// starts a new sequence number, which lets starved nodes take any route again.
+uint8_t feasibleSeq = 0;
+uint8_t feasibleCost = ROUTE_COST_INFINITE;
+bool alertSent = false;   // the server knows this bin crossed ALERT_THRESHOLD
+uint8_t alertSeq = 0;     // sequence number of this node's current alert
+long fillLevel = 0;       // estimated bin level, percent with FILL_FRACTION_BITS fraction bits
+long fillRate = 0;        // estimated fill per FILL_SAMPLE_INTERVAL, same fixed point
+uint8_t fillSamples = 0;  // samples since the bin was emptied
+uint8_t forecastSamples = FORECAST_MIN_SAMPLES; // samples this fill waits for before its first forecast
+unsigned long lastFillSample = 0;
+uint16_t sentMinutesToFull = FULL_UNKNOWN;     // forecast of the report in flight
+unsigned long sentForecastTime = 0;
+uint16_t reportedMinutesToFull = FULL_UNKNOWN; // latest forecast the server ACKed since the bin was emptied
+unsigned long reportedTime = 0;
+uint8_t seqWindowsUsed = 0;
+uint8_t nextSeqWindow = 0; // window reused when all of them are taken
+unsigned long duplicatesDropped = 0; // copies of capacity packets already in flight here
+unsigned long duplicatesAcked = 0;   // copies the server already has, ACKed here instead of forwarded
+uint8_t aggregatedAcks = 0;          // ACKs in ackAggregate, a single one goes out as a plain ACK
+AckPacket firstAggregatedAck;
+unsigned long ackAggregateStart = 0;
+uint8_t txQueueLength = 0;
+uint8_t spreadingFactor = LORA_SPREADING_FACTOR; // modem settings in use, the server can change them
+long bandwidth = LORA_BANDWIDTH;
+int8_t dataTxPower = TX_POWER_DEFAULT; // power of capacity frames to the server
+unsigned long airtimeTokens = AIRTIME_BUCKET_SIZE; // ms of airtime that can be spent right now
+unsigned long lastTokenRefill = 0;
+unsigned long airtimeUsed = 0;   // total ms spent transmitting
+unsigned long txDeferred = 0;    // frames that had to wait for airtime
+unsigned long txDropped = 0;     // frames dropped because the TX queue was full
+unsigned long retransmissions = 0; // capacity packets and batches sent again after an ACK timeout
+uint16_t ackTimeouts = 0;          // telemetry counters sent in the StatsPacket
+uint16_t routeChanges = 0;
+uint8_t txQueueHighWater = 0;
+uint8_t capacityQueueHighWater = 0;
+uint16_t ackRtt[ACK_RTT_BUCKETS];
+uint8_t statsHop = ROUTE_COST_INFINITE; // next hop routeChanges last saw, ROUTE_COST_INFINITE without a route
+unsigned long nextStatsTime = 0;
+bool joinPending = false;              // forwarding node request waiting for a response
+unsigned long joinRequestStartTime = 0; // first forwarding node request of this attempt
+unsigned long lastJoinRequestTime = 0;  // latest (re)transmission of the request
+unsigned long joinRetryDelay = 0;       // wait after it before the next one
+uint8_t joinAttempts = 0;               // requests sent since the node last had a route
+uint8_t cadBusyCount = 0;               // CADs in a row that found the channel busy
+unsigned long txBackoffUntil = 0;       // the TX queue waits for a busy channel until then
+unsigned long cadBackoffs = 0;          // times the TX queue backed off
+bool synced = false;                // superframe timing known from a beacon
+unsigned long superframeStart = 0;  // when the superframe of the latest beacon began
+unsigned long lastSyncTime = 0;     // latest beacon the timing was taken from
+uint8_t beaconSeq = 0;              // superframe number of superframeStart
+uint8_t slotCount = 0;
+uint8_t contentionSlots = 1;
+uint16_t slotLength = 0;
+unsigned long contentionOffset = SLOT_GUARD; // ms into a shared slot this node's next frame waits for
+unsigned long lastBeaconSent = 0;
+unsigned long lastRadioActivity = 0; // end of the latest frame sent or received, a slot that falls quiet is left early
+uint8_t childCount = 0;
+uint8_t listenedHop = NO_SLOT;       // next hop known to listen in this node's slot, it was told or sent a frame to this node
+unsigned long listenedHopTime = 0;
+unsigned long lastAnnounceTime = 0;  // latest advertisement telling a new next hop about this node
+unsigned long replyDueUntil = 0;     // the receiver of the latest capacity frame may be sending its ACK until then
+/* ========================================================== */
+/* ======================== VARIABLES ======================= */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ==================== SYSTEM DECLARATION ================== */
+/* ========================================================== */
+#ifdef __AVR__
+int free_sram();
+#endif
+/* ========================================================== */
+/* ==================== SYSTEM DECLARATION ================== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ================ ROUTING TABLE DECLARATION =============== */
+/* ========================================================== */
+int8_t find_route(uint8_t nodeId);
+void add_to_routing_table(uint8_t nodeId, uint8_t pathCost, uint8_t parentId, uint8_t routeSeq);
+void update_route(NodePacket &nodePacket);
+void heard_from(uint8_t nodeId, int8_t txPower = TX_POWER_DEFAULT);
+void check_forwarding_path(uint8_t senderId, uint8_t receiverId, uint8_t senderCost);
+void link_acked(uint8_t nodeId);
+void link_failed(uint8_t nodeId);
+uint8_t link_cost(const RouteEntry &entry);
+uint8_t path_cost(const RouteEntry &entry);
+bool route_feasible(const RouteEntry &entry);
+uint8_t route_seq();
+unsigned long ack_timeout();
+int8_t best_route();
+bool has_route();
+uint8_t route_cost();
+uint8_t next_hop();
+void schedule_route_advertisement(unsigned long jitter);
+void overheard_advertisement(NodePacket &nodePacket);
+void service_route_advertisement();
+void advertised_route();
+void print_routing_table();
+/* ========================================================== */
+/* ================ ROUTING TABLE DECLARATION =============== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ================= SLOT SCHEDULE DECLARATION ============== */
+/* ========================================================== */
+unsigned long superframe_length();
+uint8_t current_slot();
+unsigned long slot_start();
+uint8_t slot_of(uint8_t nodeId);
+bool contention_slot(uint8_t slot);
+uint8_t contention_slot_of(uint8_t nodeId);
+uint8_t current_superframe();
+uint8_t watched_neighbour_slot();
+uint8_t scanned_slot();
+unsigned long listen_timeout();
+unsigned long reply_time();
+void sync_to_beacon(BeaconPacket &beacon, uint8_t len);
+void check_sync();
+bool hop_listens(uint8_t nodeId);
+void heard_reply_from(uint8_t nodeId);
+bool upstream_slot_open();
+uint8_t upstream_slot(uint8_t receiverId);
+uint8_t frame_slot(TxFrame &txFrame);
+bool slot_in_use();
+bool slot_allows(TxFrame &txFrame);
+bool tx_waits_for(uint8_t slot);
+void pick_contention_offset();
+bool awaiting_ack();
+bool slot_wanted(uint8_t slot);
+bool radio_window_open();
+unsigned long next_window_start();
+unsigned long receive_timeout();
+void sleep_until(unsigned long time);
+int8_t find_child(uint8_t nodeId);
+void add_child(uint8_t nodeId);
+void remove_child(uint8_t nodeId);
+void heard_route_of(NodePacket &nodePacket);
+uint8_t highest_node_id();
+void service_beacon();
+void service_hop_announcement();
+/* ========================================================== */
+/* ================= SLOT SCHEDULE DECLARATION ============== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* =============== FILL FORECAST DECLARATION ================ */
+/* ========================================================== */
+void sample_fill_level();
+uint16_t minutes_to_full();
+bool forecast_drifted(uint16_t minutes);
+void service_fill_report();
+void fill_report_acked();
+/* ========================================================== */
+/* =============== FILL FORECAST DECLARATION ================ */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ================== TELEMETRY DECLARATION ================= */
+/* ========================================================== */
+void record_ack_rtt(unsigned long sentTime);
+void service_stats();
+void send_stats_packet();
+void handle_stats_packet(StatsPacket &packet);
+/* ========================================================== */
+/* ================== TELEMETRY DECLARATION ================= */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ============ CAPACITY HANDLING DECLARATION =============== */
+/* ========================================================== */
+bool capacity_before(const QueuedCapacity &a, const QueuedCapacity &b);
+void capacity_sift_up(uint8_t i);
+void capacity_sift_down(uint8_t i);
+void add_to_capacity_list(CapacityPacket cpacket);
+void remove_from_capacity_list();
+void process_capacity_list();
+bool capacity_packet_in_flight(uint8_t alertId, uint8_t seq);
+/* ========================================================== */
+/* ============ CAPACITY HANDLING DECLARATION =============== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* =============== ACK HANDLING DECLARATION ================= */
+/* ========================================================== */
+int8_t find_pending_ack(uint8_t alertId, uint8_t seq);
+int8_t add_to_pending_acks(uint8_t childId);
+void remove_from_pending_acks(uint8_t index);
+void service_pending_acks();
+void service_pending_batch();
+void complete_batch_record(uint8_t index);
+void service_join_request();
+uint16_t retry_backoff(uint8_t retransmits, uint8_t len);
+void send_join_request();
+bool ack_alert(uint8_t alertId, uint8_t seq, uint8_t senderId);
+void queue_ack(uint8_t alertId, uint8_t seq, uint8_t receiverId);
+void service_ack_aggregate();
+void send_ack_aggregate();
+/* ========================================================== */
+/* =============== ACK HANDLING DECLARATION ================= */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ============ DUPLICATE SUPPRESSION DECLARATION =========== */
+/* ========================================================== */
+int8_t find_seq_window(uint8_t alertId);
+bool seq_acked(uint8_t alertId, uint8_t seq);
+void mark_seq_acked(uint8_t alertId, uint8_t seq);
+bool suppress_duplicate(CapacityPacket &cpacket);
+void print_duplicate_counters();
+/* ========================================================== */
+/* ============ DUPLICATE SUPPRESSION DECLARATION =========== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ================ TX SCHEDULER DECLARATION ================ */
+/* ========================================================== */
+uint8_t tx_priority(uint8_t msgType);
+void refill_airtime_tokens();
+unsigned long airtime_remaining();
+void service_tx_queue();
+bool tx_queue_holds(unsigned long *sentTime);
+void tx_queue_cancel(unsigned long *sentTime);
+void print_airtime_budget();
+bool channel_clear(uint8_t len);
+int8_t stamp_tx_power(TxFrame &txFrame);
+void stamp_beacon(TxFrame &txFrame);
+/* ========================================================== */
+/* ================ TX SCHEDULER DECLARATION ================ */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ==== TRANSMITTING/RECEIVING FUNCTIONS DECLARATION ======== */
+/* ========================================================== */
+NodePacket construct_node_packet();
+CapacityPacket construct_capacity_packet(uint8_t alertId, uint8_t seq, uint8_t binCapacity, uint16_t minutesToFull);
+AckPacket construct_ack_packet(uint8_t alertId, uint8_t seq, uint8_t receiverId);
+void learn_from_frame(Frame &frame);
+
+unsigned long time_on_air(uint8_t len);
+uint8_t packet_length(const Packet &packet);
+uint8_t batch_packet_length(const BatchPacket &packet);
+uint8_t ack_bitmap_length(const AckBitmapFrame &frame);
+
+void sendPacket(const uint8_t *data, uint8_t len, unsigned long *sentTime = 0);
+void transmit_frame(const uint8_t *data, uint8_t len);
+void send_node_packet(uint8_t msgType, unsigned long *sentTime = 0);
+void send_ack_packet(uint8_t alertId, uint8_t seq, uint8_t receiverId);
+void send_beacon_packet();
+
+void handle_node_packet();
+void handle_node_response();
+void handle_capacity_packet(CapacityPacket &packet);
+void handle_capacity_batch(CapacityBatchPacket &packet);
+void handle_ack_packet(AckPacket &packet);
+void handle_batch_ack_packet(BatchAckPacket &packet);
+void handle_ack_bitmap_packet(AckBitmapPacket &packet);
+void handle_data_rate_packet(DataRatePacket &packet);
+void handle_beacon_packet(BeaconPacket &packet, uint8_t len);
+void apply_data_rate(uint8_t sf, long bw, int8_t txPower);
+void reset_data_rate();
+
+void forward_node_packet();
+bool forward_capacity_packet(uint8_t alertId, uint8_t seq, uint8_t binCapacity, uint16_t minutesToFull, uint8_t childId);
+void forward_capacity_batch();
+/* ========================================================== */
+/* ==== TRANSMITTING/RECEIVING FUNCTIONS DECLARATION ======== */
+/* ========================================================== */
\ No newline at end of file
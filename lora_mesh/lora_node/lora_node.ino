@@ -0,0 +1,2537 @@
+// LoRa 9x_RX/TX
+// -*- mode:C++ -*-
+// Example sketch showing how to create a simple messaging client (receiver)
+// with the RH_RF95 class. RH_RF95 class does not provide for addressing or
+// reliability, so you should only use RH_RF95 if you do not need the higher
+// level messaging abilities.
+// It is designed to work with the other example LoRa9x_TX
+
+#include "lora_node.h"
+
+void setup()
+{
+  Serial.begin(9600);
+  delay(100);
+
+  while (!rf95.init())
+  {
+    SYS_LOG.println("SYS: LoRa radio init failed");
+
+    delay(2000);
+    while (1)
+      ;
+  }
+  SYS_LOG.println("SYS: LoRa radio init OK!");
+
+  // Defaults after init are 915.0MHz, modulation GFSK_Rb250Fd250, +13dbM
+  if (!rf95.setFrequency(RF95_FREQ))
+  {
+    SYS_LOG.println("SYS: setFrequency failed");
+    while (1)
+      ;
+  }
+  SYS_LOG.print("SYS: Set Freq to ");
+  SYS_LOG.println(RF95_FREQ);
+
+  // Defaults after init are 915.0MHz, 13dBm, Bw = 125 kHz, Cr = 4/5, Sf = 128chips/symbol, CRC on
+  // The default transmitter power is 13dBm, using PA_BOOST.
+  // If you are using RFM95/96/97/98 modules which uses the PA_BOOST transmitter pin, then
+  // you can set transmitter powers from 5 to 23 dBm:
+  rf95.setTxPower(TX_POWER_DEFAULT, false);
+  rf95.setSpreadingFactor(LORA_SPREADING_FACTOR);
+  rf95.setSignalBandwidth(LORA_BANDWIDTH);
+  rf95.setCodingRate4(LORA_CODING_RATE);
+  rf95.setPreambleLength(LORA_PREAMBLE_LENGTH);
+
+#ifdef __AVR__
+  // What is left for the stack once this role's buffers are allocated
+  SYS_LOG.print("SYS: Free SRAM ");
+  SYS_LOG.println(free_sram());
+#endif
+  // Nodes powered up together spread their telemetry over the interval
+  nextStatsTime = random(STATS_INTERVAL);
+  delay(2000);
+}
+
+void loop()
+{
+  /* ========================================================== */
+  /* === HANDLING THE SLOT SCHEDULE                         === */
+  /* ========================================================== */
+  if (SLOTTED_SCHEDULE)
+  {
+    check_sync();
+    if (RELAY_ROLE)
+    {
+      service_beacon();
+    }
+    service_hop_announcement();
+  }
+  /* ========================================================== */
+  /* === HANDLING THE SLOT SCHEDULE                         === */
+  /* ========================================================== */
+
+  /* =================================== */
+  /* === HANDLING SENDING OF PACKETS === */
+  /* =================================== */
+  if (RELAY_ROLE)
+  {
+    process_capacity_list();
+  }
+  /* =================================== */
+  /* === HANDLING SENDING OF PACKETS === */
+  /* =================================== */
+
+  /* ========================================================== */
+  /* === HANDLING RETRANSMISSION OF UNACKNOWLEDGED PACKETS  === */
+  /* ========================================================== */
+  service_pending_acks();
+  if (RELAY_ROLE)
+  {
+    service_pending_batch();
+  }
+  service_join_request();
+  if (RELAY_ROLE)
+  {
+    service_route_advertisement();
+  }
+  service_stats();
+  if (RELAY_ROLE)
+  {
+    service_ack_aggregate();
+  }
+  service_tx_queue();
+  /* ========================================================== */
+  /* === HANDLING RETRANSMISSION OF UNACKNOWLEDGED PACKETS  === */
+  /* ========================================================== */
+
+  /* ========================================================== */
+  /* === HANDLING RESPONSE TO ADD NODE TO ROUTING TABLE REQ === */
+  /* === & REQUEST FOR FORWARDING CAPACITY BINS TO SERVER   === */
+  /* ========================================================== */
+  if (!radio_window_open())
+  {
+    sleep_until(next_window_start());
+  }
+  else if (rf95.waitAvailableTimeout(receive_timeout()))
+  {
+    Frame frame;
+    Packet &packet = frame.packet;
+
+    uint8_t len = sizeof(frame);
+    if (rf95.recv((uint8_t *)&frame, &len)) 
+    {
+      lastRadioActivity = millis();
+      if (packet.authKey == AUTH_KEY)
+      {
+        if (packet.msgType == MSG_TYPE_CAPACITY && len < sizeof(Packet) - sizeof(PacketData) + sizeof(CapacityPacket))
+        {
+          packet.data.capacityPacket.txPower = TX_POWER_DEFAULT;
+        }
+        learn_from_frame(frame);
+
+        if (RELAY_ROLE && packet.msgType == MSG_TYPE_REQ_FORWARD_NODE)
+        {
+          handle_node_packet();
+        }
+        else if (packet.msgType == MSG_TYPE_RES_FORWARD_NODE)
+        {
+          handle_node_response();
+        }
+        else if (packet.msgType == MSG_TYPE_BEACON && len >= packet_length(packet))
+        {
+          handle_beacon_packet(packet.data.beaconPacket, len);
+        }
+        else if (RELAY_ROLE && packet.msgType == MSG_TYPE_CAPACITY)
+        {
+          handle_capacity_packet(packet.data.capacityPacket);
+        }
+        else if (RELAY_ROLE && packet.msgType == MSG_TYPE_CAPACITY_BATCH && len >= batch_packet_length(frame.batchPacket))
+        {
+          handle_capacity_batch(frame.batchPacket.data);
+        }
+        else if (packet.msgType == MSG_TYPE_ACK_SUCCEED)
+        {
+          handle_ack_packet(packet.data.ackPacket);
+        }
+        else if (RELAY_ROLE && packet.msgType == MSG_TYPE_ACK_BATCH)
+        {
+          handle_batch_ack_packet(packet.data.batchAckPacket);
+        }
+        else if (packet.msgType == MSG_TYPE_ACK_BITMAP && len >= ack_bitmap_length(frame.ackBitmapFrame))
+        {
+          handle_ack_bitmap_packet(frame.ackBitmapFrame.data);
+        }
+        else if (packet.msgType == MSG_TYPE_DATA_RATE)
+        {
+          handle_data_rate_packet(packet.data.dataRatePacket);
+        }
+        else if (RELAY_ROLE && packet.msgType == MSG_TYPE_STATS && len >= sizeof(StatsFrame))
+        {
+          handle_stats_packet(frame.statsFrame.data);
+        }
+      }
+    }
+  }
+  /* ========================================================== */
+  /* === HANDLING RESPONSE TO ADD NODE TO ROUTING TABLE REQ === */
+  /* === & REQUEST FOR FORWARDING CAPACITY BINS TO SERVER   === */
+  /* ========================================================== */
+
+  /* ========================================================== */
+  /* === HANDLING TO SEND REQ TO ADD NODE TO ROUTING TABLE ==== */
+  /* === & WHEN CAPACITY OF BIN FULL SEND REQUEST          ==== */
+  /* ========================================================== */
+  if (ALERT_ROLE)
+  {
+    sample_fill_level();
+  }
+  if (!has_route())
+  {
+    if (!joinPending)
+    {
+      forward_node_packet();
+    }
+  }
+  else if (ALERT_ROLE)
+  {
+    if (!alertSent && find_pending_ack(NODE_ID, alertSeq) < 0)
+    {
+      service_fill_report();
+    }
+  }
+  /* ========================================================== */
+  /* === HANDLING TO SEND REQ TO ADD NODE TO ROUTING TABLE ==== */
+  /* === & WHEN CAPACITY OF BIN FULL SEND REQUEST          ==== */
+  /* ========================================================== */
+}
+
+/* ========================================================== */
+/* ===================== SYSTEM FUNCTIONS =================== */
+/* ========================================================== */
+#ifdef __AVR__
+extern char __heap_start;
+extern char *__brkval;
+
+// Bytes between the top of the heap (or the end of the globals) and the stack
+int free_sram()
+{
+  char top;
+  return &top - (__brkval ? __brkval : &__heap_start);
+}
+#endif
+/* ========================================================== */
+/* ===================== SYSTEM FUNCTIONS =================== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ================= ROUTING TABLE FUNCTIONS ================ */
+/* ========================================================== */
+int8_t find_route(uint8_t nodeId)
+{
+  for (int i = 0; i < connectedNodes; i++)
+  {
+    if (routingTable[i].node.nodeId == nodeId)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void add_to_routing_table(uint8_t nodeId, uint8_t pathCost, uint8_t parentId, uint8_t routeSeq)
+{
+  uint8_t index = connectedNodes;
+  if (connectedNodes == MAX_NODES)
+  {
+    // Make room by replacing the neighbour that is worst to route through, unless that is this one
+    index = 0;
+    for (int i = 1; i < connectedNodes; i++)
+    {
+      if (path_cost(routingTable[i]) > path_cost(routingTable[index]) ||
+          (path_cost(routingTable[i]) == path_cost(routingTable[index]) && routingTable[i].lastHeard < routingTable[index].lastHeard))
+      {
+        index = i;
+      }
+    }
+    if (path_cost(routingTable[index]) != ROUTE_COST_INFINITE && pathCost + ETX_ONE >= path_cost(routingTable[index]))
+    {
+      SYS_LOG.println("SYS: Routing table is full");
+      return;
+    }
+  }
+  else
+  {
+    connectedNodes++;
+  }
+
+  RouteEntry &entry = routingTable[index];
+  entry.node.nodeId = nodeId;
+  entry.parentNode.nodeId = parentId;
+  entry.pathCost = pathCost;
+  entry.routeSeq = routeSeq;
+  entry.delivery = 255;
+  entry.rssi = rf95.lastRssi();
+  entry.snr = rf95.lastSNR();
+  entry.lastHeard = millis();
+
+  TRAFFIC_LOG.println("SYS: Add node to the routing table");
+  print_routing_table();
+}
+
+// Distance-vector update from a route request or advertisement
+void update_route(NodePacket &nodePacket)
+{
+  int8_t index = find_route(nodePacket.node.nodeId);
+  if (index >= 0)
+  {
+    RouteEntry &entry = routingTable[index];
+    entry.pathCost = nodePacket.pathCost;
+    entry.parentNode = nodePacket.parentNode;
+    entry.routeSeq = nodePacket.routeSeq;
+    if (link_cost(entry) == ROUTE_COST_INFINITE)
+    {
+      entry.delivery = 128; // hearing it again gives a written off link another chance
+    }
+  }
+  else if (nodePacket.pathCost != ROUTE_COST_INFINITE)
+  {
+    add_to_routing_table(nodePacket.node.nodeId, nodePacket.pathCost, nodePacket.parentNode.nodeId, nodePacket.routeSeq);
+  }
+}
+
+// Every frame from a neighbour refreshes its link quality
+// Frames sent below TX_POWER_DEFAULT are scaled up, the link is judged by what control frames get
+void heard_from(uint8_t nodeId, int8_t txPower)
+{
+  int8_t index = find_route(nodeId);
+  if (index >= 0)
+  {
+    RouteEntry &entry = routingTable[index];
+    int8_t powerOffset = TX_POWER_DEFAULT - txPower;
+    entry.rssi += (rf95.lastRssi() + powerOffset - entry.rssi) / 4;
+    entry.snr += (rf95.lastSNR() + powerOffset - entry.snr) / 4;
+    entry.lastHeard = millis();
+  }
+}
+
+// A neighbour sending capacity packets to this node routes through it, whatever its last
+// advertisement said. If it is not further from the server than this node, it routed on a
+// stale cost of ours and the packet is going round a loop, advertise the current cost.
+void check_forwarding_path(uint8_t senderId, uint8_t receiverId, uint8_t senderCost)
+{
+  if (receiverId != NODE_ID)
+  {
+    return;
+  }
+  if (RELAY_ROLE)
+  {
+    add_child(senderId);
+  }
+  int8_t index = find_route(senderId);
+  if (index >= 0)
+  {
+    routingTable[index].parentNode.nodeId = NODE_ID;
+    routingTable[index].pathCost = senderCost;
+  }
+  if (RELAY_ROLE && has_route() && senderCost <= route_cost())
+  {
+    SYS_LOG.println("SYS: Routing loop detected");
+    schedule_route_advertisement(ROUTE_ADVERTISE_JITTER);
+  }
+}
+
+void link_acked(uint8_t nodeId)
+{
+  int8_t index = find_route(nodeId);
+  if (index >= 0)
+  {
+    routingTable[index].delivery += (255 - routingTable[index].delivery) / 8;
+  }
+}
+
+void link_failed(uint8_t nodeId)
+{
+  int8_t index = find_route(nodeId);
+  if (index >= 0)
+  {
+    routingTable[index].delivery -= routingTable[index].delivery / 8;
+  }
+  if (nodeId == SERVER_ID && dataTxPower < TX_POWER_DEFAULT)
+  {
+    // The server lowered the power too far or the link got worse, it lowers it again when it can
+    SYS_LOG.println("SYS: No ACK from the server, data frames back to the default power");
+    dataTxPower = TX_POWER_DEFAULT;
+  }
+}
+
+// ETX of the link from its ACK history, raised when the SNR gets close to what the modem can still decode
+uint8_t link_cost(const RouteEntry &entry)
+{
+  uint16_t cost = entry.delivery ? ETX_ONE * 255U / entry.delivery : ROUTE_COST_INFINITE;
+  int16_t margin = entry.snr - SNR_FLOOR;
+  if (margin < SNR_MARGIN_GOOD)
+  {
+    cost += (SNR_MARGIN_GOOD - margin) * ETX_ONE / 4;
+  }
+  return cost < ROUTE_COST_INFINITE ? cost : ROUTE_COST_INFINITE;
+}
+
+// Cost to the server when routing through this neighbour
+uint8_t path_cost(const RouteEntry &entry)
+{
+  if (entry.pathCost == ROUTE_COST_INFINITE || entry.parentNode.nodeId == NODE_ID ||
+      millis() - entry.lastHeard > NEIGHBOUR_TIMEOUT)
+  {
+    return ROUTE_COST_INFINITE;
+  }
+  uint16_t cost = entry.pathCost + link_cost(entry);
+  return cost < ROUTE_COST_INFINITE ? cost : ROUTE_COST_INFINITE;
+}
+
+// ACKs come back from the server, so allow ACK_TIMEOUT (ACK_TIMEOUT_SUPERFRAMES superframes with the
+// slotted schedule) for every transmission the route is expected to take
+unsigned long ack_timeout()
+{
+  uint8_t cost = route_cost();
+  unsigned long timeout = SLOTTED_SCHEDULE && synced ? ACK_TIMEOUT_SUPERFRAMES * superframe_length() : ACK_TIMEOUT;
+  return cost > ETX_ONE && cost != ROUTE_COST_INFINITE ? timeout * cost / ETX_ONE : timeout;
+}
+
+bool route_feasible(const RouteEntry &entry)
+{
+  int8_t newer = entry.routeSeq - feasibleSeq;
+  return newer > 0 || (newer == 0 && entry.pathCost < feasibleCost);
+}
+
+int8_t best_route()
+{
+  int8_t best = -1;
+  uint16_t bestCost = ROUTE_COST_INFINITE;
+  for (int i = 0; i < connectedNodes; i++)
+  {
+    uint16_t cost = path_cost(routingTable[i]);
+    if (cost == ROUTE_COST_INFINITE || !route_feasible(routingTable[i]))
+    {
+      continue;
+    }
+    // The current next hop is kept until another neighbour is clearly cheaper, so
+    // neighbours with about the same cost do not make the route flap
+    if (routingTable[i].node.nodeId != advertisedHop)
+    {
+      cost += ROUTE_SWITCH_THRESHOLD;
+    }
+    if (best < 0 || cost < bestCost)
+    {
+      best = i;
+      bestCost = cost;
+    }
+  }
+  return best;
+}
+
+bool has_route()
+{
+  return best_route() >= 0;
+}
+
+uint8_t route_cost()
+{
+  int8_t best = best_route();
+  return best >= 0 ? path_cost(routingTable[best]) : ROUTE_COST_INFINITE;
+}
+
+uint8_t route_seq()
+{
+  int8_t best = best_route();
+  return best >= 0 ? routingTable[best].routeSeq : feasibleSeq;
+}
+
+// Lowest cost neighbour towards the server, only valid while has_route()
+uint8_t next_hop()
+{
+  int8_t best = best_route();
+  return best >= 0 ? routingTable[best].node.nodeId : SERVER_ID;
+}
+
+// Advertise this node's route once the jitter has passed, several requests share one advertisement
+void schedule_route_advertisement(unsigned long jitter)
+{
+  unsigned long time = millis() + random(jitter);
+  if ((long)(lastAdvertiseTime + ROUTE_ADVERTISE_HOLDOFF - time) > 0)
+  {
+    time = lastAdvertiseTime + ROUTE_ADVERTISE_HOLDOFF + random(jitter);
+  }
+  if (!advertisePending || (long)(time - advertiseTime) < 0)
+  {
+    advertisePending = true;
+    advertiseTime = time;
+  }
+  advertiseAnswerOnly = false;
+}
+
+// Answers to a route request are suppressed once a neighbour at least as close to the
+// server has answered, otherwise every node in range answers every request
+void overheard_advertisement(NodePacket &nodePacket)
+{
+  if (advertisePending && advertiseAnswerOnly && nodePacket.pathCost <= route_cost())
+  {
+    advertisePending = false;
+  }
+}
+
+// Periodic advertisements, and triggered ones when the route is gained, lost, moves to another next
+// hop or gets dearer, so neighbours do not keep routing on stale costs. A loop that does form keeps
+// raising its own cost until it counts to ROUTE_COST_INFINITE. With the slotted schedule every beacon
+// is an advertisement, and nodes without a route listen in every slot, so none are sent besides them.
+void service_route_advertisement()
+{
+  if (SLOTTED_SCHEDULE)
+  {
+    advertisePending = false;
+    return;
+  }
+  if (!advertisePending && has_route() && (millis() - lastAdvertiseTime >= ROUTE_ADVERTISE_INTERVAL || route_seq() != feasibleSeq))
+  {
+    schedule_route_advertisement(ROUTE_UPDATE_JITTER);
+  }
+  if (!advertisePending && (has_route() != (advertisedCost != ROUTE_COST_INFINITE) ||
+                            (has_route() && (next_hop() != advertisedHop || route_cost() >= advertisedCost + ETX_ONE))))
+  {
+    schedule_route_advertisement(ROUTE_ADVERTISE_JITTER);
+  }
+  if (advertisePending && (long)(millis() - advertiseTime) >= 0)
+  {
+    advertisePending = false;
+    advertised_route();
+    if (has_route() || advertisedCost == ROUTE_COST_INFINITE)
+    {
+      send_node_packet(MSG_TYPE_RES_FORWARD_NODE);
+      TRAFFIC_LOG.println(has_route() ? "RESPONSE: Sent confirmation to be a forwarding node" : "RESPONSE: Withdrew route");
+    }
+  }
+}
+
+// The route is about to be advertised, neighbours may now take it as feasible
+void advertised_route()
+{
+  lastAdvertiseTime = millis();
+  advertisedHop = next_hop();
+  advertisedCost = route_cost();
+  if (has_route())
+  {
+    if (route_seq() != feasibleSeq)
+    {
+      feasibleSeq = route_seq();
+      feasibleCost = ROUTE_COST_INFINITE;
+    }
+    if (advertisedCost < feasibleCost)
+    {
+      feasibleCost = advertisedCost;
+    }
+  }
+}
+
+void print_routing_table()
+{
+  TRAFFIC_LOG.println("----------------------------------------");
+  TRAFFIC_LOG.println("| Routing Table (NodeID, cost, ETX, RSSI, SNR) |");
+
+  for (int i = 0; i < connectedNodes; i++)
+  {
+    TRAFFIC_LOG.print("| ");
+    TRAFFIC_LOG.print(routingTable[i].node.nodeId);
+    TRAFFIC_LOG.print(" ");
+    TRAFFIC_LOG.print(path_cost(routingTable[i]));
+    TRAFFIC_LOG.print(" ");
+    TRAFFIC_LOG.print(link_cost(routingTable[i]));
+    TRAFFIC_LOG.print(" ");
+    TRAFFIC_LOG.print(routingTable[i].rssi);
+    TRAFFIC_LOG.print(" ");
+    TRAFFIC_LOG.println(routingTable[i].snr);
+  }
+  TRAFFIC_LOG.println("----------------------------------------");
+}
+/* ========================================================== */
+/* ================= ROUTING TABLE FUNCTIONS ================ */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ================== SLOT SCHEDULE FUNCTIONS =============== */
+/* ========================================================== */
+// Only valid while synced
+unsigned long superframe_length()
+{
+  return (unsigned long)slotCount * slotLength;
+}
+
+uint8_t current_slot()
+{
+  return (millis() - superframeStart) % superframe_length() / slotLength;
+}
+
+unsigned long slot_start()
+{
+  return millis() - (millis() - superframeStart) % superframe_length() % slotLength;
+}
+
+// Slot nodeId transmits in, NO_SLOT while the superframe has no room for it
+uint8_t slot_of(uint8_t nodeId)
+{
+  if (nodeId == SERVER_ID)
+  {
+    return 0;
+  }
+  uint16_t slot = contentionSlots + nodeId;
+  return slot < slotCount ? slot : NO_SLOT;
+}
+
+bool contention_slot(uint8_t slot)
+{
+  return slot >= 1 && slot <= contentionSlots;
+}
+
+// Shared slot nodeId listens in, frames to it from nodes whose slot it does not listen in go there
+uint8_t contention_slot_of(uint8_t nodeId)
+{
+  return 1 + nodeId % contentionSlots;
+}
+
+uint8_t current_superframe()
+{
+  return beaconSeq + (millis() - superframeStart) / superframe_length();
+}
+
+// One routing table neighbour per superframe is listened to as well, so routes through the
+// neighbours that are not the next hop stay fresh
+uint8_t watched_neighbour_slot()
+{
+  if (connectedNodes == 0)
+  {
+    return NO_SLOT;
+  }
+  return slot_of(routingTable[current_superframe() % connectedNodes].node.nodeId);
+}
+
+// And one more slot, taking turns over all of them, so neighbours not in the routing table are found
+uint8_t scanned_slot()
+{
+  return contentionSlots + 1 + current_superframe() % (slotCount - contentionSlots - 1);
+}
+
+// A slot nothing was heard in for this long is left, the longest frame fits in it
+unsigned long listen_timeout()
+{
+  return 2 * SLOT_GUARD + time_on_air(sizeof(BatchPacket));
+}
+
+// Time the receiver of a capacity frame may take to ACK it, aggregated ACKs wait and can be longer
+unsigned long reply_time()
+{
+  uint8_t len = ACK_AGGREGATE_WINDOW ? sizeof(AckBitmapFrame) : sizeof(Packet) - sizeof(PacketData) + sizeof(AckPacket);
+  return ACK_AGGREGATE_WINDOW + time_on_air(len) + SLOT_GUARD;
+}
+
+// The sender stamped how far into its superframe the beacon went on air
+void sync_to_beacon(BeaconPacket &beacon, uint8_t len)
+{
+  if (beacon.contentionSlots == 0 || beacon.slotCount <= beacon.contentionSlots + 1 || beacon.slotLength <= 2 * SLOT_GUARD)
+  {
+    return;
+  }
+  if (!synced)
+  {
+    SYS_LOG.println("SYS: Synchronised to the beacon");
+    pick_contention_offset();
+  }
+  superframeStart = millis() - time_on_air(len) - beacon.offset;
+  beaconSeq = beacon.beaconSeq;
+  slotCount = beacon.slotCount;
+  contentionSlots = beacon.contentionSlots;
+  slotLength = beacon.slotLength;
+  lastSyncTime = millis();
+  synced = true;
+}
+
+void check_sync()
+{
+  if (synced && millis() - lastSyncTime > SYNC_TIMEOUT_SUPERFRAMES * superframe_length())
+  {
+    SYS_LOG.println("SYS: Lost the beacon, listening until the next one");
+    synced = false;
+  }
+}
+
+// Whether nodeId listens in this node's slot. The server always listens, a relay once it was told
+// about this node or this node's frames reached it, and for as long as it hears the beacons naming
+// it as the next hop.
+bool hop_listens(uint8_t nodeId)
+{
+  return nodeId == SERVER_ID || (nodeId == listenedHop && millis() - listenedHopTime < CHILD_TIMEOUT &&
+                                 !tx_queue_holds(&lastAnnounceTime));
+}
+
+// The sender of a frame addressed to this node has it as a child
+void heard_reply_from(uint8_t nodeId)
+{
+  listenedHop = nodeId;
+  listenedHopTime = millis();
+}
+
+// Capacity frames go in this node's own slot once the receiver listens in it, in the receiver's
+// shared slot before that
+uint8_t upstream_slot(uint8_t receiverId)
+{
+  uint8_t own = slot_of(NODE_ID);
+  return own != NO_SLOT && hop_listens(receiverId) ? own : contention_slot_of(receiverId);
+}
+
+bool upstream_slot_open()
+{
+  return synced && current_slot() == upstream_slot(next_hop());
+}
+
+// Slot a queued frame waits for
+uint8_t frame_slot(TxFrame &txFrame)
+{
+  Frame &frame = *(Frame *)txFrame.data;
+  uint8_t msgType = frame.packet.msgType;
+  if (msgType == MSG_TYPE_CAPACITY)
+  {
+    return upstream_slot(frame.packet.data.capacityPacket.receiverNode.nodeId);
+  }
+  if (msgType == MSG_TYPE_CAPACITY_BATCH)
+  {
+    return upstream_slot(frame.batchPacket.data.receiverNode.nodeId);
+  }
+  if (msgType == MSG_TYPE_STATS)
+  {
+    return upstream_slot(frame.statsFrame.data.receiverNode.nodeId);
+  }
+  if (msgType == MSG_TYPE_RES_FORWARD_NODE)
+  {
+    // Only sent to tell a new next hop about this node
+    return contention_slot_of(frame.packet.data.nodePacket.parentNode.nodeId);
+  }
+  if (msgType == MSG_TYPE_REQ_FORWARD_NODE)
+  {
+    return 1;
+  }
+  // Beacons and ACKs, children listen in this node's slot
+  return slot_of(NODE_ID);
+}
+
+// Whether a slot holds a frame this node sent or received, it listens on for the reply
+bool slot_in_use()
+{
+  return (long)(lastRadioActivity - slot_start()) > 0;
+}
+
+// Whether a queued frame may go on air now: after the guard time at the start of its slot, and over
+// before the slot ends. Shared slots are entered at a random offset.
+bool slot_allows(TxFrame &txFrame)
+{
+  if (!SLOTTED_SCHEDULE)
+  {
+    return true;
+  }
+  if (!synced)
+  {
+    return false;
+  }
+  Frame &frame = *(Frame *)txFrame.data;
+  uint8_t msgType = frame.packet.msgType;
+  unsigned long elapsed = millis() - slot_start();
+  unsigned long airtime = time_on_air(txFrame.len);
+  if (msgType == MSG_TYPE_CAPACITY || msgType == MSG_TYPE_CAPACITY_BATCH)
+  {
+    // The receiver ACKs right away, which has to fit in the slot as well
+    airtime += reply_time();
+  }
+  if (elapsed < SLOT_GUARD || elapsed + airtime + SLOT_GUARD > slotLength || (long)(replyDueUntil - millis()) > 0)
+  {
+    return false;
+  }
+
+  uint8_t slot = current_slot();
+  if (msgType == MSG_TYPE_ACK_BITMAP)
+  {
+    // Has no single receiver, children listen in this node's slot
+    return slot == frame_slot(txFrame) || slot_in_use();
+  }
+  if (msgType == MSG_TYPE_ACK_SUCCEED || msgType == MSG_TYPE_ACK_BATCH)
+  {
+    // Also in the receiver's slot, or right after the frame it answers
+    uint8_t receiverId = msgType == MSG_TYPE_ACK_SUCCEED ? frame.packet.data.ackPacket.receiverNode.nodeId
+                                                         : frame.packet.data.batchAckPacket.receiverNode.nodeId;
+    return slot == frame_slot(txFrame) || slot == slot_of(receiverId) || slot_in_use();
+  }
+  if (slot != frame_slot(txFrame))
+  {
+    return false;
+  }
+  return !contention_slot(slot) || elapsed >= SLOT_GUARD + contentionOffset % (slotLength - 2 * SLOT_GUARD - airtime + 1);
+}
+
+bool tx_waits_for(uint8_t slot)
+{
+  for (int i = 0; i < txQueueLength; i++)
+  {
+    if (frame_slot(txQueue[i]) == slot)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void pick_contention_offset()
+{
+  contentionOffset = random(65536L);
+}
+
+bool awaiting_ack()
+{
+  if (RELAY_ROLE && pendingBatch.inUse)
+  {
+    return true;
+  }
+  for (int i = 0; i < MAX_PENDING_ACKS; i++)
+  {
+    if (pendingAcks[i].inUse)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Slots this node listens or transmits in, only valid while synced
+bool slot_wanted(uint8_t slot)
+{
+  if (slot == contention_slot_of(NODE_ID) || slot == slot_of(next_hop()) || slot == watched_neighbour_slot() ||
+      slot == scanned_slot())
+  {
+    return true;
+  }
+  if (RELAY_ROLE && slot == slot_of(NODE_ID))
+  {
+    // Relays repeat the beacon in it
+    return true;
+  }
+  for (int i = 0; i < childCount; i++)
+  {
+    if (slot == slot_of(children[i].node.nodeId) && millis() - children[i].lastHeard < CHILD_TIMEOUT)
+    {
+      return true;
+    }
+  }
+  return tx_waits_for(slot);
+}
+
+// Whether the radio has to be on now. Without the timing or a route it listens all the time. Its
+// shared slot and slots it has frames for are listened to the end, and the next hop's while an ACK
+// is due, relayed ACKs come after its upstream frames. Other slots are left once nothing was heard
+// in them for listen_timeout().
+bool radio_window_open()
+{
+  if (!SLOTTED_SCHEDULE || !synced || !has_route())
+  {
+    return true;
+  }
+  uint8_t slot = current_slot();
+  unsigned long quietSince = slot_in_use() ? lastRadioActivity : slot_start();
+  bool quiet = millis() - quietSince >= listen_timeout();
+  if (!slot_wanted(slot))
+  {
+    // A frame went out in a slot it sent a reply for, or in someone else's shared slot
+    return slot_in_use() && !quiet;
+  }
+  if (slot == contention_slot_of(NODE_ID) || tx_waits_for(slot) || (slot == slot_of(next_hop()) && awaiting_ack()))
+  {
+    return true;
+  }
+  return !quiet;
+}
+
+// Start of the next slot the node listens or transmits in, there is a shared one every superframe
+unsigned long next_window_start()
+{
+  unsigned long start = slot_start();
+  uint8_t slot = current_slot();
+  for (uint16_t i = 0; i < slotCount; i++)
+  {
+    start += slotLength;
+    slot = (slot + 1) % slotCount;
+    if (slot_wanted(slot))
+    {
+      break;
+    }
+  }
+  return start;
+}
+
+// Inside a slot frames have to start right after the guard time
+unsigned long receive_timeout()
+{
+  return SLOTTED_SCHEDULE && synced ? SLOT_GUARD : RECEIVE_POLL_TIMEOUT;
+}
+
+// Radio asleep and the MCU in idle sleep until time, timer 0 keeps millis() going and wakes the MCU every ms
+void sleep_until(unsigned long time)
+{
+  rf95.sleep();
+#ifdef __AVR__
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  while ((long)(millis() - time) < 0)
+  {
+    sleep_mode();
+  }
+#else
+  delay(time - millis());
+#endif
+}
+
+int8_t find_child(uint8_t nodeId)
+{
+  for (int i = 0; i < childCount; i++)
+  {
+    if (children[i].node.nodeId == nodeId)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void add_child(uint8_t nodeId)
+{
+  int8_t index = find_child(nodeId);
+  if (index < 0)
+  {
+    if (childCount < MAX_CHILDREN)
+    {
+      index = childCount++;
+    }
+    else
+    {
+      // Make room by forgetting the child not heard from for longest
+      index = 0;
+      for (int i = 1; i < childCount; i++)
+      {
+        if (millis() - children[i].lastHeard > millis() - children[index].lastHeard)
+        {
+          index = i;
+        }
+      }
+    }
+    children[index].node.nodeId = nodeId;
+    children[index].highestNodeId = nodeId;
+    SYS_LOG.print("SYS: Listening in the slot of node ");
+    SYS_LOG.println(nodeId);
+  }
+  children[index].lastHeard = millis();
+}
+
+void remove_child(uint8_t nodeId)
+{
+  int8_t index = find_child(nodeId);
+  if (index >= 0)
+  {
+    children[index] = children[--childCount];
+  }
+}
+
+// Route requests, advertisements and beacons name the sender's next hop
+void heard_route_of(NodePacket &nodePacket)
+{
+  if (nodePacket.parentNode.nodeId == NODE_ID && nodePacket.pathCost != ROUTE_COST_INFINITE)
+  {
+    add_child(nodePacket.node.nodeId);
+  }
+  else
+  {
+    remove_child(nodePacket.node.nodeId);
+  }
+}
+
+// Passed up in the beacons so the server knows how many slots to give out
+uint8_t highest_node_id()
+{
+  uint8_t highest = NODE_ID;
+  for (int i = 0; i < childCount; i++)
+  {
+    if (children[i].highestNodeId > highest && millis() - children[i].lastHeard < CHILD_TIMEOUT)
+    {
+      highest = children[i].highestNodeId;
+    }
+  }
+  return highest;
+}
+
+// Relays repeat the beacon at the start of their own slot, so nodes further out get the timing and
+// the route. Without a route it withdraws it.
+void service_beacon()
+{
+  if (!synced || current_slot() != slot_of(NODE_ID) || millis() - lastBeaconSent < slotLength ||
+      tx_queue_holds(&lastBeaconSent))
+  {
+    return;
+  }
+  lastBeaconSent = millis();
+  send_beacon_packet();
+}
+
+// A new next hop does not listen in this node's slot yet, an advertisement in a shared slot names
+// it as the next hop. The server listens in every slot and needs no announcement.
+void service_hop_announcement()
+{
+  if (!synced || !has_route() || hop_listens(next_hop()) || tx_queue_holds(&lastAnnounceTime) ||
+      millis() - lastAnnounceTime < superframe_length())
+  {
+    return;
+  }
+  lastAnnounceTime = millis();
+  heard_reply_from(next_hop());
+  advertised_route();
+  send_node_packet(MSG_TYPE_RES_FORWARD_NODE, &lastAnnounceTime);
+}
+/* ========================================================== */
+/* ================== SLOT SCHEDULE FUNCTIONS =============== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ================ FILL FORECAST FUNCTIONS ================= */
+/* ========================================================== */
+// Alpha-beta filter over the bin level: the level estimate follows the samples, the rate follows
+// the error the last rate predicted them with. Until the fixed gains take over, the gains of the
+// expanding memory filter make it a least squares line through every sample since emptying.
+void sample_fill_level()
+{
+  if (millis() - lastFillSample < FILL_SAMPLE_INTERVAL && fillSamples > 0)
+  {
+    return;
+  }
+  lastFillSample = millis();
+
+  long measured = (long)binCapacity << FILL_FRACTION_BITS;
+  long predicted = fillLevel + fillRate;
+  long error = measured - predicted;
+  if (fillSamples == 0 || error < -((long)FILL_EMPTY_DROP << FILL_FRACTION_BITS))
+  {
+    // First sample or the bin was emptied: start over from this level
+    fillLevel = measured;
+    fillRate = 0;
+    fillSamples = 1;
+    forecastSamples = FORECAST_MIN_SAMPLES + random(FORECAST_MIN_SAMPLES + 1);
+    alertSent = false;
+    reportedMinutesToFull = FULL_UNKNOWN;
+    return;
+  }
+
+  long n = fillSamples + 1;
+  long span = n * (n + 1);
+  fillLevel = predicted + (span < 2 * (2 * n - 1) * FILL_LEVEL_GAIN ? error * 2 * (2 * n - 1) / span : error / FILL_LEVEL_GAIN);
+  fillRate += span < 6 * FILL_RATE_GAIN ? error * 6 / span : error / FILL_RATE_GAIN;
+  if (fillSamples < 255)
+  {
+    fillSamples++;
+  }
+}
+
+// Minutes until the bin is full at the estimated rate, FULL_UNKNOWN while it is not filling
+uint16_t minutes_to_full()
+{
+  if (!FILL_FORECAST || fillSamples < forecastSamples || fillRate <= 0)
+  {
+    return FULL_UNKNOWN;
+  }
+  long left = (100L << FILL_FRACTION_BITS) - fillLevel;
+  if (left <= 0)
+  {
+    return 0;
+  }
+  unsigned long minutes = (unsigned long)left * (FILL_SAMPLE_INTERVAL / 1000) / fillRate / 60;
+  return minutes < FULL_UNKNOWN ? minutes : FULL_UNKNOWN - 1;
+}
+
+// Whether the forecast moved far enough from the one the server has to be worth a report
+bool forecast_drifted(uint16_t minutes)
+{
+  if (minutes == FULL_UNKNOWN)
+  {
+    return false;
+  }
+  if (reportedMinutesToFull == FULL_UNKNOWN)
+  {
+    return true;
+  }
+  long expected = (long)reportedMinutesToFull - (long)((millis() - reportedTime) / 60000UL);
+  long tolerance = expected / FORECAST_CHANGE_DIVISOR;
+  if (tolerance < FORECAST_MIN_CHANGE)
+  {
+    tolerance = FORECAST_MIN_CHANGE;
+  }
+  long drift = (long)minutes - expected;
+  return drift > tolerance || drift < -tolerance;
+}
+
+// Report a forecast that moved, and a bin that crossed ALERT_THRESHOLD unless the server's
+// forecast already said so. Bins filling alike alert at different levels instead of together.
+void service_fill_report()
+{
+  uint16_t minutes = minutes_to_full();
+  bool drifted = forecast_drifted(minutes);
+  if (binCapacity >= ALERT_THRESHOLD && reportedMinutesToFull != FULL_UNKNOWN && !drifted)
+  {
+    alertSent = true;
+    return;
+  }
+  if (binCapacity >= ALERT_THRESHOLD || drifted)
+  {
+    sentMinutesToFull = minutes;
+    sentForecastTime = millis();
+    forward_capacity_packet(NODE_ID, alertSeq, binCapacity, minutes, NODE_ID);
+  }
+}
+
+// The server ACKed this node's latest report
+void fill_report_acked()
+{
+  if (binCapacity >= ALERT_THRESHOLD)
+  {
+    alertSent = true;
+  }
+  if (sentMinutesToFull != FULL_UNKNOWN)
+  {
+    reportedMinutesToFull = sentMinutesToFull;
+    reportedTime = sentForecastTime;
+  }
+  alertSeq++;
+}
+/* ========================================================== */
+/* ================ FILL FORECAST FUNCTIONS ================= */
+/* ========================================================== */
+
+/* ========================================================== */
+/* =================== TELEMETRY FUNCTIONS ================== */
+/* ========================================================== */
+// Count an ACK in the round-trip histogram, timed from the attempt it answers
+void record_ack_rtt(unsigned long sentTime)
+{
+  unsigned long rtt = millis() - sentTime;
+  unsigned long limit = ACK_RTT_BASE;
+  uint8_t bucket = 0;
+  while (bucket < ACK_RTT_BUCKETS - 1 && rtt >= limit)
+  {
+    bucket++;
+    limit <<= 2;
+  }
+  ackRtt[bucket]++;
+}
+
+void service_stats()
+{
+  uint8_t hop = has_route() ? next_hop() : ROUTE_COST_INFINITE;
+  if (hop != statsHop)
+  {
+    routeChanges++;
+    statsHop = hop;
+  }
+  // Telemetry waits until no capacity report is queued or in flight, so it never holds up an alert
+  if (!has_route() || (long)(millis() - nextStatsTime) < 0 || awaiting_ack() || capacityPackets > 0)
+  {
+    return;
+  }
+  nextStatsTime = millis() + STATS_INTERVAL;
+  send_stats_packet();
+}
+
+void send_stats_packet()
+{
+  StatsFrame frame;
+  frame.authKey = AUTH_KEY;
+  frame.msgType = MSG_TYPE_STATS;
+  StatsPacket &stats = frame.data;
+  stats.senderNode.nodeId = NODE_ID;
+  stats.receiverNode.nodeId = next_hop();
+  stats.originNode.nodeId = NODE_ID;
+  stats.pathCost = route_cost();
+  stats.uptime = millis() / 60000UL;
+  stats.txFrames = rf95.txGood();
+  stats.rxFrames = rf95.rxGood();
+  stats.retransmissions = retransmissions;
+  stats.ackTimeouts = ackTimeouts;
+  stats.routeChanges = routeChanges;
+  stats.txQueueHighWater = txQueueHighWater;
+  stats.capacityQueueHighWater = capacityQueueHighWater;
+  memcpy(stats.ackRtt, ackRtt, sizeof(ackRtt));
+
+  TRAFFIC_LOG.println("REQUEST: Sending telemetry to the server");
+  sendPacket((uint8_t *)&frame, sizeof(frame));
+}
+
+// Telemetry is not worth a retransmission, a frame that cannot go on towards the server is dropped
+void handle_stats_packet(StatsPacket &packet)
+{
+  if (packet.receiverNode.nodeId != NODE_ID || !has_route() || packet.pathCost <= route_cost())
+  {
+    return;
+  }
+
+  StatsFrame frame;
+  frame.authKey = AUTH_KEY;
+  frame.msgType = MSG_TYPE_STATS;
+  frame.data = packet;
+  frame.data.senderNode.nodeId = NODE_ID;
+  frame.data.receiverNode.nodeId = next_hop();
+  frame.data.pathCost = route_cost();
+  sendPacket((uint8_t *)&frame, sizeof(frame));
+}
+/* ========================================================== */
+/* =================== TELEMETRY FUNCTIONS ================== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ============== CAPACITY HANDLING FUNCTIONS =============== */
+/* ========================================================== */
+// Whether a goes out before b: the fuller bin first, every CAPACITY_AGE_STEP spent waiting counts as
+// one more percent. All entries age alike, so the order never changes while they wait.
+bool capacity_before(const QueuedCapacity &a, const QueuedCapacity &b)
+{
+  long capacityAhead = ((long)a.packet.binCapacity - b.packet.binCapacity) * CAPACITY_AGE_STEP;
+  long waitedLonger = (long)(b.queuedTime - a.queuedTime);
+  return capacityAhead + waitedLonger > 0;
+}
+
+void capacity_sift_up(uint8_t i)
+{
+  while (i > 0)
+  {
+    uint8_t parent = (i - 1) / 2;
+    if (!capacity_before(processCapacityPackets[i], processCapacityPackets[parent]))
+    {
+      break;
+    }
+    QueuedCapacity temp = processCapacityPackets[i];
+    processCapacityPackets[i] = processCapacityPackets[parent];
+    processCapacityPackets[parent] = temp;
+    i = parent;
+  }
+}
+
+void capacity_sift_down(uint8_t i)
+{
+  while (true)
+  {
+    uint8_t first = i;
+    uint8_t left = 2 * i + 1;
+    uint8_t right = left + 1;
+    if (left < capacityPackets && capacity_before(processCapacityPackets[left], processCapacityPackets[first]))
+    {
+      first = left;
+    }
+    if (right < capacityPackets && capacity_before(processCapacityPackets[right], processCapacityPackets[first]))
+    {
+      first = right;
+    }
+    if (first == i)
+    {
+      break;
+    }
+    QueuedCapacity temp = processCapacityPackets[i];
+    processCapacityPackets[i] = processCapacityPackets[first];
+    processCapacityPackets[first] = temp;
+    i = first;
+  }
+}
+
+// The queue holds one reading per bin: a newer one replaces the queued one and keeps its age.
+// When the queue is full the least urgent packet makes room, or the new one is dropped.
+void add_to_capacity_list(CapacityPacket cpacket)
+{
+  for (uint8_t i = 0; i < capacityPackets; i++)
+  {
+    QueuedCapacity &queued = processCapacityPackets[i];
+    if (queued.packet.alertNode.nodeId != cpacket.alertNode.nodeId)
+    {
+      continue;
+    }
+    if ((int8_t)(cpacket.alertSeq - queued.packet.alertSeq) < 0)
+    {
+      TRAFFIC_LOG.println("SYS: Older capacity packet than the queued one, dropping it");
+      return;
+    }
+    queued.packet = cpacket;
+    capacityCoalesced++;
+    capacity_sift_up(i);
+    capacity_sift_down(i);
+    TRAFFIC_LOG.println("SYS: Replaced the queued capacity packet of the same bin");
+    return;
+  }
+
+  QueuedCapacity entry;
+  entry.packet = cpacket;
+  entry.queuedTime = millis();
+
+  if (capacityPackets == MAX_CAPACITY_PACKETS)
+  {
+    // The least urgent packet is one of the leaves
+    uint8_t last = MAX_CAPACITY_PACKETS / 2;
+    for (uint8_t i = last + 1; i < capacityPackets; i++)
+    {
+      if (capacity_before(processCapacityPackets[last], processCapacityPackets[i]))
+      {
+        last = i;
+      }
+    }
+    capacityEvicted++;
+    if (!capacity_before(entry, processCapacityPackets[last]))
+    {
+      SYS_LOG.println("SYS: Capacity list is full, dropping packet");
+      return;
+    }
+    processCapacityPackets[last] = entry;
+    capacity_sift_up(last);
+    SYS_LOG.println("SYS: Capacity list is full, replaced the least urgent packet");
+    return;
+  }
+
+  if (capacityPackets == 0)
+  {
+    capacityListStartTime = entry.queuedTime;
+  }
+  processCapacityPackets[capacityPackets] = entry;
+  capacity_sift_up(capacityPackets++);
+  if (capacityPackets > capacityQueueHighWater)
+  {
+    capacityQueueHighWater = capacityPackets;
+  }
+
+  TRAFFIC_LOG.println("SYS: Add packet to the capacity list");
+}
+
+void remove_from_capacity_list()
+{
+  if (capacityPackets > 0)
+  {
+    capacityPackets--;
+    processCapacityPackets[0] = processCapacityPackets[capacityPackets];
+    capacity_sift_down(0);
+
+    TRAFFIC_LOG.println("SYS: Removed first capacity packet from list");
+  }
+  else
+  {
+    TRAFFIC_LOG.println("SYS: No capacity packets to remove from the list");
+  }
+}
+
+// Move queued capacity packets in flight, sharing one frame when several are waiting
+void process_capacity_list()
+{
+  if (capacityPackets == 0 || !has_route())
+  {
+    return;
+  }
+
+  // Give other packets BATCH_WINDOW to arrive so they can share the frame, with the slotted schedule
+  // they gather until the slot they can go in
+  if (SLOTTED_SCHEDULE ? !upstream_slot_open()
+                       : capacityPackets < MAX_BATCH_RECORDS && capacityPackets < MAX_CAPACITY_PACKETS &&
+                             millis() - capacityListStartTime < BATCH_WINDOW)
+  {
+    return;
+  }
+
+  if (capacityPackets >= 2 && !pendingBatch.inUse)
+  {
+    forward_capacity_batch();
+  }
+
+  while (capacityPackets > 0)
+  {
+    CapacityPacket &cpacket = processCapacityPackets[0].packet;
+    if (!forward_capacity_packet(cpacket.alertNode.nodeId, cpacket.alertSeq, cpacket.binCapacity, cpacket.minutesToFull,
+                                 cpacket.senderNode.nodeId))
+    {
+      break;
+    }
+    remove_from_capacity_list();
+  }
+}
+
+// Whether this alert already left here for the server, queued copies are merged by add_to_capacity_list()
+bool capacity_packet_in_flight(uint8_t alertId, uint8_t seq)
+{
+  if (pendingBatch.inUse)
+  {
+    CapacityBatchPacket &batch = pendingBatch.packet.data;
+    for (int i = 0; i < batch.recordCount; i++)
+    {
+      if (!(pendingBatch.ackedRecords & (1 << i)) && batch.records[i].alertNode.nodeId == alertId &&
+          batch.records[i].alertSeq == seq)
+      {
+        return true;
+      }
+    }
+  }
+  return find_pending_ack(alertId, seq) >= 0;
+}
+/* ========================================================== */
+/* ============== CAPACITY HANDLING FUNCTIONS =============== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ================= ACK HANDLING FUNCTIONS ================= */
+/* ========================================================== */
+int8_t find_pending_ack(uint8_t alertId, uint8_t seq)
+{
+  for (int i = 0; i < MAX_PENDING_ACKS; i++)
+  {
+    CapacityPacket &cpacket = pendingAcks[i].packet.data.capacityPacket;
+    if (pendingAcks[i].inUse && cpacket.alertNode.nodeId == alertId && cpacket.alertSeq == seq)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int8_t add_to_pending_acks(uint8_t childId)
+{
+  for (int i = 0; i < MAX_PENDING_ACKS; i++)
+  {
+    if (!pendingAcks[i].inUse)
+    {
+      pendingAcks[i].childNode.nodeId = childId;
+      pendingAcks[i].retransmits = 0;
+      pendingAcks[i].inUse = true;
+      return i;
+    }
+  }
+  return -1;
+}
+
+void remove_from_pending_acks(uint8_t index)
+{
+  // A retransmission still waiting for airtime is no longer needed
+  tx_queue_cancel(&pendingAcks[index].lastSentTime);
+  pendingAcks[index].inUse = false;
+}
+
+// Retransmit every capacity packet whose ACK is overdue, giving up after MAX_RETRANSMITS
+void service_pending_acks()
+{
+  for (int i = 0; i < MAX_PENDING_ACKS; i++)
+  {
+    PendingAck &pending = pendingAcks[i];
+    // The ACK timer only starts once the TX scheduler has put the packet on air
+    if (!pending.inUse || millis() - pending.lastSentTime < ack_timeout() + pending.retryBackoff ||
+        tx_queue_holds(&pending.lastSentTime))
+    {
+      continue;
+    }
+
+    CapacityPacket &cpacket = pending.packet.data.capacityPacket;
+    link_failed(cpacket.receiverNode.nodeId);
+    ackTimeouts++;
+    // A retransmission lost as well, the next hop may have stopped listening in this node's slot
+    if (pending.retransmits > 0)
+    {
+      listenedHop = NO_SLOT;
+    }
+
+    if (pending.retransmits < MAX_RETRANSMITS)
+    {
+      TRAFFIC_LOG.println("ACK: Not received, attempting to retransmit");
+      // The failed attempt may have made another neighbour the cheaper way to the server
+      if (has_route())
+      {
+        cpacket.receiverNode.nodeId = next_hop();
+      }
+      pending.lastSentTime = millis();
+      pending.retransmits++;
+      pending.retryBackoff = retry_backoff(pending.retransmits, packet_length(pending.packet));
+      sendPacket((uint8_t *)&pending.packet, packet_length(pending.packet), &pending.lastSentTime);
+      retransmissions++;
+      continue;
+    }
+
+    // Every failed attempt raised the link's ETX, so the route moves to another neighbour
+    // once that one is cheaper, a single lost ACK no longer drops the forwarding node
+    TRAFFIC_LOG.println("Ack: Not received, giving up on the packet");
+
+    // Requeue relayed packets so they go out again once a forwarding node is found
+    if (RELAY_ROLE && pending.childNode.nodeId != NODE_ID)
+    {
+      cpacket.senderNode = pending.childNode;
+      add_to_capacity_list(cpacket);
+    }
+    remove_from_pending_acks(i);
+  }
+}
+
+// Same as service_pending_acks() for the capacity batch in flight
+void service_pending_batch()
+{
+  if (!pendingBatch.inUse || millis() - pendingBatch.lastSentTime < ack_timeout() + pendingBatch.retryBackoff ||
+      tx_queue_holds(&pendingBatch.lastSentTime))
+  {
+    return;
+  }
+
+  CapacityBatchPacket &batch = pendingBatch.packet.data;
+  link_failed(batch.receiverNode.nodeId);
+  ackTimeouts++;
+  if (pendingBatch.retransmits > 0)
+  {
+    listenedHop = NO_SLOT;
+  }
+
+  if (pendingBatch.retransmits < MAX_RETRANSMITS)
+  {
+    TRAFFIC_LOG.println("ACK: Not received, attempting to retransmit batch");
+    if (has_route())
+    {
+      batch.receiverNode.nodeId = next_hop();
+    }
+    pendingBatch.lastSentTime = millis();
+    pendingBatch.retransmits++;
+    pendingBatch.retryBackoff = retry_backoff(pendingBatch.retransmits, batch_packet_length(pendingBatch.packet));
+    sendPacket((uint8_t *)&pendingBatch.packet, batch_packet_length(pendingBatch.packet), &pendingBatch.lastSentTime);
+    retransmissions++;
+    return;
+  }
+
+  TRAFFIC_LOG.println("Ack: Not received, giving up on the batch");
+
+  for (int i = 0; i < batch.recordCount; i++)
+  {
+    if (!(pendingBatch.ackedRecords & (1 << i)) && pendingBatch.childNodes[i].nodeId != NODE_ID)
+    {
+      CapacityPacket cpacket;
+      cpacket.alertNode = batch.records[i].alertNode;
+      cpacket.senderNode = pendingBatch.childNodes[i];
+      cpacket.receiverNode.nodeId = NODE_ID;
+      cpacket.binCapacity = batch.records[i].binCapacity;
+      cpacket.alertSeq = batch.records[i].alertSeq;
+      cpacket.minutesToFull = batch.records[i].minutesToFull;
+      add_to_capacity_list(cpacket);
+    }
+  }
+  pendingBatch.inUse = false;
+}
+
+// Pass the ACK for one record of the capacity batch back to where the record came from
+void complete_batch_record(uint8_t index)
+{
+  CapacityRecord &record = pendingBatch.packet.data.records[index];
+  if (record.alertNode.nodeId == NODE_ID)
+  {
+    fill_report_acked();
+  }
+  else
+  {
+    mark_seq_acked(record.alertNode.nodeId, record.alertSeq);
+    queue_ack(record.alertNode.nodeId, record.alertSeq, pendingBatch.childNodes[index].nodeId);
+  }
+  pendingBatch.ackedRecords |= 1 << index;
+}
+
+// The server has alert seq of alertId: end what waits for its ACK here and pass the ACK back to
+// where the alert came from. Returns whether senderId is the node the alert was sent to, only then
+// the ACK counts for the link.
+bool ack_alert(uint8_t alertId, uint8_t seq, uint8_t senderId)
+{
+  // The server has this alert, copies of it arriving later are ACKed right here
+  if (RELAY_ROLE && alertId != NODE_ID)
+  {
+    mark_seq_acked(alertId, seq);
+  }
+
+  int8_t index = find_pending_ack(alertId, seq);
+  if (index < 0)
+  {
+    // The record may have gone upstream in the capacity batch instead
+    if (RELAY_ROLE && pendingBatch.inUse)
+    {
+      CapacityBatchPacket &batch = pendingBatch.packet.data;
+      for (int i = 0; i < batch.recordCount; i++)
+      {
+        if (!(pendingBatch.ackedRecords & (1 << i)) && batch.records[i].alertNode.nodeId == alertId &&
+            batch.records[i].alertSeq == seq)
+        {
+          TRAFFIC_LOG.println("ACK: Received, capacity alert sent to server");
+          bool fromHop = batch.receiverNode.nodeId == senderId;
+          if (fromHop)
+          {
+            link_acked(senderId);
+            record_ack_rtt(pendingBatch.lastSentTime);
+          }
+          complete_batch_record(i);
+          if (pendingBatch.ackedRecords == (1 << batch.recordCount) - 1)
+          {
+            tx_queue_cancel(&pendingBatch.lastSentTime);
+            pendingBatch.inUse = false;
+          }
+          return fromHop;
+        }
+      }
+    }
+    // Late ACK for a packet that was already acknowledged or given up on
+    return false;
+  }
+
+  TRAFFIC_LOG.println("ACK: Received, capacity alert sent to server");
+  bool fromHop = pendingAcks[index].packet.data.capacityPacket.receiverNode.nodeId == senderId;
+  if (fromHop)
+  {
+    link_acked(senderId);
+    record_ack_rtt(pendingAcks[index].lastSentTime);
+  }
+  if (alertId == NODE_ID)
+  {
+    fill_report_acked();
+  }
+  else
+  {
+    TRAFFIC_LOG.println("RESPONSE: Forwarding ACK to alert node");
+    queue_ack(alertId, seq, pendingAcks[index].childNode.nodeId);
+  }
+  remove_from_pending_acks(index);
+  return fromHop;
+}
+
+// ACKs for children that fall due within ACK_AGGREGATE_WINDOW of the first share one frame, each
+// alert node's record carrying everything the server is known to have of it
+void queue_ack(uint8_t alertId, uint8_t seq, uint8_t receiverId)
+{
+  int8_t window = find_seq_window(alertId);
+  if (window < 0)
+  {
+    send_ack_packet(alertId, seq, receiverId);
+    return;
+  }
+  if (aggregatedAcks == 0)
+  {
+    ackAggregateStart = millis();
+    firstAggregatedAck = construct_ack_packet(alertId, seq, receiverId);
+    ackAggregate.recordCount = 0;
+  }
+  aggregatedAcks++;
+
+  uint8_t i = 0;
+  while (i < ackAggregate.recordCount && ackAggregate.records[i].alertNode.nodeId != alertId)
+  {
+    i++;
+  }
+  ackAggregate.records[i] = ackedAlerts[window];
+  if (i == ackAggregate.recordCount && ++ackAggregate.recordCount == MAX_ACK_RECORDS)
+  {
+    send_ack_aggregate();
+  }
+}
+
+void service_ack_aggregate()
+{
+  if (aggregatedAcks > 0 && millis() - ackAggregateStart >= ACK_AGGREGATE_WINDOW)
+  {
+    send_ack_aggregate();
+  }
+}
+
+// A lone ACK goes out as a plain MSG_TYPE_ACK_SUCCEED, it is shorter
+void send_ack_aggregate()
+{
+  if (aggregatedAcks == 1)
+  {
+    send_ack_packet(firstAggregatedAck.alertNode.nodeId, firstAggregatedAck.alertSeq, firstAggregatedAck.receiverNode.nodeId);
+  }
+  else
+  {
+    Frame frame;
+    frame.ackBitmapFrame.authKey = AUTH_KEY;
+    frame.ackBitmapFrame.msgType = MSG_TYPE_ACK_BITMAP;
+    frame.ackBitmapFrame.data = ackAggregate;
+    frame.ackBitmapFrame.data.senderNode.nodeId = NODE_ID;
+    sendPacket((uint8_t *)&frame, ack_bitmap_length(frame.ackBitmapFrame));
+  }
+  aggregatedAcks = 0;
+}
+
+// Retransmit the forwarding node request until a node accepts or JOIN_TIMEOUT passes
+void service_join_request()
+{
+  if (!joinPending || tx_queue_holds(&lastJoinRequestTime))
+  {
+    return;
+  }
+
+  if (millis() - joinRequestStartTime > JOIN_TIMEOUT)
+  {
+    TRAFFIC_LOG.println("ACK: Not received, no nodes accepted as forwarding node");
+    joinPending = false;
+    // The withdrawal has had JOIN_TIMEOUT to reach the nodes that routed through this one,
+    // stop waiting for the server's next sequence number and take any route again
+    feasibleCost = ROUTE_COST_INFINITE;
+    reset_data_rate();
+  }
+  else if (millis() - lastJoinRequestTime >= joinRetryDelay)
+  {
+    TRAFFIC_LOG.println("ACK: Not received, attempting to retransmit");
+    send_join_request();
+  }
+}
+
+// Random wait of up to 2^retransmits airtimes of the frame
+uint16_t retry_backoff(uint8_t retransmits, uint8_t len)
+{
+  return random(time_on_air(len) << (retransmits < RETRY_BACKOFF_MAX_EXP ? retransmits : RETRY_BACKOFF_MAX_EXP));
+}
+
+// Binary exponential backoff with jitter: the next request waits between half and all of a window
+// that doubles with every request, so nodes that booted together stop asking in step
+void send_join_request()
+{
+  unsigned long window = (unsigned long)JOIN_RETRY_INTERVAL << (joinAttempts < JOIN_BACKOFF_MAX_EXP ? joinAttempts : JOIN_BACKOFF_MAX_EXP);
+  joinRetryDelay = window / 2 + random(window / 2 + 1);
+  joinAttempts++;
+  lastJoinRequestTime = millis();
+  send_node_packet(MSG_TYPE_REQ_FORWARD_NODE, &lastJoinRequestTime);
+}
+/* ========================================================== */
+/* ================= ACK HANDLING FUNCTIONS ================= */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ============= DUPLICATE SUPPRESSION FUNCTIONS ============ */
+/* ========================================================== */
+int8_t find_seq_window(uint8_t alertId)
+{
+  for (int i = 0; i < seqWindowsUsed; i++)
+  {
+    if (ackedAlerts[i].alertNode.nodeId == alertId)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool seq_acked(uint8_t alertId, uint8_t seq)
+{
+  int8_t index = find_seq_window(alertId);
+  if (index < 0)
+  {
+    return false;
+  }
+  // Sequence numbers wrap, anything more than the window behind is taken as new (e.g. the alert node rebooted)
+  uint8_t age = ackedAlerts[index].highestSeq - seq;
+  return age < SEQ_WINDOW_SIZE && (ackedAlerts[index].seen & (1U << age));
+}
+
+void mark_seq_acked(uint8_t alertId, uint8_t seq)
+{
+  int8_t index = find_seq_window(alertId);
+  if (index < 0)
+  {
+    if (seqWindowsUsed < MAX_SEQ_WINDOWS)
+    {
+      index = seqWindowsUsed++;
+    }
+    else
+    {
+      index = nextSeqWindow;
+      nextSeqWindow = (nextSeqWindow + 1) % MAX_SEQ_WINDOWS;
+    }
+    ackedAlerts[index].alertNode.nodeId = alertId;
+    ackedAlerts[index].highestSeq = seq;
+    ackedAlerts[index].seen = 1;
+    return;
+  }
+
+  SeqWindow &window = ackedAlerts[index];
+  uint8_t age = window.highestSeq - seq;
+  uint8_t ahead = seq - window.highestSeq;
+  if (age < SEQ_WINDOW_SIZE)
+  {
+    window.seen |= 1U << age;
+  }
+  else
+  {
+    // Newer than the window, or so far behind that the alert node must have started over
+    window.seen = ahead < SEQ_WINDOW_SIZE ? (window.seen << ahead) | 1 : 1;
+    window.highestSeq = seq;
+  }
+}
+
+// A capacity packet sent again because its ACK got lost is not forwarded a second time:
+// if the server already ACKed it the ACK is repeated from here, if it is still on its
+// way the ACK will follow
+bool suppress_duplicate(CapacityPacket &cpacket)
+{
+  if (seq_acked(cpacket.alertNode.nodeId, cpacket.alertSeq))
+  {
+    duplicatesAcked++;
+    TRAFFIC_LOG.println("SYS: Duplicate capacity packet, already at the server");
+    queue_ack(cpacket.alertNode.nodeId, cpacket.alertSeq, cpacket.senderNode.nodeId);
+    print_duplicate_counters();
+    return true;
+  }
+  if (capacity_packet_in_flight(cpacket.alertNode.nodeId, cpacket.alertSeq))
+  {
+    duplicatesDropped++;
+    TRAFFIC_LOG.println("SYS: Duplicate capacity packet, already forwarding it");
+    print_duplicate_counters();
+    return true;
+  }
+  return false;
+}
+
+void print_duplicate_counters()
+{
+  TRAFFIC_LOG.print("SYS: Duplicates ACKed here ");
+  TRAFFIC_LOG.print(duplicatesAcked);
+  TRAFFIC_LOG.print(", dropped ");
+  TRAFFIC_LOG.println(duplicatesDropped);
+}
+/* ========================================================== */
+/* ============= DUPLICATE SUPPRESSION FUNCTIONS ============ */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ================= TX SCHEDULER FUNCTIONS ================= */
+/* ========================================================== */
+uint8_t tx_priority(uint8_t msgType)
+{
+  if (msgType == MSG_TYPE_BEACON)
+  {
+    return TX_PRIORITY_BEACON;
+  }
+  if (msgType == MSG_TYPE_ACK_SUCCEED || msgType == MSG_TYPE_ACK_BATCH || msgType == MSG_TYPE_ACK_BITMAP)
+  {
+    return TX_PRIORITY_ACK;
+  }
+  if (msgType == MSG_TYPE_CAPACITY || msgType == MSG_TYPE_CAPACITY_BATCH)
+  {
+    return TX_PRIORITY_ALERT;
+  }
+  if (msgType == MSG_TYPE_RES_FORWARD_NODE)
+  {
+    return TX_PRIORITY_ROUTE;
+  }
+  if (msgType == MSG_TYPE_STATS)
+  {
+    return TX_PRIORITY_STATS;
+  }
+  return TX_PRIORITY_JOIN;
+}
+
+// Token bucket: every second earns DUTY_CYCLE_PERCENT * 10 ms of airtime, up to AIRTIME_BUCKET_SIZE
+void refill_airtime_tokens()
+{
+  unsigned long earned = (millis() - lastTokenRefill) * DUTY_CYCLE_PERCENT / 100;
+  if (earned > 0)
+  {
+    // Only move the refill time by what was paid for so fractions of a ms carry over
+    lastTokenRefill += earned * 100 / DUTY_CYCLE_PERCENT;
+    airtimeTokens += earned;
+    if (airtimeTokens > AIRTIME_BUCKET_SIZE)
+    {
+      airtimeTokens = AIRTIME_BUCKET_SIZE;
+    }
+  }
+}
+
+unsigned long airtime_remaining()
+{
+  refill_airtime_tokens();
+  return airtimeTokens;
+}
+
+// Transmit queued frames in priority order for as long as the airtime budget allows. With the
+// slotted schedule a frame waiting for its slot lets the ones behind it go in theirs.
+void service_tx_queue()
+{
+  uint8_t i = 0;
+  while (i < txQueueLength)
+  {
+    TxFrame &frame = txQueue[i];
+    int8_t power = stamp_tx_power(frame);
+    if (!slot_allows(frame))
+    {
+      i++;
+      continue;
+    }
+    unsigned long airtime = time_on_air(frame.len);
+    if (airtime_remaining() < airtime)
+    {
+      // Lower priority frames wait behind it so they cannot starve it
+      return;
+    }
+    if (!channel_clear(frame.len))
+    {
+      return;
+    }
+
+    airtimeTokens -= airtime;
+    airtimeUsed += airtime;
+    if (frame.sentTime)
+    {
+      *frame.sentTime = millis();
+    }
+    if (SLOTTED_SCHEDULE && contention_slot(current_slot()))
+    {
+      pick_contention_offset();
+    }
+    stamp_beacon(frame);
+    rf95.setTxPower(power, false);
+    transmit_frame(frame.data, frame.len);
+    if (frame.data[1] == MSG_TYPE_CAPACITY || frame.data[1] == MSG_TYPE_CAPACITY_BATCH)
+    {
+      // Keep quiet while the ACK comes back
+      replyDueUntil = millis() + reply_time();
+    }
+
+    txQueueLength--;
+    for (int j = i; j < txQueueLength; j++)
+    {
+      txQueue[j] = txQueue[j + 1];
+    }
+  }
+}
+
+bool tx_queue_holds(unsigned long *sentTime)
+{
+  for (int i = 0; i < txQueueLength; i++)
+  {
+    if (txQueue[i].sentTime == sentTime)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void tx_queue_cancel(unsigned long *sentTime)
+{
+  for (int i = 0; i < txQueueLength; i++)
+  {
+    if (txQueue[i].sentTime == sentTime)
+    {
+      txQueueLength--;
+      for (int j = i; j < txQueueLength; j++)
+      {
+        txQueue[j] = txQueue[j + 1];
+      }
+      return;
+    }
+  }
+}
+
+// Capacity frames to the server go out at the power the server picked and carry it, so the server
+// can tell its margin and other nodes scale their link estimate. Everything else uses TX_POWER_DEFAULT
+// so neighbours that route through this node keep hearing it.
+int8_t stamp_tx_power(TxFrame &txFrame)
+{
+  Frame &frame = *(Frame *)txFrame.data;
+  int8_t power = TX_POWER_DEFAULT;
+  if (frame.packet.msgType == MSG_TYPE_CAPACITY)
+  {
+    CapacityPacket &cpacket = frame.packet.data.capacityPacket;
+    power = cpacket.receiverNode.nodeId == SERVER_ID ? dataTxPower : TX_POWER_DEFAULT;
+    cpacket.txPower = power;
+    txFrame.len = packet_length(frame.packet);
+  }
+  else if (frame.packet.msgType == MSG_TYPE_CAPACITY_BATCH)
+  {
+    CapacityBatchPacket &batch = frame.batchPacket.data;
+    power = batch.receiverNode.nodeId == SERVER_ID ? dataTxPower : TX_POWER_DEFAULT;
+    batch.txPower = power;
+  }
+  return power;
+}
+
+// A beacon says how far into the superframe it went on air, so it is stamped right before that
+void stamp_beacon(TxFrame &txFrame)
+{
+  Frame &frame = *(Frame *)txFrame.data;
+  if (frame.packet.msgType == MSG_TYPE_BEACON)
+  {
+    frame.packet.data.beaconPacket.beaconSeq = current_superframe();
+    frame.packet.data.beaconPacket.offset = (millis() - superframeStart) % superframe_length();
+  }
+}
+
+// Channel activity detection before a frame of len bytes goes on air, after a busy one the TX queue
+// waits a random part of a window of 2^cadBusyCount airtimes
+bool channel_clear(uint8_t len)
+{
+  if (!LISTEN_BEFORE_TALK)
+  {
+    return true;
+  }
+  if ((long)(millis() - txBackoffUntil) < 0)
+  {
+    return false;
+  }
+  if (!rf95.isChannelActive())
+  {
+    cadBusyCount = 0;
+    return true;
+  }
+  unsigned long window = time_on_air(len) << (cadBusyCount < CAD_BACKOFF_MAX_EXP ? cadBusyCount : CAD_BACKOFF_MAX_EXP);
+  txBackoffUntil = millis() + 1 + random(window);
+  cadBusyCount++;
+  cadBackoffs++;
+  return false;
+}
+
+void print_airtime_budget()
+{
+  TRAFFIC_LOG.print("SYS: Airtime used ");
+  TRAFFIC_LOG.print(airtimeUsed);
+  TRAFFIC_LOG.print(" ms, remaining ");
+  TRAFFIC_LOG.print(airtimeTokens);
+  TRAFFIC_LOG.print(" ms, deferred ");
+  TRAFFIC_LOG.print(txDeferred);
+  TRAFFIC_LOG.print(", dropped ");
+  TRAFFIC_LOG.println(txDropped);
+}
+/* ========================================================== */
+/* ================= TX SCHEDULER FUNCTIONS ================= */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ============ TRANSMITTING/RECEIVING FUNCTIONS ============ */
+/* ========================================================== */
+NodePacket construct_node_packet()
+{
+  Node node;
+  NodePacket nodePacket;
+
+  node.nodeId = NODE_ID;
+  nodePacket.node = node;
+  nodePacket.pathCost = route_cost();
+  nodePacket.parentNode.nodeId = next_hop();
+  nodePacket.routeSeq = route_seq();
+
+  return nodePacket;
+}
+
+CapacityPacket construct_capacity_packet(uint8_t alertId, uint8_t seq, uint8_t binCapacity, uint16_t minutesToFull)
+{
+  Node alertNode;
+  Node senderNode;
+  Node receiverNode;
+  CapacityPacket capacityPacket;
+
+  alertNode.nodeId = alertId;
+  senderNode.nodeId = NODE_ID;
+  receiverNode.nodeId = next_hop();
+  capacityPacket.alertNode = alertNode;
+  capacityPacket.senderNode = senderNode;
+  capacityPacket.receiverNode = receiverNode;
+  capacityPacket.binCapacity = binCapacity;
+  capacityPacket.pathCost = route_cost();
+  capacityPacket.alertSeq = seq;
+  capacityPacket.txPower = TX_POWER_DEFAULT;
+  capacityPacket.minutesToFull = minutesToFull;
+
+  return capacityPacket;
+}
+
+AckPacket construct_ack_packet(uint8_t alertId, uint8_t seq, uint8_t receiverId)
+{
+  Node alertNode;
+  Node receiverNode;
+  AckPacket ackPacket;
+
+  alertNode.nodeId = alertId;
+  receiverNode.nodeId = receiverId;
+  ackPacket.alertNode = alertNode;
+  ackPacket.receiverNode = receiverNode;
+  ackPacket.senderNode.nodeId = NODE_ID;
+  ackPacket.alertSeq = seq;
+
+  return ackPacket;
+}
+
+// Refresh what is known about the neighbour that sent the frame
+void learn_from_frame(Frame &frame)
+{
+  Packet &packet = frame.packet;
+  if (packet.msgType == MSG_TYPE_REQ_FORWARD_NODE || packet.msgType == MSG_TYPE_RES_FORWARD_NODE ||
+      packet.msgType == MSG_TYPE_BEACON)
+  {
+    // A beacon carries the sender's route advertisement
+    NodePacket &nodePacket = packet.msgType == MSG_TYPE_BEACON ? packet.data.beaconPacket.route : packet.data.nodePacket;
+    update_route(nodePacket);
+    heard_from(nodePacket.node.nodeId);
+    if (RELAY_ROLE)
+    {
+      heard_route_of(nodePacket);
+      if (packet.msgType != MSG_TYPE_REQ_FORWARD_NODE)
+      {
+        overheard_advertisement(nodePacket);
+      }
+    }
+  }
+  else if (packet.msgType == MSG_TYPE_CAPACITY)
+  {
+    CapacityPacket &cpacket = packet.data.capacityPacket;
+    heard_from(cpacket.senderNode.nodeId, cpacket.txPower);
+    check_forwarding_path(cpacket.senderNode.nodeId, cpacket.receiverNode.nodeId, cpacket.pathCost);
+  }
+  else if (packet.msgType == MSG_TYPE_CAPACITY_BATCH)
+  {
+    CapacityBatchPacket &batch = frame.batchPacket.data;
+    heard_from(batch.senderNode.nodeId, batch.txPower);
+    check_forwarding_path(batch.senderNode.nodeId, batch.receiverNode.nodeId, batch.pathCost);
+  }
+  else if (packet.msgType == MSG_TYPE_STATS)
+  {
+    StatsPacket &stats = frame.statsFrame.data;
+    heard_from(stats.senderNode.nodeId);
+    check_forwarding_path(stats.senderNode.nodeId, stats.receiverNode.nodeId, stats.pathCost);
+  }
+  else if (packet.msgType == MSG_TYPE_ACK_SUCCEED)
+  {
+    heard_from(packet.data.ackPacket.senderNode.nodeId);
+    if (packet.data.ackPacket.receiverNode.nodeId == NODE_ID)
+    {
+      heard_reply_from(packet.data.ackPacket.senderNode.nodeId);
+    }
+  }
+  else if (packet.msgType == MSG_TYPE_ACK_BATCH)
+  {
+    heard_from(packet.data.batchAckPacket.senderNode.nodeId);
+    if (packet.data.batchAckPacket.receiverNode.nodeId == NODE_ID)
+    {
+      heard_reply_from(packet.data.batchAckPacket.senderNode.nodeId);
+    }
+  }
+  else if (packet.msgType == MSG_TYPE_ACK_BITMAP)
+  {
+    // Whether it answers this node only shows once its records are matched
+    heard_from(frame.ackBitmapFrame.data.senderNode.nodeId);
+  }
+}
+
+// Time on air in ms of a len byte payload with the configured modem settings (Semtech AN1200.13)
+unsigned long time_on_air(uint8_t len)
+{
+  unsigned long symbolTime = (1UL << spreadingFactor) * 1000000UL / bandwidth; // us
+  int8_t lowDataRateOptimize = symbolTime > 16000 ? 1 : 0;
+
+  // RadioHead adds its own header, the explicit LoRa header and CRC are always on
+  int16_t payloadBits = 8 * (len + RH_RF95_HEADER_LEN) - 4 * spreadingFactor + 28 + 16;
+  int16_t bitsPerBlock = 4 * (spreadingFactor - 2 * lowDataRateOptimize);
+  int16_t payloadSymbols = 8;
+  if (payloadBits > 0)
+  {
+    payloadSymbols += (payloadBits + bitsPerBlock - 1) / bitsPerBlock * LORA_CODING_RATE;
+  }
+
+  // preamble + 4.25 symbols of sync word, counted in quarter symbols
+  unsigned long quarterSymbols = 4UL * (LORA_PREAMBLE_LENGTH + payloadSymbols) + 17;
+  return (symbolTime * quarterSymbols / 4 + 999) / 1000;
+}
+
+// Only the packet a frame carries goes on air, not the whole union. A capacity packet sent at
+// TX_POWER_DEFAULT also leaves out its txPower, receivers put it back.
+uint8_t packet_length(const Packet &packet)
+{
+  uint8_t header = sizeof(Packet) - sizeof(PacketData);
+  if (packet.msgType == MSG_TYPE_CAPACITY)
+  {
+    return header + sizeof(CapacityPacket) - (packet.data.capacityPacket.txPower == TX_POWER_DEFAULT ? sizeof(int8_t) : 0);
+  }
+  if (packet.msgType == MSG_TYPE_ACK_SUCCEED || packet.msgType == MSG_TYPE_ACK_FAILURE)
+  {
+    return header + sizeof(AckPacket);
+  }
+  if (packet.msgType == MSG_TYPE_ACK_BATCH)
+  {
+    return header + sizeof(BatchAckPacket);
+  }
+  if (packet.msgType == MSG_TYPE_DATA_RATE)
+  {
+    return header + sizeof(DataRatePacket);
+  }
+  if (packet.msgType == MSG_TYPE_BEACON)
+  {
+    return header + sizeof(BeaconPacket);
+  }
+  return header + sizeof(NodePacket);
+}
+
+// Only the used records of a capacity batch go on air
+uint8_t batch_packet_length(const BatchPacket &packet)
+{
+  uint8_t recordCount = packet.data.recordCount <= MAX_BATCH_RECORDS ? packet.data.recordCount : MAX_BATCH_RECORDS;
+  return sizeof(BatchPacket) - (MAX_BATCH_RECORDS - recordCount) * sizeof(CapacityRecord);
+}
+
+// Only the used records of an aggregated ACK go on air
+uint8_t ack_bitmap_length(const AckBitmapFrame &frame)
+{
+  uint8_t recordCount = frame.data.recordCount <= MAX_ACK_RECORDS ? frame.data.recordCount : MAX_ACK_RECORDS;
+  return sizeof(AckBitmapFrame) - (MAX_ACK_RECORDS - recordCount) * sizeof(SeqWindow);
+}
+
+// Queue a frame in the TX scheduler, it goes on air right away if the airtime budget allows
+void sendPacket(const uint8_t *data, uint8_t len, unsigned long *sentTime)
+{
+  if (len > sizeof(Frame))
+  {
+    SYS_LOG.println("Packet forwarding failed");
+    return;
+  }
+
+  uint8_t priority = tx_priority(data[1]);
+  // Frames waiting for their slot are not deferred by the budget
+  if ((!SLOTTED_SCHEDULE && txQueueLength > 0) || airtime_remaining() < time_on_air(len))
+  {
+    txDeferred++;
+    print_airtime_budget();
+  }
+
+  if (txQueueLength == TX_QUEUE_SIZE)
+  {
+    // Make room by dropping the newest frame of the lowest priority, unless that is this one
+    if (txQueue[TX_QUEUE_SIZE - 1].priority <= priority)
+    {
+      SYS_LOG.println("SYS: TX queue is full, dropping packet");
+      txDropped++;
+      return;
+    }
+    txQueueLength--;
+    txDropped++;
+  }
+
+  uint8_t index = txQueueLength;
+  while (index > 0 && txQueue[index - 1].priority > priority)
+  {
+    txQueue[index] = txQueue[index - 1];
+    index--;
+  }
+  txQueue[index].priority = priority;
+  txQueue[index].len = len;
+  txQueue[index].sentTime = sentTime;
+  memcpy(txQueue[index].data, data, len);
+  txQueueLength++;
+  if (txQueueLength > txQueueHighWater)
+  {
+    txQueueHighWater = txQueueLength;
+  }
+
+  service_tx_queue();
+}
+
+void transmit_frame(const uint8_t *data, uint8_t len)
+{
+  if (rf95.send(data, len))
+  {
+    // Serial.println("Packet forwarded successfully");
+    rf95.waitPacketSent();
+    lastRadioActivity = millis();
+  }
+  else
+  {
+    SYS_LOG.println("Packet forwarding failed");
+  }
+}
+
+void send_node_packet(uint8_t msgType, unsigned long *sentTime)
+{
+  Packet packet;
+  packet.authKey = AUTH_KEY;
+  packet.msgType = msgType;
+  packet.data.nodePacket = construct_node_packet();
+
+  sendPacket((uint8_t *)&packet, packet_length(packet), sentTime);
+}
+
+// beaconSeq and the offset are filled in by stamp_beacon() when it goes on air
+void send_beacon_packet()
+{
+  Packet packet;
+  packet.authKey = AUTH_KEY;
+  packet.msgType = MSG_TYPE_BEACON;
+  packet.data.beaconPacket.route = construct_node_packet();
+  packet.data.beaconPacket.slotCount = slotCount;
+  packet.data.beaconPacket.contentionSlots = contentionSlots;
+  packet.data.beaconPacket.slotLength = slotLength;
+  packet.data.beaconPacket.highestNodeId = highest_node_id();
+  advertised_route();
+
+  sendPacket((uint8_t *)&packet, packet_length(packet), &lastBeaconSent);
+}
+
+void send_ack_packet(uint8_t alertId, uint8_t seq, uint8_t receiverId)
+{
+  Packet packet;
+  packet.authKey = AUTH_KEY;
+  packet.msgType = MSG_TYPE_ACK_SUCCEED;
+  packet.data.ackPacket = construct_ack_packet(alertId, seq, receiverId);
+
+  sendPacket((uint8_t *)&packet, packet_length(packet));
+}
+
+void handle_node_packet()
+{
+  TRAFFIC_LOG.println("REQUEST: Received to be a node's forwarding node");
+  // Only nodes with a route can forward, the advertisement goes out after a random wait
+  if (has_route())
+  {
+    bool answerOnly = !advertisePending || advertiseAnswerOnly;
+    schedule_route_advertisement(ROUTE_ADVERTISE_JITTER);
+    advertiseAnswerOnly = answerOnly;
+  }
+}
+
+// learn_from_frame() already took the advertised route into the routing table
+void handle_node_response()
+{
+  if (has_route())
+  {
+    joinAttempts = 0;
+  }
+  if (joinPending && has_route())
+  {
+    TRAFFIC_LOG.println("RESPONSE: Node's acknowledgement as forwarding node");
+    tx_queue_cancel(&lastJoinRequestTime);
+    joinPending = false;
+  }
+}
+
+// The timing is taken from the next hop, or from any beacon while the node has none. learn_from_frame()
+// already took the route the beacon advertises.
+void handle_beacon_packet(BeaconPacket &packet, uint8_t len)
+{
+  uint8_t senderId = packet.route.node.nodeId;
+  int8_t child = RELAY_ROLE ? find_child(senderId) : -1;
+  if (child >= 0)
+  {
+    children[child].highestNodeId = packet.highestNodeId;
+  }
+  if (SLOTTED_SCHEDULE && (!synced || !has_route() || senderId == next_hop()))
+  {
+    sync_to_beacon(packet, len);
+  }
+  handle_node_response();
+}
+
+void handle_capacity_packet(CapacityPacket &cpacket)
+{
+  // Ensure that the capacityPacket is for the correct forwarding node
+  if (cpacket.receiverNode.nodeId == NODE_ID)
+  {
+    TRAFFIC_LOG.println("REQUEST: Received to forward capacity packet, forwarding...");
+    if (suppress_duplicate(cpacket))
+    {
+      return;
+    }
+
+    /* ========================================================== */
+    /* === PACKET PRIORITY BY CAPACITY BEFORE FORWARDING == */
+    /* ========================================================== */
+    add_to_capacity_list(cpacket);
+  }
+}
+
+void handle_capacity_batch(CapacityBatchPacket &batch)
+{
+  // Ensure that the batch is for the correct forwarding node
+  if (batch.receiverNode.nodeId == NODE_ID && batch.recordCount <= MAX_BATCH_RECORDS)
+  {
+    TRAFFIC_LOG.println("REQUEST: Received to forward capacity batch, forwarding...");
+
+    // Records are queued on their own, their ACKs come back one by one through handle_ack_packet()
+    for (int i = 0; i < batch.recordCount; i++)
+    {
+      CapacityPacket cpacket;
+      cpacket.alertNode = batch.records[i].alertNode;
+      cpacket.senderNode = batch.senderNode;
+      cpacket.receiverNode = batch.receiverNode;
+      cpacket.binCapacity = batch.records[i].binCapacity;
+      cpacket.alertSeq = batch.records[i].alertSeq;
+      cpacket.minutesToFull = batch.records[i].minutesToFull;
+      if (!suppress_duplicate(cpacket))
+      {
+        add_to_capacity_list(cpacket);
+      }
+    }
+  }
+}
+
+void handle_ack_packet(AckPacket &ackPacket)
+{
+  if (ackPacket.receiverNode.nodeId != NODE_ID)
+  {
+    return;
+  }
+  ack_alert(ackPacket.alertNode.nodeId, ackPacket.alertSeq, ackPacket.senderNode.nodeId);
+}
+
+// Every alert a record covers is at the server, wherever the frame came from. It only counts as
+// a reply of the sender when the sender is where the alert was sent to.
+void handle_ack_bitmap_packet(AckBitmapPacket &ackPacket)
+{
+  bool reply = false;
+  for (int i = 0; i < ackPacket.recordCount; i++)
+  {
+    SeqWindow &record = ackPacket.records[i];
+    if (!RELAY_ROLE && record.alertNode.nodeId != NODE_ID)
+    {
+      continue;
+    }
+    for (uint8_t age = 0; age < SEQ_WINDOW_SIZE; age++)
+    {
+      if (record.seen & (1U << age))
+      {
+        reply |= ack_alert(record.alertNode.nodeId, record.highestSeq - age, ackPacket.senderNode.nodeId);
+      }
+    }
+  }
+  if (reply)
+  {
+    heard_reply_from(ackPacket.senderNode.nodeId);
+  }
+}
+
+void handle_batch_ack_packet(BatchAckPacket &ackPacket)
+{
+  if (ackPacket.receiverNode.nodeId != NODE_ID || !pendingBatch.inUse || ackPacket.batchId != pendingBatch.packet.data.batchId)
+  {
+    return;
+  }
+
+  TRAFFIC_LOG.println("ACK: Received, capacity batch sent to server");
+  link_acked(ackPacket.senderNode.nodeId);
+  record_ack_rtt(pendingBatch.lastSentTime);
+  for (int i = 0; i < pendingBatch.packet.data.recordCount; i++)
+  {
+    if (!(pendingBatch.ackedRecords & (1 << i)))
+    {
+      complete_batch_record(i);
+    }
+  }
+  tx_queue_cancel(&pendingBatch.lastSentTime);
+  pendingBatch.inUse = false;
+}
+
+void handle_data_rate_packet(DataRatePacket &packet)
+{
+  if (packet.receiverNode.nodeId != NODE_ID)
+  {
+    return;
+  }
+  heard_reply_from(packet.senderNode.nodeId);
+  SYS_LOG.print("RESPONSE: Data rate from server, SF");
+  SYS_LOG.print(packet.spreadingFactor);
+  SYS_LOG.print(" ");
+  SYS_LOG.print(packet.txPower);
+  SYS_LOG.println(" dBm");
+  apply_data_rate(packet.spreadingFactor, 125000L << packet.bandwidthCode, packet.txPower);
+}
+
+void apply_data_rate(uint8_t sf, long bw, int8_t txPower)
+{
+  if (sf != spreadingFactor)
+  {
+    spreadingFactor = sf;
+    rf95.setSpreadingFactor(sf);
+  }
+  if (bw != bandwidth)
+  {
+    bandwidth = bw;
+    rf95.setSignalBandwidth(bw);
+  }
+  dataTxPower = txPower < TX_POWER_MIN ? TX_POWER_MIN : txPower > TX_POWER_MAX ? TX_POWER_MAX : txPower;
+}
+
+// Without any node to talk to, a data rate set by the server may be why, go back to the one every node starts with
+void reset_data_rate()
+{
+  if (spreadingFactor != LORA_SPREADING_FACTOR || bandwidth != LORA_BANDWIDTH || dataTxPower != TX_POWER_DEFAULT)
+  {
+    SYS_LOG.println("SYS: Lost contact, back to the default data rate");
+    apply_data_rate(LORA_SPREADING_FACTOR, LORA_BANDWIDTH, TX_POWER_DEFAULT);
+  }
+}
+
+// Send the forwarding node request, the response is picked up by loop()
+void forward_node_packet()
+{
+  TRAFFIC_LOG.println("REQUEST: Add forwarding node...");
+  joinPending = true;
+  joinRequestStartTime = millis();
+  // After a timed out attempt the backoff of its last request still runs
+  if (joinAttempts == 0)
+  {
+    send_join_request();
+  }
+}
+
+// Send a capacity packet upstream without waiting for the ACK, returns false when
+// MAX_PENDING_ACKS packets are already in flight
+bool forward_capacity_packet(uint8_t alertId, uint8_t seq, uint8_t binCapacity, uint16_t minutesToFull, uint8_t childId)
+{
+  int8_t index = add_to_pending_acks(childId);
+  if (index < 0)
+  {
+    return false;
+  }
+
+  TRAFFIC_LOG.println("REQUEST: Foward capacity packet...");
+  PendingAck &pending = pendingAcks[index];
+  pending.packet.authKey = AUTH_KEY;
+  pending.packet.msgType = MSG_TYPE_CAPACITY;
+  pending.packet.data.capacityPacket = construct_capacity_packet(alertId, seq, binCapacity, minutesToFull);
+
+  pending.lastSentTime = millis();
+  pending.retryBackoff = retry_backoff(0, packet_length(pending.packet));
+  sendPacket((uint8_t *)&pending.packet, packet_length(pending.packet), &pending.lastSentTime);
+
+  return true;
+}
+
+// Send every queued capacity packet (up to MAX_BATCH_RECORDS) upstream in one frame
+void forward_capacity_batch()
+{
+  TRAFFIC_LOG.println("REQUEST: Foward capacity batch...");
+  BatchPacket &packet = pendingBatch.packet;
+  packet.authKey = AUTH_KEY;
+  packet.msgType = MSG_TYPE_CAPACITY_BATCH;
+  packet.data.senderNode.nodeId = NODE_ID;
+  packet.data.receiverNode.nodeId = next_hop();
+  packet.data.pathCost = route_cost();
+  packet.data.batchId = nextBatchId++;
+  packet.data.txPower = TX_POWER_DEFAULT;
+  packet.data.recordCount = 0;
+
+  while (capacityPackets > 0 && packet.data.recordCount < MAX_BATCH_RECORDS)
+  {
+    uint8_t i = packet.data.recordCount++;
+    CapacityPacket &cpacket = processCapacityPackets[0].packet;
+    packet.data.records[i].alertNode = cpacket.alertNode;
+    packet.data.records[i].binCapacity = cpacket.binCapacity;
+    packet.data.records[i].alertSeq = cpacket.alertSeq;
+    packet.data.records[i].minutesToFull = cpacket.minutesToFull;
+    pendingBatch.childNodes[i] = cpacket.senderNode;
+    remove_from_capacity_list();
+  }
+
+  pendingBatch.ackedRecords = 0;
+  pendingBatch.retransmits = 0;
+  pendingBatch.inUse = true;
+  pendingBatch.lastSentTime = millis();
+  pendingBatch.retryBackoff = retry_backoff(0, batch_packet_length(packet));
+  sendPacket((uint8_t *)&packet, batch_packet_length(packet), &pendingBatch.lastSentTime);
+}
+/* ========================================================== */
+/* ============ TRANSMITTING/RECEIVING FUNCTIONS ============ */
+/* ========================================================== */
\ No newline at end of file
@@ -0,0 +1,55 @@
+/* ========================================================== */
+/* =================== NODE CONFIGURATION =================== */
+/* ========================================================== */
+// Every LoRa node runs this sketch, only the parameters below differ between boards.
+// Routes to the server are learned over the air.
+// Pick a board with NODE_PRESET, e.g.
+//   arduino-cli compile -b arduino:avr:uno --build-property "build.extra_flags=-DNODE_PRESET=2" lora_node
+// or override single parameters the same way (-DMAX_CAPACITY_PACKETS=16).
+#define NODE_ROLE_ALERT 0x01 // watches a bin and raises capacity alerts
+#define NODE_ROLE_RELAY 0x02 // forwarding node for other nodes' capacity packets
+
+#ifndef NODE_PRESET
+#define NODE_PRESET 1
+#endif
+
+#if NODE_PRESET == 1 // relay next to the server
+#define PRESET_NODE_ID 1
+#define PRESET_NODE_ROLES NODE_ROLE_RELAY
+#define PRESET_BIN_CAPACITY 0
+#elif NODE_PRESET == 2 // bin behind node 1
+#define PRESET_NODE_ID 2
+#define PRESET_NODE_ROLES (NODE_ROLE_ALERT | NODE_ROLE_RELAY)
+#define PRESET_BIN_CAPACITY 80
+#elif NODE_PRESET == 3 // bin behind node 1
+#define PRESET_NODE_ID 3
+#define PRESET_NODE_ROLES (NODE_ROLE_ALERT | NODE_ROLE_RELAY)
+#define PRESET_BIN_CAPACITY 90
+#else
+#error "Unknown NODE_PRESET"
+#endif
+
+#ifndef NODE_ID // host builds pass their own so many copies of one sketch can share a channel
+#define NODE_ID PRESET_NODE_ID // Id of this node (randomly generated)
+#endif
+#ifndef NODE_ROLES
+#define NODE_ROLES PRESET_NODE_ROLES
+#endif
+#ifndef INITIAL_BIN_CAPACITY
+#define INITIAL_BIN_CAPACITY PRESET_BIN_CAPACITY // simulated bin capacity (%)
+#endif
+#ifndef MAX_NODES
+#define MAX_NODES 4 // routing table size, neighbours that can forward towards the server
+#endif
+#ifndef MAX_CAPACITY_PACKETS
+#define MAX_CAPACITY_PACKETS 10 // capacity packets a relay can queue
+#endif
+#ifndef MAX_SEQ_WINDOWS
+#define MAX_SEQ_WINDOWS 8 // alert nodes a relay remembers recently ACKed alerts of
+#endif
+#ifndef MAX_CHILDREN
+#define MAX_CHILDREN (NODE_ROLES & NODE_ROLE_RELAY ? 8 : 1) // nodes routing through this one whose slots it listens in
+#endif
+/* ========================================================== */
+/* =================== NODE CONFIGURATION =================== */
+/* ========================================================== */
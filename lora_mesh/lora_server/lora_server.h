@@ -12,32 +12,135 @@
 // Frequency must match other nodes in mesh
 #define RF95_FREQ 920.0
 
+// Modem settings must match other nodes in mesh
+#define LORA_SPREADING_FACTOR 7
+#define LORA_BANDWIDTH 125000
+#define LORA_CODING_RATE 5 // denominator of the 4/x coding rate
+#define LORA_PREAMBLE_LENGTH 8
+#define SNR_FLOOR (-(15 + 5 * (LORA_SPREADING_FACTOR - 7)) / 2) // dB, lowest SNR the modem demodulates
+
+// Data rate control of the nodes the server hears directly, power limits must match the nodes
+#define TX_POWER_DEFAULT 13 // dBm
+#define TX_POWER_MIN 2
+#define TX_POWER_MAX 20
+#define ADR_MARGIN 10       // dB of SNR kept above SNR_FLOOR for fading and interference
+#define ADR_STEP 3          // dB, power changes in whole steps
+#define ADR_HISTORY 4       // capacity frames the best SNR is taken over before deciding
+#define ADR_COMMAND_HOLDOFF 60000UL // a node that did not follow a command is sent it again after this
+#define ADR_QUIET_TIME 2000 // commands wait for a quiet channel, right after an ACK the node is still busy
+
+// Regional duty cycle limit, enforced by the TX scheduler under sendPacket()
+#define DUTY_CYCLE_PERCENT 1
+#define AIRTIME_BUCKET_SIZE 3600UL // ms of airtime that can be spent in one burst
+#define TX_QUEUE_SIZE 4            // frames waiting for airtime
+#define TX_PRIORITY_BEACON 0
+#define TX_PRIORITY_ACK 1
+#define TX_PRIORITY_ALERT 2
+#define TX_PRIORITY_JOIN 3
+
+// Listen before talk as on the nodes: frames wait for a clear CAD, a busy channel backs the TX queue
+// off for a random part of a window that doubles with every busy CAD in a row
+#ifndef LISTEN_BEFORE_TALK
+#define LISTEN_BEFORE_TALK 1
+#endif
+#define CAD_BACKOFF_MAX_EXP 4
+
+// Slotted schedule, must match the nodes. The server's beacon opens every superframe of slotCount
+// slots: slot 0 is the server's, then contentionSlots shared slots, and node n owns slot
+// contentionSlots + n. Nodes sleep the radio in the slots they have no part in.
+#ifndef SLOTTED_SCHEDULE
+#define SLOTTED_SCHEDULE 1
+#endif
+#define NODES_PER_CONTENTION_SLOT 16 // every node listens in one shared slot, more nodes get more of them
+#define SLOT_LENGTH 250UL  // ms, a capacity batch and its ACK fit in one slot
+#define SLOT_GUARD 10      // ms at both ends of a slot for clock drift
+#define SLOT_COUNT_MIN 16  // slots per superframe before any node is known
+#define SLOT_COUNT_STEP 8  // the superframe grows in steps as higher node ids are heard of
+
 // Singleton instance of the radio driver
 RH_RF95 rf95(RFM95_CS, RFM95_INT);
 /* ========================================================== */
 /* ================= RADIOHEAD DEFINITIONS ================== */
 /* ========================================================== */
 
+/* ========================================================== */
+/* =================== LOGGING DEFINITIONS ================== */
+/* ========================================================== */
+// Serial output is slow at 9600 baud and every string literal costs flash, so lines
+// below LOG_LEVEL are compiled out. Build with -DLOG_LEVEL=2 for per-frame traces.
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_SYS 1     // setup, faults, bin reports and telemetry
+#define LOG_LEVEL_TRAFFIC 2 // every frame sent, received and ACKed
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_SYS
+#endif
+
+// Stands in for Serial at a disabled level, calls to it compile to nothing
+struct NullLog
+{
+  template <typename T> size_t print(T, int = 0) { return 0; }
+  template <typename T> size_t println(T, int = 0) { return 0; }
+  size_t println() { return 0; }
+};
+
+#if LOG_LEVEL >= LOG_LEVEL_SYS
+#define SYS_LOG Serial
+#else
+#define SYS_LOG NullLog()
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_TRAFFIC
+#define TRAFFIC_LOG Serial
+#else
+#define TRAFFIC_LOG NullLog()
+#endif
+/* ========================================================== */
+/* =================== LOGGING DEFINITIONS ================== */
+/* ========================================================== */
+
 /* ========================================================== */
 /* =============== MESH DEFINITIONS & STRUCTS =============== */
 /* ========================================================== */
 #define AUTH_KEY 0x01 // Shared secret key to authenticate nodes
 #define NODE_ID 0     // Id of this node
 #define MAX_CAPACITY_PACKETS 10
+#define MAX_BATCH_RECORDS MAX_CAPACITY_PACKETS // must match the nodes
+#define MAX_SEQ_WINDOWS 32 // alert nodes the server remembers received alerts of
+#define SEQ_WINDOW_SIZE 16 // must match the nodes
+#define MAX_ACK_RECORDS 8  // must match the nodes, alert nodes one aggregated ACK covers
+#ifndef ACK_AGGREGATE_WINDOW
+#define ACK_AGGREGATE_WINDOW (SLOTTED_SCHEDULE ? 0 : 100) // must match the nodes, ms an ACK waits for others to share its frame
+#endif
+#define ROUTE_ADVERTISE_INTERVAL (5UL * 60 * 1000) // must match the nodes, keeps the routes of nodes next to the server fresh
+#define JOIN_ANSWER_HOLDOFF 2000 // least time between two answers to forwarding node requests, one answers every request heard before it
+#define JOIN_ADMIT_MARGIN 3      // dB above SNR_FLOOR a request must arrive at to be answered, weaker nodes are left to the relays
 #define MSG_TYPE_REQ_FORWARD_NODE 10
 #define MSG_TYPE_RES_FORWARD_NODE 14
 #define MSG_TYPE_CAPACITY 3
 #define MSG_TYPE_ACK_SUCCEED 4
 #define MSG_TYPE_ACK_FAILURE 5
+#define MSG_TYPE_CAPACITY_BATCH 6
+#define MSG_TYPE_ACK_BATCH 7
+#define MSG_TYPE_DATA_RATE 8
+#define MSG_TYPE_BEACON 9
+#define MSG_TYPE_STATS 11
+#define MSG_TYPE_ACK_BITMAP 12
+#define MAX_LINK_MARGINS 32 // nodes next to the server whose data rate is controlled
+#define FULL_UNKNOWN 0xFFFF // must match the nodes, minutesToFull of a bin without a forecast
+#define ACK_RTT_BUCKETS 6   // must match the nodes
+#define ACK_RTT_BASE 250    // must match the nodes, ms covered by the first ACK round-trip bucket
 
 struct Node
 {
   uint8_t nodeId;
 };
 
+// Route request (MSG_TYPE_REQ_FORWARD_NODE) or advertisement (MSG_TYPE_RES_FORWARD_NODE)
 struct NodePacket
 {
   Node node;
+  uint8_t pathCost; // sender's cost to the server, always 0 from the server itself
+  Node parentNode;  // sender's next hop towards the server
+  uint8_t routeSeq; // bumped by every periodic advertisement from the server
 };
 
 struct CapacityPacket
@@ -46,20 +149,114 @@ struct CapacityPacket
   Node senderNode;
   Node receiverNode;
   uint8_t binCapacity;
+  uint8_t pathCost; // sender's cost to the server, a receiver that is no closer is part of a loop
+  uint8_t alertSeq; // new for every alert of the alert node, retransmissions and relays keep it
+  uint16_t minutesToFull; // alert node's forecast when it sent the alert, FULL_UNKNOWN without one
+  int8_t txPower;   // dBm the sender transmitted this frame at, last so it can be left out
 };
 
 struct AckPacket
 {
   Node alertNode; // the root node that sends alert
   Node receiverNode;
-  uint8_t authKey;
-  uint8_t msgType;
+  Node senderNode;
+  uint8_t alertSeq; // alert being acknowledged
+};
+
+// Alert sequence numbers already received from one alert node
+struct SeqWindow
+{
+  Node alertNode;
+  uint8_t highestSeq; // newest sequence number in the window
+  uint16_t seen;      // bit n is set when highestSeq - n was received
+};
+
+// ACKs for several alert nodes in one frame, each record a copy of the alert node's window
+struct AckBitmapPacket
+{
+  Node senderNode;
+  uint8_t recordCount;
+  SeqWindow records[MAX_ACK_RECORDS]; // only recordCount records are transmitted
+};
+
+struct CapacityRecord
+{
+  Node alertNode; // the root node that sends alert
+  uint8_t binCapacity;
+  uint8_t alertSeq;
+  uint16_t minutesToFull; // as in CapacityPacket
+};
+
+// Capacity packets from several alert nodes sharing one frame, acknowledged by one MSG_TYPE_ACK_BATCH
+struct CapacityBatchPacket
+{
+  Node senderNode;
+  Node receiverNode;
+  uint8_t batchId;
+  uint8_t recordCount;
+  uint8_t pathCost; // as in CapacityPacket
+  int8_t txPower;   // as in CapacityPacket
+  CapacityRecord records[MAX_BATCH_RECORDS]; // only recordCount records are transmitted
+};
+
+struct BatchAckPacket
+{
+  Node receiverNode;
+  uint8_t batchId;
+  Node senderNode;
+};
+
+// Data rate a node next to the server should send its capacity frames at
+struct DataRatePacket
+{
+  Node receiverNode;
+  Node senderNode;
+  uint8_t spreadingFactor;
+  uint8_t bandwidthCode; // bandwidth is 125 kHz << bandwidthCode
+  int8_t txPower;        // dBm
+};
+
+// Opens a superframe (MSG_TYPE_BEACON), relays repeat it in their own slot
+struct BeaconPacket
+{
+  NodePacket route;       // the sender's route advertisement
+  uint8_t beaconSeq;      // superframe number
+  uint8_t slotCount;      // slots in a superframe
+  uint8_t contentionSlots; // shared slots after the server's
+  uint16_t slotLength;    // ms
+  uint16_t offset;        // ms into the superframe the beacon went on air
+  uint8_t highestNodeId;  // highest node id routing through the sender, so the server sizes the superframe
+};
+
+static_assert(255 * SLOT_LENGTH <= 0xFFFF, "a superframe must fit the beacon offset");
+
+// Telemetry counters a node sends every few minutes (MSG_TYPE_STATS), never ACKed. Counters
+// are since the node booted and wrap around.
+struct StatsPacket
+{
+  Node senderNode;
+  Node receiverNode;
+  Node originNode; // node the counters are from
+  uint8_t pathCost;
+  uint16_t uptime; // minutes
+  uint16_t txFrames;
+  uint16_t rxFrames;
+  uint16_t retransmissions;
+  uint16_t ackTimeouts;
+  uint16_t routeChanges;
+  uint8_t txQueueHighWater;
+  uint8_t capacityQueueHighWater;
+  uint16_t ackRtt[ACK_RTT_BUCKETS]; // bucket n counts ACKs up to ACK_RTT_BASE << 2n ms
 };
 
 union PacketData
 {
   NodePacket nodePacket;
   CapacityPacket capacityPacket;
+  AckPacket ackPacket;
+  BatchAckPacket batchAckPacket;
+  DataRatePacket dataRatePacket;
+  BeaconPacket beaconPacket;
 };
 
 struct Packet
@@ -69,22 +266,183 @@ struct Packet
   PacketData data;
 };
 
+struct BatchPacket
+{
+  uint8_t authKey;
+  uint8_t msgType;
+  CapacityBatchPacket data;
+};
+
+struct StatsFrame
+{
+  uint8_t authKey;
+  uint8_t msgType;
+  StatsPacket data;
+};
+
+struct AckBitmapFrame
+{
+  uint8_t authKey;
+  uint8_t msgType;
+  AckBitmapPacket data;
+};
+
+// Receive buffer large enough for every kind of packet, authKey and msgType line up in all of them
+union Frame
+{
+  Packet packet;
+  BatchPacket batchPacket;
+  StatsFrame statsFrame;
+  AckBitmapFrame ackBitmapFrame;
+};
+
+// Frame waiting in the TX scheduler for airtime
+struct TxFrame
+{
+  uint8_t priority;
+  uint8_t len;
+  uint8_t data[sizeof(Frame)];
+};
+
+struct SeqWindow receivedAlerts[MAX_SEQ_WINDOWS];
+
+// SNR of the capacity frames a node next to the server sent at its current power
+struct LinkMargin
+{
+  Node node;
+  int8_t txPower;  // power of the frames measured
+  int8_t bestSnr;  // best SNR over the frames measured
+  uint8_t samples;
+  int8_t commandPower; // power to send the node once the channel is quiet
+  bool commandPending;
+  unsigned long lastCommandTime;
+};
+
+struct LinkMargin linkMargins[MAX_LINK_MARGINS];
+
 // At anypoint of time the node can enqueue MAX_PROCESS_CAPACITY_PACKETS number of packets
 struct CapacityPacket processCapacityPackets[MAX_CAPACITY_PACKETS];
+
+// Frames ordered by priority, then by the order they were queued in
+struct TxFrame txQueue[TX_QUEUE_SIZE];
+
+// ACKs waiting for ACK_AGGREGATE_WINDOW to pass, one record per alert node
+struct AckBitmapPacket ackAggregate;
 /* ========================================================== */
 /* =============== MESH DEFINITIONS & STRUCTS =============== */
 /* ========================================================== */
 
+/* ========================================================== */
+/* ======================== VARIABLES ======================= */
+/* ========================================================== */
+uint8_t txQueueLength = 0;
+unsigned long airtimeTokens = AIRTIME_BUCKET_SIZE; // ms of airtime that can be spent right now
+unsigned long lastTokenRefill = 0;
+unsigned long airtimeUsed = 0;   // total ms spent transmitting
+unsigned long txDeferred = 0;    // frames that had to wait for airtime
+unsigned long txDropped = 0;     // frames dropped because the TX queue was full
+unsigned long lastAdvertiseTime = 0;
+uint8_t routeSeq = 0;
+uint8_t seqWindowsUsed = 0;
+uint8_t nextSeqWindow = 0;          // window reused when all of them are taken
+unsigned long duplicatesReceived = 0; // capacity records sent again after a lost ACK
+uint8_t aggregatedAcks = 0;         // ACKs in ackAggregate, a single one goes out as a plain ACK
+AckPacket firstAggregatedAck;
+unsigned long ackAggregateStart = 0;
+uint8_t linkMarginsUsed = 0;
+uint8_t nextLinkMargin = 0;         // entry reused when all of them are taken
+unsigned long dataRateCommands = 0; // data rate packets sent
+unsigned long lastReceiveTime = 0;
+unsigned long superframeStart = 0;
+uint8_t beaconSeq = 0;
+uint8_t slotCount = SLOT_COUNT_MIN;
+uint8_t contentionSlots = 1;
+uint8_t highestNodeId = 0;          // highest node id heard of, every node up to it gets a slot
+uint16_t contentionOffset = 0;      // random wait into the shared slot, re-drawn after every use
+bool joinAnswerPending = false;     // a forwarding node request waits for the answer
+unsigned long lastJoinAnswer = 0;
+unsigned long joinsRefused = 0;     // requests too weak to be answered
+uint8_t cadBusyCount = 0;           // CADs in a row that found the channel busy
+unsigned long txBackoffUntil = 0;   // the TX queue waits for a busy channel until then
+unsigned long cadBackoffs = 0;      // times the TX queue backed off
+/* ========================================================== */
+/* ======================== VARIABLES ======================= */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ================ TX SCHEDULER DECLARATION ================ */
+/* ========================================================== */
+uint8_t tx_priority(uint8_t msgType);
+void refill_airtime_tokens();
+unsigned long airtime_remaining();
+void service_tx_queue();
+bool channel_clear(uint8_t len);
+void print_airtime_budget();
+/* ========================================================== */
+/* ================ TX SCHEDULER DECLARATION ================ */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ================= SLOT SCHEDULE DECLARATION ============== */
+/* ========================================================== */
+unsigned long superframe_length();
+uint8_t current_slot();
+unsigned long slot_elapsed();
+bool slot_allows(TxFrame &txFrame);
+void heard_of_node(uint8_t nodeId);
+void service_beacon();
+unsigned long receive_timeout();
+/* ========================================================== */
+/* ================= SLOT SCHEDULE DECLARATION ============== */
+/* ========================================================== */
+
 /* ========================================================== */
 /* ==== TRANSMITTING/RECEIVING FUNCTIONS DECLARATION ======== */
 /* ========================================================== */
-NodePacket construct_node_packet(uint8_t msgType);
-AckPacket construct_ack_packet(uint8_t alertId, uint8_t receiverId, uint8_t msgType);
+NodePacket construct_node_packet();
+AckPacket construct_ack_packet(uint8_t alertId, uint8_t seq, uint8_t receiverId);
+
+unsigned long time_on_air(uint8_t len);
 
 void sendPacket(const uint8_t *data, uint8_t len);
+void transmit_frame(const uint8_t *data, uint8_t len);
+void send_node_packet();
+void send_beacon_packet();
+void send_ack_packet(uint8_t alertId, uint8_t seq, uint8_t receiverId);
+void send_batch_ack_packet(uint8_t receiverId, uint8_t batchId);
+void queue_ack(uint8_t alertId, uint8_t seq, uint8_t receiverId);
+void service_ack_aggregate();
+void send_ack_aggregate();
+void send_data_rate_packet(uint8_t receiverId, int8_t txPower);
+uint8_t packet_length(const Packet &packet);
+uint8_t batch_packet_length(const BatchPacket &packet);
+uint8_t ack_bitmap_length(const AckBitmapFrame &frame);
 
 void handle_node_packet(NodePacket &packet);
+void service_join_answer();
 void handle_capacity_packet(CapacityPacket &packet);
+void handle_capacity_batch(CapacityBatchPacket &packet);
+void print_bin_report(uint8_t alertId, uint8_t binCapacity, uint16_t minutesToFull);
+void handle_stats_packet(StatsPacket &stats);
 /* ========================================================== */
 /* ==== TRANSMITTING/RECEIVING FUNCTIONS DECLARATION ======== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ================ DATA RATE CONTROL DECLARATION =========== */
+/* ========================================================== */
+int8_t find_link_margin(uint8_t nodeId);
+void track_link_margin(uint8_t nodeId, int8_t txPower, int8_t snr);
+void service_data_rate_commands();
+/* ========================================================== */
+/* ================ DATA RATE CONTROL DECLARATION =========== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ============ DUPLICATE SUPPRESSION DECLARATION =========== */
+/* ========================================================== */
+int8_t find_seq_window(uint8_t alertId);
+bool check_and_mark_seq(uint8_t alertId, uint8_t seq);
+/* ========================================================== */
+/* ============ DUPLICATE SUPPRESSION DECLARATION =========== */
 /* ========================================================== */
\ No newline at end of file
@@ -13,48 +13,94 @@ void setup() {
   delay(100);
 
   while (!rf95.init()) {
-    Serial.println("SYS: LoRa radio init failed");
+    SYS_LOG.println("SYS: LoRa radio init failed");
 
     delay(2000);
     while (1)
       ;
   }
-  Serial.println("SYS: LoRa radio init OK!");
+  SYS_LOG.println("SYS: LoRa radio init OK!");
 
   // Defaults after init are 915.0MHz, modulation GFSK_Rb250Fd250, +13dbM
   if (!rf95.setFrequency(RF95_FREQ)) {
-    Serial.println("SYS: setFrequency failed");
+    SYS_LOG.println("SYS: setFrequency failed");
     while (1)
       ;
   }
-  Serial.print("SYS: Set Freq to ");
-  Serial.println(RF95_FREQ);
+  SYS_LOG.print("SYS: Set Freq to ");
+  SYS_LOG.println(RF95_FREQ);
 
   // Defaults after init are 915.0MHz, 13dBm, Bw = 125 kHz, Cr = 4/5, Sf = 128chips/symbol, CRC on
   // The default transmitter power is 13dBm, using PA_BOOST.
   // If you are using RFM95/96/97/98 modules which uses the PA_BOOST transmitter pin, then
   // you can set transmitter powers from 5 to 23 dBm:
-  rf95.setTxPower(13, false);
+  rf95.setTxPower(TX_POWER_DEFAULT, false);
+  rf95.setSpreadingFactor(LORA_SPREADING_FACTOR);
+  rf95.setSignalBandwidth(LORA_BANDWIDTH);
+  rf95.setCodingRate4(LORA_CODING_RATE);
+  rf95.setPreambleLength(LORA_PREAMBLE_LENGTH);
 
   delay(2000);
 }
 
 void loop() {
+  /* ========================================================== */
+  /* === HANDLING FRAMES WAITING FOR AIRTIME                === */
+  /* ========================================================== */
+  service_beacon();
+  service_join_answer();
+  service_ack_aggregate();
+  service_tx_queue();
+  /* ========================================================== */
+  /* === HANDLING FRAMES WAITING FOR AIRTIME                === */
+  /* ========================================================== */
+
+  /* ========================================================== */
+  /* === HANDLING ROUTE ADVERTISEMENT                       === */
+  /* ========================================================== */
+  service_data_rate_commands();
+  if (millis() - lastAdvertiseTime >= ROUTE_ADVERTISE_INTERVAL) {
+    // A new sequence number lets nodes that lost their route take any route again, with the
+    // slotted schedule the beacons carry it
+    routeSeq++;
+    lastAdvertiseTime = millis();
+    if (!SLOTTED_SCHEDULE) {
+      send_node_packet();
+      TRAFFIC_LOG.println("RESPONSE: Advertised route to the server");
+    }
+  }
+  /* ========================================================== */
+  /* === HANDLING ROUTE ADVERTISEMENT                       === */
+  /* ========================================================== */
+
   /* ========================================================== */
   /* === HANDLING RESPONSE TO ADD NODE TO ROUTING TABLE REQ === */
   /* === & REQUEST FOR HANDLING CAPACITY BINS AT SERVER     === */
   /* ========================================================== */
-  if (rf95.waitAvailableTimeout(1500)) {
-    Packet packet;
+  if (rf95.waitAvailableTimeout(receive_timeout())) {
+    Frame frame;
+    Packet &packet = frame.packet;
 
-    uint8_t len = sizeof(packet);
-    if (rf95.recv((uint8_t *)&packet, &len)) 
+    uint8_t len = sizeof(frame);
+    if (rf95.recv((uint8_t *)&frame, &len)) 
     {
+      lastReceiveTime = millis();
       if (packet.authKey == AUTH_KEY) {
+        if (packet.msgType == MSG_TYPE_CAPACITY && len < sizeof(Packet) - sizeof(PacketData) + sizeof(CapacityPacket)) {
+          packet.data.capacityPacket.txPower = TX_POWER_DEFAULT;
+        }
         if (packet.msgType == MSG_TYPE_REQ_FORWARD_NODE) {
           handle_node_packet(packet.data.nodePacket);
+        } else if (packet.msgType == MSG_TYPE_RES_FORWARD_NODE) {
+          heard_of_node(packet.data.nodePacket.node.nodeId);
+        } else if (packet.msgType == MSG_TYPE_BEACON) {
+          heard_of_node(packet.data.beaconPacket.highestNodeId);
         } else if (packet.msgType == MSG_TYPE_CAPACITY) {
           handle_capacity_packet(packet.data.capacityPacket);
+        } else if (packet.msgType == MSG_TYPE_CAPACITY_BATCH && len >= batch_packet_length(frame.batchPacket)) {
+          handle_capacity_batch(frame.batchPacket.data);
+        } else if (packet.msgType == MSG_TYPE_STATS && len >= sizeof(StatsFrame)) {
+          handle_stats_packet(frame.statsFrame.data);
         }
       }
     }
@@ -64,6 +110,200 @@ void loop() {
   /* === & REQUEST FOR HANDLING CAPACITY BINS AT SERVER     === */
   /* ========================================================== */
 }
+/* ========================================================== */
+/* ================= TX SCHEDULER FUNCTIONS ================= */
+/* ========================================================== */
+uint8_t tx_priority(uint8_t msgType) {
+  if (msgType == MSG_TYPE_BEACON) {
+    return TX_PRIORITY_BEACON;
+  }
+  if (msgType == MSG_TYPE_ACK_SUCCEED || msgType == MSG_TYPE_ACK_BATCH || msgType == MSG_TYPE_ACK_BITMAP) {
+    return TX_PRIORITY_ACK;
+  }
+  if (msgType == MSG_TYPE_CAPACITY || msgType == MSG_TYPE_CAPACITY_BATCH) {
+    return TX_PRIORITY_ALERT;
+  }
+  return TX_PRIORITY_JOIN;
+}
+
+// Token bucket: every second earns DUTY_CYCLE_PERCENT * 10 ms of airtime, up to AIRTIME_BUCKET_SIZE
+void refill_airtime_tokens() {
+  unsigned long earned = (millis() - lastTokenRefill) * DUTY_CYCLE_PERCENT / 100;
+  if (earned > 0) {
+    // Only move the refill time by what was paid for so fractions of a ms carry over
+    lastTokenRefill += earned * 100 / DUTY_CYCLE_PERCENT;
+    airtimeTokens += earned;
+    if (airtimeTokens > AIRTIME_BUCKET_SIZE) {
+      airtimeTokens = AIRTIME_BUCKET_SIZE;
+    }
+  }
+}
+
+unsigned long airtime_remaining() {
+  refill_airtime_tokens();
+  return airtimeTokens;
+}
+
+// Transmit queued frames in priority order for as long as the airtime budget allows. With the
+// slotted schedule a frame waiting for its slot lets the ones behind it go.
+void service_tx_queue() {
+  uint8_t i = 0;
+  while (i < txQueueLength) {
+    TxFrame &frame = txQueue[i];
+    if (!slot_allows(frame)) {
+      i++;
+      continue;
+    }
+    unsigned long airtime = time_on_air(frame.len);
+    if (airtime_remaining() < airtime) {
+      // Lower priority frames wait behind it so they cannot starve it
+      return;
+    }
+    if (!channel_clear(frame.len)) {
+      return;
+    }
+
+    airtimeTokens -= airtime;
+    airtimeUsed += airtime;
+    if (frame.data[1] == MSG_TYPE_BEACON) {
+      // How far into the superframe the beacon went on air, nodes take their timing from it
+      Packet &packet = *(Packet *)frame.data;
+      packet.data.beaconPacket.beaconSeq = beaconSeq;
+      packet.data.beaconPacket.offset = millis() - superframeStart;
+    } else if (frame.data[1] == MSG_TYPE_RES_FORWARD_NODE) {
+      contentionOffset = random(65536L);
+    }
+    transmit_frame(frame.data, frame.len);
+
+    txQueueLength--;
+    for (int j = i; j < txQueueLength; j++) {
+      txQueue[j] = txQueue[j + 1];
+    }
+  }
+}
+
+// Channel activity detection before a frame of len bytes goes on air
+bool channel_clear(uint8_t len) {
+  if (!LISTEN_BEFORE_TALK) {
+    return true;
+  }
+  if ((long)(millis() - txBackoffUntil) < 0) {
+    return false;
+  }
+  if (!rf95.isChannelActive()) {
+    cadBusyCount = 0;
+    return true;
+  }
+  unsigned long window = time_on_air(len) << (cadBusyCount < CAD_BACKOFF_MAX_EXP ? cadBusyCount : CAD_BACKOFF_MAX_EXP);
+  txBackoffUntil = millis() + 1 + random(window);
+  cadBusyCount++;
+  cadBackoffs++;
+  return false;
+}
+
+void print_airtime_budget() {
+  TRAFFIC_LOG.print("SYS: Airtime used ");
+  TRAFFIC_LOG.print(airtimeUsed);
+  TRAFFIC_LOG.print(" ms, remaining ");
+  TRAFFIC_LOG.print(airtimeTokens);
+  TRAFFIC_LOG.print(" ms, deferred ");
+  TRAFFIC_LOG.print(txDeferred);
+  TRAFFIC_LOG.print(", dropped ");
+  TRAFFIC_LOG.println(txDropped);
+}
+/* ========================================================== */
+/* ================= TX SCHEDULER FUNCTIONS ================= */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ================== SLOT SCHEDULE FUNCTIONS =============== */
+/* ========================================================== */
+unsigned long superframe_length() {
+  return (unsigned long)slotCount * SLOT_LENGTH;
+}
+
+uint8_t current_slot() {
+  return (millis() - superframeStart) / SLOT_LENGTH;
+}
+
+unsigned long slot_elapsed() {
+  return (millis() - superframeStart) % SLOT_LENGTH;
+}
+
+// Beacons and data rate commands go in the server's slot, advertisements in a shared slot. ACKs go
+// right away, the node that sent the frame listens for the rest of the slot it sent in.
+bool slot_allows(TxFrame &txFrame) {
+  if (!SLOTTED_SCHEDULE) {
+    return true;
+  }
+  uint8_t msgType = txFrame.data[1];
+  if (msgType == MSG_TYPE_ACK_SUCCEED || msgType == MSG_TYPE_ACK_BATCH || msgType == MSG_TYPE_ACK_BITMAP) {
+    return true;
+  }
+  unsigned long elapsed = slot_elapsed();
+  unsigned long airtime = time_on_air(txFrame.len);
+  if (elapsed < SLOT_GUARD || elapsed + airtime + SLOT_GUARD > SLOT_LENGTH) {
+    return false;
+  }
+  if (msgType == MSG_TYPE_RES_FORWARD_NODE) {
+    uint8_t slot = current_slot();
+    return slot >= 1 && slot <= contentionSlots &&
+           elapsed >= SLOT_GUARD + contentionOffset % (SLOT_LENGTH - 2 * SLOT_GUARD - airtime + 1);
+  }
+  return current_slot() == 0;
+}
+
+// Every node up to the highest id heard of gets a slot
+void heard_of_node(uint8_t nodeId) {
+  if (nodeId > highestNodeId) {
+    highestNodeId = nodeId;
+  }
+}
+
+// Opens every superframe. Its length only changes here, between superframes, so nodes never
+// see two lengths at once from the server.
+void service_beacon() {
+  if (!SLOTTED_SCHEDULE || millis() - superframeStart < superframe_length()) {
+    return;
+  }
+  while (millis() - superframeStart >= superframe_length()) {
+    superframeStart += superframe_length();
+    beaconSeq++;
+  }
+
+  uint8_t shared = 1 + highestNodeId / NODES_PER_CONTENTION_SLOT;
+  uint16_t needed = 1 + shared + highestNodeId;
+  needed = (needed + SLOT_COUNT_STEP - 1) / SLOT_COUNT_STEP * SLOT_COUNT_STEP;
+  if (needed > 255) {
+    needed = 255;
+  }
+  if (needed > slotCount || shared > contentionSlots) {
+    slotCount = needed > slotCount ? needed : slotCount;
+    contentionSlots = shared > contentionSlots ? shared : contentionSlots;
+    SYS_LOG.print("SYS: Superframe grown to ");
+    SYS_LOG.print(slotCount);
+    SYS_LOG.print(" slots, ");
+    SYS_LOG.print(contentionSlots);
+    SYS_LOG.println(" shared");
+  }
+  send_beacon_packet();
+}
+
+// Wake up for the next superframe, or poll every guard time while frames wait for their slot
+unsigned long receive_timeout() {
+  if (!SLOTTED_SCHEDULE) {
+    return txQueueLength > 0 ? 100 : 1500;
+  }
+  if (txQueueLength > 0) {
+    return SLOT_GUARD;
+  }
+  unsigned long untilNext = superframe_length() - (millis() - superframeStart);
+  return untilNext < 1500 ? untilNext : 1500;
+}
+/* ========================================================== */
+/* ================== SLOT SCHEDULE FUNCTIONS =============== */
+/* ========================================================== */
+
 /* ========================================================== */
 /* ============ TRANSMITTING/RECEIVING FUNCTIONS ============ */
 /* ========================================================== */
@@ -73,11 +313,14 @@ NodePacket construct_node_packet() {
 
   node.nodeId = NODE_ID;
   nodePacket.node = node;
+  nodePacket.pathCost = 0;
+  nodePacket.parentNode = node;
+  nodePacket.routeSeq = routeSeq;
 
   return nodePacket;
 }
 
-AckPacket construct_ack_packet(uint8_t alertId, uint8_t receiverId, uint8_t msgType) {
+AckPacket construct_ack_packet(uint8_t alertId, uint8_t seq, uint8_t receiverId) {
   Node alertNode;
   Node receiverNode;
   AckPacket ackPacket;
@@ -86,53 +329,476 @@ AckPacket construct_ack_packet(uint8_t alertId, uint8_t receiverId, uint8_t msgT
   receiverNode.nodeId = receiverId;
   ackPacket.alertNode = alertNode;
   ackPacket.receiverNode = receiverNode;
-  ackPacket.authKey = AUTH_KEY;
-  ackPacket.msgType = msgType;
+  ackPacket.senderNode.nodeId = NODE_ID;
+  ackPacket.alertSeq = seq;
 
   return ackPacket;
 }
 
+// Time on air in ms of a len byte payload with the configured modem settings (Semtech AN1200.13)
+unsigned long time_on_air(uint8_t len) {
+  unsigned long symbolTime = (1UL << LORA_SPREADING_FACTOR) * 1000000UL / LORA_BANDWIDTH; // us
+  int8_t lowDataRateOptimize = symbolTime > 16000 ? 1 : 0;
+
+  // RadioHead adds its own header, the explicit LoRa header and CRC are always on
+  int16_t payloadBits = 8 * (len + RH_RF95_HEADER_LEN) - 4 * LORA_SPREADING_FACTOR + 28 + 16;
+  int16_t bitsPerBlock = 4 * (LORA_SPREADING_FACTOR - 2 * lowDataRateOptimize);
+  int16_t payloadSymbols = 8;
+  if (payloadBits > 0) {
+    payloadSymbols += (payloadBits + bitsPerBlock - 1) / bitsPerBlock * LORA_CODING_RATE;
+  }
+
+  // preamble + 4.25 symbols of sync word, counted in quarter symbols
+  unsigned long quarterSymbols = 4UL * (LORA_PREAMBLE_LENGTH + payloadSymbols) + 17;
+  return (symbolTime * quarterSymbols / 4 + 999) / 1000;
+}
+
+// Queue a frame in the TX scheduler, it goes on air right away if the airtime budget allows
 void sendPacket(const uint8_t *data, uint8_t len) {
+  if (len > sizeof(Frame)) {
+    SYS_LOG.println("Packet forwarding failed");
+    return;
+  }
+
+  uint8_t priority = tx_priority(data[1]);
+  // Frames waiting for their slot are not deferred by the budget
+  if ((!SLOTTED_SCHEDULE && txQueueLength > 0) || airtime_remaining() < time_on_air(len)) {
+    txDeferred++;
+    print_airtime_budget();
+  }
+
+  if (txQueueLength == TX_QUEUE_SIZE) {
+    // Make room by dropping the newest frame of the lowest priority, unless that is this one
+    if (txQueue[TX_QUEUE_SIZE - 1].priority <= priority) {
+      SYS_LOG.println("SYS: TX queue is full, dropping packet");
+      txDropped++;
+      return;
+    }
+    txQueueLength--;
+    txDropped++;
+  }
+
+  uint8_t index = txQueueLength;
+  while (index > 0 && txQueue[index - 1].priority > priority) {
+    txQueue[index] = txQueue[index - 1];
+    index--;
+  }
+  txQueue[index].priority = priority;
+  txQueue[index].len = len;
+  memcpy(txQueue[index].data, data, len);
+  txQueueLength++;
+
+  service_tx_queue();
+}
+
+void transmit_frame(const uint8_t *data, uint8_t len) {
   if (rf95.send(data, len)) {
     // Serial.println("Packet forwarded successfully");
     rf95.waitPacketSent();
   } else {
-    Serial.println("Packet forwarding failed");
+    SYS_LOG.println("Packet forwarding failed");
   }
 }
 
-void handle_node_packet(NodePacket &packet) {
-  if (packet.node.nodeId != 2 || packet.node.nodeId != 3) {
-    Serial.println("REQUEST: Received to be a node's forwarding node");
-    NodePacket nodePacket = construct_node_packet();
-    Packet packet;
-    packet.msgType = MSG_TYPE_RES_FORWARD_NODE;
-    packet.data.nodePacket = nodePacket;
+// Route advertisement, answers route requests and goes out every ROUTE_ADVERTISE_INTERVAL
+void send_node_packet() {
+  Packet packet;
+  packet.authKey = AUTH_KEY;
+  packet.msgType = MSG_TYPE_RES_FORWARD_NODE;
+  packet.data.nodePacket = construct_node_packet();
+
+  sendPacket((uint8_t *)&packet, packet_length(packet));
+}
+
+// Opens a superframe, beaconSeq and the offset are filled in when it goes on air
+void send_beacon_packet() {
+  Packet packet;
+  packet.authKey = AUTH_KEY;
+  packet.msgType = MSG_TYPE_BEACON;
+  packet.data.beaconPacket.route = construct_node_packet();
+  packet.data.beaconPacket.slotCount = slotCount;
+  packet.data.beaconPacket.contentionSlots = contentionSlots;
+  packet.data.beaconPacket.slotLength = SLOT_LENGTH;
+  packet.data.beaconPacket.highestNodeId = highestNodeId;
+
+  sendPacket((uint8_t *)&packet, packet_length(packet));
+}
+
+void send_ack_packet(uint8_t alertId, uint8_t seq, uint8_t receiverId) {
+  Packet packet;
+  packet.authKey = AUTH_KEY;
+  packet.msgType = MSG_TYPE_ACK_SUCCEED;
+  packet.data.ackPacket = construct_ack_packet(alertId, seq, receiverId);
+
+  sendPacket((uint8_t *)&packet, packet_length(packet));
+}
+
+void send_data_rate_packet(uint8_t receiverId, int8_t txPower) {
+  Packet packet;
+  packet.authKey = AUTH_KEY;
+  packet.msgType = MSG_TYPE_DATA_RATE;
+  packet.data.dataRatePacket.receiverNode.nodeId = receiverId;
+  packet.data.dataRatePacket.senderNode.nodeId = NODE_ID;
+  packet.data.dataRatePacket.spreadingFactor = LORA_SPREADING_FACTOR;
+  packet.data.dataRatePacket.bandwidthCode = 0;
+  while ((125000L << packet.data.dataRatePacket.bandwidthCode) < LORA_BANDWIDTH) {
+    packet.data.dataRatePacket.bandwidthCode++;
+  }
+  packet.data.dataRatePacket.txPower = txPower;
+
+  sendPacket((uint8_t *)&packet, packet_length(packet));
+}
+
+void send_batch_ack_packet(uint8_t receiverId, uint8_t batchId) {
+  Packet packet;
+  packet.authKey = AUTH_KEY;
+  packet.msgType = MSG_TYPE_ACK_BATCH;
+  packet.data.batchAckPacket.receiverNode.nodeId = receiverId;
+  packet.data.batchAckPacket.batchId = batchId;
+  packet.data.batchAckPacket.senderNode.nodeId = NODE_ID;
+
+  sendPacket((uint8_t *)&packet, packet_length(packet));
+}
+
+// ACKs that fall due within ACK_AGGREGATE_WINDOW of the first share one frame, so a burst of
+// capacity frames is not answered by a burst of ACKs. Each alert node's record is its whole window.
+void queue_ack(uint8_t alertId, uint8_t seq, uint8_t receiverId) {
+  int8_t window = find_seq_window(alertId);
+  if (window < 0) {
+    send_ack_packet(alertId, seq, receiverId);
+    return;
+  }
+  if (aggregatedAcks == 0) {
+    ackAggregateStart = millis();
+    firstAggregatedAck = construct_ack_packet(alertId, seq, receiverId);
+    ackAggregate.recordCount = 0;
+  }
+  aggregatedAcks++;
+
+  uint8_t i = 0;
+  while (i < ackAggregate.recordCount && ackAggregate.records[i].alertNode.nodeId != alertId) {
+    i++;
+  }
+  ackAggregate.records[i] = receivedAlerts[window];
+  if (i == ackAggregate.recordCount && ++ackAggregate.recordCount == MAX_ACK_RECORDS) {
+    send_ack_aggregate();
+  }
+}
+
+void service_ack_aggregate() {
+  if (aggregatedAcks > 0 && millis() - ackAggregateStart >= ACK_AGGREGATE_WINDOW) {
+    send_ack_aggregate();
+  }
+}
+
+// A lone ACK goes out as a plain MSG_TYPE_ACK_SUCCEED, it is shorter
+void send_ack_aggregate() {
+  if (aggregatedAcks == 1) {
+    send_ack_packet(firstAggregatedAck.alertNode.nodeId, firstAggregatedAck.alertSeq, firstAggregatedAck.receiverNode.nodeId);
+  } else {
+    Frame frame;
+    frame.ackBitmapFrame.authKey = AUTH_KEY;
+    frame.ackBitmapFrame.msgType = MSG_TYPE_ACK_BITMAP;
+    frame.ackBitmapFrame.data = ackAggregate;
+    frame.ackBitmapFrame.data.senderNode.nodeId = NODE_ID;
+    sendPacket((uint8_t *)&frame, ack_bitmap_length(frame.ackBitmapFrame));
+  }
+  aggregatedAcks = 0;
+}
+
+// Only the packet a frame carries goes on air, not the whole union. A capacity packet sent at
+// TX_POWER_DEFAULT also leaves out its txPower.
+uint8_t packet_length(const Packet &packet) {
+  uint8_t header = sizeof(Packet) - sizeof(PacketData);
+  if (packet.msgType == MSG_TYPE_CAPACITY) {
+    return header + sizeof(CapacityPacket) - (packet.data.capacityPacket.txPower == TX_POWER_DEFAULT ? sizeof(int8_t) : 0);
+  }
+  if (packet.msgType == MSG_TYPE_ACK_SUCCEED || packet.msgType == MSG_TYPE_ACK_FAILURE) {
+    return header + sizeof(AckPacket);
+  }
+  if (packet.msgType == MSG_TYPE_ACK_BATCH) {
+    return header + sizeof(BatchAckPacket);
+  }
+  if (packet.msgType == MSG_TYPE_DATA_RATE) {
+    return header + sizeof(DataRatePacket);
+  }
+  if (packet.msgType == MSG_TYPE_BEACON) {
+    return header + sizeof(BeaconPacket);
+  }
+  return header + sizeof(NodePacket);
+}
+
+// Only the used records of a capacity batch go on air
+uint8_t batch_packet_length(const BatchPacket &packet) {
+  uint8_t recordCount = packet.data.recordCount <= MAX_BATCH_RECORDS ? packet.data.recordCount : MAX_BATCH_RECORDS;
+  return sizeof(BatchPacket) - (MAX_BATCH_RECORDS - recordCount) * sizeof(CapacityRecord);
+}
+
+// Only the used records of an aggregated ACK go on air
+uint8_t ack_bitmap_length(const AckBitmapFrame &frame) {
+  uint8_t recordCount = frame.data.recordCount <= MAX_ACK_RECORDS ? frame.data.recordCount : MAX_ACK_RECORDS;
+  return sizeof(AckBitmapFrame) - (MAX_ACK_RECORDS - recordCount) * sizeof(SeqWindow);
+}
 
-    uint8_t len = sizeof(packet);
-    sendPacket((uint8_t *)&packet, &len);
+// Admission control: only requesters heard with JOIN_ADMIT_MARGIN to spare are answered, and the
+// answers of many requests at once are coalesced into one advertisement
+void handle_node_packet(NodePacket &packet) {
+  heard_of_node(packet.node.nodeId);
+  TRAFFIC_LOG.println("REQUEST: Received to be a node's forwarding node");
+  if (rf95.lastSNR() < SNR_FLOOR + JOIN_ADMIT_MARGIN) {
+    joinsRefused++;
+    TRAFFIC_LOG.println("RESPONSE: Link too weak, left to the relays");
+    return;
+  }
+  joinAnswerPending = true;
+}
 
-    Serial.println("RESPONSE: Sent confirmation to be a forwarding node");
+// The advertisement is broadcast, so one answers every request that came in while it waited
+void service_join_answer() {
+  if (!joinAnswerPending || millis() - lastJoinAnswer < JOIN_ANSWER_HOLDOFF) {
+    return;
   }
+  joinAnswerPending = false;
+  lastJoinAnswer = millis();
+  send_node_packet();
+  TRAFFIC_LOG.println("RESPONSE: Sent confirmation to be a forwarding node");
 }
 
 void handle_capacity_packet(CapacityPacket &cpacket) {
   // Ensure that the capacityPacket is for the correct forwarding node
   if (cpacket.receiverNode.nodeId == NODE_ID) {
-    Serial.println("RESPONSE: Received capacity packet at server");
+    TRAFFIC_LOG.println("RESPONSE: Received capacity packet at server");
+    heard_of_node(cpacket.senderNode.nodeId);
+    heard_of_node(cpacket.alertNode.nodeId);
+    int8_t snr = rf95.lastSNR();
+
+    // A copy sent again after a lost ACK only needs the ACK
+    bool duplicate = check_and_mark_seq(cpacket.alertNode.nodeId, cpacket.alertSeq);
+    queue_ack(cpacket.alertNode.nodeId, cpacket.alertSeq, cpacket.senderNode.nodeId);
+    track_link_margin(cpacket.senderNode.nodeId, cpacket.txPower, snr);
+    if (duplicate) {
+      return;
+    }
+
+    print_bin_report(cpacket.alertNode.nodeId, cpacket.binCapacity, cpacket.minutesToFull);
+  }
+}
+
+void handle_capacity_batch(CapacityBatchPacket &batch) {
+  // Ensure that the batch is for the correct forwarding node
+  if (batch.receiverNode.nodeId == NODE_ID && batch.recordCount <= MAX_BATCH_RECORDS) {
+    TRAFFIC_LOG.println("RESPONSE: Received capacity batch at server");
+    heard_of_node(batch.senderNode.nodeId);
+    int8_t snr = rf95.lastSNR();
+
+    // One ACK covers every record in the batch
+    send_batch_ack_packet(batch.senderNode.nodeId, batch.batchId);
+    track_link_margin(batch.senderNode.nodeId, batch.txPower, snr);
+
+    for (int i = 0; i < batch.recordCount; i++) {
+      heard_of_node(batch.records[i].alertNode.nodeId);
+      if (check_and_mark_seq(batch.records[i].alertNode.nodeId, batch.records[i].alertSeq)) {
+        continue;
+      }
+      print_bin_report(batch.records[i].alertNode.nodeId, batch.records[i].binCapacity, batch.records[i].minutesToFull);
+    }
+  }
+}
+
+// Minutes to full are counted from when the alert node sent the report
+void print_bin_report(uint8_t alertId, uint8_t binCapacity, uint16_t minutesToFull) {
+  SYS_LOG.print("RESPONSE: Bin capacity for node ");
+  SYS_LOG.print(alertId);
+  SYS_LOG.print(" is at ");
+  SYS_LOG.print(binCapacity);
+  if (minutesToFull == FULL_UNKNOWN) {
+    SYS_LOG.println("%");
+    return;
+  }
+  SYS_LOG.print("%, full in ");
+  SYS_LOG.print(minutesToFull);
+  SYS_LOG.println(" min");
+}
 
-    AckPacket ackPacket = construct_ack_packet(cpacket.alertNode.nodeId, cpacket.senderNode.nodeId, MSG_TYPE_ACK_SUCCEED);
-    
-    uint8_t len = sizeof(ackPacket);
-    sendPacket((uint8_t *)&ackPacket, &len);
+// One line per report, the counters are cumulative so rates come from two reports of a node
+void handle_stats_packet(StatsPacket &stats) {
+  if (stats.receiverNode.nodeId != NODE_ID) {
+    return;
+  }
+  heard_of_node(stats.senderNode.nodeId);
+  heard_of_node(stats.originNode.nodeId);
 
-    Serial.print("RESPONSE: Bin capacity for node ");
-    Serial.print(cpacket.alertNode.nodeId);
-    Serial.print(" is at ");
-    Serial.print(cpacket.binCapacity);
-    Serial.println("%");
+  SYS_LOG.print("STATS: node ");
+  SYS_LOG.print(stats.originNode.nodeId);
+  SYS_LOG.print(" up ");
+  SYS_LOG.print(stats.uptime);
+  SYS_LOG.print(" min, tx ");
+  SYS_LOG.print(stats.txFrames);
+  SYS_LOG.print(", rx ");
+  SYS_LOG.print(stats.rxFrames);
+  SYS_LOG.print(", retransmits ");
+  SYS_LOG.print(stats.retransmissions);
+  SYS_LOG.print(", ACK timeouts ");
+  SYS_LOG.print(stats.ackTimeouts);
+  SYS_LOG.print(", route changes ");
+  SYS_LOG.print(stats.routeChanges);
+  SYS_LOG.print(", queues ");
+  SYS_LOG.print(stats.txQueueHighWater);
+  SYS_LOG.print("/");
+  SYS_LOG.print(stats.capacityQueueHighWater);
+  SYS_LOG.print(", ACK RTT");
+  for (int i = 0; i < ACK_RTT_BUCKETS; i++) {
+    SYS_LOG.print(" ");
+    SYS_LOG.print(stats.ackRtt[i]);
   }
+  SYS_LOG.println();
 }
 /* ========================================================== */
 /* ============ TRANSMITTING/RECEIVING FUNCTIONS ============ */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ================== DATA RATE CONTROL FUNCTIONS =========== */
+/* ========================================================== */
+int8_t find_link_margin(uint8_t nodeId) {
+  for (int i = 0; i < linkMarginsUsed; i++) {
+    if (linkMargins[i].node.nodeId == nodeId) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Called for every capacity frame from a node next to the server with the SNR it arrived at.
+// Once ADR_HISTORY frames were measured at one power, the node is told the power that leaves
+// ADR_MARGIN dB above the SNR floor, in ADR_STEP dB steps.
+void track_link_margin(uint8_t nodeId, int8_t txPower, int8_t snr) {
+  int8_t index = find_link_margin(nodeId);
+  if (index < 0) {
+    if (linkMarginsUsed < MAX_LINK_MARGINS) {
+      index = linkMarginsUsed++;
+    } else {
+      index = nextLinkMargin;
+      nextLinkMargin = (nextLinkMargin + 1) % MAX_LINK_MARGINS;
+    }
+    linkMargins[index].node.nodeId = nodeId;
+    linkMargins[index].samples = 0;
+    linkMargins[index].commandPending = false;
+    linkMargins[index].lastCommandTime = millis() - ADR_COMMAND_HOLDOFF;
+  }
+
+  LinkMargin &link = linkMargins[index];
+  if (link.commandPending && link.commandPower == txPower) {
+    link.commandPending = false;
+  }
+  if (link.samples == 0 || link.txPower != txPower) {
+    link.txPower = txPower;
+    link.bestSnr = snr;
+    link.samples = 0;
+  } else if (snr > link.bestSnr) {
+    link.bestSnr = snr;
+  }
+  if (++link.samples < ADR_HISTORY) {
+    return;
+  }
+  link.samples = 0;
+
+  int16_t margin = link.bestSnr - SNR_FLOOR - ADR_MARGIN;
+  int16_t power = txPower;
+  if (margin >= ADR_STEP) {
+    power -= margin / ADR_STEP * ADR_STEP;
+  } else if (margin < 0) {
+    power += (-margin + ADR_STEP - 1) / ADR_STEP * ADR_STEP;
+  }
+  power = power < TX_POWER_MIN ? TX_POWER_MIN : power > TX_POWER_MAX ? TX_POWER_MAX : power;
+
+  // Changes below one step are not worth a frame
+  if ((power - txPower >= ADR_STEP || txPower - power >= ADR_STEP) && millis() - link.lastCommandTime >= ADR_COMMAND_HOLDOFF) {
+    link.commandPower = power;
+    link.commandPending = true;
+    SYS_LOG.print("RESPONSE: Data rate for node ");
+    SYS_LOG.print(nodeId);
+    SYS_LOG.print(", SNR ");
+    SYS_LOG.print(link.bestSnr);
+    SYS_LOG.print(" dB at ");
+    SYS_LOG.print(txPower);
+    SYS_LOG.print(" dBm, now ");
+    SYS_LOG.print(power);
+    SYS_LOG.println(" dBm");
+  }
+}
+
+// One pending command at a time, only after ADR_QUIET_TIME without any frame. Sent right after
+// the ACK it would collide with whatever the node sends next and deafen the server meanwhile.
+// With the slotted schedule it goes in the server's own slot, where nobody else sends.
+void service_data_rate_commands() {
+  if (SLOTTED_SCHEDULE ? current_slot() != 0 || txQueueLength > 1
+                       : txQueueLength > 0 || millis() - lastReceiveTime < ADR_QUIET_TIME) {
+    return;
+  }
+  for (int i = 0; i < linkMarginsUsed; i++) {
+    LinkMargin &link = linkMargins[i];
+    if (link.commandPending) {
+      link.commandPending = false;
+      link.lastCommandTime = millis();
+      dataRateCommands++;
+      send_data_rate_packet(link.node.nodeId, link.commandPower);
+      return;
+    }
+  }
+}
+/* ========================================================== */
+/* ================== DATA RATE CONTROL FUNCTIONS =========== */
+/* ========================================================== */
+
+/* ========================================================== */
+/* ============= DUPLICATE SUPPRESSION FUNCTIONS ============ */
+/* ========================================================== */
+int8_t find_seq_window(uint8_t alertId) {
+  for (int i = 0; i < seqWindowsUsed; i++) {
+    if (receivedAlerts[i].alertNode.nodeId == alertId) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Records seq as received from alertId, true when it already was
+bool check_and_mark_seq(uint8_t alertId, uint8_t seq) {
+  int8_t index = find_seq_window(alertId);
+  if (index < 0) {
+    if (seqWindowsUsed < MAX_SEQ_WINDOWS) {
+      index = seqWindowsUsed++;
+    } else {
+      index = nextSeqWindow;
+      nextSeqWindow = (nextSeqWindow + 1) % MAX_SEQ_WINDOWS;
+    }
+    receivedAlerts[index].alertNode.nodeId = alertId;
+    receivedAlerts[index].highestSeq = seq;
+    receivedAlerts[index].seen = 1;
+    return false;
+  }
+
+  SeqWindow &window = receivedAlerts[index];
+  uint8_t age = window.highestSeq - seq;
+  uint8_t ahead = seq - window.highestSeq;
+  if (age < SEQ_WINDOW_SIZE) {
+    if (window.seen & (1U << age)) {
+      duplicatesReceived++;
+      TRAFFIC_LOG.print("RESPONSE: Duplicate capacity packet from node ");
+      TRAFFIC_LOG.print(alertId);
+      TRAFFIC_LOG.print(", duplicates so far ");
+      TRAFFIC_LOG.println(duplicatesReceived);
+      return true;
+    }
+    window.seen |= 1U << age;
+  } else {
+    // Newer than the window, or so far behind that the alert node must have started over
+    window.seen = ahead < SEQ_WINDOW_SIZE ? (window.seen << ahead) | 1 : 1;
+    window.highestSeq = seq;
+  }
+  return false;
+}
+/* ========================================================== */
+/* ============= DUPLICATE SUPPRESSION FUNCTIONS ============ */
 /* ========================================================== */
\ No newline at end of file